@@ -0,0 +1,208 @@
+# bench.tcl --
+#
+#	End-to-end throughput and latency benchmark for the mqttc extension.
+#	It drives "publishMessage" and "receive" through the mock broker in
+#	this directory (or any broker given with -uri) and reports msgs/s,
+#	MB/s and latency percentiles for every combination of protocol
+#	version, QoS, payload size and publisher count.
+#
+#	Usage:
+#	    tclsh bench.tcl ?-broker path? ?-uri uri? ?-unix 0|1? ?-aliases n?
+#	        ?-versions list? ?-qos list? ?-sizes list? ?-clients list?
+#	        ?-count n? ?-window n? ?-persistence type?
+#
+#	-aliases makes the mock broker offer n MQTT 5 topic aliases, and the
+#	subscriber allow as many in the other direction.  -persistence is the
+#	persistence of the subscriber (none by default, or default, log, mmap
+#	or tmpfs), which stores every message it receives until it is taken.
+#
+#	Every message carries its send time in microseconds, so the latency
+#	is the time from the start of publishMessage to the return of the
+#	receive which delivered it.  Messages are published in windows of
+#	-window messages, which are then drained by a single subscriber.
+#
+# Copyright (c) 2026 The mqttc authors.
+#
+# This file is licensed under BSD 3-Clause License, see LICENSE.
+
+package require Tcl 8.6-
+package require mqttc
+
+array set opts {
+    -broker   ./mockbroker
+    -uri      {}
+    -unix     0
+    -aliases  0
+    -versions {3.1.1 5}
+    -qos      {0 1 2}
+    -sizes    {16 256 4096 65536}
+    -clients  {1 4}
+    -count    200
+    -window   64
+    -persistence none
+}
+
+foreach {key value} $argv {
+    if {![info exists opts($key)]} {
+        puts stderr "unknown option \"$key\", must be one of: [lsort [array names opts]]"
+        exit 1
+    }
+    set opts($key) $value
+}
+
+#
+# Starts the mock broker and returns the URI to connect to.
+#
+proc startBroker {} {
+    global opts brokerChan
+
+    set cmd [list $opts(-broker) -port 0 -aliases $opts(-aliases) -quiet]
+    if {$opts(-unix)} {
+        set path [file join [pwd] mqttc-bench-[pid].sock]
+        lappend cmd -unix $path
+    }
+    set brokerChan [open |$cmd r]
+    set uri {}
+    while {[gets $brokerChan line] >= 0} {
+        switch -glob -- $line {
+            "listening tcp *" {
+                if {!$opts(-unix)} {
+                    set uri tcp://[lindex $line 2]:[lindex $line 3]
+                }
+            }
+            "listening unix *" {
+                set uri unix://[lindex $line 2]
+            }
+            ready break
+        }
+    }
+    if {$uri eq {}} {
+        error "mock broker did not start"
+    }
+    return $uri
+}
+
+proc stopBroker {} {
+    global brokerChan
+
+    if {[info exists brokerChan]} {
+        catch {exec kill [pid $brokerChan]}
+        catch {close $brokerChan}
+        unset brokerChan
+    }
+}
+
+#
+# Returns the given percentile of a sorted list.
+#
+proc percentile {sorted p} {
+    set n [llength $sorted]
+    if {$n == 0} {
+        return 0
+    }
+    set idx [expr {int(ceil($p / 100.0 * $n)) - 1}]
+    if {$idx < 0} {
+        set idx 0
+    }
+    return [lindex $sorted $idx]
+}
+
+#
+# Runs one benchmark case and returns a result row.
+#
+proc runCase {uri version qos size nclients count window} {
+    global runId opts
+
+    set run [incr runId]
+    set topic bench/$run
+    set connopts [list -timeout 5000 -version $version]
+
+    set subopts $connopts
+    if {$version eq "5" && $opts(-aliases) > 0} {
+        lappend subopts -topic-alias-maximum $opts(-aliases)
+    }
+    if {$opts(-persistence) ne "none"} {
+        lappend subopts -persistence $opts(-persistence) -persistenceDir [pwd]
+    }
+    mqttc sub $uri benchsub-[pid]-$run 1 {*}$subopts
+    sub subscribe $topic/# $qos
+    set pubs {}
+    for {set i 0} {$i < $nclients} {incr i} {
+        mqttc pub$i $uri benchpub-[pid]-$run-$i 1 {*}$connopts
+        lappend pubs pub$i
+    }
+
+    # The payload is "<send time in microseconds>|xxxx...", padded to size.
+    set stamp [clock microseconds]
+    set padding [string repeat x [expr {max(0, $size - [string length $stamp] - 1)}]]
+
+    set latencies {}
+    set lost 0
+    set sent 0
+    set start [clock microseconds]
+    while {$sent < $count} {
+        set batch [expr {min($window, $count - $sent)}]
+        for {set i 0} {$i < $batch} {incr i} {
+            set pub [lindex $pubs [expr {$sent % $nclients}]]
+            $pub publishMessage $topic/[expr {$sent % $nclients}] \
+                "[clock microseconds]|$padding" $qos 0
+            incr sent
+        }
+        for {set i 0} {$i < $batch} {incr i} {
+            set msg [sub receive]
+            if {[llength $msg] == 0} {
+                incr lost [expr {$batch - $i}]
+                break
+            }
+            set now [clock microseconds]
+            set payload [lindex $msg 1]
+            lappend latencies [expr {$now - [string range $payload 0 [string first | $payload]-1]}]
+        }
+    }
+    set elapsed [expr {([clock microseconds] - $start) / 1e6}]
+
+    foreach pub $pubs {
+        $pub close
+    }
+    sub close
+
+    set received [llength $latencies]
+    set sorted [lsort -integer $latencies]
+    return [list $version $qos $size $nclients $received $lost \
+        [expr {$received / $elapsed}] \
+        [expr {$received * $size / $elapsed / 1e6}] \
+        [percentile $sorted 50] [percentile $sorted 90] \
+        [percentile $sorted 99] [percentile $sorted 100]]
+}
+
+set runId 0
+if {$opts(-uri) ne {}} {
+    set uri $opts(-uri)
+} else {
+    set uri [startBroker]
+}
+
+set format "%-6s %3s %7s %7s %8s %5s %10s %8s %8s %8s %8s %8s"
+puts [format $format version qos size clients received lost \
+    msgs/s MB/s p50(us) p90(us) p99(us) max(us)]
+if {[catch {
+    foreach version $opts(-versions) {
+        foreach qos $opts(-qos) {
+            foreach size $opts(-sizes) {
+                foreach nclients $opts(-clients) {
+                    set row [runCase $uri $version $qos $size $nclients \
+                        $opts(-count) $opts(-window)]
+                    lassign $row v q s c received lost rate mbps p50 p90 p99 pmax
+                    puts [format $format $v $q $s $c $received $lost \
+                        [format %.0f $rate] [format %.2f $mbps] $p50 $p90 $p99 $pmax]
+                    flush stdout
+                }
+            }
+        }
+    }
+} msg]} {
+    stopBroker
+    puts stderr $::errorInfo
+    exit 1
+}
+stopBroker
@@ -0,0 +1,453 @@
+/*
+ * codecbench.c --
+ *
+ *	Microbenchmarks for the MQTT packet codec, run in isolation from the
+ *	network.  Each case is timed over a fixed number of iterations and
+ *	reported as nanoseconds and heap allocations per packet:
+ *
+ *	  factory     MQTTPacket_Factory reading a PUBLISH from a socket pair
+ *	  publish     MQTTPacket_publish decoding an already read packet body
+ *	  send        MQTTPacket_send_publish writing into a socket pair which
+ *	              is drained after every packet (the memory sink)
+ *	  propswrite  MQTTProperties_write of the corpus properties
+ *	  propsread   MQTTProperties_read of the same properties
+ *	  vbidecode   MQTTPacket_decodeBuf of 1 to 4 byte remaining lengths
+ *	  utf8        UTF8_validate of the corpus topic
+ *
+ *	over three corpora: "tiny" (16 byte telemetry, QoS 0, MQTT 3.1.1),
+ *	"blob" (64 KiB payload, QoS 1, MQTT 3.1.1) and "v5props" (256 byte
+ *	payload, QoS 1, MQTT 5 with 16 user properties), and
+ *
+ *	  inflight    MQTTProtocol_storePublication and removePublication of
+ *	              a window of in-flight publications from four handles,
+ *	              acknowledged one handle after the other
+ *
+ *	Usage:
+ *	    codecbench ?-iterations n? ?-corpus name? ?-window n?
+ *
+ *	where -corpus "-" selects the cases which use no corpus.
+ *
+ *	The allocation counts come from the Paho heap tracker and are only
+ *	available when the library is built without HIGH_PERFORMANCE.
+ *
+ * Copyright (c) 2026 The mqttc authors.
+ *
+ * This file is licensed under BSD 3-Clause License, see LICENSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "MQTTClient.h"
+#include "MQTTPacket.h"
+#include "MQTTProperties.h"
+#include "MQTTProtocolClient.h"
+#include "Clients.h"
+#include "LinkedList.h"
+#include "Heap.h"
+#include "utf-8.h"
+
+#define BUFSIZE (1024 * 1024)
+
+extern ClientStates* bstate;
+
+typedef struct
+{
+	const char* name;
+	int MQTTVersion;
+	int qos;
+	int payloadlen;
+	int userProperties;
+} Corpus;
+
+static Corpus corpora[] =
+{
+	{"tiny", MQTTVERSION_3_1_1, 0, 16, 0},
+	{"blob", MQTTVERSION_3_1_1, 1, 64 * 1024, 0},
+	{"v5props", MQTTVERSION_5, 1, 256, 16},
+};
+
+static const char* topic =
+	"site/6f1c2a4e-8d2b-4c1e-9a53-2b7f0e6d4c11/device/"
+	"0c9e5d3a-1f47-4b8e-a2d6-93e41b7c5f08/sensor/temperature";
+
+static networkHandles* net;
+static int sink = -1;
+static char* scratch;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t heap_allocations(void)
+{
+#if !defined(HIGH_PERFORMANCE)
+	return Heap_get_info()->allocations;
+#else
+	return 0;
+#endif
+}
+
+static void report(const char* corpus, const char* name, int iterations, long long start, size_t allocs)
+{
+	double ns = (double)(now_ns() - start) / iterations;
+
+#if !defined(HIGH_PERFORMANCE)
+	printf("%-8s %-11s %10.1f %10.2f\n", corpus, name, ns,
+		(double)(heap_allocations() - allocs) / iterations);
+#else
+	printf("%-8s %-11s %10.1f %10s\n", corpus, name, ns, "n/a");
+#endif
+	fflush(stdout);
+}
+
+static void fail(const char* what)
+{
+	fprintf(stderr, "codecbench: %s failed\n", what);
+	exit(1);
+}
+
+/*
+ * Reads exactly len bytes from the sink side of the socket pair.
+ */
+static void drain(char* buf, size_t len)
+{
+	size_t got = 0;
+
+	while (got < len)
+	{
+		ssize_t rc = read(sink, buf + got, len - got);
+
+		if (rc <= 0)
+			fail("read");
+		got += rc;
+	}
+}
+
+static void writeall(const char* buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len)
+	{
+		ssize_t rc = write(sink, buf + done, len - done);
+
+		if (rc <= 0)
+			fail("write");
+		done += rc;
+	}
+}
+
+/*
+ * Creates a client which is never connected, and attaches one end of a
+ * socket pair to it, so that the codec functions see a registered
+ * network handle (persistence lookups go through the client list).
+ */
+static void setup(MQTTClient* client)
+{
+	MQTTClient_createOptions createOpts = MQTTClient_createOptions_initializer;
+	ListElement* current = NULL;
+	int fds[2];
+	int size = 4 * BUFSIZE;
+
+	createOpts.MQTTVersion = MQTTVERSION_5;
+	if (MQTTClient_createWithOptions(client, "tcp://127.0.0.1:1883", "codecbench",
+			MQTTCLIENT_PERSISTENCE_NONE, NULL, &createOpts) != MQTTCLIENT_SUCCESS)
+		fail("MQTTClient_create");
+	while (ListNextElement(bstate->clients, &current))
+	{
+		Clients* c = (Clients*)current->content;
+
+		if (strcmp(c->clientID, "codecbench") == 0)
+			net = &c->net;
+	}
+	if (net == NULL)
+		fail("client lookup");
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		fail("socketpair");
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	net->socket = fds[0];
+	sink = fds[1];
+}
+
+static void teardown(MQTTClient* client)
+{
+	close(net->socket);
+	close(sink);
+	net->socket = 0;
+	MQTTClient_destroy(client);
+}
+
+static void addProperties(MQTTProperties* props, const Corpus* corpus)
+{
+	MQTTProperty property;
+	char name[32], value[64];
+	int i;
+
+	property.identifier = MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL;
+	property.value.integer4 = 3600;
+	MQTTProperties_add(props, &property);
+	property.identifier = MQTTPROPERTY_CODE_CONTENT_TYPE;
+	property.value.data.data = "application/json";
+	property.value.data.len = (int)strlen(property.value.data.data);
+	MQTTProperties_add(props, &property);
+	for (i = 0; i < corpus->userProperties; ++i)
+	{
+		snprintf(name, sizeof(name), "key-%d", i);
+		snprintf(value, sizeof(value), "value-%d-0123456789abcdef", i);
+		property.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+		property.value.data.data = name;
+		property.value.data.len = (int)strlen(name);
+		property.value.value.data = value;
+		property.value.value.len = (int)strlen(value);
+		MQTTProperties_add(props, &property);
+	}
+}
+
+static void runCorpus(const Corpus* corpus, int iterations)
+{
+	Publish pub;
+	MQTTProperties props = MQTTProperties_initializer;
+	char* payload = malloc(corpus->payloadlen);
+	char* packet = NULL;
+	size_t packetlen, headerlen;
+	unsigned int remlen = 0;
+	long long start;
+	size_t allocs;
+	int i, rc;
+
+	memset(payload, 'x', corpus->payloadlen);
+	memset(&pub, 0, sizeof(pub));
+	pub.topic = (char*)topic;
+	pub.topiclen = (int)strlen(topic);
+	pub.msgId = 1;
+	pub.payload = payload;
+	pub.payloadlen = corpus->payloadlen;
+	pub.MQTTVersion = corpus->MQTTVersion;
+	if (corpus->MQTTVersion >= MQTTVERSION_5)
+	{
+		addProperties(&props, corpus);
+		pub.properties = props;
+	}
+
+	/* Encode one packet to learn its wire form, used by the decode cases. */
+	if (MQTTPacket_send_publish(&pub, 0, corpus->qos, 0, net, "codecbench") != TCPSOCKET_COMPLETE)
+		fail("MQTTPacket_send_publish");
+	drain(scratch, 1);
+	headerlen = 1;
+	do
+		drain(scratch + headerlen, 1);
+	while (scratch[headerlen++] & 128);
+	MQTTPacket_decodeBuf(scratch + 1, &remlen);
+	drain(scratch + headerlen, remlen);
+	packetlen = headerlen + remlen;
+	packet = malloc(packetlen);
+	memcpy(packet, scratch, packetlen);
+
+	allocs = heap_allocations();
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		if (MQTTPacket_send_publish(&pub, 0, corpus->qos, 0, net, "codecbench") != TCPSOCKET_COMPLETE)
+			fail("MQTTPacket_send_publish");
+		drain(scratch, packetlen);
+	}
+	report(corpus->name, "send", iterations, start, allocs);
+
+	allocs = heap_allocations();
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		Publish* pack;
+
+		writeall(packet, packetlen);
+		if ((pack = MQTTPacket_Factory(corpus->MQTTVersion, net, &rc)) == NULL)
+			fail("MQTTPacket_Factory");
+		MQTTPacket_freePublish(pack);
+	}
+	report(corpus->name, "factory", iterations, start, allocs);
+
+	allocs = heap_allocations();
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		Publish* pack;
+
+		memcpy(scratch, packet + headerlen, remlen);
+		if ((pack = MQTTPacket_publish(corpus->MQTTVersion, packet[0], scratch, remlen)) == NULL)
+			fail("MQTTPacket_publish");
+		MQTTPacket_freePublish(pack);
+	}
+	report(corpus->name, "publish", iterations, start, allocs);
+
+	if (corpus->MQTTVersion >= MQTTVERSION_5)
+	{
+		char* end = NULL;
+
+		allocs = heap_allocations();
+		start = now_ns();
+		for (i = 0; i < iterations; ++i)
+		{
+			char* ptr = scratch;
+
+			MQTTProperties_write(&ptr, &props);
+			end = ptr;
+		}
+		report(corpus->name, "propswrite", iterations, start, allocs);
+
+		allocs = heap_allocations();
+		start = now_ns();
+		for (i = 0; i < iterations; ++i)
+		{
+			MQTTProperties readProps = MQTTProperties_initializer;
+			char* ptr = scratch;
+
+			if (MQTTProperties_read(&readProps, &ptr, end) != 1)
+				fail("MQTTProperties_read");
+			MQTTProperties_free(&readProps);
+		}
+		report(corpus->name, "propsread", iterations, start, allocs);
+	}
+
+	allocs = heap_allocations();
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		if (!UTF8_validate(pub.topiclen, pub.topic))
+			fail("UTF8_validate");
+	}
+	report(corpus->name, "utf8", iterations, start, allocs);
+
+	MQTTProperties_free(&props);
+	free(packet);
+	free(payload);
+}
+
+/*
+ * Decodes remaining lengths of every encoded size, 1 to 4 bytes.
+ */
+static void runVBI(int iterations)
+{
+	static const size_t lengths[] = {100, 10000, 1000000, 200000000};
+	char encoded[4][4];
+	unsigned int value, total = 0;
+	long long start;
+	size_t allocs;
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		MQTTPacket_encode(encoded[i], lengths[i]);
+	allocs = heap_allocations();
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		MQTTPacket_decodeBuf(encoded[i & 3], &value);
+		total += value;
+	}
+	report("-", "vbidecode", iterations, start, allocs);
+	if (total == 0)
+		fail("MQTTPacket_decodeBuf");
+}
+
+/*
+ * Stores a window of publications from several handles, interleaved as they
+ * would be sent, and removes them handle by handle, as when the
+ * acknowledgements of one connection arrive while the others are still in
+ * flight.  Reported per publication stored and removed.
+ */
+static void runInflight(int iterations, int window)
+{
+	const int handles = 4;
+	Publications** pubs = NULL;
+	int rounds = (iterations + window - 1) / window;
+	long long start;
+	size_t allocs;
+	int r, h, i, len;
+
+	if ((pubs = malloc(window * sizeof(Publications*))) == NULL)
+		fail("malloc");
+	allocs = heap_allocations();
+	start = now_ns();
+	for (r = 0; r < rounds; ++r)
+	{
+		for (i = 0; i < window; ++i)
+		{
+			Publish publish;
+
+			memset(&publish, '\0', sizeof(publish));
+			publish.topic = (char*)topic;
+			publish.topiclen = (int)strlen(topic);
+			if ((pubs[i] = MQTTProtocol_storePublication(&publish, &len)) == NULL)
+				fail("MQTTProtocol_storePublication");
+			pubs[i]->topic = NULL; /* not ours to free */
+		}
+		for (h = 0; h < handles; ++h)
+			for (i = h; i < window; i += handles)
+				MQTTProtocol_removePublication(pubs[i]);
+	}
+	report("-", "inflight", rounds * window, start, allocs);
+	free(pubs);
+}
+
+int main(int argc, char** argv)
+{
+	MQTTClient client;
+	const char* only = NULL;
+	int iterations = 100000;
+	int window = 10000;
+	size_t c;
+	int i;
+
+	for (i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-iterations") == 0)
+			iterations = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-corpus") == 0)
+			only = argv[i + 1];
+		else if (strcmp(argv[i], "-window") == 0)
+			window = atoi(argv[i + 1]);
+		else
+		{
+			fprintf(stderr, "usage: %s ?-iterations n? ?-corpus name? ?-window n?\n", argv[0]);
+			return 1;
+		}
+	}
+	if (i != argc || iterations <= 0 || window <= 0)
+	{
+		fprintf(stderr, "usage: %s ?-iterations n? ?-corpus name? ?-window n?\n", argv[0]);
+		return 1;
+	}
+
+	setup(&client);
+	scratch = malloc(BUFSIZE);
+	printf("%-8s %-11s %10s %10s\n", "corpus", "case", "ns/packet", "allocs/pkt");
+	for (c = 0; c < sizeof(corpora) / sizeof(corpora[0]); ++c)
+	{
+		if (only == NULL || strcmp(only, corpora[c].name) == 0)
+			runCorpus(&corpora[c], iterations);
+	}
+	if (only == NULL || strcmp(only, "-") == 0)
+	{
+		runVBI(iterations);
+		runInflight(iterations, window);
+	}
+	free(scratch);
+	teardown(&client);
+	return 0;
+}
@@ -0,0 +1,1004 @@
+/*
+ * mockbroker.c --
+ *
+ *	A small, self-contained MQTT 3.1/3.1.1/5 broker stand-in used by the
+ *	benchmark suite in this directory.  It is single threaded, keeps
+ *	everything in memory and implements just enough of the protocol to
+ *	drive the mqttc extension end to end:
+ *
+ *	  CONNECT/CONNACK, SUBSCRIBE/SUBACK (with + and # wildcards),
+ *	  UNSUBSCRIBE/UNSUBACK, PUBLISH at QoS 0/1/2 in both directions,
+ *	  PINGREQ/PINGRESP and DISCONNECT.
+ *
+ *	Sessions are not kept across connections, retained messages are not
+ *	stored and the acknowledgements of messages sent to subscribers are
+ *	accepted but not tracked.  It is not a real broker and must never be
+ *	used as one.
+ *
+ *	Usage:
+ *	    mockbroker ?-port port? ?-unix path? ?-aliases n? ?-quiet?
+ *
+ *	A port of 0 picks an ephemeral port.  With -aliases, MQTT 5 clients
+ *	are offered n topic aliases (TOPIC_ALIAS_MAXIMUM in the CONNACK) and
+ *	aliased publications are resolved before they are forwarded.  Clients
+ *	which allow topic aliases in their CONNECT are sent aliased topics,
+ *	first come first served until their aliases run out.  Once the listeners are ready,
+ *	one line per listener is written to stdout, e.g.
+ *	    listening tcp 127.0.0.1 40321
+ *	    listening unix /tmp/mqtt.sock
+ *	followed by the line "ready", so a driver script can wait for it.
+ *
+ * Copyright (c) 2026 The mqttc authors.
+ *
+ * This file is licensed under BSD 3-Clause License, see LICENSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define CONNECT     1
+#define CONNACK     2
+#define PUBLISH     3
+#define PUBACK      4
+#define PUBREC      5
+#define PUBREL      6
+#define PUBCOMP     7
+#define SUBSCRIBE   8
+#define SUBACK      9
+#define UNSUBSCRIBE 10
+#define UNSUBACK    11
+#define PINGREQ     12
+#define PINGRESP    13
+#define DISCONNECT  14
+#define AUTH        15
+
+#define PROP_TOPIC_ALIAS_MAXIMUM 0x22
+#define PROP_TOPIC_ALIAS 0x23
+
+typedef struct
+{
+	char* filter;
+	int qos;
+} Subscription;
+
+typedef struct
+{
+	int fd;
+	int version;          /* 3, 4 or 5, 0 until CONNECT has been received */
+	int closing;
+	unsigned char* in;    /* partially received packets */
+	size_t inlen, incap;
+	unsigned char* out;   /* data not yet accepted by the socket */
+	size_t outoff, outlen, outcap;
+	Subscription* subs;
+	int nsubs, subcap;
+	int next_msgid;
+	unsigned char** aliases;  /* inbound topic aliases, indexed by alias - 1 */
+	int* aliaslens;
+	unsigned char** outaliases;  /* outbound topic aliases, indexed by alias - 1 */
+	int* outaliaslens;
+	int noutaliases, outaliasmax;
+} Conn;
+
+static Conn** conns = NULL;
+static int nconns = 0, conncap = 0;
+static int listeners[2] = {-1, -1};
+static int nlisteners = 0;
+static volatile sig_atomic_t stopping = 0;
+static int quiet = 0;
+static int aliasmax = 0;
+
+static unsigned long stat_in = 0, stat_out = 0, stat_bytes_in = 0;
+
+
+static void onsignal(int sig)
+{
+	stopping = 1;
+}
+
+
+static void* xrealloc(void* p, size_t size)
+{
+	void* n = realloc(p, size);
+
+	if (n == NULL)
+	{
+		fprintf(stderr, "mockbroker: out of memory\n");
+		exit(1);
+	}
+	return n;
+}
+
+
+static int setnonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/*
+ * Output buffering.  Everything goes through outAppend() and is flushed
+ * as far as the socket allows; the rest waits for POLLOUT.
+ */
+
+static void outFlush(Conn* c)
+{
+	while (c->outoff < c->outlen)
+	{
+		ssize_t n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->closing = 1;
+			break;
+		}
+		c->outoff += n;
+	}
+	if (c->outoff == c->outlen)
+		c->outoff = c->outlen = 0;
+}
+
+
+static void outAppend(Conn* c, const void* data, size_t len)
+{
+	if (c->outoff > 0 && c->outoff == c->outlen)
+		c->outoff = c->outlen = 0;
+	if (c->outlen + len > c->outcap)
+	{
+		if (c->outoff > 0)
+		{
+			memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+			c->outlen -= c->outoff;
+			c->outoff = 0;
+		}
+		if (c->outlen + len > c->outcap)
+		{
+			c->outcap = (c->outlen + len) * 2;
+			c->out = xrealloc(c->out, c->outcap);
+		}
+	}
+	memcpy(c->out + c->outlen, data, len);
+	c->outlen += len;
+}
+
+
+static int encodeLength(unsigned char* buf, size_t length)
+{
+	int n = 0;
+
+	do
+	{
+		unsigned char d = length % 128;
+		length /= 128;
+		if (length > 0)
+			d |= 0x80;
+		buf[n++] = d;
+	} while (length > 0);
+	return n;
+}
+
+
+static void sendHeader(Conn* c, unsigned char byte, size_t remaining)
+{
+	unsigned char hdr[5];
+
+	hdr[0] = byte;
+	outAppend(c, hdr, 1 + encodeLength(&hdr[1], remaining));
+}
+
+
+static void sendAck(Conn* c, int type, int flags, int msgid)
+{
+	unsigned char buf[2];
+
+	sendHeader(c, (unsigned char)((type << 4) | flags), 2);
+	buf[0] = (unsigned char)(msgid >> 8);
+	buf[1] = (unsigned char)(msgid & 0xFF);
+	outAppend(c, buf, 2);
+}
+
+
+/*
+ * Packet reading helpers.  All of them check against the end of the packet.
+ */
+
+static int readInt(const unsigned char** p, const unsigned char* end, int* value)
+{
+	if (end - *p < 2)
+		return 0;
+	*value = ((*p)[0] << 8) | (*p)[1];
+	*p += 2;
+	return 1;
+}
+
+
+static int readVBI(const unsigned char** p, const unsigned char* end, size_t* value)
+{
+	size_t multiplier = 1;
+	int len = 0;
+
+	*value = 0;
+	do
+	{
+		if (*p >= end || ++len > 4)
+			return 0;
+		*value += (**p & 127) * multiplier;
+		multiplier *= 128;
+	} while ((*(*p)++ & 128) != 0);
+	return 1;
+}
+
+
+static int readString(const unsigned char** p, const unsigned char* end,
+		const unsigned char** str, int* len)
+{
+	if (!readInt(p, end, len) || end - *p < *len)
+		return 0;
+	*str = *p;
+	*p += *len;
+	return 1;
+}
+
+
+/*
+ * Skips a single MQTT 5 property, returning its length or 0 if malformed.
+ */
+static size_t propertyLength(const unsigned char* p, const unsigned char* end)
+{
+	const unsigned char* q = p + 1;
+	int len;
+	size_t vbi;
+
+	if (p >= end)
+		return 0;
+	switch (*p)
+	{
+		case 0x01: case 0x17: case 0x19: case 0x24: case 0x25:
+		case 0x28: case 0x29: case 0x2A:
+			q += 1;
+			break;
+		case 0x13: case 0x21: case 0x22: case 0x23:
+			q += 2;
+			break;
+		case 0x02: case 0x11: case 0x18: case 0x27:
+			q += 4;
+			break;
+		case 0x0B:
+			if (!readVBI(&q, end, &vbi))
+				return 0;
+			break;
+		case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16:
+		case 0x1A: case 0x1C: case 0x1F:
+			if (!readInt(&q, end, &len))
+				return 0;
+			q += len;
+			break;
+		case 0x26:
+			if (!readInt(&q, end, &len))
+				return 0;
+			q += len;
+			if (!readInt(&q, end, &len))
+				return 0;
+			q += len;
+			break;
+		default:
+			return 0;
+	}
+	return (q <= end) ? (size_t)(q - p) : 0;
+}
+
+
+/*
+ * Topic filter matching with the MQTT + and # wildcards.
+ */
+static int topicMatches(const char* filter, const unsigned char* topic, int topiclen)
+{
+	const unsigned char* t = topic;
+	const unsigned char* tend = topic + topiclen;
+
+	while (*filter)
+	{
+		if (*filter == '#')
+			return 1;
+		if (*filter == '+')
+		{
+			while (t < tend && *t != '/')
+				t++;
+			filter++;
+		}
+		else
+		{
+			if (t >= tend || *t != (unsigned char)*filter)
+				return 0;
+			t++;
+			filter++;
+		}
+		if (*filter == '/' && filter[1] == '#' && filter[2] == '\0' && t == tend)
+			return 1;  /* "a/#" also matches "a" */
+	}
+	return t == tend;
+}
+
+
+static void closeConn(int i)
+{
+	Conn* c = conns[i];
+	int j;
+
+	close(c->fd);
+	for (j = 0; j < c->nsubs; j++)
+		free(c->subs[j].filter);
+	free(c->subs);
+	if (c->aliases)
+	{
+		for (j = 0; j < aliasmax; j++)
+			free(c->aliases[j]);
+		free(c->aliases);
+		free(c->aliaslens);
+	}
+	for (j = 0; j < c->noutaliases; j++)
+		free(c->outaliases[j]);
+	free(c->outaliases);
+	free(c->outaliaslens);
+	free(c->in);
+	free(c->out);
+	free(c);
+	conns[i] = conns[--nconns];
+}
+
+
+static void handleConnect(Conn* c, const unsigned char* p, const unsigned char* end)
+{
+	const unsigned char* name;
+	int namelen;
+	unsigned char flags = 0;
+
+	if (!readString(&p, end, &name, &namelen) || p >= end)
+	{
+		c->closing = 1;
+		return;
+	}
+	c->version = *p++;
+	if (c->version == 5)
+	{
+		const unsigned char* q;
+		size_t proplen;
+
+		p += 3;  /* connect flags and keep alive */
+		if (!readVBI(&p, end, &proplen) || (size_t)(end - p) < proplen)
+		{
+			c->closing = 1;
+			return;
+		}
+		for (q = p; q < p + proplen; )
+		{
+			size_t len = propertyLength(q, p + proplen);
+
+			if (len == 0)
+				break;
+			if (*q == PROP_TOPIC_ALIAS_MAXIMUM)
+			{
+				const unsigned char* r = q + 1;
+
+				readInt(&r, q + len, &c->outaliasmax);
+			}
+			q += len;
+		}
+		if (c->outaliasmax > 0)
+		{
+			c->outaliases = xrealloc(NULL, c->outaliasmax * sizeof(unsigned char*));
+			c->outaliaslens = xrealloc(NULL, c->outaliasmax * sizeof(int));
+		}
+	}
+	if (c->version == 5 && aliasmax > 0)
+	{
+		/* flags, reason code, properties: TOPIC_ALIAS_MAXIMUM */
+		unsigned char body[] = {0x00, 0x00, 0x03, PROP_TOPIC_ALIAS_MAXIMUM, 0x00, 0x00};
+
+		body[4] = (unsigned char)(aliasmax >> 8);
+		body[5] = (unsigned char)(aliasmax & 0xFF);
+		c->aliases = xrealloc(NULL, aliasmax * sizeof(unsigned char*));
+		c->aliaslens = xrealloc(NULL, aliasmax * sizeof(int));
+		memset(c->aliases, 0, aliasmax * sizeof(unsigned char*));
+		sendHeader(c, CONNACK << 4, sizeof(body));
+		outAppend(c, body, sizeof(body));
+	}
+	else if (c->version == 5)
+	{
+		unsigned char body[] = {0x00, 0x00, 0x00};  /* flags, reason code, no properties */
+
+		sendHeader(c, CONNACK << 4, sizeof(body));
+		outAppend(c, body, sizeof(body));
+	}
+	else
+	{
+		unsigned char body[2];
+
+		body[0] = flags;
+		body[1] = 0x00;
+		sendHeader(c, CONNACK << 4, sizeof(body));
+		outAppend(c, body, sizeof(body));
+	}
+}
+
+
+static void handleSubscribe(Conn* c, const unsigned char* p, const unsigned char* end)
+{
+	unsigned char rcs[256];
+	int msgid, nrcs = 0;
+	size_t proplen;
+
+	if (!readInt(&p, end, &msgid))
+		goto bad;
+	if (c->version == 5)
+	{
+		if (!readVBI(&p, end, &proplen) || (size_t)(end - p) < proplen)
+			goto bad;
+		p += proplen;
+	}
+	while (p < end && nrcs < (int)sizeof(rcs))
+	{
+		const unsigned char* topic;
+		int topiclen, qos;
+
+		if (!readString(&p, end, &topic, &topiclen) || p >= end)
+			goto bad;
+		qos = *p++ & 0x03;
+		if (qos > 2)
+			qos = 2;
+		if (c->nsubs == c->subcap)
+		{
+			c->subcap = c->subcap ? c->subcap * 2 : 8;
+			c->subs = xrealloc(c->subs, c->subcap * sizeof(Subscription));
+		}
+		c->subs[c->nsubs].filter = xrealloc(NULL, topiclen + 1);
+		memcpy(c->subs[c->nsubs].filter, topic, topiclen);
+		c->subs[c->nsubs].filter[topiclen] = '\0';
+		c->subs[c->nsubs].qos = qos;
+		c->nsubs++;
+		rcs[nrcs++] = (unsigned char)qos;
+	}
+	sendHeader(c, (SUBACK << 4), 2 + (c->version == 5) + nrcs);
+	{
+		unsigned char id[3] = {(unsigned char)(msgid >> 8), (unsigned char)(msgid & 0xFF), 0};
+		outAppend(c, id, 2 + (c->version == 5));
+	}
+	outAppend(c, rcs, nrcs);
+	return;
+bad:
+	c->closing = 1;
+}
+
+
+static void handleUnsubscribe(Conn* c, const unsigned char* p, const unsigned char* end)
+{
+	unsigned char rcs[256];
+	int msgid, nrcs = 0;
+	size_t proplen;
+
+	if (!readInt(&p, end, &msgid))
+		goto bad;
+	if (c->version == 5)
+	{
+		if (!readVBI(&p, end, &proplen) || (size_t)(end - p) < proplen)
+			goto bad;
+		p += proplen;
+	}
+	while (p < end && nrcs < (int)sizeof(rcs))
+	{
+		const unsigned char* topic;
+		int topiclen, j;
+
+		if (!readString(&p, end, &topic, &topiclen))
+			goto bad;
+		rcs[nrcs] = 0x11;  /* no subscription existed */
+		for (j = 0; j < c->nsubs; j++)
+		{
+			if ((int)strlen(c->subs[j].filter) == topiclen &&
+					memcmp(c->subs[j].filter, topic, topiclen) == 0)
+			{
+				free(c->subs[j].filter);
+				c->subs[j] = c->subs[--c->nsubs];
+				rcs[nrcs] = 0x00;
+				break;
+			}
+		}
+		nrcs++;
+	}
+	if (c->version == 5)
+	{
+		unsigned char id[3] = {(unsigned char)(msgid >> 8), (unsigned char)(msgid & 0xFF), 0};
+
+		sendHeader(c, (UNSUBACK << 4), 3 + nrcs);
+		outAppend(c, id, 3);
+		outAppend(c, rcs, nrcs);
+	}
+	else
+		sendAck(c, UNSUBACK, 0, msgid);
+	return;
+bad:
+	c->closing = 1;
+}
+
+
+/*
+ * Forwards one publication to a subscriber.  MQTT 5 properties are passed
+ * through, except for a topic alias which is only valid on the connection
+ * it arrived on.
+ */
+static void forward(Conn* to, int qos, const unsigned char* topic, int topiclen,
+		const unsigned char* props, size_t proplen, const unsigned char* payload, size_t payloadlen)
+{
+	unsigned char buf[8];
+	unsigned char* newprops = NULL;
+	size_t newproplen = 0, remaining;
+	int vbilen = 0, alias = 0, i;
+
+	if (to->version == 5)
+	{
+		const unsigned char* p = props;
+		const unsigned char* end = props + proplen;
+
+		for (i = 0; i < to->noutaliases; i++)
+		{
+			if (to->outaliaslens[i] == topiclen && memcmp(to->outaliases[i], topic, topiclen) == 0)
+				break;
+		}
+		if (i < to->noutaliases)
+		{
+			alias = i + 1;
+			topiclen = 0;  /* the subscriber already knows the alias */
+		}
+		else if (to->noutaliases < to->outaliasmax)
+		{
+			to->outaliases[i] = xrealloc(NULL, topiclen);
+			memcpy(to->outaliases[i], topic, topiclen);
+			to->outaliaslens[i] = topiclen;
+			alias = ++to->noutaliases;
+		}
+
+		newprops = xrealloc(NULL, proplen + 4);
+		while (p < end)
+		{
+			size_t len = propertyLength(p, end);
+
+			if (len == 0)
+				break;
+			if (*p != PROP_TOPIC_ALIAS)
+			{
+				memcpy(newprops + newproplen, p, len);
+				newproplen += len;
+			}
+			p += len;
+		}
+		if (alias > 0)
+		{
+			newprops[newproplen++] = PROP_TOPIC_ALIAS;
+			newprops[newproplen++] = (unsigned char)(alias >> 8);
+			newprops[newproplen++] = (unsigned char)(alias & 0xFF);
+		}
+		vbilen = encodeLength(buf, newproplen);
+	}
+
+	remaining = 2 + topiclen + ((qos > 0) ? 2 : 0) + vbilen + newproplen + payloadlen;
+	sendHeader(to, (unsigned char)((PUBLISH << 4) | (qos << 1)), remaining);
+	buf[0] = (unsigned char)(topiclen >> 8);
+	buf[1] = (unsigned char)(topiclen & 0xFF);
+	outAppend(to, buf, 2);
+	outAppend(to, topic, topiclen);
+	if (qos > 0)
+	{
+		if (++to->next_msgid > 65535)
+			to->next_msgid = 1;
+		buf[0] = (unsigned char)(to->next_msgid >> 8);
+		buf[1] = (unsigned char)(to->next_msgid & 0xFF);
+		outAppend(to, buf, 2);
+	}
+	if (to->version == 5)
+	{
+		encodeLength(buf, newproplen);
+		outAppend(to, buf, vbilen);
+		outAppend(to, newprops, newproplen);
+		free(newprops);
+	}
+	outAppend(to, payload, payloadlen);
+	stat_out++;
+}
+
+
+/*
+ * Applies the TOPIC_ALIAS property of an MQTT 5 PUBLISH, if any: a topic
+ * given with an alias (re)defines it, an empty topic is replaced by the
+ * one the alias stands for.  Returns 0 if the alias is not valid.
+ */
+static int resolveAlias(Conn* c, const unsigned char* props, size_t proplen,
+		const unsigned char** topic, int* topiclen)
+{
+	const unsigned char* p = props;
+	const unsigned char* end = props + proplen;
+	int alias = 0;
+
+	while (p < end)
+	{
+		size_t len = propertyLength(p, end);
+
+		if (len == 0)
+			return 0;
+		if (*p == PROP_TOPIC_ALIAS)
+		{
+			const unsigned char* q = p + 1;
+
+			readInt(&q, end, &alias);
+		}
+		p += len;
+	}
+	if (alias == 0)
+		return *topiclen > 0;
+	if (alias > aliasmax || c->aliases == NULL)
+		return 0;
+	if (*topiclen > 0)
+	{
+		free(c->aliases[alias - 1]);
+		c->aliases[alias - 1] = xrealloc(NULL, *topiclen);
+		memcpy(c->aliases[alias - 1], *topic, *topiclen);
+		c->aliaslens[alias - 1] = *topiclen;
+	}
+	else if (c->aliases[alias - 1] == NULL)
+		return 0;
+	else
+	{
+		*topic = c->aliases[alias - 1];
+		*topiclen = c->aliaslens[alias - 1];
+	}
+	return 1;
+}
+
+
+static void handlePublish(Conn* c, unsigned char header, const unsigned char* p, const unsigned char* end)
+{
+	const unsigned char* topic;
+	const unsigned char* props = NULL;
+	int topiclen, msgid = 0, i, j;
+	int qos = (header >> 1) & 0x03;
+	size_t proplen = 0;
+
+	if (!readString(&p, end, &topic, &topiclen))
+		goto bad;
+	if (qos > 0 && !readInt(&p, end, &msgid))
+		goto bad;
+	if (c->version == 5)
+	{
+		if (!readVBI(&p, end, &proplen) || (size_t)(end - p) < proplen)
+			goto bad;
+		props = p;
+		p += proplen;
+		if (!resolveAlias(c, props, proplen, &topic, &topiclen))
+			goto bad;
+	}
+	stat_in++;
+
+	for (i = 0; i < nconns; i++)
+	{
+		Conn* to = conns[i];
+		int subqos = -1;
+
+		if (to->version == 0 || to->closing)
+			continue;
+		for (j = 0; j < to->nsubs; j++)
+		{
+			if (to->subs[j].qos > subqos && topicMatches(to->subs[j].filter, topic, topiclen))
+				subqos = to->subs[j].qos;
+		}
+		if (subqos >= 0)
+			forward(to, (qos < subqos) ? qos : subqos, topic, topiclen, props, proplen, p, end - p);
+	}
+
+	if (qos == 1)
+		sendAck(c, PUBACK, 0, msgid);
+	else if (qos == 2)
+		sendAck(c, PUBREC, 0, msgid);
+	return;
+bad:
+	c->closing = 1;
+}
+
+
+/*
+ * Dispatches one complete packet.
+ */
+static void handlePacket(Conn* c, unsigned char header, const unsigned char* p, size_t len)
+{
+	const unsigned char* end = p + len;
+	int type = header >> 4;
+	int msgid;
+
+	if (c->version == 0 && type != CONNECT)
+	{
+		c->closing = 1;
+		return;
+	}
+	switch (type)
+	{
+		case CONNECT:
+			handleConnect(c, p, end);
+			break;
+		case PUBLISH:
+			handlePublish(c, header, p, end);
+			break;
+		case PUBREC:
+			if (readInt(&p, end, &msgid))
+				sendAck(c, PUBREL, 2, msgid);
+			break;
+		case PUBREL:
+			if (readInt(&p, end, &msgid))
+				sendAck(c, PUBCOMP, 0, msgid);
+			break;
+		case PUBACK:
+		case PUBCOMP:
+			break;
+		case SUBSCRIBE:
+			handleSubscribe(c, p, end);
+			break;
+		case UNSUBSCRIBE:
+			handleUnsubscribe(c, p, end);
+			break;
+		case PINGREQ:
+			sendHeader(c, PINGRESP << 4, 0);
+			break;
+		case DISCONNECT:
+			c->closing = 1;
+			break;
+		default:
+			c->closing = 1;
+			break;
+	}
+}
+
+
+/*
+ * Reads what is available on a connection and handles all complete packets.
+ */
+static void readConn(Conn* c)
+{
+	size_t off = 0;
+
+	for (;;)
+	{
+		ssize_t n;
+
+		if (c->incap - c->inlen < 65536)
+		{
+			c->incap = c->incap ? c->incap * 2 : 65536;
+			c->in = xrealloc(c->in, c->incap);
+		}
+		n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+		if (n == 0)
+		{
+			c->closing = 1;
+			break;
+		}
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->closing = 1;
+			break;
+		}
+		c->inlen += n;
+		stat_bytes_in += n;
+		if (c->inlen < c->incap)
+			break;
+	}
+
+	while (!c->closing)
+	{
+		const unsigned char* p = c->in + off + 1;
+		const unsigned char* end = c->in + c->inlen;
+		size_t remaining;
+
+		if (c->inlen - off < 2)
+			break;
+		if (!readVBI(&p, end, &remaining))
+		{
+			if (end - (c->in + off + 1) >= 4)
+				c->closing = 1;  /* malformed length */
+			break;
+		}
+		if ((size_t)(end - p) < remaining)
+			break;
+		handlePacket(c, c->in[off], p, remaining);
+		off = (p + remaining) - c->in;
+	}
+	if (off > 0)
+	{
+		memmove(c->in, c->in + off, c->inlen - off);
+		c->inlen -= off;
+	}
+}
+
+
+static int listenTcp(int port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd, on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0 ||
+			getsockname(fd, (struct sockaddr*)&addr, &len) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	setnonblocking(fd);
+	printf("listening tcp 127.0.0.1 %d\n", ntohs(addr.sin_port));
+	return fd;
+}
+
+
+static int listenUnix(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	unlink(path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	setnonblocking(fd);
+	printf("listening unix %s\n", path);
+	return fd;
+}
+
+
+static void acceptConns(int lfd)
+{
+	int fd;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0)
+	{
+		Conn* c = xrealloc(NULL, sizeof(Conn));
+		int on = 1;
+
+		memset(c, 0, sizeof(Conn));
+		c->fd = fd;
+		setnonblocking(fd);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); /* fails harmlessly on unix sockets */
+		if (nconns == conncap)
+		{
+			conncap = conncap ? conncap * 2 : 16;
+			conns = xrealloc(conns, conncap * sizeof(Conn*));
+		}
+		conns[nconns++] = c;
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	struct pollfd* fds = NULL;
+	const char* unixpath = NULL;
+	int port = 1883, i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-port") == 0 && i + 1 < argc)
+			port = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-unix") == 0 && i + 1 < argc)
+			unixpath = argv[++i];
+		else if (strcmp(argv[i], "-aliases") == 0 && i + 1 < argc)
+			aliasmax = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-quiet") == 0)
+			quiet = 1;
+		else
+		{
+			fprintf(stderr, "usage: %s ?-port port? ?-unix path? ?-aliases n? ?-quiet?\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (aliasmax < 0 || aliasmax > 65535)
+	{
+		fprintf(stderr, "mockbroker: -aliases must be 0 to 65535\n");
+		return 2;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+
+	if (port >= 0 && (listeners[nlisteners++] = listenTcp(port)) < 0)
+	{
+		perror("mockbroker: tcp listener");
+		return 1;
+	}
+	if (unixpath && (listeners[nlisteners++] = listenUnix(unixpath)) < 0)
+	{
+		perror("mockbroker: unix listener");
+		return 1;
+	}
+	printf("ready\n");
+	fflush(stdout);
+
+	while (!stopping)
+	{
+		int nfds = nlisteners + nconns;
+
+		fds = xrealloc(fds, nfds * sizeof(struct pollfd));
+		for (i = 0; i < nlisteners; i++)
+		{
+			fds[i].fd = listeners[i];
+			fds[i].events = POLLIN;
+		}
+		for (i = 0; i < nconns; i++)
+		{
+			fds[nlisteners + i].fd = conns[i]->fd;
+			fds[nlisteners + i].events = POLLIN | ((conns[i]->outlen > conns[i]->outoff) ? POLLOUT : 0);
+		}
+		if (poll(fds, nfds, 1000) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("mockbroker: poll");
+			break;
+		}
+		for (i = 0; i < nlisteners; i++)
+		{
+			if (fds[i].revents & POLLIN)
+				acceptConns(listeners[i]);
+		}
+		/* connections accepted above are not in fds yet, so only walk the old ones */
+		for (i = 0; i < nfds - nlisteners; i++)
+		{
+			if (fds[nlisteners + i].revents & (POLLIN | POLLHUP | POLLERR))
+				readConn(conns[i]);
+		}
+		for (i = nconns - 1; i >= 0; i--)
+		{
+			outFlush(conns[i]);
+			if (conns[i]->closing)
+				closeConn(i);
+		}
+	}
+
+	if (!quiet)
+		fprintf(stderr, "mockbroker: %lu publications in, %lu out, %lu bytes read\n",
+			stat_in, stat_out, stat_bytes_in);
+	for (i = nconns - 1; i >= 0; i--)
+		closeConn(i);
+	if (unixpath)
+		unlink(unixpath);
+	free(fds);
+	free(conns);
+	return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * restorebench.c --
+ *
+ *	Benchmark of the restore of a persisted session when a client is
+ *	created.  For each count, a store is filled with that many records
+ *	through the persistence of a client, and the client is destroyed and
+ *	created again, timing MQTTClient_createWithOptions as it reads the
+ *	records back:
+ *
+ *	  sent     QoS 1 PUBLISH packets waiting for their PUBACK, restored
+ *	           into the outbound messages of the client (at most 65535,
+ *	           the number of message IDs)
+ *	  queued   received messages not yet taken by the application,
+ *	           restored into the message queue of the client
+ *
+ *	Usage:
+ *	    restorebench ?-counts list? ?-persistence type? ?-dir path?
+ *
+ *	where -counts is a comma separated list (default 10000,100000,1000000),
+ *	-persistence is default, log, mmap or sqlite, and -dir is where the store is
+ *	made (default the working directory).  The store is cleared after each
+ *	count.
+ *
+ * Copyright (c) 2026 The mqttc authors.
+ *
+ * This file is licensed under BSD 3-Clause License, see LICENSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "MQTTClient.h"
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistence.h"
+#include "Clients.h"
+#include "LinkedList.h"
+#include "Heap.h"
+
+#define MAX_MSGID 65535
+#define PAYLOADLEN 32
+
+extern ClientStates* bstate;
+
+static const char* serverURI = "tcp://127.0.0.1:1883";
+static const char* clientID = "restorebench";
+static const char* topic = "bench/restore/telemetry";
+
+static int persistenceType = MQTTCLIENT_PERSISTENCE_DEFAULT;
+static const char* directory = ".";
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fail(const char* what)
+{
+	fprintf(stderr, "restorebench: %s failed\n", what);
+	exit(1);
+}
+
+/*
+ * Creates the client, restoring whatever its store holds, and returns its
+ * internal state so that records can be put straight into the store.
+ */
+static Clients* create(MQTTClient* client, int slots)
+{
+	MQTTClient_createOptions createOpts = MQTTClient_createOptions_initializer;
+	MQTTClient_logPersistenceOptions logOpts = MQTTClient_logPersistenceOptions_initializer;
+	MQTTClient_mmapPersistenceOptions mapOpts = MQTTClient_mmapPersistenceOptions_initializer;
+	MQTTClient_sqlitePersistenceOptions sqlOpts = MQTTClient_sqlitePersistenceOptions_initializer;
+	void* context = (void*)directory;
+	ListElement* current = NULL;
+
+	if (persistenceType == MQTTCLIENT_PERSISTENCE_LOG)
+	{
+		logOpts.directory = directory;
+		context = &logOpts;
+	}
+	else if (persistenceType == MQTTCLIENT_PERSISTENCE_MMAP)
+	{
+		mapOpts.directory = directory;
+		mapOpts.slotCount = slots;
+		mapOpts.slotSize = 128;
+		context = &mapOpts;
+	}
+	else if (persistenceType == MQTTCLIENT_PERSISTENCE_SQLITE)
+	{
+		sqlOpts.directory = directory;
+		context = &sqlOpts;
+	}
+	createOpts.MQTTVersion = MQTTVERSION_3_1_1;
+	if (MQTTClient_createWithOptions(client, serverURI, clientID, persistenceType,
+			context, &createOpts) != MQTTCLIENT_SUCCESS)
+		fail("MQTTClient_create");
+	while (ListNextElement(bstate->clients, &current))
+	{
+		Clients* c = (Clients*)current->content;
+
+		if (strcmp(c->clientID, clientID) == 0)
+			return c;
+	}
+	fail("client lookup");
+	return NULL;
+}
+
+/*
+ * Puts the PUBLISH packets of count QoS 1 messages, as MQTTPersistence_putPacket
+ * would have written them on sending.
+ */
+static void putSent(Clients* c, int count)
+{
+	char packet[256];
+	char payload[PAYLOADLEN];
+	char key[32];
+	size_t topiclen = strlen(topic);
+	int remaining = (int)(2 + topiclen + 2 + PAYLOADLEN);
+	int msgid;
+
+	memset(payload, 'x', sizeof(payload));
+	for (msgid = 1; msgid <= count; ++msgid)
+	{
+		char* ptr = packet;
+		char* buffers[1];
+		int buflens[1];
+
+		*ptr++ = 0x32; /* PUBLISH, QoS 1 */
+		*ptr++ = (char)remaining; /* one byte of remaining length */
+		*ptr++ = (char)(topiclen >> 8);
+		*ptr++ = (char)(topiclen & 0xFF);
+		memcpy(ptr, topic, topiclen);
+		ptr += topiclen;
+		*ptr++ = (char)(msgid >> 8);
+		*ptr++ = (char)(msgid & 0xFF);
+		memcpy(ptr, payload, PAYLOADLEN);
+		ptr += PAYLOADLEN;
+		buffers[0] = packet;
+		buflens[0] = (int)(ptr - packet);
+		snprintf(key, sizeof(key), "%s%d", PERSISTENCE_PUBLISH_SENT, msgid);
+		if (c->persistence->pput(c->phandle, key, 1, buffers, buflens) != 0)
+			fail("pput");
+	}
+}
+
+/*
+ * Puts count queue entries, as MQTTPersistence_persistQueueEntry would have
+ * written them on receiving.
+ */
+static void putQueued(Clients* c, int count)
+{
+	char payload[PAYLOADLEN];
+	char key[32];
+	int payloadlen = PAYLOADLEN, qos = 1, retained = 0, dup = 0, msgid = 0;
+	int topicLen = 0;
+	unsigned int seqno;
+
+	memset(payload, 'x', sizeof(payload));
+	for (seqno = 0; seqno < (unsigned int)count; ++seqno)
+	{
+		char* buffers[8];
+		int buflens[8];
+
+		msgid = (int)(seqno % MAX_MSGID) + 1;
+		buffers[0] = (char*)&payloadlen; buflens[0] = sizeof(int);
+		buffers[1] = payload; buflens[1] = PAYLOADLEN;
+		buffers[2] = (char*)&qos; buflens[2] = sizeof(int);
+		buffers[3] = (char*)&retained; buflens[3] = sizeof(int);
+		buffers[4] = (char*)&dup; buflens[4] = sizeof(int);
+		buffers[5] = (char*)&msgid; buflens[5] = sizeof(int);
+		buffers[6] = (char*)topic; buflens[6] = (int)strlen(topic) + 1;
+		buffers[7] = (char*)&topicLen; buflens[7] = sizeof(int);
+		snprintf(key, sizeof(key), "%s%u", PERSISTENCE_QUEUE_KEY, seqno);
+		if (c->persistence->pput(c->phandle, key, 8, buffers, buflens) != 0)
+			fail("pput");
+	}
+}
+
+static void run(const char* name, int count)
+{
+	MQTTClient client;
+	Clients* c = create(&client, count);
+	long long start;
+	int restored;
+
+	if (strcmp(name, "sent") == 0)
+		putSent(c, count);
+	else
+		putQueued(c, count);
+	MQTTClient_destroy(&client);
+
+	start = now_ns();
+	c = create(&client, count);
+	start = now_ns() - start;
+	restored = (strcmp(name, "sent") == 0) ? c->outboundMsgs->count : c->messageQueue->count;
+	if (restored != count)
+		fprintf(stderr, "restorebench: %d of %d records restored\n", restored, count);
+	printf("%-8s %-8s %8d %12.1f %12.2f\n", persistenceType == MQTTCLIENT_PERSISTENCE_LOG ? "log" :
+		persistenceType == MQTTCLIENT_PERSISTENCE_MMAP ? "mmap" :
+		persistenceType == MQTTCLIENT_PERSISTENCE_SQLITE ? "sqlite" : "default",
+		name, count, start / 1e6, (double)start / 1e3 / count);
+	fflush(stdout);
+	c->persistence->pclear(c->phandle);
+	MQTTClient_destroy(&client);
+}
+
+int main(int argc, char** argv)
+{
+	const char* usage = "usage: %s ?-counts list? ?-persistence default|log|mmap|sqlite? ?-dir path?\n";
+	char counts[256] = "10000,100000,1000000";
+	char* save = NULL;
+	char* tok;
+	int i;
+
+	for (i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-counts") == 0 && strlen(argv[i + 1]) < sizeof(counts))
+			strcpy(counts, argv[i + 1]);
+		else if (strcmp(argv[i], "-persistence") == 0 && strcmp(argv[i + 1], "default") == 0)
+			persistenceType = MQTTCLIENT_PERSISTENCE_DEFAULT;
+		else if (strcmp(argv[i], "-persistence") == 0 && strcmp(argv[i + 1], "log") == 0)
+			persistenceType = MQTTCLIENT_PERSISTENCE_LOG;
+		else if (strcmp(argv[i], "-persistence") == 0 && strcmp(argv[i + 1], "mmap") == 0)
+			persistenceType = MQTTCLIENT_PERSISTENCE_MMAP;
+#if defined(MQTT_SQLITE)
+		else if (strcmp(argv[i], "-persistence") == 0 && strcmp(argv[i + 1], "sqlite") == 0)
+			persistenceType = MQTTCLIENT_PERSISTENCE_SQLITE;
+#endif
+		else if (strcmp(argv[i], "-dir") == 0)
+			directory = argv[i + 1];
+		else
+		{
+			fprintf(stderr, usage, argv[0]);
+			return 1;
+		}
+	}
+	if (i != argc)
+	{
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	printf("%-8s %-8s %8s %12s %12s\n", "store", "case", "records", "restore ms", "us/record");
+	for (tok = strtok_r(counts, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		int count = atoi(tok);
+
+		if (count <= 0 || count > PERSISTENCE_SEQNO_LIMIT)
+		{
+			fprintf(stderr, "restorebench: counts must be 1 to %d\n", PERSISTENCE_SEQNO_LIMIT);
+			return 1;
+		}
+		run("sent", count > MAX_MSGID ? MAX_MSGID : count);
+		run("queued", count);
+	}
+	return 0;
+}
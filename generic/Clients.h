@@ -34,6 +34,20 @@
 #include "LinkedList.h"
 #include "MQTTClientPersistence.h"
 #include "Socket.h"
+#include "TopicAliases.h"
+
+/**
+ * A received PUBLISH packet kept in one heap block, with the topic and the
+ * payload following this header, or only the payload if the topic is that
+ * of an inbound topic alias.  The structures pointing into the packet,
+ * the Publish, a stored publication and the message handed to the
+ * application, each hold a reference to it.
+ */
+typedef struct
+{
+	int refcount;	/**< the number of structures pointing into the packet */
+	const char* aliasTopic;	/**< the topic of an inbound alias the packet holds a reference to, or NULL */
+} PacketBuffer;
 
 /**
  * Stored publication data to minimize copying
@@ -46,6 +60,12 @@ typedef struct
 	int payloadlen;
 	int refcount;
 	uint8_t mask[4];
+	void (*release)(void*, void*); /**< releases a borrowed payload instead of free, if set */
+	void* release_context; /**< the first argument of release */
+	ListElement link; /**< the element in state.publications */
+	PacketBuffer* buffer; /**< the received packet the topic and payload point into, if any */
+	int streamed; /**< the number of payload bytes written to a payload stream instead */
+	PayloadFile* file; /**< the file the payload is read from as it is sent, instead of payload, if set */
 } Publications;
 
 /**
@@ -62,6 +82,7 @@ typedef struct
 	START_TIME_TYPE lastTouch;		    /**> used for retry and expiry */
 	char nextMessageType;	/**> PUBREC, PUBREL, PUBCOMP */
 	int len;				/**> length of the whole structure+data */
+	ListElement link;		/**> the element in outboundMsgs or inboundMsgs */
 } Messages;
 
 /**
@@ -76,6 +97,19 @@ typedef struct
 	int qos;
 } willMessages;
 
+/**
+ * Where the payloads of large received publications are written as they are
+ * read, rather than being read into memory whole.
+ */
+typedef struct
+{
+	size_t threshold; /**< the smallest packet offered to open, 0 for none */
+	void* context;    /**< the first argument of the functions */
+	int (*open)(void* context, char* topicName, int topicLen, int qos, size_t payloadlen, void** stream);
+	int (*write)(void* context, void* stream, const char* data, size_t len);
+	void (*close)(void* context, void* stream, int rc);
+} PayloadSink;
+
 typedef struct
 {
 	SOCKET socket;
@@ -93,6 +127,11 @@ typedef struct
 	int websocket; /**< socket has been upgraded to use web sockets */
 	char *websocket_key;
 	const MQTTClient_nameValue* httpHeaders;
+	TopicAliases* outboundAliases; /**< MQTT 5 topic aliases for the publications we send */
+	TopicAliases* inboundAliases; /**< MQTT 5 topic aliases for the publications we receive */
+	PayloadSink sink; /**< where large payloads are streamed to, if anywhere */
+	struct InboundStreamStruct* instream; /**< the publication being read in pieces, if any */
+	struct OutboundFileStruct* outfile; /**< the publication being sent from a file in pieces, if any */
 } networkHandles;
 
 
@@ -142,10 +181,17 @@ typedef struct Clients
 	int connect_count;              /**< the number of outbound messages on reconnect - to ensure we send them all */
 	int connect_sent;               /**< the current number of outbound messages on reconnect that we've sent */
 	List* messageQueue;             /**< inbound complete but undelivered messages */
+	int maxQueuedMessages;          /**< the number of undelivered messages at which reading stops, 0 for no limit */
+	size_t maxQueuedBytes;          /**< the undelivered payload bytes at which reading stops, 0 for no limit */
+	int queuedMessages;             /**< inbound complete but undelivered messages, including those being delivered */
+	size_t queuedBytes;             /**< the payload bytes of the undelivered messages */
+	int readsPaused;                /**< whether reading from the socket is stopped until messages are delivered */
 	List* outboundQueue;            /**< outbound queued messages */
 	unsigned int qentry_seqno;
 	void* phandle;                  /**< the persistence handle */
 	MQTTClient_persistence* persistence; /**< a persistence implementation */
+	struct MQTTPersistenceWriterStruct* writer; /**< commits the persistence writes in the background, if set */
+	struct MQTTPersistenceBatchesStruct* qbatches; /**< the batches the message queue is persisted in, if any */
     MQTTPersistence_beforeWrite* beforeWrite; /**< persistence write callback */
     MQTTPersistence_afterRead* afterRead; /**< persistence read callback */
     void* beforeWrite_context;      /**< context to be used with the persistence beforeWrite callbacks */
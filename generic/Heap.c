@@ -56,7 +56,7 @@ static pthread_mutex_t heap_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type heap_mutex = &heap_mutex_store;
 #endif
 
-static heap_info state = {0, 0}; /**< global heap state information */
+static heap_info state = {0, 0, 0}; /**< global heap state information */
 
 typedef uint64_t eyecatcherType;
 static eyecatcherType eyecatcher = (eyecatcherType)0x8888888888888888;
@@ -211,6 +211,7 @@ void* mymalloc(char* file, int line, size_t size)
 	*(eyecatcherType*)(((char*)(s->ptr)) + (sizeof(eyecatcherType) + size)) = eyecatcher; /* end eyecatcher */
 	Log(TRACE_MAX, -1, "Allocating %d bytes in heap at file %s line %d ptr %p\n", (int)size, file, line, s->ptr);
 	TreeAdd(&heap, s, space);
+	state.allocations++;
 	state.current_size += size;
 	if (state.current_size > state.max_size)
 		state.max_size = state.current_size;
@@ -335,6 +336,7 @@ void *myrealloc(char* file, int line, void* p, size_t size)
 
 		checkEyecatchers(file, line, p, s->size);
 		size = Heap_roundup(size);
+		state.allocations++;
 		state.current_size += size - s->size;
 		if (state.current_size > state.max_size)
 			state.max_size = state.current_size;
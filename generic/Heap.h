@@ -63,6 +63,7 @@ typedef struct
 {
 	size_t current_size;	/**< current size of the heap in bytes */
 	size_t max_size;		/**< max size the heap has reached in bytes */
+	size_t allocations;		/**< number of allocations and reallocations made */
 } heap_info;
 
 #if defined(__cplusplus)
@@ -33,6 +33,7 @@
 
 
 static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int freeContent);
+static void ListReleaseElement(List* aList, ListElement* element);
 
 
 /**
@@ -58,6 +59,63 @@ List* ListInitialize(void)
 }
 
 
+/**
+ * Sets a list structure to an empty intrusive list.
+ * @param newl a pointer to the list structure to be initialized
+ * @param offset the offset of the ListElement in the items, from offsetof
+ */
+void ListZeroIntrusive(List* newl, size_t offset)
+{
+	ListZero(newl);
+	newl->intrusive = 1;
+	newl->offset = offset;
+}
+
+
+/**
+ * Allocates and initializes a new intrusive list structure.
+ * @param offset the offset of the ListElement in the items, from offsetof
+ * @return a pointer to the new list structure
+ */
+List* ListInitializeIntrusive(size_t offset)
+{
+	List* newl = malloc(sizeof(List));
+	if (newl)
+		ListZeroIntrusive(newl, offset);
+	return newl;
+}
+
+
+/**
+ * Gets an element for a new item: the one embedded in the item for an
+ * intrusive list, otherwise a new one.
+ * @param aList the list the item is to be added to
+ * @param content the item
+ * @return the element, or NULL if memory is short
+ */
+static ListElement* ListNewElement(List* aList, void* content)
+{
+	if (aList->intrusive)
+		return (ListElement*)((char*)content + aList->offset);
+	return malloc(sizeof(ListElement));
+}
+
+
+/**
+ * Lets go of the element of an item which has been unlinked from a list.
+ * An embedded element is marked as not in the list, others are freed.
+ * @param aList the list the item was in
+ * @param element the element
+ */
+static void ListReleaseElement(List* aList, ListElement* element)
+{
+	if (aList->intrusive)
+		element->content = NULL;
+	else
+		free(element);
+}
+
+
 /**
  * Append an already allocated ListElement and content to a list.  Can be used to move
  * an item from one list to another.
@@ -89,7 +147,7 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t s
  */
 ListElement* ListAppend(List* aList, void* content, size_t size)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = ListNewElement(aList, content);
 	if (newel)
 		ListAppendNoMalloc(aList, content, newel, size);
 	return newel;
@@ -106,7 +164,7 @@ ListElement* ListAppend(List* aList, void* content, size_t size)
  */
 ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* index)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = ListNewElement(aList, content);
 
 	if (newel == NULL)
 		return newel;
@@ -146,6 +204,7 @@ ListElement* ListFind(List* aList, void* content)
 /**
  * Finds an element in a list by comparing the content or pointer to the content.  A callback
  * function is used to define the method of comparison for each element.
+ * In an intrusive list, the element of a content pointer is found without a search.
  * @param aList the list in which the search is to be conducted
  * @param content pointer to the content to look for
  * @param callback pointer to a function which compares each element (NULL means compare by content pointer)
@@ -155,7 +214,14 @@ ListElement* ListFindItem(List* aList, void* content, int(*callback)(void*, void
 {
 	ListElement* rc = NULL;
 
-	if (aList->current != NULL && ((callback == NULL && aList->current->content == content) ||
+	if (callback == NULL && aList->intrusive)
+	{	/* an embedded element points back to its item while it is in the list */
+		ListElement* element = (ListElement*)((char*)content + aList->offset);
+
+		if (element->content == content)
+			rc = aList->current = element;
+	}
+	else if (aList->current != NULL && ((callback == NULL && aList->current->content == content) ||
 		   (callback != NULL && callback(aList->current->content, content))))
 		rc = aList->current;
 	else
@@ -202,6 +268,7 @@ static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*),
 {
 	ListElement* next = NULL;
 	ListElement* saved = aList->current;
+	void* found = NULL;
 	int saveddeleted = 0;
 
 	if (!ListFindItem(aList, content, callback))
@@ -219,14 +286,12 @@ static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*),
 		aList->current->next->prev = aList->current->prev;
 
 	next = aList->current->next;
-	if (freeContent)
-    {
-		free(aList->current->content);
-                aList->current->content = NULL;
-    }
+	found = aList->current->content;
 	if (saved == aList->current)
 		saveddeleted = 1;
-	free(aList->current);
+	ListReleaseElement(aList, aList->current);
+	if (freeContent) /* after the element, which may be part of the content */
+		free(found);
 	if (saveddeleted)
 		aList->current = next;
 	else
@@ -248,6 +313,29 @@ int ListDetach(List* aList, void* content)
 }
 
 
+/**
+ * Removes but does not free the content of a list element, given the element itself,
+ * so that the list does not have to be searched.
+ * @param aList the list from which the element is to be removed
+ * @param element the element to remove, which must be in aList
+ */
+void ListDetachElement(List* aList, ListElement* element)
+{
+	if (element->prev == NULL)
+		aList->first = element->next;
+	else
+		element->prev->next = element->next;
+	if (element->next == NULL)
+		aList->last = element->prev;
+	else
+		element->next->prev = element->prev;
+	if (aList->current == element)
+		aList->current = element->next;
+	ListReleaseElement(aList, element);
+	--(aList->count);
+}
+
+
 /**
  * Removes and frees an item in a list by comparing the pointer to the content.
  * @param aList the list from which the item is to be removed
@@ -279,7 +367,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
-		free(first);
+		ListReleaseElement(aList, first);
 		--(aList->count);
 	}
 	return content;
@@ -317,7 +405,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
-		free(last);
+		ListReleaseElement(aList, last);
 		--(aList->count);
 	}
 	return content;
@@ -361,13 +449,12 @@ void ListEmpty(List* aList)
 	while (aList->first != NULL)
 	{
 		ListElement* first = aList->first;
-		if (first->content != NULL)
-                {
-			free(first->content);
-                        first->content = NULL;
-                }
+		void* content = first->content;
+
 		aList->first = first->next;
-		free(first);
+		ListReleaseElement(aList, first);
+		if (content != NULL) /* after the element, which may be part of the content */
+			free(content);
 	}
 	aList->count = 0;
 	aList->size = 0;
@@ -395,7 +482,7 @@ void ListFreeNoContent(List* aList)
 	{
 		ListElement* first = aList->first;
 		aList->first = first->next;
-		free(first);
+		ListReleaseElement(aList, first);
 	}
 	free(aList);
 }
@@ -20,6 +20,7 @@
 #define LINKEDLIST_H
 
 #include <stdlib.h> /* for size_t definition */
+#include <stddef.h> /* for offsetof */
 
 /*BE
 defm defList(T)
@@ -62,7 +63,13 @@ typedef struct ListElementStruct
 
 
 /**
- * Structure to hold all data for one list
+ * Structure to hold all data for one list.
+ *
+ * The elements of an intrusive list are embedded in the items themselves, at
+ * the same offset in each, rather than allocated for each item,
+ * so that adding and removing items never allocates, and removing an item
+ * by its pointer does not search the list.  An item can only be in one
+ * intrusive list per embedded element at a time.
  */
 typedef struct
 {
@@ -71,10 +78,14 @@ typedef struct
 				*current;	/**< current element in the list, for iteration */
 	int count;  /**< no of items */
 	size_t size;  /**< heap storage used */
+	int intrusive;  /**< whether the elements are embedded in the items */
+	size_t offset;  /**< the offset of the embedded element in each item */
 } List;
 
 void ListZero(List*);
 List* ListInitialize(void);
+void ListZeroIntrusive(List* newl, size_t offset);
+List* ListInitializeIntrusive(size_t offset);
 
 ListElement* ListAppend(List* aList, void* content, size_t size);
 void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t size);
@@ -88,6 +99,7 @@ void* ListPopTail(List* aList);
 
 int ListDetach(List* aList, void* content);
 int ListDetachItem(List* aList, void* content, int(*callback)(void*, void*));
+void ListDetachElement(List* aList, ListElement* element);
 
 void ListFree(List* aList);
 void ListEmpty(List* aList);
@@ -64,6 +64,9 @@
 #include "MQTTProtocolOut.h"
 #include "Thread.h"
 #include "SocketBuffer.h"
+#include "MemoryPool.h"
+#include "MessageRing.h"
+#include "MQTTPersistenceWriter.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
@@ -124,6 +127,7 @@ extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 #endif
 extern mutex_type log_mutex;
+extern mutex_type pool_mutex;
 
 int MQTTClient_init(void)
 {
@@ -175,6 +179,12 @@ int MQTTClient_init(void)
 			printf("socket_mutex error %d\n", rc);
 			goto exit;
 		}
+		if ((pool_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		{
+			rc = GetLastError();
+			printf("pool_mutex error %d\n", rc);
+			goto exit;
+		}
 	}
 exit:
 	return rc;
@@ -196,6 +206,8 @@ void MQTTClient_cleanup(void)
 		CloseHandle(log_mutex);
 	if (socket_mutex)
 		CloseHandle(socket_mutex);
+	if (pool_mutex)
+		CloseHandle(pool_mutex);
 	if (mqttclient_mutex)
 		CloseHandle(mqttclient_mutex);
 }
@@ -282,12 +294,20 @@ static int running = 0;
 static int tostop = 0;
 static thread_id_type run_id = 0;
 
+/** the number of messages which can be handed to the delivery thread of a client at once */
+#define MQTTCLIENT_DELIVERY_RING 1024
+
+/** the longest wait for the socket while acks are queued, which may be waiting for persistence commits */
+#define MQTTCLIENT_ACK_POLL 10L
+
 typedef struct
 {
 	MQTTClient_message* msg;
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	int payloadlen; /* counted in queuedBytes until the message is delivered */
+	ListElement link; /* the element in messageQueue */
 } qEntry;
 
 
@@ -324,7 +344,24 @@ typedef struct
 	sem_type unsuback_sem;
 	MQTTPacket* pack;
 
+	int connectAsync; /* a connect started by MQTTClient_connectStart is in progress */
+	int connectRc; /* how the last connect started by MQTTClient_connectStart ended */
+	int connectVersion;
+	START_TIME_TYPE connectStart;
+	ELAPSED_TIME_TYPE connectTimeout;
+	MQTTClient_connectOptions* connectOptions;
+	MQTTProperties* connectProperties;
+	MQTTProperties* willProperties;
+
 	unsigned long commandTimeout;
+
+	MessageRing* delivery; /* messages handed from MQTTClient_run to the delivery thread */
+	MessageRing* delivered; /* messages handed back once messageArrived has accepted them */
+	int delivering; /* the number of messages in the two rings, only used by MQTTClient_run */
+	volatile int delivery_running; /* the delivery thread has been started and not yet finished */
+	volatile int delivery_stop; /* the delivery thread is to finish */
+	int destroy_pending; /* MQTTClient_destroy is left to the delivery thread, once it finishes */
+	thread_id_type delivery_id;
 } MQTTClients;
 
 struct props_rc_parms
@@ -339,10 +376,13 @@ static void MQTTClient_emptyMessageQueue(Clients* client);
 static int MQTTClient_deliverMessage(
 		int rc, MQTTClients* m,
 		char** topicName, int* topicLen,
-		MQTTClient_message** message);
+		MQTTClient_message** message, int borrowTopic);
 static int clientSockCompare(void* a, void* b);
 static thread_return_type WINAPI connectionLost_call(void* context);
 static thread_return_type WINAPI MQTTClient_run(void* n);
+static thread_return_type WINAPI MQTTClient_deliver(void* n);
+static void MQTTClient_handOver(MQTTClients* m);
+static void MQTTClient_stopDelivery(MQTTClients* m);
 static int MQTTClient_stop(void);
 static void MQTTClient_closeSession(Clients* client, enum MQTTReasonCodes reason, MQTTProperties* props);
 static int MQTTClient_cleanSession(Clients* client);
@@ -390,7 +430,11 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 		goto exit;
 	}
 
-	if (strlen(clientId) == 0 && persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT)
+	if (strlen(clientId) == 0 && (persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_LOG ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_MMAP ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_TMPFS ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_SQLITE))
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
@@ -429,6 +473,8 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 		#endif
 		Log_initialize((Log_nameValue*)MQTTClient_getVersionInfo());
 		bstate->clients = ListInitialize();
+		if (state.publications.count == 0)
+			ListZeroIntrusive(&(state.publications), offsetof(Publications, link));
 		Socket_outInitialize();
 		Socket_setWriteCompleteCallback(MQTTClient_writeComplete);
 		Socket_setWriteContinueCallback(MQTTClient_writeContinue);
@@ -507,9 +553,9 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
 	m->c->MQTTVersion = (options) ? options->MQTTVersion : MQTTVERSION_DEFAULT;
-	m->c->outboundMsgs = ListInitialize();
-	m->c->inboundMsgs = ListInitialize();
-	m->c->messageQueue = ListInitialize();
+	m->c->outboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->inboundMsgs = ListInitializeIntrusive(offsetof(Messages, link));
+	m->c->messageQueue = ListInitializeIntrusive(offsetof(qEntry, link));
 	m->c->outboundQueue = ListInitialize();
 	m->c->clientID = MQTTStrdup(clientId);
 	m->connect_sem = Thread_create_sem(&rc);
@@ -554,6 +600,7 @@ static void MQTTClient_terminate(void)
 		ListFree(handles);
 		handles = NULL;
 		WebSocket_terminate();
+		MemoryPool_terminate();
 		#if !defined(NO_HEAP_TRACKING)
 			Heap_terminate();
 		#endif
@@ -564,22 +611,74 @@ static void MQTTClient_terminate(void)
 }
 
 
+/**
+ * Keeps count of the messages of a client which have been received and not yet delivered,
+ * and stops reading from its socket while they are at either of its limits, until they
+ * are down to half of both.  No keepalive pings are sent or timed out while reads are stopped.
+ * mqttclient_mutex must be locked when you call this function, if multi threaded
+ * @param client the client
+ * @param qe the queue entry of the message
+ * @param added 1 if the message has been received, 0 if it has been delivered or discarded
+ */
+static void MQTTClient_countQueued(Clients* client, qEntry* qe, int added)
+{
+	if (added)
+	{
+		++(client->queuedMessages);
+		client->queuedBytes += qe->payloadlen;
+	}
+	else
+	{
+		--(client->queuedMessages);
+		client->queuedBytes -= qe->payloadlen;
+	}
+	if (client->net.socket <= 0)
+		;
+	else if (!client->readsPaused)
+	{
+		if ((client->maxQueuedMessages > 0 && client->queuedMessages >= client->maxQueuedMessages) ||
+			(client->maxQueuedBytes > 0 && client->queuedBytes >= client->maxQueuedBytes))
+		{
+			Log(TRACE_MIN, -1, "Pausing reads for client %s, %d messages of %lu bytes queued",
+				client->clientID, client->queuedMessages, (unsigned long)client->queuedBytes);
+			Socket_pauseReads(client->net.socket, 1);
+			client->readsPaused = 1;
+		}
+	}
+	else if ((client->maxQueuedMessages == 0 || client->queuedMessages <= client->maxQueuedMessages / 2) &&
+		(client->maxQueuedBytes == 0 || client->queuedBytes <= client->maxQueuedBytes / 2))
+	{
+		Log(TRACE_MIN, -1, "Resuming reads for client %s, %d messages of %lu bytes queued",
+			client->clientID, client->queuedMessages, (unsigned long)client->queuedBytes);
+		Socket_pauseReads(client->net.socket, 0);
+		client->readsPaused = 0;
+		/* an answer to a ping sent before the pause is given its full time again */
+		if (client->ping_outstanding)
+			client->net.lastPing = MQTTTime_now();
+		if (client->ping_due)
+			client->ping_due_time = MQTTTime_now();
+	}
+}
+
+
 static void MQTTClient_emptyMessageQueue(Clients* client)
 {
 	FUNC_ENTRY;
 	/* empty message queue */
 	if (client->messageQueue->count > 0)
 	{
-		ListElement* current = NULL;
-		while (ListNextElement(client->messageQueue, &current))
+		qEntry* qe = NULL;
+
+		/* detach each entry before it is freed, as its list element is part of it */
+		while ((qe = (qEntry*)ListDetachHead(client->messageQueue)) != NULL)
 		{
-			qEntry* qe = (qEntry*)(current->content);
-			free(qe->topicName);
-			MQTTProperties_free(&qe->msg->properties);
-			free(qe->msg->payload);
-			free(qe->msg);
+			if (((MQTTPersistence_queuedMessage*)qe->msg)->buffer == NULL)
+				free(qe->topicName); /* otherwise it is in the packet freed with the message */
+			MQTTClient_freeMessage(&qe->msg);
+			MQTTClient_countQueued(client, qe, 0);
+			MemoryPool_free(POOL_QUEUE_ENTRY, qe);
 		}
-		ListEmpty(client->messageQueue);
+		ListEmpty(client->messageQueue); /* resets the size */
 	}
 	FUNC_EXIT;
 }
@@ -599,7 +698,17 @@ void MQTTClient_destroy(MQTTClient* handle)
 	if (m->c)
 	{
 		SOCKET saved_socket = m->c->net.socket;
-		char* saved_clientid = MQTTStrdup(m->c->clientID);
+		char* saved_clientid = NULL;
+
+		/* the messages delivered are unpersisted before the persistence is closed */
+		MQTTClient_stopDelivery(m);
+		if (m->delivery_running)
+		{	/* called from messageArrived, or the callback is stuck: m is freed when it returns */
+			m->destroy_pending = 1;
+			*handle = NULL;
+			goto exit;
+		}
+		saved_clientid = MQTTStrdup(m->c->clientID);
 #if !defined(NO_PERSISTENCE)
 		MQTTPersistence_close(m->c);
 #endif
@@ -632,10 +741,15 @@ exit:
 
 void MQTTClient_freeMessage(MQTTClient_message** message)
 {
+	PacketBuffer* buffer = ((MQTTPersistence_queuedMessage*)*message)->buffer;
+
 	FUNC_ENTRY;
 	MQTTProperties_free(&(*message)->properties);
-	free((*message)->payload);
-	free(*message);
+	if (buffer)
+		MQTTPacket_releaseBuffer(buffer); /* the payload and topic point into it */
+	else
+		free((*message)->payload);
+	MemoryPool_free(POOL_CLIENT_MESSAGE, *message);
 	*message = NULL;
 	FUNC_EXIT;
 }
@@ -676,13 +790,37 @@ void MQTTResponse_free(MQTTResponse response)
 }
 
 
-static int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, int* topicLen, MQTTClient_message** message)
+/**
+ * Gets the topic of a queued message for the application to free with
+ * MQTTClient_free.  A topic in the received packet goes with the message,
+ * so it is copied.
+ * @param qe the queued message
+ * @return the topic, or NULL if memory is short
+ */
+static char* MQTTClient_ownTopicName(qEntry* qe)
+{
+	char* topicName = qe->topicName;
+
+	if (((MQTTPersistence_queuedMessage*)qe->msg)->buffer && (topicName = malloc(qe->topicLen + 1)) != NULL)
+		memcpy(topicName, qe->topicName, qe->topicLen + 1);
+	return topicName;
+}
+
+
+static int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, int* topicLen, MQTTClient_message** message,
+		int borrowTopic)
 {
 	qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
 
 	FUNC_ENTRY;
+	if (borrowTopic)
+		*topicName = qe->topicName;
+	else if ((*topicName = MQTTClient_ownTopicName(qe)) == NULL)
+	{	/* leave the message queued */
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
 	*message = qe->msg;
-	*topicName = qe->topicName;
 	*topicLen = qe->topicLen;
 	if (strlen(*topicName) != *topicLen)
 		rc = MQTTCLIENT_TOPICNAME_TRUNCATED;
@@ -690,7 +828,10 @@ static int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, i
 	if (m->c->persistence)
 		MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
 #endif
-	ListRemove(m->c->messageQueue, m->c->messageQueue->first->content);
+	ListDetach(m->c->messageQueue, qe);
+	MQTTClient_countQueued(m->c, qe, 0);
+	MemoryPool_free(POOL_QUEUE_ENTRY, qe);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -790,6 +931,78 @@ int MQTTClient_setPublished(MQTTClient handle, void* context, MQTTClient_publish
 }
 
 
+int MQTTClient_setQueueLimits(MQTTClient handle, int maxMessages, size_t maxBytes)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+	MQTTClients* m = handle;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(mqttclient_mutex);
+
+	if (m == NULL || maxMessages < 0)
+		rc = MQTTCLIENT_FAILURE;
+	else
+	{
+		m->c->maxQueuedMessages = maxMessages;
+		m->c->maxQueuedBytes = maxBytes;
+	}
+
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_setPersistenceSync(MQTTClient handle, int policy, int value)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+	MQTTClients* m = handle;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(mqttclient_mutex);
+
+	if (m == NULL || policy < MQTTCLIENT_PERSISTENCE_SYNC_NONE || policy > MQTTCLIENT_PERSISTENCE_SYNC_EACH ||
+		((policy == MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL || policy == MQTTCLIENT_PERSISTENCE_SYNC_COUNT) && value <= 0))
+		rc = MQTTCLIENT_FAILURE;
+	else if (m->c->persistence == NULL)
+		; /* nothing to write */
+	else if (m->c->writer)
+		MQTTPersistenceWriter_setPolicy(m->c->writer, policy, value);
+	else if ((m->c->writer = MQTTPersistenceWriter_create(m->c->persistence, m->c->phandle, policy, value)) == NULL)
+		rc = MQTTCLIENT_FAILURE;
+
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_setPayloadStream(MQTTClient handle, size_t threshold, void* context,
+		MQTTClient_streamOpen* open, MQTTClient_streamWrite* write, MQTTClient_streamClose* close)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+	MQTTClients* m = handle;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(mqttclient_mutex);
+
+	if (m == NULL || open == NULL || write == NULL || close == NULL)
+		rc = MQTTCLIENT_FAILURE;
+	else
+	{	/* a payload being streamed is finished with the functions it started with */
+		m->c->net.sink.threshold = threshold;
+		m->c->net.sink.context = context;
+		m->c->net.sink.open = open;
+		m->c->net.sink.write = write;
+		m->c->net.sink.close = close;
+	}
+
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 #if 0
 int MQTTClient_setHandleAuth(MQTTClient handle, void* context, MQTTClient_handleAuth* auth_handle)
 {
@@ -857,6 +1070,14 @@ static thread_return_type WINAPI MQTTClient_run(void* n)
 			break;
 		timeout = 100L;
 
+		if (handles)
+		{	/* pass the messages received to the delivery threads, and free the ones delivered */
+			ListElement* current = NULL;
+
+			while (ListNextElement(handles, &current))
+				MQTTClient_handOver((MQTTClients*)(current->content));
+		}
+
 		/* find client corresponding to socket */
 		if (ListFindItem(handles, &sock, clientSockCompare) == NULL)
 		{
@@ -891,35 +1112,6 @@ static thread_return_type WINAPI MQTTClient_run(void* n)
 		}
 		else
 		{
-			if (m->c->messageQueue->count > 0 && m->ma)
-			{
-				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
-				int topicLen = qe->topicLen;
-
-				if (strlen(qe->topicName) == topicLen)
-					topicLen = 0;
-
-				Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
-					m->c->clientID, m->c->messageQueue->count);
-				Paho_thread_unlock_mutex(mqttclient_mutex);
-				rc = (*(m->ma))(m->context, qe->topicName, topicLen, qe->msg);
-				Paho_thread_lock_mutex(mqttclient_mutex);
-				/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
-				 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
-				 * so we must be careful how we use it.
-				 */
-				if (rc)
-				{
-					#if !defined(NO_PERSISTENCE)
-					if (m->c->persistence)
-						MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
-					#endif
-					ListRemove(m->c->messageQueue, qe);
-				}
-				else
-					Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
-						m->c->clientID);
-			}
 			if (pack)
 			{
 				if (pack->header.bits.type == CONNACK)
@@ -1033,6 +1225,195 @@ static thread_return_type WINAPI MQTTClient_run(void* n)
 }
 
 
+/**
+ * Frees the messages which the delivery thread of a client has handed back.
+ * mqttclient_mutex must be locked, as the persistence may be updated.
+ * @param m the client
+ */
+static void MQTTClient_reclaimDelivered(MQTTClients* m)
+{
+	qEntry* qe = NULL;
+
+	while ((qe = (qEntry*)MessageRing_pop(m->delivered)) != NULL)
+	{
+#if !defined(NO_PERSISTENCE)
+		if (m->c->persistence)
+			MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
+#endif
+		MQTTClient_countQueued(m->c, qe, 0);
+		MemoryPool_free(POOL_QUEUE_ENTRY, qe);
+		--(m->delivering);
+	}
+}
+
+
+/**
+ * Moves the received messages of a client with a messageArrived callback from its message
+ * queue to its delivery thread, starting the thread first if need be.  The messages are
+ * pushed as one batch, with one wakeup.  Only called by MQTTClient_run, with mqttclient_mutex
+ * locked, as it is the only producer of the delivery ring and consumer of the delivered ring.
+ * @param m the client
+ */
+static void MQTTClient_handOver(MQTTClients* m)
+{
+	int pushed = 0;
+
+	if (m->ma == NULL || m->c == NULL || m->delivery_stop)
+		goto exit;
+	if (m->delivery == NULL)
+	{
+		if (m->c->messageQueue->count == 0 || m->delivery_running || !m->c->connected)
+			goto exit;
+		if ((m->delivery = MessageRing_create(MQTTCLIENT_DELIVERY_RING)) == NULL ||
+			(m->delivered = MessageRing_create(MQTTCLIENT_DELIVERY_RING)) == NULL)
+		{	/* the messages stay queued until memory is less short */
+			MessageRing_destroy(m->delivery);
+			m->delivery = NULL;
+			goto exit;
+		}
+		m->delivering = 0;
+		m->delivery_running = 1;
+		Paho_thread_start(MQTTClient_deliver, m);
+	}
+	MQTTClient_reclaimDelivered(m);
+	/* the two rings can always take all the messages handed over and not yet reclaimed */
+	while (m->c->messageQueue->count > 0 && m->delivering < MessageRing_capacity(m->delivery))
+	{
+		MessageRing_push(m->delivery, ListDetachHead(m->c->messageQueue));
+		++(m->delivering);
+		++pushed;
+	}
+	if (pushed > 0)
+	{
+		Log(TRACE_MIN, -1, "Handed %d messages to the delivery thread for client %s, %d in delivery",
+			pushed, m->c->clientID, m->delivering);
+		MessageRing_wake(m->delivery);
+	}
+exit:
+	return;
+}
+
+
+/**
+ * Puts the messages the delivery thread of a client did not get to back at the front of the
+ * message queue, in order, frees those it delivered and frees the rings.  Called by the
+ * delivery thread as it finishes, with mqttclient_mutex locked, which keeps MQTTClient_run
+ * away from the rings.
+ * @param m the client
+ */
+static void MQTTClient_endDelivery(MQTTClients* m)
+{
+	ListElement* first = m->c->messageQueue->first;
+	qEntry* qe = NULL;
+
+	while ((qe = (qEntry*)MessageRing_pop(m->delivery)) != NULL)
+	{
+		size_t size = sizeof(qe) + sizeof(qe->msg) + qe->msg->payloadlen + strlen(qe->topicName)+1;
+
+		if (first)
+			ListInsert(m->c->messageQueue, qe, size, first);
+		else
+			ListAppend(m->c->messageQueue, qe, size);
+		--(m->delivering);
+	}
+	MQTTClient_reclaimDelivered(m);
+	MessageRing_destroy(m->delivery);
+	MessageRing_destroy(m->delivered);
+	m->delivery = m->delivered = NULL;
+}
+
+
+/* This is the thread function that calls the messageArrived callback of a client */
+static thread_return_type WINAPI MQTTClient_deliver(void* n)
+{
+	MQTTClients* m = n;
+	int destroy = 0;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTClient_deliver");
+	m->delivery_id = Paho_thread_getid();
+	while (!m->delivery_stop)
+	{
+		qEntry* qe = (qEntry*)MessageRing_peek(m->delivery);
+		int topicLen = 0;
+		char* topicName = NULL;
+		int rc = 0;
+
+		if (qe == NULL)
+		{
+			MessageRing_wait(m->delivery, 100);
+			continue;
+		}
+		topicLen = qe->topicLen;
+		if (strlen(qe->topicName) == topicLen)
+			topicLen = 0;
+		if ((topicName = MQTTClient_ownTopicName(qe)) != NULL) /* otherwise try again when memory is less short */
+			rc = (*(m->ma))(m->context, topicName, topicLen, qe->msg);
+		/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
+		 * the ring, and it will be retried later.  If 1 is returned then the message data may have been freed,
+		 * so we must be careful how we use it.
+		 */
+		if (rc)
+		{
+			MessageRing_pop(m->delivery);
+			MessageRing_push(m->delivered, qe); /* the persistence is updated by MQTTClient_run */
+		}
+		else
+		{
+			if (topicName && topicName != qe->topicName)
+				free(topicName);
+			Log(TRACE_MIN, -1, "False returned from messageArrived, message remains on queue");
+			MQTTTime_sleep(100L);
+		}
+	}
+	Paho_thread_lock_mutex(mqttclient_mutex);
+	MQTTClient_endDelivery(m);
+	m->delivery_running = 0;
+	if ((destroy = m->destroy_pending) == 0)
+		m->delivery_stop = 0; /* otherwise MQTTClient_run does not start another thread */
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	if (destroy)
+		MQTTClient_destroy((MQTTClient*)&m);
+	FUNC_EXIT;
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
+/**
+ * Stops the delivery thread of a client, if it has one, and waits for it to finish, unless
+ * called from the messageArrived callback, in which case it finishes when the callback returns,
+ * or the callback does not return within 10 seconds: delivery_running is still set then.
+ * mqttclient_mutex must be locked when you call this function.
+ * @param m the client
+ */
+static void MQTTClient_stopDelivery(MQTTClients* m)
+{
+	FUNC_ENTRY;
+	if (m->delivery_running)
+	{
+		int count = 0;
+
+		m->delivery_stop = 1;
+		MessageRing_wake(m->delivery);
+		if (Paho_thread_getid() != m->delivery_id)
+		{
+			while (m->delivery_running && ++count < 1000)
+			{
+				Paho_thread_unlock_mutex(mqttclient_mutex);
+				MQTTTime_sleep(10L);
+				Paho_thread_lock_mutex(mqttclient_mutex);
+			}
+			if (m->delivery_running)
+				Log(LOG_ERROR, -1, "Delivery thread for client %s did not finish", m->c->clientID);
+		}
+	}
+	FUNC_EXIT;
+}
+
+
 static int MQTTClient_stop(void)
 {
 	int rc = 0;
@@ -1106,6 +1487,7 @@ static void MQTTClient_closeSession(Clients* client, enum MQTTReasonCodes reason
 {
 	FUNC_ENTRY;
 	client->good = 0;
+	client->readsPaused = 0; /* the socket goes */
 	client->ping_outstanding = 0;
 	client->ping_due = 0;
 	if (client->net.socket > 0)
@@ -1127,6 +1509,13 @@ static void MQTTClient_closeSession(Clients* client, enum MQTTReasonCodes reason
 		client->net.ssl = NULL;
 #endif
 	}
+	TopicAliases_free(client->net.outboundAliases);
+	client->net.outboundAliases = NULL;
+	TopicAliases_free(client->net.inboundAliases);
+	client->net.inboundAliases = NULL;
+	MQTTPacket_endStream(&client->net);
+	MQTTPacket_endFile(&client->net);
+	MQTTProtocol_emptyAckQueue(client); /* they were for the connection which has gone */
 	client->connected = 0;
 	client->connect_state = NOT_IN_PROGRESS;
 
@@ -1160,28 +1549,36 @@ void Protocol_processPublication(Publish* publish, Clients* client, int allocate
 	MQTTClient_message initialized = MQTTClient_message_initializer;
 
 	FUNC_ENTRY;
-	qe = malloc(sizeof(qEntry));
+	qe = MemoryPool_alloc(POOL_QUEUE_ENTRY);
 	if (!qe)
 		goto exit;
-	mm = malloc(sizeof(MQTTClient_message));
+	mm = MemoryPool_alloc(POOL_CLIENT_MESSAGE);
 	if (!mm)
 	{
-		free(qe);
+		MemoryPool_free(POOL_QUEUE_ENTRY, qe);
 		goto exit;
 	}
 	memcpy(mm, &initialized, sizeof(MQTTClient_message));
+	((MQTTPersistence_queuedMessage*)mm)->buffer = publish->buffer;
 
 	qe->msg = mm;
 	qe->topicName = publish->topic;
 	qe->topicLen = publish->topiclen;
+	qe->payloadlen = publish->payloadlen;
 	publish->topic = NULL;
-	if (allocatePayload)
+	if (publish->buffer)
+	{	/* the topic and payload stay in the received packet */
+		if (allocatePayload)
+			MQTTPacket_retainBuffer(publish->buffer); /* otherwise the caller's reference is handed over */
+		mm->payload = publish->payload;
+	}
+	else if (allocatePayload)
 	{
 		mm->payload = malloc(publish->payloadlen);
 		if (mm->payload == NULL)
 		{
-			free(mm);
-			free(qe);
+			MemoryPool_free(POOL_CLIENT_MESSAGE, mm);
+			MemoryPool_free(POOL_QUEUE_ENTRY, qe);
 			goto exit;
 		}
 		memcpy(mm->payload, publish->payload, publish->payloadlen);
@@ -1196,11 +1593,13 @@ void Protocol_processPublication(Publish* publish, Clients* client, int allocate
 	else
 		mm->dup = publish->header.bits.dup;
 	mm->msgid = publish->msgId;
+	mm->streamed = publish->streamed;
 
 	if (publish->MQTTVersion >= 5)
 		mm->properties = MQTTProperties_copy(&publish->properties);
 
 	ListAppend(client->messageQueue, qe, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
+	MQTTClient_countQueued(client, qe, 1);
 #if !defined(NO_PERSISTENCE)
 	if (client->persistence)
 		MQTTPersistence_persistQueueEntry(client, (MQTTPersistence_qEntry*)qe);
@@ -1210,6 +1609,235 @@ exit:
 }
 
 
+/**
+ * Carries on with a connect once the TCP connect has completed: starts the proxy, SSL or
+ * websocket connect, or sends the MQTT connect packet.
+ * mqttclient_mutex must be locked when you call this function, if multi threaded
+ * @return MQTTCLIENT_SUCCESS, or SOCKET_ERROR if the connect has failed
+ */
+static int MQTTClient_connectTCPDone(MQTTClients* m, const char* serverURI, int MQTTVersion,
+	MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+#if defined(OPENSSL)
+	if (m->ssl)
+	{
+		int port1;
+		size_t hostname_len;
+		const char *topic;
+		int setSocketForSSLrc = 0;
+
+		if (m->c->net.https_proxy) {
+			m->c->connect_state = PROXY_CONNECT_IN_PROGRESS;
+			if ((rc = Proxy_connect( &m->c->net, 1, serverURI)) == SOCKET_ERROR )
+				goto exit;
+		}
+
+		hostname_len = MQTTProtocol_addressPort(serverURI, &port1, &topic, MQTT_DEFAULT_PORT);
+		setSocketForSSLrc = SSLSocket_setSocketForSSL(&m->c->net, m->c->sslopts,
+			serverURI, hostname_len);
+
+		if (setSocketForSSLrc != MQTTCLIENT_SUCCESS)
+		{
+			if (m->c->session != NULL)
+				if ((rc = SSL_set_session(m->c->net.ssl, m->c->session)) != 1)
+					Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
+			rc = m->c->sslopts->struct_version >= 3 ?
+				SSLSocket_connect(m->c->net.ssl, m->c->net.socket, serverURI,
+					m->c->sslopts->verify, m->c->sslopts->ssl_error_cb, m->c->sslopts->ssl_error_context) :
+				SSLSocket_connect(m->c->net.ssl, m->c->net.socket, serverURI,
+					m->c->sslopts->verify, NULL, NULL);
+			if (rc == TCPSOCKET_INTERRUPTED)
+				m->c->connect_state = SSL_IN_PROGRESS;  /* the connect is still in progress */
+			else if (rc == SSL_FATAL)
+			{
+				rc = SOCKET_ERROR;
+				goto exit;
+			}
+			else if (rc == 1)
+			{
+				if (m->websocket)
+				{
+					m->c->connect_state = WEBSOCKET_IN_PROGRESS;
+					rc = WebSocket_connect(&m->c->net, 1, serverURI);
+					if ( rc == SOCKET_ERROR )
+						goto exit;
+				}
+				else
+				{
+					rc = MQTTCLIENT_SUCCESS;
+					m->c->connect_state = WAIT_FOR_CONNACK;
+					if (MQTTPacket_send_connect(m->c, MQTTVersion, connectProperties, willProperties) == SOCKET_ERROR)
+					{
+						rc = SOCKET_ERROR;
+						goto exit;
+					}
+					if ((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
+						m->c->session = SSL_get1_session(m->c->net.ssl);
+				}
+			}
+		}
+		else
+		{
+			rc = SOCKET_ERROR;
+			goto exit;
+		}
+	}
+	else
+#endif
+	{
+		if (m->c->net.http_proxy) {
+			m->c->connect_state = PROXY_CONNECT_IN_PROGRESS;
+			if ((rc = Proxy_connect( &m->c->net, 0, serverURI)) == SOCKET_ERROR )
+				goto exit;
+		}
+
+		if (m->websocket)
+		{
+			m->c->connect_state = WEBSOCKET_IN_PROGRESS;
+			if ( WebSocket_connect(&m->c->net, 0, serverURI) == SOCKET_ERROR )
+			{
+				rc = SOCKET_ERROR;
+				goto exit;
+			}
+		}
+		else
+		{
+			m->c->connect_state = WAIT_FOR_CONNACK; /* TCP connect completed, in which case send the MQTT connect packet */
+			if (MQTTPacket_send_connect(m->c, MQTTVersion, connectProperties, willProperties) == SOCKET_ERROR)
+			{
+				rc = SOCKET_ERROR;
+				goto exit;
+			}
+		}
+	}
+	rc = MQTTCLIENT_SUCCESS;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if defined(OPENSSL)
+/**
+ * Carries on with a connect once the SSL connect has completed.
+ * mqttclient_mutex must be locked when you call this function, if multi threaded
+ * @return MQTTCLIENT_SUCCESS, or SOCKET_ERROR if the connect has failed
+ */
+static int MQTTClient_connectSSLDone(MQTTClients* m, const char* serverURI, int MQTTVersion,
+	MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	if((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
+		m->c->session = SSL_get1_session(m->c->net.ssl);
+
+	if ( m->websocket )
+	{
+		/* wait for websocket connect */
+		m->c->connect_state = WEBSOCKET_IN_PROGRESS;
+		if (WebSocket_connect( &m->c->net, 1, serverURI) != 1)
+			rc = SOCKET_ERROR;
+	}
+	else
+	{
+		m->c->connect_state = WAIT_FOR_CONNACK; /* TCP connect completed, in which case send the MQTT connect packet */
+		if (MQTTPacket_send_connect(m->c, MQTTVersion, connectProperties, willProperties) == SOCKET_ERROR)
+			rc = SOCKET_ERROR;
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+#endif
+
+
+/**
+ * Takes in the CONNACK of a connect.
+ * mqttclient_mutex must be locked when you call this function, if multi threaded
+ * @param resp set to the reason code, and to the CONNACK properties for MQTT 5
+ * @return the value of the session present flag
+ */
+static int MQTTClient_connectConnack(MQTTClients* m, Connack* connack, int MQTTVersion,
+	MQTTProperties* connectProperties, MQTTResponse* resp)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+	int sessionPresent = 0;
+
+	FUNC_ENTRY;
+	Log(TRACE_PROTOCOL, 1, NULL, m->c->net.socket, m->c->clientID, connack->rc);
+	if ((rc = connack->rc) == MQTTCLIENT_SUCCESS)
+	{
+		m->c->connected = 1;
+		m->c->good = 1;
+		m->c->connect_state = NOT_IN_PROGRESS;
+		if (MQTTVersion >= MQTTVERSION_3_1_1)
+			sessionPresent = connack->flags.bits.sessionPresent;
+		TopicAliases_free(m->c->net.outboundAliases);
+		m->c->net.outboundAliases = NULL;
+		TopicAliases_free(m->c->net.inboundAliases);
+		m->c->net.inboundAliases = NULL;
+		if (m->c->MQTTVersion >= MQTTVERSION_5 &&
+				MQTTProperties_hasProperty(&connack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM))
+			m->c->net.outboundAliases = TopicAliases_create((int)MQTTProperties_getNumericValue(
+				&connack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM), 1);
+		if (m->c->MQTTVersion >= MQTTVERSION_5 && connectProperties &&
+				MQTTProperties_hasProperty(connectProperties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM))
+			m->c->net.inboundAliases = TopicAliases_create((int)MQTTProperties_getNumericValue(
+				connectProperties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM), 0);
+		if (m->c->cleansession || m->c->cleanstart)
+			rc = MQTTClient_cleanSession(m->c);
+		if (m->c->outboundMsgs->count > 0)
+		{
+			ListElement* outcurrent = NULL;
+			START_TIME_TYPE zero = START_TIME_ZERO;
+
+			while (ListNextElement(m->c->outboundMsgs, &outcurrent))
+			{
+				Messages* m2 = (Messages*)(outcurrent->content);
+				memset(&m2->lastTouch, '\0', sizeof(m2->lastTouch));
+			}
+			MQTTProtocol_retry(zero, 1, 1);
+			if (m->c->connected != 1)
+				rc = MQTTCLIENT_DISCONNECTED;
+		}
+		if (m->c->MQTTVersion == MQTTVERSION_5)
+		{
+			if ((resp->properties = malloc(sizeof(MQTTProperties))) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				goto exit;
+			}
+			*resp->properties = MQTTProperties_copy(&connack->properties);
+
+			if (MQTTProperties_hasProperty(&connack->properties, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE))
+			{
+				/* update the keep alive from the server keep alive */
+				int server_keep_alive = (int)MQTTProperties_getNumericValue(&connack->properties, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE);
+				if (server_keep_alive != -999999)
+				{
+					Log(LOG_PROTOCOL, -1, "Setting keep alive interval to server keep alive %d", server_keep_alive);
+					m->c->keepAliveInterval = server_keep_alive;
+				}
+			}
+			else if (m->c->keepAliveInterval != m->c->savedKeepAliveInterval)
+			{
+				/* if the keep alive has been previously updated with a server keep alive, but there is no server keep alive
+				on this connect, reset it to the value requested in the original connect API */
+				Log(LOG_PROTOCOL, -1, "Resetting keep alive interval to %d", m->c->savedKeepAliveInterval);
+				m->c->keepAliveInterval = m->c->savedKeepAliveInterval;
+			}
+		}
+	}
+exit:
+	resp->reasonCode = rc;
+	FUNC_EXIT_RC(rc);
+	return sessionPresent;
+}
+
+
 static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* options, const char* serverURI, int MQTTVersion,
 	START_TIME_TYPE start, ELAPSED_TIME_TYPE millisecsTimeout, MQTTProperties* connectProperties, MQTTProperties* willProperties)
 {
@@ -1269,6 +1897,13 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 		goto exit;
 	}
 
+	if (m->connectAsync)
+	{	/* the rest is done by MQTTClient_connectStep as the socket becomes ready */
+		m->connectVersion = MQTTVersion;
+		rc = MQTTCLIENT_CONNECT_IN_PROGRESS;
+		goto exit;
+	}
+
 	if (m->c->connect_state == TCP_IN_PROGRESS) /* TCP connect started - wait for completion */
 	{
 		Paho_thread_unlock_mutex(mqttclient_mutex);
@@ -1279,98 +1914,8 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 			rc = SOCKET_ERROR;
 			goto exit;
 		}
-#if defined(OPENSSL)
-		if (m->ssl)
-		{
-			int port1;
-			size_t hostname_len;
-			const char *topic;
-			int setSocketForSSLrc = 0;
-
-			if (m->c->net.https_proxy) {
-				m->c->connect_state = PROXY_CONNECT_IN_PROGRESS;
-				if ((rc = Proxy_connect( &m->c->net, 1, serverURI)) == SOCKET_ERROR )
-					goto exit;
-			}
-
-			hostname_len = MQTTProtocol_addressPort(serverURI, &port1, &topic, MQTT_DEFAULT_PORT);
-			setSocketForSSLrc = SSLSocket_setSocketForSSL(&m->c->net, m->c->sslopts,
-				serverURI, hostname_len);
-
-			if (setSocketForSSLrc != MQTTCLIENT_SUCCESS)
-			{
-				if (m->c->session != NULL)
-					if ((rc = SSL_set_session(m->c->net.ssl, m->c->session)) != 1)
-						Log(TRACE_MIN, -1, "Failed to set SSL session with stored data, non critical");
-				rc = m->c->sslopts->struct_version >= 3 ?
-					SSLSocket_connect(m->c->net.ssl, m->c->net.socket, serverURI,
-						m->c->sslopts->verify, m->c->sslopts->ssl_error_cb, m->c->sslopts->ssl_error_context) :
-					SSLSocket_connect(m->c->net.ssl, m->c->net.socket, serverURI,
-						m->c->sslopts->verify, NULL, NULL);
-				if (rc == TCPSOCKET_INTERRUPTED)
-					m->c->connect_state = SSL_IN_PROGRESS;  /* the connect is still in progress */
-				else if (rc == SSL_FATAL)
-				{
-					rc = SOCKET_ERROR;
-					goto exit;
-				}
-				else if (rc == 1)
-				{
-					if (m->websocket)
-					{
-						m->c->connect_state = WEBSOCKET_IN_PROGRESS;
-						rc = WebSocket_connect(&m->c->net, 1, serverURI);
-						if ( rc == SOCKET_ERROR )
-							goto exit;
-					}
-					else
-					{
-						rc = MQTTCLIENT_SUCCESS;
-						m->c->connect_state = WAIT_FOR_CONNACK;
-						if (MQTTPacket_send_connect(m->c, MQTTVersion, connectProperties, willProperties) == SOCKET_ERROR)
-						{
-							rc = SOCKET_ERROR;
-							goto exit;
-						}
-						if ((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
-							m->c->session = SSL_get1_session(m->c->net.ssl);
-					}
-				}
-			}
-			else
-			{
-				rc = SOCKET_ERROR;
-				goto exit;
-			}
-		}
-#endif
-		else
-		{
-			if (m->c->net.http_proxy) {
-				m->c->connect_state = PROXY_CONNECT_IN_PROGRESS;
-				if ((rc = Proxy_connect( &m->c->net, 0, serverURI)) == SOCKET_ERROR )
-					goto exit;
-			}
-
-			if (m->websocket)
-			{
-				m->c->connect_state = WEBSOCKET_IN_PROGRESS;
-				if ( WebSocket_connect(&m->c->net, 0, serverURI) == SOCKET_ERROR )
-				{
-					rc = SOCKET_ERROR;
-					goto exit;
-				}
-			}
-			else
-			{
-				m->c->connect_state = WAIT_FOR_CONNACK; /* TCP connect completed, in which case send the MQTT connect packet */
-				if (MQTTPacket_send_connect(m->c, MQTTVersion, connectProperties, willProperties) == SOCKET_ERROR)
-				{
-					rc = SOCKET_ERROR;
-					goto exit;
-				}
-			}
-		}
+		if ((rc = MQTTClient_connectTCPDone(m, serverURI, MQTTVersion, connectProperties, willProperties)) != MQTTCLIENT_SUCCESS)
+			goto exit;
 	}
 
 #if defined(OPENSSL)
@@ -1378,35 +1923,14 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 	{
 		Paho_thread_unlock_mutex(mqttclient_mutex);
 		MQTTClient_waitfor(handle, CONNECT, &rc, millisecsTimeout - MQTTTime_elapsed(start));
-		Paho_thread_lock_mutex(mqttclient_mutex);
-		if (rc != 1)
-		{
-			rc = SOCKET_ERROR;
-			goto exit;
-		}
-		if((m->c->cleansession == 0 && m->c->cleanstart == 0) && m->c->session == NULL)
-			m->c->session = SSL_get1_session(m->c->net.ssl);
-
-		if ( m->websocket )
-		{
-			/* wait for websocket connect */
-			m->c->connect_state = WEBSOCKET_IN_PROGRESS;
-			rc = WebSocket_connect( &m->c->net, 1, serverURI);
-			if ( rc != 1 )
-			{
-				rc = SOCKET_ERROR;
-				goto exit;
-			}
-		}
-		else
-		{
-			m->c->connect_state = WAIT_FOR_CONNACK; /* TCP connect completed, in which case send the MQTT connect packet */
-			if (MQTTPacket_send_connect(m->c, MQTTVersion, connectProperties, willProperties) == SOCKET_ERROR)
-			{
-				rc = SOCKET_ERROR;
-				goto exit;
-			}
+		Paho_thread_lock_mutex(mqttclient_mutex);
+		if (rc != 1)
+		{
+			rc = SOCKET_ERROR;
+			goto exit;
 		}
+		if ((rc = MQTTClient_connectSSLDone(m, serverURI, MQTTVersion, connectProperties, willProperties)) != MQTTCLIENT_SUCCESS)
+			goto exit;
 	}
 #endif
 
@@ -1433,60 +1957,9 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 			rc = SOCKET_ERROR;
 		else
 		{
-			Connack* connack = (Connack*)pack;
-			Log(TRACE_PROTOCOL, 1, NULL, m->c->net.socket, m->c->clientID, connack->rc);
-			if ((rc = connack->rc) == MQTTCLIENT_SUCCESS)
-			{
-				m->c->connected = 1;
-				m->c->good = 1;
-				m->c->connect_state = NOT_IN_PROGRESS;
-				if (MQTTVersion >= MQTTVERSION_3_1_1)
-					sessionPresent = connack->flags.bits.sessionPresent;
-				if (m->c->cleansession || m->c->cleanstart)
-					rc = MQTTClient_cleanSession(m->c);
-				if (m->c->outboundMsgs->count > 0)
-				{
-					ListElement* outcurrent = NULL;
-					START_TIME_TYPE zero = START_TIME_ZERO;
-
-					while (ListNextElement(m->c->outboundMsgs, &outcurrent))
-					{
-						Messages* m2 = (Messages*)(outcurrent->content);
-						memset(&m2->lastTouch, '\0', sizeof(m2->lastTouch));
-					}
-					MQTTProtocol_retry(zero, 1, 1);
-					if (m->c->connected != 1)
-						rc = MQTTCLIENT_DISCONNECTED;
-				}
-				if (m->c->MQTTVersion == MQTTVERSION_5)
-				{
-					if ((resp.properties = malloc(sizeof(MQTTProperties))) == NULL)
-					{
-						rc = PAHO_MEMORY_ERROR;
-						goto exit;
-					}
-					*resp.properties = MQTTProperties_copy(&connack->properties);
-
-					if (MQTTProperties_hasProperty(&connack->properties, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE))
-					{
-						/* update the keep alive from the server keep alive */
-						int server_keep_alive = (int)MQTTProperties_getNumericValue(&connack->properties, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE);
-						if (server_keep_alive != -999999)
-						{
-							Log(LOG_PROTOCOL, -1, "Setting keep alive interval to server keep alive %d", server_keep_alive);
-							m->c->keepAliveInterval = server_keep_alive;
-						}
-					}
-					else if (m->c->keepAliveInterval != m->c->savedKeepAliveInterval)
-					{
-						/* if the keep alive has been previously updated with a server keep alive, but there is no server keep alive
-						on this connect, reset it to the value requested in the original connect API */
-						Log(LOG_PROTOCOL, -1, "Resetting keep alive interval to %d", m->c->savedKeepAliveInterval);
-						m->c->keepAliveInterval = m->c->savedKeepAliveInterval;
-					}
-				}
-			}
-			MQTTPacket_freeConnack(connack);
+			sessionPresent = MQTTClient_connectConnack(m, (Connack*)pack, MQTTVersion, connectProperties, &resp);
+			rc = resp.reasonCode;
+			MQTTPacket_freeConnack((Connack*)pack);
 			m->pack = NULL;
 		}
 	}
@@ -1500,7 +1973,7 @@ exit:
 			options->returned.sessionPresent = sessionPresent;
 		}
 	}
-	else
+	else if (rc != MQTTCLIENT_CONNECT_IN_PROGRESS)
 		MQTTClient_disconnect1(handle, 0, 0, (MQTTVersion == 3), MQTTREASONCODE_SUCCESS, NULL); /* don't want to call connection lost */
 
 	resp.reasonCode = rc;
@@ -1718,7 +2191,7 @@ static MQTTResponse MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectO
 	{
 		rc = MQTTClient_connectURIVersion(handle, options, serverURI, 4, start, millisecsTimeout,
 				connectProperties, willProperties);
-		if (rc.reasonCode != MQTTCLIENT_SUCCESS)
+		if (rc.reasonCode != MQTTCLIENT_SUCCESS && !m->connectAsync)
 		{
 			rc = MQTTClient_connectURIVersion(handle, options, serverURI, 3, start, millisecsTimeout,
 					connectProperties, willProperties);
@@ -1735,6 +2208,220 @@ exit:
 
 MQTTResponse MQTTClient_connectAll(MQTTClient handle, MQTTClient_connectOptions* options,
 		MQTTProperties* connectProperties, MQTTProperties* willProperties);
+static MQTTResponse MQTTClient_connectAll1(MQTTClient handle, MQTTClient_connectOptions* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties);
+
+
+static void MQTTClient_freeWill(Clients* c)
+{
+	if (c->will)
+	{
+		if (c->will->payload)
+			free(c->will->payload);
+		if (c->will->topic)
+			free(c->will->topic);
+		free(c->will);
+		c->will = NULL;
+	}
+}
+
+
+/**
+ * Lowers the number of messages in flight to the receive maximum of the server, if it is less.
+ */
+static void MQTTClient_setReceiveMaximum(MQTTClients* m, MQTTProperties* connackProperties)
+{
+	if (connackProperties && MQTTProperties_hasProperty(connackProperties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM))
+	{
+		int recv_max = (int)MQTTProperties_getNumericValue(connackProperties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
+		if (m->c->maxInflightMessages > recv_max)
+			m->c->maxInflightMessages = recv_max;
+	}
+}
+
+
+/**
+ * Finishes a connect started by MQTTClient_connectStart.
+ * mqttclient_mutex must be locked when you call this function, if multi threaded
+ */
+static void MQTTClient_connectEnd(MQTTClients* m, MQTTResponse* resp, int sessionPresent)
+{
+	FUNC_ENTRY;
+	if (resp->reasonCode != MQTTCLIENT_SUCCESS)
+	{
+		MQTTClient_disconnect1(m, 0, 0, (m->connectVersion == 3), MQTTREASONCODE_SUCCESS, NULL);
+		if (m->connectVersion == 4 && (m->connectOptions->struct_version < 3 ||
+				m->connectOptions->MQTTVersion == MQTTVERSION_DEFAULT) &&
+				MQTTTime_elapsed(m->connectStart) < m->connectTimeout)
+		{	/* as MQTTClient_connectAll does, MQTT 3.1 is tried once 3.1.1 has failed */
+			MQTTResponse_free(*resp);
+			*resp = MQTTClient_connectURIVersion(m, m->connectOptions, m->currentServerURI, 3,
+					m->connectStart, m->connectTimeout, m->connectProperties, m->willProperties);
+			if (resp->reasonCode == MQTTCLIENT_CONNECT_IN_PROGRESS)
+			{
+				MQTTResponse_free(*resp);
+				goto exit;
+			}
+			m->connectVersion = 3; /* and it has disconnected already, if it failed */
+		}
+	}
+	m->connectAsync = 0;
+	m->connectRc = resp->reasonCode;
+	if (resp->reasonCode == MQTTCLIENT_SUCCESS)
+	{
+		MQTTClient_setReceiveMaximum(m, resp->properties);
+		if (m->connectOptions->struct_version >= 4)
+		{
+			m->connectOptions->returned.serverURI = m->currentServerURI;
+			m->connectOptions->returned.MQTTVersion = m->connectVersion;
+			m->connectOptions->returned.sessionPresent = sessionPresent;
+		}
+	}
+	MQTTClient_freeWill(m->c);
+	MQTTResponse_free(*resp);
+exit:
+	FUNC_EXIT_RC(m->connectRc);
+}
+
+
+/**
+ * Carries on with a connect started by MQTTClient_connectStart, once its socket is ready.
+ * mqttclient_mutex must be locked when you call this function, if multi threaded
+ * @param pack the packet read from the socket, if any, which is freed
+ * @param rc the return code of reading the socket
+ */
+static void MQTTClient_connectStep(MQTTClients* m, MQTTPacket* pack, int rc)
+{
+	MQTTResponse resp = MQTTResponse_initializer;
+	int sessionPresent = 0;
+
+	FUNC_ENTRY;
+	resp.reasonCode = MQTTCLIENT_SUCCESS;
+	if (rc == SOCKET_ERROR)
+		resp.reasonCode = SOCKET_ERROR;
+	else if (m->c->connect_state == TCP_IN_PROGRESS)
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		if (getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len) != 0 || error != 0)
+			resp.reasonCode = SOCKET_ERROR;
+		else
+			resp.reasonCode = MQTTClient_connectTCPDone(m, m->currentServerURI, m->connectVersion,
+					m->connectProperties, m->willProperties);
+	}
+#if defined(OPENSSL)
+	else if (m->c->connect_state == SSL_IN_PROGRESS)
+	{
+		rc = m->c->sslopts->struct_version >= 3 ?
+			SSLSocket_connect(m->c->net.ssl, m->c->net.socket, m->currentServerURI,
+				m->c->sslopts->verify, m->c->sslopts->ssl_error_cb, m->c->sslopts->ssl_error_context) :
+			SSLSocket_connect(m->c->net.ssl, m->c->net.socket, m->currentServerURI,
+				m->c->sslopts->verify, NULL, NULL);
+		if (rc == SSL_FATAL)
+			resp.reasonCode = SOCKET_ERROR;
+		else if (rc == 1) /* rc == 1 means SSL connect has finished and succeeded */
+			resp.reasonCode = MQTTClient_connectSSLDone(m, m->currentServerURI, m->connectVersion,
+					m->connectProperties, m->willProperties);
+	}
+#endif
+	else if (m->c->connect_state == WEBSOCKET_IN_PROGRESS)
+	{
+		if (rc != TCPSOCKET_INTERRUPTED) /* websocket upgrade complete */
+		{
+			m->c->connect_state = WAIT_FOR_CONNACK;
+			if (MQTTPacket_send_connect(m->c, m->connectVersion, m->connectProperties, m->willProperties) == SOCKET_ERROR)
+				resp.reasonCode = SOCKET_ERROR;
+		}
+	}
+	else if (m->c->connect_state == WAIT_FOR_CONNACK && pack)
+	{
+		if (pack->header.bits.type == CONNACK)
+		{
+			sessionPresent = MQTTClient_connectConnack(m, (Connack*)pack, m->connectVersion,
+					m->connectProperties, &resp);
+			MQTTPacket_freeConnack((Connack*)pack);
+		}
+		else
+		{
+			MQTTPacket_free_packet(pack);
+			resp.reasonCode = SOCKET_ERROR;
+		}
+	}
+
+	if (resp.reasonCode != MQTTCLIENT_SUCCESS || m->c->connected)
+		MQTTClient_connectEnd(m, &resp, sessionPresent);
+	FUNC_EXIT;
+}
+
+
+MQTTResponse MQTTClient_connectStart(MQTTClient handle, MQTTClient_connectOptions* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	MQTTClients* m = handle;
+	MQTTResponse response = MQTTResponse_initializer;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL || options == NULL)
+	{
+		response.reasonCode = MQTTCLIENT_NULL_PARAMETER;
+		goto exit;
+	}
+
+	/* held from the check to the end of the start, so that no other thread sees half a connect */
+	Paho_thread_lock_mutex(connect_mutex);
+	Paho_thread_lock_mutex(mqttclient_mutex);
+	if (m->ma || m->connectAsync || m->c->connected)
+		response.reasonCode = MQTTCLIENT_FAILURE;
+	else
+	{
+		m->connectAsync = 1;
+		m->connectStart = MQTTTime_start_clock();
+		m->connectTimeout = options->connectTimeout * 1000;
+		m->connectOptions = options;
+		m->connectProperties = connectProperties;
+		m->willProperties = willProperties;
+		response = MQTTClient_connectAll1(handle, options, connectProperties, willProperties);
+		if (response.reasonCode != MQTTCLIENT_CONNECT_IN_PROGRESS)
+		{
+			m->connectAsync = 0;
+			m->connectRc = response.reasonCode;
+		}
+	}
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	Paho_thread_unlock_mutex(connect_mutex);
+
+exit:
+	FUNC_EXIT_RC(response.reasonCode);
+	return response;
+}
+
+
+int MQTTClient_connectStatus(MQTTClient handle)
+{
+	MQTTClients* m = handle;
+	int rc = MQTTCLIENT_NULL_PARAMETER;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(mqttclient_mutex);
+	if (m == NULL || m->c == NULL)
+		goto exit;
+
+	if (m->connectAsync && MQTTTime_elapsed(m->connectStart) > m->connectTimeout)
+	{
+		MQTTResponse resp = MQTTResponse_initializer;
+
+		Log(TRACE_MIN, -1, "Connect of client %s timed out", m->c->clientID);
+		resp.reasonCode = SOCKET_ERROR;
+		MQTTClient_connectEnd(m, &resp, 0);
+	}
+	rc = m->connectAsync ? MQTTCLIENT_CONNECT_IN_PROGRESS : m->connectRc;
+exit:
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
 
 int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 {
@@ -1769,13 +2456,29 @@ MQTTResponse MQTTClient_connect5(MQTTClient handle, MQTTClient_connectOptions* o
 MQTTResponse MQTTClient_connectAll(MQTTClient handle, MQTTClient_connectOptions* options,
 		MQTTProperties* connectProperties, MQTTProperties* willProperties)
 {
-	MQTTClients* m = handle;
-	MQTTResponse rc = MQTTResponse_initializer;
+	MQTTResponse rc;
 
 	FUNC_ENTRY;
 	Paho_thread_lock_mutex(connect_mutex);
 	Paho_thread_lock_mutex(mqttclient_mutex);
+	rc = MQTTClient_connectAll1(handle, options, connectProperties, willProperties);
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	Paho_thread_unlock_mutex(connect_mutex);
+	FUNC_EXIT_RC(rc.reasonCode);
+	return rc;
+}
+
+
+/**
+ * connect_mutex and mqttclient_mutex must be locked when you call this function, if multi threaded
+ */
+static MQTTResponse MQTTClient_connectAll1(MQTTClient handle, MQTTClient_connectOptions* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	MQTTClients* m = handle;
+	MQTTResponse rc = MQTTResponse_initializer;
 
+	FUNC_ENTRY;
 	rc.reasonCode = SOCKET_ERROR;
 	if (!library_initialized)
 	{
@@ -1918,32 +2621,16 @@ MQTTResponse MQTTClient_connectAll(MQTTClient handle, MQTTClient_connectOptions*
 			}
 #endif
 			rc = MQTTClient_connectURI(handle, options, serverURI, connectProperties, willProperties);
-			if (rc.reasonCode == MQTTREASONCODE_SUCCESS)
+			if (rc.reasonCode == MQTTREASONCODE_SUCCESS || rc.reasonCode == MQTTCLIENT_CONNECT_IN_PROGRESS)
 				break;
 		}
 	}
 	if (rc.reasonCode == MQTTREASONCODE_SUCCESS)
-	{
-		if (rc.properties && MQTTProperties_hasProperty(rc.properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM))
-		{
-			int recv_max = (int)MQTTProperties_getNumericValue(rc.properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
-			if (m->c->maxInflightMessages > recv_max)
-				m->c->maxInflightMessages = recv_max;
-		}
-	}
+		MQTTClient_setReceiveMaximum(m, rc.properties);
 
 exit:
-	if (m && m->c && m->c->will)
-	{
-		if (m->c->will->payload)
-			free(m->c->will->payload);
-		if (m->c->will->topic)
-			free(m->c->will->topic);
-		free(m->c->will);
-		m->c->will = NULL;
-	}
-	Paho_thread_unlock_mutex(mqttclient_mutex);
-	Paho_thread_unlock_mutex(connect_mutex);
+	if (m && m->c && rc.reasonCode != MQTTCLIENT_CONNECT_IN_PROGRESS) /* the will is sent once the connect is made */
+		MQTTClient_freeWill(m->c);
 	FUNC_EXIT_RC(rc.reasonCode);
 	return rc;
 }
@@ -1969,6 +2656,12 @@ static int MQTTClient_disconnect1(MQTTClient handle, int timeout, int call_conne
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	if (m->connectAsync)
+	{	/* a connect started by MQTTClient_connectStart is given up */
+		m->connectAsync = 0;
+		m->connectRc = MQTTCLIENT_DISCONNECTED;
+		MQTTClient_freeWill(m->c);
+	}
 	was_connected = m->c->connected; /* should be 1 */
 	if (m->c->connected != 0)
 	{
@@ -1984,6 +2677,7 @@ static int MQTTClient_disconnect1(MQTTClient handle, int timeout, int call_conne
 		}
 	}
 
+	MQTTClient_stopDelivery(m);
 	MQTTClient_closeSession(m->c, reason, props);
 
 exit:
@@ -2372,8 +3066,16 @@ int MQTTClient_unsubscribe(MQTTClient handle, const char* topic)
 }
 
 
-MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
-		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
+/**
+ * Publishes a message, either copying the payload or taking over the
+ * caller's buffer.
+ * @param release if not NULL, the payload is borrowed rather than copied, and
+ * released with this function once it is no longer needed
+ * @param context the first argument of release
+ */
+static MQTTResponse MQTTClient_publishCommon(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken,
+		MQTTClient_payloadRelease* release, void* context, PayloadFile* file)
 {
 	int rc = MQTTCLIENT_SUCCESS;
 	MQTTClients* m = handle;
@@ -2422,15 +3124,31 @@ MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int p
 		goto exit;
 	}
 
-	if ((p = malloc(sizeof(Publish))) == NULL)
+	if ((p = MemoryPool_alloc(POOL_PUBLISH)) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit_and_free;
 	}
 	memset(p->mask, '\0', sizeof(p->mask));
+	p->topic = NULL;
 	p->payload = NULL;
 	p->payloadlen = payloadlen;
-	if (payloadlen > 0)
+	p->release = NULL;
+	p->release_context = NULL;
+	p->buffer = NULL;
+	p->streamed = 0;
+	p->file = file;
+	file = NULL; /* freed with p from now on */
+	if (p->file)
+		; /* the payload is read from the file as it is sent */
+	else if (payloadlen > 0 && release && !m->c->net.websocket)
+	{	/* web sockets mask the payload in place, so only borrow it otherwise */
+		p->payload = (char*)payload;
+		p->release = release;
+		p->release_context = context;
+		release = NULL; /* released with p->payload from now on */
+	}
+	else if (payloadlen > 0)
 	{
 		if ((p->payload = malloc(payloadlen)) == NULL)
 		{
@@ -2492,9 +3210,13 @@ exit_and_free:
 	{
 		if (p->topic)
 			free(p->topic);
-		if (p->payload)
+		if (p->payload && p->release)
+			(*p->release)(p->release_context, p->payload);
+		else if (p->payload)
 			free(p->payload);
-		free(p);
+		if (p->file)
+			MQTTPacket_freeFile(p->file);
+		MemoryPool_free(POOL_PUBLISH, p);
 	}
 
 	if (rc == SOCKET_ERROR)
@@ -2505,6 +3227,10 @@ exit_and_free:
 	}
 
 exit:
+	if (release && payload)
+		(*release)(context, (void*)payload); /* not handed over, or copied */
+	if (file)
+		MQTTPacket_freeFile(file);
 	Paho_thread_unlock_mutex(mqttclient_mutex);
 	resp.reasonCode = rc;
 	FUNC_EXIT_RC(resp.reasonCode);
@@ -2512,6 +3238,80 @@ exit:
 }
 
 
+MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
+{
+	return MQTTClient_publishCommon(handle, topicName, payloadlen, payload, qos, retained, properties,
+		deliveryToken, NULL, NULL, NULL);
+}
+
+
+MQTTResponse MQTTClient_publish5Borrowed(MQTTClient handle, const char* topicName, int payloadlen, void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken,
+		MQTTClient_payloadRelease* release, void* context)
+{
+	MQTTResponse rc = MQTTResponse_initializer;
+
+	if (release == NULL)
+	{
+		rc.reasonCode = MQTTCLIENT_NULL_PARAMETER;
+		return rc;
+	}
+	return MQTTClient_publishCommon(handle, topicName, payloadlen, payload, qos, retained, properties,
+		deliveryToken, release, context, NULL);
+}
+
+
+MQTTResponse MQTTClient_publishFile5(MQTTClient handle, const char* topicName, int fd, long long offset,
+		int payloadlen, int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
+{
+	MQTTResponse rc = MQTTResponse_initializer;
+#if defined(_WIN32) || defined(_WIN64)
+	FUNC_ENTRY;
+	rc.reasonCode = MQTTCLIENT_FAILURE; /* there is no pread, and so no reading of payloads from files */
+#else
+	MQTTClients* m = handle;
+	PayloadFile* file = NULL;
+	int persisted = 0;
+
+	FUNC_ENTRY;
+	if ((file = malloc(sizeof(PayloadFile))) == NULL)
+	{
+		close(fd);
+		rc.reasonCode = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	file->fd = fd;
+	file->offset = (off_t)offset;
+
+	Paho_thread_lock_mutex(mqttclient_mutex);
+	persisted = (m && m->c && m->c->persistence && qos > 0);
+	Paho_thread_unlock_mutex(mqttclient_mutex);
+	if (persisted || payloadlen == 0)
+	{	/* the whole packet is persisted before it is sent, so the payload has to be in memory */
+		char* payload = NULL;
+
+		if (payloadlen > 0 && (payload = malloc(payloadlen)) == NULL)
+			rc.reasonCode = PAHO_MEMORY_ERROR;
+		else if (payloadlen > 0 && MQTTPacket_readFile(file, payload, 0, payloadlen) != 0)
+			rc.reasonCode = MQTTCLIENT_FAILURE;
+		MQTTPacket_freeFile(file);
+		if (rc.reasonCode == MQTTCLIENT_SUCCESS)
+			rc = MQTTClient_publishCommon(handle, topicName, payloadlen, payload, qos, retained, properties,
+				deliveryToken, NULL, NULL, NULL);
+		if (payload)
+			free(payload);
+	}
+	else
+		rc = MQTTClient_publishCommon(handle, topicName, payloadlen, NULL, qos, retained, properties,
+			deliveryToken, NULL, NULL, file);
+exit:
+#endif
+	FUNC_EXIT_RC(rc.reasonCode);
+	return rc;
+}
+
+
 int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
 							 int qos, int retained, MQTTClient_deliveryToken* deliveryToken)
 {
@@ -2606,6 +3406,10 @@ static MQTTPacket* MQTTClient_cycle(SOCKET* sock, ELAPSED_TIME_TYPE timeout, int
 	{
 		/* 0 from getReadySocket indicates no work to do, rc -1 == error */
 #endif
+		if (MQTTPersistence_queueBatchesOpen())
+			timeout = 0; /* the batches are written once nothing more is waiting to be read */
+		else if (timeout > MQTTCLIENT_ACK_POLL && MQTTProtocol_acksQueued())
+			timeout = MQTTCLIENT_ACK_POLL; /* they are sent by MQTTClient_retry */
 		start = MQTTTime_start_clock();
 		*sock = Socket_getReadySocket(0, (int)timeout, socket_mutex, rc);
 		*rc = rc1;
@@ -2632,6 +3436,12 @@ static MQTTPacket* MQTTClient_cycle(SOCKET* sock, ELAPSED_TIME_TYPE timeout, int
 				if (*rc == TCPSOCKET_INTERRUPTED)
 					*rc = 0;
 			}
+			if (m->connectAsync)
+			{	/* whoever is reading the sockets carries on the connects started by MQTTClient_connectStart */
+				MQTTClient_connectStep(m, pack, *rc);
+				pack = NULL;
+				*rc = 0;
+			}
 		}
 
 		if (pack)
@@ -2682,6 +3492,13 @@ static MQTTPacket* MQTTClient_cycle(SOCKET* sock, ELAPSED_TIME_TYPE timeout, int
 				pack = NULL;
 		}
 	}
+	if (*sock == 0 && MQTTPersistence_queueBatchesPending())
+	{	/* the messages received in a burst are written in one go, before they are acknowledged */
+		ListElement* current = NULL;
+
+		while (ListNextElement(bstate->clients, &current))
+			MQTTPersistence_writeQueueBatch((Clients*)current->content);
+	}
 	MQTTClient_retry();
 	Paho_thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(*rc);
@@ -2803,8 +3620,8 @@ exit:
 }
 
 
-int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
-											 unsigned long timeout)
+static int MQTTClient_receiveCommon(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
+		unsigned long timeout, int borrowTopic)
 {
 	int rc = TCPSOCKET_COMPLETE;
 	START_TIME_TYPE start = MQTTTime_start_clock();
@@ -2848,7 +3665,7 @@ int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTC
 	while (elapsed < timeout && m->c->messageQueue->count == 0);
 
 	if (m->c->messageQueue->count > 0)
-		rc = MQTTClient_deliverMessage(rc, m, topicName, topicLen, message);
+		rc = MQTTClient_deliverMessage(rc, m, topicName, topicLen, message, borrowTopic);
 
 	if (rc == SOCKET_ERROR)
 		MQTTClient_disconnect_internal(handle, 0);
@@ -2859,6 +3676,20 @@ exit:
 }
 
 
+int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
+											 unsigned long timeout)
+{
+	return MQTTClient_receiveCommon(handle, topicName, topicLen, message, timeout, 0);
+}
+
+
+int MQTTClient_receiveBorrowed(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
+		unsigned long timeout)
+{
+	return MQTTClient_receiveCommon(handle, topicName, topicLen, message, timeout, 1);
+}
+
+
 void MQTTClient_yield(void)
 {
 	START_TIME_TYPE start = MQTTTime_start_clock();
@@ -2893,6 +3724,42 @@ exit:
 	FUNC_EXIT;
 }
 
+void MQTTClient_poll(unsigned long timeout)
+{
+	START_TIME_TYPE start = MQTTTime_start_clock();
+	ELAPSED_TIME_TYPE elapsed = 0L;
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (running) /* nor is poll */
+		goto exit;
+
+	while (1)
+	{
+		SOCKET sock = -1;
+
+		MQTTClient_cycle(&sock, (timeout > elapsed) ? timeout - elapsed : 0L, &rc);
+		Paho_thread_lock_mutex(mqttclient_mutex);
+		if (rc == SOCKET_ERROR && ListFindItem(handles, &sock, clientSockCompare))
+		{
+			MQTTClients* m = (MQTTClient)(handles->current->content);
+			if (m->c->connect_state != DISCONNECTING)
+				MQTTClient_disconnect_internal(m, 0);
+		}
+		/* once the time is up, the sockets which are ready are still each read once */
+		elapsed = MQTTTime_elapsed(start);
+		if (sock == 0 || (elapsed >= timeout && ++count > handles->count))
+		{
+			Paho_thread_unlock_mutex(mqttclient_mutex);
+			break;
+		}
+		Paho_thread_unlock_mutex(mqttclient_mutex);
+	}
+exit:
+	FUNC_EXIT;
+}
+
 /*
 static int pubCompare(void* a, void* b)
 {
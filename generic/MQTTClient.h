@@ -205,6 +205,11 @@
   * Return code: 0 length will topic on connect
   */
  #define MQTTCLIENT_0_LEN_WILL_TOPIC -17
+ /**
+  * Return code: a connect started with MQTTClient_connectStart() has not
+  * finished yet
+  */
+ #define MQTTCLIENT_CONNECT_IN_PROGRESS -18
 
 
 /**
@@ -332,9 +337,15 @@ typedef struct
 	 * The MQTT V5 properties associated with the message.
 	 */
 	MQTTProperties properties;
+	/**
+	 * For received messages only: the number of payload bytes written to the
+	 * stream set with MQTTClient_setPayloadStream() instead of to
+	 * <i>payload</i>, which is then empty.  0 if the payload was not streamed.
+	 */
+	int streamed;
 } MQTTClient_message;
 
-#define MQTTClient_message_initializer { {'M', 'Q', 'T', 'M'}, 1, 0, NULL, 0, 0, 0, 0, MQTTProperties_initializer }
+#define MQTTClient_message_initializer { {'M', 'Q', 'T', 'M'}, 1, 0, NULL, 0, 0, 0, 0, MQTTProperties_initializer, 0 }
 
 /**
  * This is a callback function. The client application
@@ -495,6 +506,133 @@ typedef void MQTTClient_published(void* context, int dt, int packet_type, MQTTPr
 
 LIBMQTT_API int MQTTClient_setPublished(MQTTClient handle, void* context, MQTTClient_published* co);
 
+/**
+ * Limits the messages which have been received but not yet delivered to the
+ * application.  When either limit is reached, the client stops reading from
+ * the network connection, so that TCP flow control holds the messages back
+ * at the server, and reads again once the messages waiting are down to half
+ * of both limits.  While reading is stopped, the responses to keepalive
+ * pings are not read either, so the application must go on receiving
+ * messages within the keepalive interval for the connection to stay up.
+ * @param handle A valid client handle from a successful call to
+ * MQTTClient_create().
+ * @param maxMessages The number of messages waiting at which reading stops,
+ * or 0 for no limit.
+ * @param maxBytes The total payload size of the messages waiting at which
+ * reading stops, or 0 for no limit.
+ * @return ::MQTTCLIENT_SUCCESS if the limits were set, ::MQTTCLIENT_FAILURE
+ * if the handle or a limit is not valid.
+ */
+LIBMQTT_API int MQTTClient_setQueueLimits(MQTTClient handle, int maxMessages, size_t maxBytes);
+
+/**
+ * The records are committed to the persistent store as soon as the writer
+ * thread gets to them, and nothing waits for them (see MQTTClient_setPersistenceSync()).
+ */
+#define MQTTCLIENT_PERSISTENCE_SYNC_NONE 0
+/**
+ * The records are committed once the oldest has waited the interval given in
+ * milliseconds (see MQTTClient_setPersistenceSync()).
+ */
+#define MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL 1
+/**
+ * The records are committed once the count given is waiting, or the oldest
+ * has waited 100 milliseconds (see MQTTClient_setPersistenceSync()).
+ */
+#define MQTTCLIENT_PERSISTENCE_SYNC_COUNT 2
+/**
+ * Each record is committed at once, the call which wrote it waiting for the
+ * commit (see MQTTClient_setPersistenceSync()).
+ */
+#define MQTTCLIENT_PERSISTENCE_SYNC_EACH 3
+
+/**
+ * Moves the writes to the persistent store of a client onto a thread of its
+ * own, which commits the records written in batches, so that the latency of
+ * the store no longer limits the message rate.  A record put and removed
+ * again before its batch is committed never reaches the store.  With
+ * ::MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL and ::MQTTCLIENT_PERSISTENCE_SYNC_COUNT,
+ * the acknowledgements sent to the server (PUBACK, PUBREC, PUBREL and PUBCOMP)
+ * are held back until the records written before them have been committed.
+ * With ::MQTTCLIENT_PERSISTENCE_SYNC_NONE, a record may be lost if the
+ * process ends before it is committed.  Has no effect if the client has no
+ * persistence.  A record is committed when the store's put or remove function
+ * has returned; whether that has reached the disk is up to the store.  A put
+ * which fails is tried again, and the records after it wait for it, so the
+ * acknowledgements held back for them stay held.
+ * @param handle A valid client handle from a successful call to
+ * MQTTClient_create().
+ * @param policy When the records are committed, one of ::MQTTCLIENT_PERSISTENCE_SYNC_NONE,
+ * ::MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL, ::MQTTCLIENT_PERSISTENCE_SYNC_COUNT or
+ * ::MQTTCLIENT_PERSISTENCE_SYNC_EACH.
+ * @param value The interval in milliseconds for ::MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL,
+ * the count of records for ::MQTTCLIENT_PERSISTENCE_SYNC_COUNT, ignored otherwise.
+ * @return ::MQTTCLIENT_SUCCESS if the policy was set, ::MQTTCLIENT_FAILURE
+ * if the handle, the policy or the value is not valid, or the writer thread
+ * could not be started.
+ */
+LIBMQTT_API int MQTTClient_setPersistenceSync(MQTTClient handle, int policy, int value);
+
+/**
+ * This is a callback function, called when a publication at least as large
+ * as the threshold given to MQTTClient_setPayloadStream() starts to arrive,
+ * once its topic has been read, to decide whether its payload is streamed.
+ * It is called on the thread reading from the network, which is the
+ * application's own thread unless callbacks are set.
+ * @param context The <i>context</i> value passed to MQTTClient_setPayloadStream().
+ * @param topicName The topic of the publication, not null terminated.
+ * @param topicLen The length of the topic.
+ * @param qos The quality of service of the publication.
+ * @param payloadlen The length of the payload, which is still to be read.
+ * @param stream Set to the stream the payload is to be written to, which is
+ * passed to the write and close functions.
+ * @return 1 to stream the payload, 0 to receive the publication as usual.
+ */
+typedef int MQTTClient_streamOpen(void* context, char* topicName, int topicLen, int qos,
+		size_t payloadlen, void** stream);
+
+/**
+ * This is a callback function, called with each part of a streamed payload
+ * in order, as it is read.
+ * @param context The <i>context</i> value passed to MQTTClient_setPayloadStream().
+ * @param stream The stream set by the open function.
+ * @param data The next part of the payload.
+ * @param len The length of the part.
+ * @return 0 on success, any other value to discard the rest of the payload.
+ */
+typedef int MQTTClient_streamWrite(void* context, void* stream, const char* data, size_t len);
+
+/**
+ * This is a callback function, called once a streamed payload has been read,
+ * or when the connection is lost while it is being read.
+ * @param context The <i>context</i> value passed to MQTTClient_setPayloadStream().
+ * @param stream The stream set by the open function.
+ * @param rc 0 if the whole payload was written, -1 otherwise.
+ */
+typedef void MQTTClient_streamClose(void* context, void* stream, int rc);
+
+/**
+ * Streams the payloads of large received publications to the application as
+ * they are read, rather than reading each into memory whole, so that the
+ * memory used does not depend on the size of the messages.  The publication
+ * is then received as usual, with an empty payload and
+ * MQTTClient_message.streamed set to the number of bytes written.
+ * A streamed QoS 1 publication may be streamed again if it is redelivered.
+ * @param handle A valid client handle from a successful call to
+ * MQTTClient_create().
+ * @param threshold The packet size at or above which publications are offered
+ * to <i>open</i>, or 0 to stop streaming payloads.
+ * @param context A pointer to any application-specific context, passed to
+ * each of the functions.
+ * @param open The function deciding whether a payload is streamed.
+ * @param write The function writing a part of a payload.
+ * @param close The function called at the end of a payload.
+ * @return ::MQTTCLIENT_SUCCESS if the stream was set, ::MQTTCLIENT_FAILURE
+ * if the handle or a function is not valid.
+ */
+LIBMQTT_API int MQTTClient_setPayloadStream(MQTTClient handle, size_t threshold, void* context,
+		MQTTClient_streamOpen* open, MQTTClient_streamWrite* write, MQTTClient_streamClose* close);
+
 /**
  * This function creates an MQTT client ready for connection to the
  * specified server and using the specified persistent storage (see
@@ -537,11 +675,30 @@ LIBMQTT_API int MQTTClient_setPublished(MQTTClient handle, void* context, MQTTCl
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use the file system-based persistence which
+ * appends the records to a log rather than writing a file for each.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MMAP: Use the file system-based persistence which
+ * keeps the records in the slots of a preallocated, memory mapped file.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_TMPFS: Use the file system-based persistence which
+ * writes the records to a fast working directory and checkpoints them to disk.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_SQLITE: Use the persistence which keeps the records
+ * of the clients of a directory in one SQLite database, if the library has it.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
  * should be set to the location of the persistence directory (if set
  * to NULL, the persistence directory used is the working directory).
+ * For ::MQTTCLIENT_PERSISTENCE_LOG persistence, it points to a
+ * ::MQTTClient_logPersistenceOptions structure, or is NULL for the defaults,
+ * for ::MQTTCLIENT_PERSISTENCE_MMAP to a ::MQTTClient_mmapPersistenceOptions
+ * structure, or is NULL, for ::MQTTCLIENT_PERSISTENCE_TMPFS to a
+ * ::MQTTClient_tmpfsPersistenceOptions structure, or is NULL, and for
+ * ::MQTTCLIENT_PERSISTENCE_SQLITE to a ::MQTTClient_sqlitePersistenceOptions
+ * structure, or is NULL.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @return ::MQTTCLIENT_SUCCESS if the client is successfully created, otherwise
@@ -600,11 +757,30 @@ typedef struct
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use the file system-based persistence which
+ * appends the records to a log rather than writing a file for each.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MMAP: Use the file system-based persistence which
+ * keeps the records in the slots of a preallocated, memory mapped file.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_TMPFS: Use the file system-based persistence which
+ * writes the records to a fast working directory and checkpoints them to disk.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_SQLITE: Use the persistence which keeps the records
+ * of the clients of a directory in one SQLite database, if the library has it.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
  * should be set to the location of the persistence directory (if set
  * to NULL, the persistence directory used is the working directory).
+ * For ::MQTTCLIENT_PERSISTENCE_LOG persistence, it points to a
+ * ::MQTTClient_logPersistenceOptions structure, or is NULL for the defaults,
+ * for ::MQTTCLIENT_PERSISTENCE_MMAP to a ::MQTTClient_mmapPersistenceOptions
+ * structure, or is NULL, for ::MQTTCLIENT_PERSISTENCE_TMPFS to a
+ * ::MQTTClient_tmpfsPersistenceOptions structure, or is NULL, and for
+ * ::MQTTCLIENT_PERSISTENCE_SQLITE to a ::MQTTClient_sqlitePersistenceOptions
+ * structure, or is NULL.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @param options additional options for the create.
@@ -1062,6 +1238,44 @@ LIBMQTT_API void MQTTResponse_free(MQTTResponse response);
 LIBMQTT_API MQTTResponse MQTTClient_connect5(MQTTClient handle, MQTTClient_connectOptions* options,
 		MQTTProperties* connectProperties, MQTTProperties* willProperties);
 
+/**
+  * Starts to connect a client as MQTTClient_connect() or MQTTClient_connect5()
+  * do, without waiting for the connect to complete.  The TCP connect is
+  * started, and the SSL or websocket connect, the MQTT CONNECT and its CONNACK
+  * follow as the socket becomes ready, whenever the library reads the sockets:
+  * in MQTTClient_poll(), MQTTClient_yield(), MQTTClient_receive() or while any
+  * other client waits, so that the connects of many clients can be in
+  * progress at once.  The host name of the server is still resolved before
+  * returning.  MQTTClient_connectStatus() tells when the connect has finished.
+  *
+  * The options and properties must stay valid until then; the return values
+  * of the options are filled out as by MQTTClient_connect().  Only the first
+  * server URI of the options is tried; with ::MQTTVERSION_DEFAULT, MQTT 3.1
+  * is tried too if 3.1.1 fails, within the same connect timeout.  The properties of the CONNACK are not returned.  This is
+  * only for single-threaded clients, without MQTTClient_setCallbacks().
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @param options A pointer to a valid MQTTClient_connectOptions
+  * structure.
+  * @param connectProperties the MQTT 5.0 connect properties to use, or NULL
+  * @param willProperties the MQTT 5.0 properties to set on the will message, or NULL
+  * @return ::MQTTCLIENT_CONNECT_IN_PROGRESS if the connect has been started,
+  * or an error code as MQTTClient_connect5() returns.
+  */
+LIBMQTT_API MQTTResponse MQTTClient_connectStart(MQTTClient handle, MQTTClient_connectOptions* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties);
+
+/**
+  * Tells how a connect started by MQTTClient_connectStart() is going.  A
+  * connect which has taken longer than the connect timeout of its options is
+  * failed here.
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @return ::MQTTCLIENT_CONNECT_IN_PROGRESS while the connect is going on,
+  * then ::MQTTCLIENT_SUCCESS, or the error or CONNACK reason code it failed with.
+  */
+LIBMQTT_API int MQTTClient_connectStatus(MQTTClient handle);
+
 /**
   * This function attempts to disconnect the client from the MQTT
   * server. In order to allow the client time to complete handling of messages
@@ -1263,6 +1477,72 @@ LIBMQTT_API int MQTTClient_publish(MQTTClient handle, const char* topicName, int
   */
 LIBMQTT_API MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
 		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* dt);
+
+/**
+  * This is a callback function, which releases a payload passed to
+  * MQTTClient_publish5Borrowed() once the client library no longer needs it.
+  * It is called on the thread which is processing the client's network
+  * traffic, with the client's internal lock held, so it must not call back
+  * into the client library.
+  * @param context The context pointer passed to MQTTClient_publish5Borrowed().
+  * @param payload The payload passed to MQTTClient_publish5Borrowed().
+  */
+typedef void MQTTClient_payloadRelease(void* context, void* payload);
+
+/**
+  * Attempts to publish a message like MQTTClient_publish5(), but without
+  * copying the payload.  The library takes ownership of the payload buffer,
+  * which must stay unchanged until release is called with it.  A QoS 0
+  * message is written straight from the buffer, which is normally released
+  * before this function returns; a QoS 1 or 2 message keeps the buffer for
+  * retries and releases it when the exchange completes or the message is
+  * discarded.  release is also called when the publish fails, so the caller
+  * never releases the buffer itself.  Over web sockets, which mask the
+  * payload in place, the payload is copied and released at once.
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @param topicName The topic associated with this message.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the byte array payload of the message.
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param properties the MQTT 5.0 properties to be used, NULL for MQTT 3
+  * @param dt A pointer to an ::MQTTClient_deliveryToken, or NULL.
+  * @param release The function to call when the payload is no longer needed.
+  * @param context A pointer passed to release.
+  * @return the MQTT 5.0 response information: error codes and properties.
+  */
+LIBMQTT_API MQTTResponse MQTTClient_publish5Borrowed(MQTTClient handle, const char* topicName, int payloadlen, void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* dt,
+		MQTTClient_payloadRelease* release, void* context);
+
+/**
+  * Attempts to publish a message like MQTTClient_publish5(), with the payload
+  * read from a file as it is sent rather than held in memory.  The library
+  * takes ownership of the file descriptor, and closes it when the message no
+  * longer needs it, or when the publish fails.  Over plain TCP on Linux the
+  * file is handed to the socket with sendfile(); over TLS and web sockets it
+  * is read and written in pieces of at most 64 kilobytes.  A QoS 1 or 2
+  * message which has to be sent again is read from the file again, so the
+  * file must not change until the exchange completes.  If the client has
+  * persistence and qos is not 0, the payload is read into memory and
+  * published as by MQTTClient_publish5(), as it has to be persisted.
+  * Not supported on Windows, where fd is left open and MQTTCLIENT_FAILURE
+  * is returned.
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @param topicName The topic associated with this message.
+  * @param fd A file descriptor open for reading, which supports pread().
+  * @param offset Where in the file the payload starts.
+  * @param payloadlen The length of the payload in bytes.
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param properties the MQTT 5.0 properties to be used, NULL for MQTT 3
+  * @param dt A pointer to an ::MQTTClient_deliveryToken, or NULL.
+  * @return the MQTT 5.0 response information: error codes and properties.
+  */
+LIBMQTT_API MQTTResponse MQTTClient_publishFile5(MQTTClient handle, const char* topicName, int fd, long long offset,
+		int payloadlen, int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* dt);
 /**
   * This function attempts to publish a message to a given topic (see also
   * MQTTClient_publish()). An ::MQTTClient_deliveryToken is issued when
@@ -1353,6 +1633,17 @@ LIBMQTT_API int MQTTClient_getPendingDeliveryTokens(MQTTClient handle, MQTTClien
   */
 LIBMQTT_API void MQTTClient_yield(void);
 
+/**
+  * Does the work of MQTTClient_yield() for the sockets which are ready,
+  * waiting up to <i>timeout</i> milliseconds for the first one, and returns
+  * as soon as there are no more, rather than after 100 milliseconds.  This is
+  * what carries on connects started with MQTTClient_connectStart() from an
+  * application's own event loop.
+  * @param timeout The longest time to wait for a socket to be ready, in
+  * milliseconds.
+  */
+LIBMQTT_API void MQTTClient_poll(unsigned long timeout);
+
 /**
   * This function performs a synchronous receive of incoming messages. It should
   * be used only when the client application has not set callback methods to
@@ -1387,6 +1678,26 @@ LIBMQTT_API void MQTTClient_yield(void);
 LIBMQTT_API int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
 		unsigned long timeout);
 
+/**
+  * Receives a message like MQTTClient_receive(), but without giving the
+  * topic a copy of its own.  The topic of a received message is kept in
+  * the same block of memory as its payload, so <i>topicName</i> stays valid
+  * until the message is freed with MQTTClient_freeMessage(), and must not be
+  * freed by the application.  A message is then received with no more than
+  * the one allocation its packet was read into.
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @param topicName The address of a pointer to a topic, which is set to
+  * point to the topic of the message.
+  * @param topicLen The length of the topic, as for MQTTClient_receive().
+  * @param message The address of a pointer to the received message, as for
+  * MQTTClient_receive().
+  * @param timeout The length of time to wait for a message in milliseconds.
+  * @return as for MQTTClient_receive().
+  */
+LIBMQTT_API int MQTTClient_receiveBorrowed(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
+		unsigned long timeout);
+
 /**
   * This function frees memory allocated to an MQTT message, including the
   * additional memory allocated to the message payload. The client application
@@ -77,6 +77,33 @@
   * persistence mechanism (see MQTTClient_create()).
   */
 #define MQTTCLIENT_PERSISTENCE_USER 2
+/**
+  * This <i>persistence_type</i> value specifies the file system-based
+  * persistence mechanism which appends the records to a log of segment files
+  * (see MQTTClient_create() and ::MQTTClient_logPersistenceOptions).
+  */
+#define MQTTCLIENT_PERSISTENCE_LOG 3
+/**
+  * This <i>persistence_type</i> value specifies the file system-based
+  * persistence mechanism which keeps the records in the slots of a
+  * preallocated, memory mapped file (see MQTTClient_create() and
+  * ::MQTTClient_mmapPersistenceOptions).
+  */
+#define MQTTCLIENT_PERSISTENCE_MMAP 4
+/**
+  * This <i>persistence_type</i> value specifies the file system-based
+  * persistence mechanism which writes the records to a fast working directory,
+  * such as a tmpfs, and checkpoints them to disk (see MQTTClient_create() and
+  * ::MQTTClient_tmpfsPersistenceOptions).
+  */
+#define MQTTCLIENT_PERSISTENCE_TMPFS 5
+/**
+  * This <i>persistence_type</i> value specifies the persistence mechanism
+  * which keeps the records of the clients in one SQLite database per
+  * directory (see MQTTClient_create() and ::MQTTClient_sqlitePersistenceOptions).
+  * It is only there if the library is built with SQLite.
+  */
+#define MQTTCLIENT_PERSISTENCE_SQLITE 6
 
 /** 
   * Application-specific persistence functions must return this error code if 
@@ -252,6 +279,108 @@ typedef struct {
 } MQTTClient_persistence;
 
 
+/** The log, mmap and SQLite persistences leave syncing their files to the operating system */
+#define MQTTCLIENT_LOG_SYNC_NEVER 0
+/** The log, mmap and SQLite persistences sync their file after each put and remove */
+#define MQTTCLIENT_LOG_SYNC_ALWAYS 1
+/** The log, mmap and SQLite persistences sync their file at most every syncInterval milliseconds */
+#define MQTTCLIENT_LOG_SYNC_INTERVAL 2
+
+/**
+ * The options of the ::MQTTCLIENT_PERSISTENCE_LOG persistence, passed as the
+ * <i>persistence_context</i> of MQTTClient_create().  They are copied, so
+ * they need not outlive the call.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTL. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The directory under which the log of each client is kept, NULL for the working directory */
+	const char* directory;
+	/** When the log is synced to disk, one of the MQTTCLIENT_LOG_SYNC values */
+	int syncPolicy;
+	/** The longest time between syncs, in milliseconds, with ::MQTTCLIENT_LOG_SYNC_INTERVAL */
+	int syncInterval;
+	/** The size at which a new segment file is started, in bytes, 0 for the default of 4 MB */
+	int segmentSize;
+} MQTTClient_logPersistenceOptions;
+
+#define MQTTClient_logPersistenceOptions_initializer { {'M', 'Q', 'T', 'L'}, 0, NULL, MQTTCLIENT_LOG_SYNC_NEVER, 0, 0 }
+
+/**
+ * The options of the ::MQTTCLIENT_PERSISTENCE_MMAP persistence, passed as the
+ * <i>persistence_context</i> of MQTTClient_create().  They are copied, so
+ * they need not outlive the call.  The slots of an existing file are kept,
+ * whatever slotCount and slotSize say.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTM. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The directory under which the file of each client is kept, NULL for the working directory */
+	const char* directory;
+	/** The number of slots in the file, 0 for the default of 1024 */
+	int slotCount;
+	/** The size of each slot, in bytes, a multiple of 8, 0 for the default of 512.
+	 *  Records which do not fit in a slot are written to files of their own. */
+	int slotSize;
+	/** When the file is synced to disk, one of the MQTTCLIENT_LOG_SYNC values */
+	int syncPolicy;
+	/** The longest time between syncs, in milliseconds, with ::MQTTCLIENT_LOG_SYNC_INTERVAL */
+	int syncInterval;
+} MQTTClient_mmapPersistenceOptions;
+
+#define MQTTClient_mmapPersistenceOptions_initializer { {'M', 'Q', 'T', 'M'}, 0, NULL, 0, 0, MQTTCLIENT_LOG_SYNC_NEVER, 0 }
+
+/**
+ * The options of the ::MQTTCLIENT_PERSISTENCE_TMPFS persistence, passed as the
+ * <i>persistence_context</i> of MQTTClient_create().  They are copied, so
+ * they need not outlive the call.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTK. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The directory under which the checkpoint of each client is kept, NULL for the working directory */
+	const char* directory;
+	/** The directory under which the records are written, NULL for /dev/shm on Linux and the
+	 *  temporary directory elsewhere.  It must not be the same as directory. */
+	const char* workDirectory;
+	/** The longest time between checkpoints, in milliseconds, 0 for the default of 1000 */
+	int checkpointInterval;
+} MQTTClient_tmpfsPersistenceOptions;
+
+#define MQTTClient_tmpfsPersistenceOptions_initializer { {'M', 'Q', 'T', 'K'}, 0, NULL, NULL, 0 }
+
+/**
+ * The options of the ::MQTTCLIENT_PERSISTENCE_SQLITE persistence, passed as the
+ * <i>persistence_context</i> of MQTTClient_create().  They are copied, so
+ * they need not outlive the call.  The clients of a process which use the
+ * same directory share its database, which is synced as often as the
+ * strictest of their sync policies says.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTQ. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The directory of the database, NULL for the working directory */
+	const char* directory;
+	/** When the database is synced to disk, one of the MQTTCLIENT_LOG_SYNC values */
+	int syncPolicy;
+	/** The longest time between syncs, in milliseconds, with ::MQTTCLIENT_LOG_SYNC_INTERVAL */
+	int syncInterval;
+} MQTTClient_sqlitePersistenceOptions;
+
+#define MQTTClient_sqlitePersistenceOptions_initializer { {'M', 'Q', 'T', 'Q'}, 0, NULL, MQTTCLIENT_LOG_SYNC_NEVER, 0 }
+
 /**
  * A callback which is invoked just before a write to persistence.  This can be
  * used to transform the data, for instance to encrypt it.
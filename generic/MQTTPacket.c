@@ -36,6 +36,8 @@
 #include "StackTrace.h"
 #include "WebSocket.h"
 #include "MQTTTime.h"
+#include "MemoryPool.h"
+#include "SocketBuffer.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -94,7 +96,13 @@ pf new_packets[] =
 
 
 static char* readUTFlen(char** pptr, char* enddata, int* len);
+static int MQTTPacket_resolveTopicAlias(networkHandles* net, Publish* pack, int* aliased);
+static Publish* MQTTPacket_readPublish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen, int copyTopic);
+static int MQTTPacket_keepPublish(Publish* pack, char* data, int aliased);
+static int MQTTPacket_startStream(networkHandles* net, unsigned char aHeader, size_t remaining_length);
+static Publish* MQTTPacket_readStream(int MQTTVersion, networkHandles* net, size_t* wsFramePos, int* error);
 static int MQTTPacket_send_ack(int MQTTVersion, int type, int msgid, int dup, networkHandles *net);
+static int MQTTPacket_startFile(networkHandles* net, char* buf0, size_t buf0len, PacketBuffers* bufs);
 
 /**
  * Reads one MQTT packet from a socket.
@@ -114,7 +122,13 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 	FUNC_ENTRY;
 	*error = SOCKET_ERROR;  /* indicate whether an error occurred, or not */
 
-	const size_t headerWsFramePos = WebSocket_framePos();
+	size_t headerWsFramePos = WebSocket_framePos();
+
+	if (net->instream)
+	{	/* the rest of a publication which is being read in pieces */
+		pack = MQTTPacket_readStream(MQTTVersion, net, &headerWsFramePos, error);
+		goto exit;
+	}
 
 	/* read the packet data from the socket */
 	*error = WebSocket_getch(net, &header.byte);
@@ -125,6 +139,13 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 	if ((*error = MQTTPacket_decode(net, &remaining_length)) != TCPSOCKET_COMPLETE)
 		goto exit; /* packet not read, *error indicates whether SOCKET_ERROR occurred */
 
+	if (header.bits.type == PUBLISH && net->sink.threshold > 0 && remaining_length >= net->sink.threshold)
+	{	/* read a large publication in pieces, so that its payload can be streamed */
+		if ((*error = MQTTPacket_startStream(net, header.byte, remaining_length)) == TCPSOCKET_COMPLETE)
+			pack = MQTTPacket_readStream(MQTTVersion, net, &headerWsFramePos, error);
+		goto exit;
+	}
+
 	/* now read the rest, the variable header and payload */
 	data = WebSocket_getdata(net, remaining_length, &actual_len);
 	if (remaining_length && data == NULL)
@@ -147,11 +168,26 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 			Log(TRACE_MIN, 2, NULL, ptype);
 		else
 		{
-			if ((pack = (*new_packets[ptype])(MQTTVersion, header.byte, data, remaining_length)) == NULL)
+			int aliased = 0;
+
+			if (ptype == PUBLISH) /* the topic and payload are left in data until the packet is kept below */
+				pack = MQTTPacket_readPublish(MQTTVersion, header.byte, data, remaining_length, 0);
+			else
+				pack = (*new_packets[ptype])(MQTTVersion, header.byte, data, remaining_length);
+			if (pack == NULL)
 			{
 				*error = SOCKET_ERROR; // was BAD_MQTT_PACKET;
 				Log(LOG_ERROR, -1, "Bad MQTT packet, type %d", ptype);
 			}
+			else if (ptype == PUBLISH && MQTTVersion >= MQTTVERSION_5 &&
+					MQTTPacket_resolveTopicAlias(net, (Publish*)pack, &aliased) != 0)
+			{
+				((Publish*)pack)->topic = NULL; /* not allocated yet */
+				MQTTPacket_freePublish((Publish*)pack);
+				pack = NULL;
+				*error = SOCKET_ERROR;
+				Log(LOG_ERROR, -1, "Invalid topic alias in PUBLISH");
+			}
 #if !defined(NO_PERSISTENCE)
 			else if (header.bits.type == PUBLISH && header.bits.qos == 2)
 			{
@@ -160,16 +196,42 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 
 				if (buf == NULL)
 				{
+					((Publish*)pack)->topic = NULL;
+					MQTTPacket_freePublish((Publish*)pack);
+					pack = NULL;
 					*error = SOCKET_ERROR;
 					goto exit;
 				}
 				buf[0] = header.byte;
-				buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
-				*error = MQTTPersistence_putPacket(net->socket, buf, buf0len, 1,
-					&data, &remaining_length, header.bits.type, ((Publish *)pack)->msgId, 1, MQTTVersion);
+				if (aliased)
+				{   /* persist the topic in place of the alias, which only lasts as long as the connection */
+					Publish* publish = (Publish*)pack;
+					char topiclen[2];
+					char* ptr = topiclen;
+					char* bufs[3] = {topiclen, publish->topic, data + 2};
+					size_t lens[3] = {2, publish->topiclen, remaining_length - 2};
+
+					writeInt(&ptr, publish->topiclen);
+					buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length + publish->topiclen);
+					*error = MQTTPersistence_putPacket(net->socket, buf, buf0len, 3,
+						bufs, lens, header.bits.type, publish->msgId, 1, MQTTVersion);
+				}
+				else
+				{
+					buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
+					*error = MQTTPersistence_putPacket(net->socket, buf, buf0len, 1,
+						&data, &remaining_length, header.bits.type, ((Publish *)pack)->msgId, 1, MQTTVersion);
+				}
 				free(buf);
 			}
 #endif
+			if (pack && ptype == PUBLISH && MQTTPacket_keepPublish((Publish*)pack, data, aliased) != 0)
+			{
+				((Publish*)pack)->topic = NULL;
+				MQTTPacket_freePublish((Publish*)pack);
+				pack = NULL;
+				*error = SOCKET_ERROR;
+			}
 		}
 	}
 	if (pack)
@@ -183,6 +245,46 @@ exit:
 }
 
 
+/**
+ * Applies the MQTT 5 TOPIC_ALIAS property of a received PUBLISH, if any.
+ * A topic sent with an alias (re)defines the alias, an empty topic is
+ * replaced by the one the alias stands for.
+ * @param net the network handle the packet was read from
+ * @param pack the decoded publish packet
+ * @param aliased returned: whether the topic was filled in from an alias
+ * @return 0 on success, -1 if the alias is not valid
+ */
+static int MQTTPacket_resolveTopicAlias(networkHandles* net, Publish* pack, int* aliased)
+{
+	const char* topic = NULL;
+	int alias = 0, topiclen = 0;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	*aliased = 0;
+	if (!MQTTProperties_hasProperty(&pack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS))
+	{
+		rc = 0;
+		goto exit;
+	}
+	alias = (int)MQTTProperties_getNumericValue(&pack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+	if (net->inboundAliases == NULL)
+		goto exit; /* we did not allow any aliases */
+	if (pack->topiclen > 0)
+		rc = TopicAliases_set(net->inboundAliases, alias, pack->topic, pack->topiclen);
+	else if ((topic = TopicAliases_get(net->inboundAliases, alias, &topiclen)) != NULL)
+	{	/* the packet holds a reference to the topic in the table once it is kept */
+		pack->topic = (char*)topic;
+		pack->topiclen = topiclen;
+		*aliased = 1;
+		rc = 0;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Sends an MQTT packet in one system call write
  * @param socket the socket to which to write the data
@@ -226,6 +328,7 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 	packetbufs.buflens = &buflen;
 	packetbufs.frees = &freeData;
 	memset(packetbufs.mask, '\0', sizeof(packetbufs.mask));
+	packetbufs.file = NULL;
 	rc = WebSocket_putdatas(net, &buf, &buf0len, &packetbufs);
 
 	if (rc == TCPSOCKET_COMPLETE)
@@ -249,10 +352,12 @@ exit:
  * @param count the number of buffers
  * @param buffers the rest of the buffers to write (not including remaining length)
  * @param buflens the lengths of the data in the array of buffers to be written
+ * @param persistbufs the buffers to persist for a QoS 1 or 2 PUBLISH, if they differ
+ * from those written (the topic was replaced by a topic alias), or NULL
  * @param the MQTT version being used
  * @return the completion code (TCPSOCKET_COMPLETE etc)
  */
-int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, int MQTTVersion)
+int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, PacketBuffers* persistbufs, int MQTTVersion)
 {
 	int i, rc = SOCKET_ERROR;
 	size_t buf0len, total = 0;
@@ -272,15 +377,36 @@ int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, in
 	MQTTPacket_encode(&buf[1], total);
 
 #if !defined(NO_PERSISTENCE)
-	if (header.bits.type == PUBLISH && header.bits.qos != 0)
+	if (header.bits.type == PUBLISH && header.bits.qos != 0 && persistbufs == NULL)
 	{   /* persist PUBLISH QoS1 and Qo2 */
 		char *ptraux = bufs->buffers[2];
 		int msgId = readInt(&ptraux);
 		rc = MQTTPersistence_putPacket(net->socket, buf, buf0len, bufs->count, bufs->buffers, bufs->buflens,
 			header.bits.type, msgId, 0, MQTTVersion);
 	}
+	else if (header.bits.type == PUBLISH && header.bits.qos != 0)
+	{   /* persist the PUBLISH with its full topic, as aliases do not outlive the connection */
+		char pbuf0[5];
+		size_t pbuf0len, ptotal = 0;
+		char *ptraux = persistbufs->buffers[2];
+		int msgId = readInt(&ptraux);
+
+		for (i = 0; i < persistbufs->count; i++)
+			ptotal += persistbufs->buflens[i];
+		pbuf0[0] = header.byte;
+		pbuf0len = 1 + MQTTPacket_encode(&pbuf0[1], ptotal);
+		rc = MQTTPersistence_putPacket(net->socket, pbuf0, pbuf0len, persistbufs->count, persistbufs->buffers,
+			persistbufs->buflens, header.bits.type, msgId, 0, MQTTVersion);
+	}
 #endif
-	rc = WebSocket_putdatas(net, &buf, &buf0len, bufs);
+#if defined(OPENSSL)
+	if (bufs->file && (net->websocket || net->ssl))
+#else
+	if (bufs->file && net->websocket)
+#endif
+		rc = MQTTPacket_startFile(net, buf, buf0len, bufs);
+	else
+		rc = WebSocket_putdatas(net, &buf, &buf0len, bufs);
 
 	if (rc == TCPSOCKET_COMPLETE)
 		net->lastSent = MQTTTime_now();
@@ -293,6 +419,234 @@ exit:
 }
 
 
+/**
+ * Reads part of a payload from its file.
+ * @param file the file the payload is in
+ * @param buf the buffer to read into
+ * @param pos the position in the payload to read from
+ * @param len the number of bytes to read
+ * @return 0 on success, -1 if the bytes could not all be read
+ */
+int MQTTPacket_readFile(PayloadFile* file, char* buf, size_t pos, size_t len)
+{
+	int rc = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	FUNC_ENTRY;
+	rc = -1; /* payloads are not read from files on Windows */
+#else
+	size_t done = 0;
+
+	FUNC_ENTRY;
+	while (done < len)
+	{
+		ssize_t n = pread(file->fd, buf + done, len - done, file->offset + (off_t)(pos + done));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{	/* a read error, or the file has been cut short */
+			rc = -1;
+			break;
+		}
+		done += (size_t)n;
+	}
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Closes the file of a payload and frees it.
+ * @param file the file, may be NULL
+ */
+void MQTTPacket_freeFile(PayloadFile* file)
+{
+	FUNC_ENTRY;
+	if (file)
+	{
+#if !defined(_WIN32) && !defined(_WIN64)
+		close(file->fd);
+#endif
+		free(file);
+	}
+	FUNC_EXIT;
+}
+
+
+/** the most payload read from a file at once, when it is sent in pieces */
+#define FILE_CHUNK 65536
+
+/**
+ * A publication whose payload is sent from a file in pieces, each written
+ * separately, because the connection encrypts or frames what is written and
+ * so the file cannot be handed to the socket.  Each piece is sent when the
+ * one before it has been written, before anything else is written to the
+ * socket, so the pieces of the packet are not interleaved with other packets.
+ */
+typedef struct OutboundFileStruct
+{
+	PayloadFile* file;  /**< the file, which belongs to the publication being sent */
+	size_t pos;         /**< the position in the payload of the next piece */
+	size_t left;        /**< the number of payload bytes still to send */
+} OutboundFile;
+
+
+/**
+ * Writes one piece of a packet whose payload is sent from a file.
+ * @param net the network handle to write to
+ * @param buf the piece, freed here or by the socket layer once it is written
+ * @param buflen the length of the piece
+ * @return the completion code
+ */
+static int MQTTPacket_sendPiece(networkHandles* net, char* buf, size_t buflen)
+{
+	PacketBuffers nobufs = {0, NULL, NULL, NULL, {0, 0, 0, 0}, NULL};
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	rc = WebSocket_putdatas(net, &buf, &buflen, &nobufs);
+	if (rc == TCPSOCKET_COMPLETE)
+		net->lastSent = MQTTTime_now();
+	/* a web socket frame is built from a copy, and an interrupted TLS write frees its buffer when done */
+	if (net->websocket || rc != TCPSOCKET_INTERRUPTED)
+		free(buf);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Starts to send a packet whose payload is read from a file in pieces.  The
+ * buffers before the payload are copied and sent as the first piece.
+ * As with SSLSocket_putdatas, if the write is interrupted buf0 and the
+ * buffers to be freed are freed here, as the copies are used to finish it.
+ * @param net the network handle to write to
+ * @param buf0 the fixed header
+ * @param buf0len the length of the fixed header
+ * @param bufs the rest of the packet, the last buffer being read from bufs->file
+ * @return the completion code
+ */
+static int MQTTPacket_startFile(networkHandles* net, char* buf0, size_t buf0len, PacketBuffers* bufs)
+{
+	OutboundFile* f = NULL;
+	char* head = NULL;
+	char* ptr = NULL;
+	size_t headlen = buf0len;
+	int i, rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	for (i = 0; i < bufs->count - 1; ++i)
+		headlen += bufs->buflens[i];
+	if ((f = malloc(sizeof(OutboundFile))) == NULL)
+		goto exit;
+	if ((head = malloc(headlen)) == NULL)
+	{
+		free(f);
+		goto exit;
+	}
+	ptr = head;
+	memcpy(ptr, buf0, buf0len);
+	ptr += buf0len;
+	for (i = 0; i < bufs->count - 1; ++i)
+	{
+		if (bufs->buflens[i] > 0)
+		{
+			memcpy(ptr, bufs->buffers[i], bufs->buflens[i]);
+			ptr += bufs->buflens[i];
+		}
+	}
+	f->file = bufs->file;
+	f->pos = 0;
+	f->left = bufs->buflens[bufs->count - 1];
+	net->outfile = f;
+
+	if ((rc = MQTTPacket_sendPiece(net, head, headlen)) == TCPSOCKET_COMPLETE)
+		rc = MQTTPacket_continueFile(net);
+	else if (rc != TCPSOCKET_INTERRUPTED)
+		MQTTPacket_endFile(net);
+
+	if (rc == TCPSOCKET_INTERRUPTED)
+	{
+		free(buf0);
+		for (i = 0; i < bufs->count; ++i)
+		{
+			if (bufs->frees[i])
+			{
+				free(bufs->buffers[i]);
+				bufs->buffers[i] = NULL;
+			}
+		}
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Sends the next pieces of a payload being sent from a file, until it has
+ * all been sent or a piece is not written in full.  Called when the previous
+ * piece has been written, before any other packet is sent.
+ * @param net the network handle to write to
+ * @return TCPSOCKET_COMPLETE if the packet has been written, or there is
+ * none, TCPSOCKET_INTERRUPTED if a piece is still being written, or
+ * SOCKET_ERROR
+ */
+int MQTTPacket_continueFile(networkHandles* net)
+{
+	OutboundFile* f = net->outfile;
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if (f == NULL)
+		goto exit;
+	while (f->left > 0 && rc == TCPSOCKET_COMPLETE)
+	{
+		size_t len = min(f->left, FILE_CHUNK);
+		char* buf = malloc(len);
+
+		if (buf == NULL)
+		{
+			rc = SOCKET_ERROR;
+			break;
+		}
+		if (MQTTPacket_readFile(f->file, buf, f->pos, len) != 0)
+		{
+			Log(LOG_ERROR, -1, "Failed to read %lu payload bytes from file for socket %d", (unsigned long)len, net->socket);
+			free(buf);
+			rc = SOCKET_ERROR;
+			break;
+		}
+		f->pos += len;
+		f->left -= len;
+		rc = MQTTPacket_sendPiece(net, buf, len);
+	}
+	if (f->left == 0 || rc != TCPSOCKET_INTERRUPTED)
+		MQTTPacket_endFile(net); /* a last piece still being written is finished by the socket layer */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Stops sending a payload from a file, when it has all been sent or the
+ * connection is closed.  The file itself belongs to the publication.
+ * @param net the network handle
+ */
+void MQTTPacket_endFile(networkHandles* net)
+{
+	FUNC_ENTRY;
+	if (net->outfile)
+	{
+		free(net->outfile);
+		net->outfile = NULL;
+	}
+	FUNC_EXIT;
+}
+
+
 /**
  * Encodes the message length according to the MQTT algorithm
  * @param buf the buffer into which the encoded data is written
@@ -556,20 +910,48 @@ exit:
  * @return pointer to the packet structure
  */
 void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
+{
+	return MQTTPacket_readPublish(MQTTVersion, aHeader, data, datalen, 1);
+}
+
+
+/**
+ * Reads a publish packet.  The payload is left in the packet data.
+ * @param MQTTVersion
+ * @param aHeader the MQTT header byte
+ * @param data the rest of the packet
+ * @param datalen the length of the rest of the packet
+ * @param copyTopic whether to copy the topic into a string of its own, rather
+ * than to leave it in the packet data, where it is not terminated
+ * @return pointer to the packet structure
+ */
+static Publish* MQTTPacket_readPublish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen, int copyTopic)
 {
 	Publish* pack = NULL;
 	char* curdata = data;
 	char* enddata = &data[datalen];
 
 	FUNC_ENTRY;
-	if ((pack = malloc(sizeof(Publish))) == NULL)
+	if ((pack = MemoryPool_alloc(POOL_PUBLISH)) == NULL)
 		goto exit;
 	memset(pack, '\0', sizeof(Publish));
 	pack->MQTTVersion = MQTTVersion;
 	pack->header.byte = aHeader;
-	if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) /* Topic name on which to publish */
+	if (copyTopic)
+		pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen); /* Topic name on which to publish */
+	else
 	{
-		free(pack);
+		MQTTLenString topic;
+
+		if (MQTTLenStringRead(&topic, &curdata, enddata) != -1)
+		{
+			pack->topic = topic.data;
+			pack->topiclen = topic.len;
+		}
+	}
+	if (pack->topic == NULL)
+	{
+		MemoryPool_free(POOL_PUBLISH, pack);
 		pack = NULL;
 		goto exit;
 	}
@@ -577,7 +959,9 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
 	{
 		if (enddata - curdata < 2)  /* Is there enough data for the msgid? */
 		{
-			free(pack);
+			if (copyTopic)
+				free(pack->topic);
+			MemoryPool_free(POOL_PUBLISH, pack);
 			pack = NULL;
 			goto exit;
 		}
@@ -593,8 +977,9 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
 		{
 			if (pack->properties.array)
 				free(pack->properties.array);
-			if (pack)
-				free(pack);
+			if (copyTopic)
+				free(pack->topic);
+			MemoryPool_free(POOL_PUBLISH, pack);
 			pack = NULL; /* signal protocol error */
 			goto exit;
 		}
@@ -607,6 +992,505 @@ exit:
 }
 
 
+/**
+ * Moves a received publish packet into a PacketBuffer, so that its topic and
+ * payload stay where they are until the packet has been delivered, after the
+ * next packet has been read.  The buffer the packet was read into is taken
+ * over if it can be, with the topic moved to the start of the data and
+ * terminated there, or left in the alias table if it is that of an alias,
+ * otherwise the topic and payload are copied into a new one.
+ * @param pack the publish packet, with the topic and payload in data
+ * @param data the rest of the packet, as read
+ * @param aliased whether the topic is from a topic alias rather than in data
+ * @return 0 on success, PAHO_MEMORY_ERROR if a buffer could not be allocated
+ */
+static int MQTTPacket_keepPublish(Publish* pack, char* data, int aliased)
+{
+	char* buf = NULL;
+	char* topic = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((buf = SocketBuffer_takeData(data)) != NULL)
+	{
+		pack->buffer = (PacketBuffer*)buf;
+		pack->buffer->refcount = 1;
+		pack->buffer->aliasTopic = NULL;
+		if (aliased)
+		{	/* the topic is in the alias table, which keeps it for us */
+			TopicAliases_retainTopic(pack->topic);
+			pack->buffer->aliasTopic = pack->topic;
+			goto exit;
+		}
+		topic = memmove(data, pack->topic, pack->topiclen); /* the length bytes make room for the terminator */
+	}
+	else if ((buf = malloc(SOCKETBUFFER_HEADROOM + pack->topiclen + 1 + pack->payloadlen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	else
+	{
+		pack->buffer = (PacketBuffer*)buf;
+		pack->buffer->refcount = 1;
+		pack->buffer->aliasTopic = NULL;
+		topic = memcpy(buf + SOCKETBUFFER_HEADROOM, pack->topic, pack->topiclen);
+		pack->payload = memcpy(topic + pack->topiclen + 1, pack->payload, pack->payloadlen);
+	}
+	topic[pack->topiclen] = '\0';
+	pack->topic = topic;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Adds a reference to a received packet.
+ * @param buffer the packet
+ */
+void MQTTPacket_retainBuffer(PacketBuffer* buffer)
+{
+	++(buffer->refcount);
+}
+
+
+/**
+ * Drops a reference to a received packet, and frees it with the last one.
+ * The references held by the library are all taken and dropped by the thread
+ * reading the packets before the message is handed to the application, so
+ * the count needs no lock.
+ * @param buffer the packet
+ */
+void MQTTPacket_releaseBuffer(PacketBuffer* buffer)
+{
+	if (--(buffer->refcount) == 0)
+	{
+		if (buffer->aliasTopic)
+			TopicAliases_releaseTopic(buffer->aliasTopic);
+		free(buffer);
+	}
+}
+
+
+/**
+ * The parts of a publication read in pieces, in the order they are read.
+ */
+enum MQTTPacket_streamStates
+{
+	STREAM_TOPIC_LENGTH, /**< the length of the topic */
+	STREAM_HEAD,         /**< the topic, the message id and the length of the properties */
+	STREAM_PROPERTIES,   /**< the rest of the MQTT 5 properties */
+	STREAM_OPEN,         /**< the variable header has been read */
+	STREAM_PAYLOAD       /**< the payload */
+};
+
+/** the most payload read at once when a publication is read in pieces */
+#define STREAM_CHUNK 65536
+
+/**
+ * A publication which is read in pieces, over as many calls to
+ * MQTTPacket_Factory as it takes, so that its payload can be written to the
+ * application's payload stream as it arrives rather than held in memory.
+ */
+typedef struct InboundStreamStruct
+{
+	unsigned char header;     /**< the MQTT header byte */
+	size_t remaining_length;  /**< the length of the packet after the fixed header */
+	int state;                /**< the part to read next, one of ::MQTTPacket_streamStates */
+	char* head;               /**< the variable header, as read so far */
+	size_t headlen;           /**< the length of the variable header read so far */
+	size_t want;              /**< the number of bytes to read into head next */
+	size_t excess;            /**< the number of payload bytes read into head after the variable header */
+	Publish* pack;            /**< the packet, once the variable header has been read */
+	int aliased;              /**< whether the topic is from a topic alias */
+	char* buf;                /**< the buffer the packet is kept in, as by MQTTPacket_keepPublish */
+	char* payload;            /**< where in buf the payload is copied to, if it is not streamed */
+	size_t left;              /**< the number of payload bytes still to read */
+	size_t written;           /**< the number of payload bytes copied or streamed */
+	int streaming;            /**< whether the payload is written to the payload stream */
+	void* stream;             /**< the application's stream */
+	int failed;               /**< whether writing to the stream failed */
+} InboundStream;
+
+
+/**
+ * Starts to read a large publication in pieces, once its fixed header has
+ * been read.
+ * @param net the network handle the packet is read from
+ * @param aHeader the MQTT header byte
+ * @param remaining_length the length of the rest of the packet
+ * @return TCPSOCKET_COMPLETE on success, SOCKET_ERROR otherwise
+ */
+static int MQTTPacket_startStream(networkHandles* net, unsigned char aHeader, size_t remaining_length)
+{
+	InboundStream* s = NULL;
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	if (remaining_length < 2)
+	{
+		Log(LOG_ERROR, -1, "Bad MQTT packet, type %d", PUBLISH);
+		goto exit;
+	}
+	if ((s = malloc(sizeof(InboundStream))) == NULL)
+		goto exit;
+	memset(s, '\0', sizeof(InboundStream));
+	s->header = aHeader;
+	s->remaining_length = remaining_length;
+	s->state = STREAM_TOPIC_LENGTH;
+	s->want = 2;
+	net->instream = s;
+	rc = TCPSOCKET_COMPLETE;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Reads the next piece of a publication which is read in pieces.
+ * @param net the network handle the packet is read from
+ * @param bytes the length of the piece
+ * @param wsFramePos returned: the websocket frame position to go back to
+ * if the piece has not all arrived yet
+ * @param data returned: the piece, valid until the next read
+ * @return TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED or SOCKET_ERROR
+ */
+static int MQTTPacket_readPiece(networkHandles* net, size_t bytes, size_t* wsFramePos, char** data)
+{
+	size_t actual_len = 0;
+	int rc = TCPSOCKET_COMPLETE;
+
+	*wsFramePos = WebSocket_framePos();
+	if ((*data = WebSocket_getdata(net, bytes, &actual_len)) == NULL)
+		rc = SOCKET_ERROR;
+	else if (actual_len < bytes)
+	{
+		net->lastReceived = MQTTTime_now();
+		rc = TCPSOCKET_INTERRUPTED;
+	}
+	return rc;
+}
+
+
+/**
+ * Reads the next part of the variable header of a publication read in pieces.
+ * The header is kept with four zero bytes after it, so that a variable byte
+ * integer at its end can be decoded without reading past it.
+ * @param net the network handle the packet is read from
+ * @param s the publication
+ * @param wsFramePos returned: the websocket frame position to go back to
+ * @return TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED or SOCKET_ERROR
+ */
+static int MQTTPacket_readHead(networkHandles* net, InboundStream* s, size_t* wsFramePos)
+{
+	char* data = NULL;
+	char* head = NULL;
+	int rc;
+
+	if ((rc = MQTTPacket_readPiece(net, s->want, wsFramePos, &data)) != TCPSOCKET_COMPLETE)
+		goto exit;
+	if (s->head == NULL)
+		head = malloc(s->want + 4);
+	else
+		head = realloc(s->head, s->headlen + s->want + 4);
+	if (head == NULL)
+	{
+		rc = SOCKET_ERROR;
+		goto exit;
+	}
+	s->head = head;
+	memcpy(&s->head[s->headlen], data, s->want);
+	s->headlen += s->want;
+	memset(&s->head[s->headlen], '\0', 4);
+	s->want = 0;
+exit:
+	return rc;
+}
+
+
+/**
+ * Copies or streams the next part of the payload of a publication read in pieces.
+ * @param net the network handle the packet is read from
+ * @param s the publication
+ * @param data the part of the payload
+ * @param len the length of the part
+ */
+static void MQTTPacket_putPayload(networkHandles* net, InboundStream* s, const char* data, size_t len)
+{
+	if (!s->streaming)
+		memcpy(&s->payload[s->written], data, len);
+	else if (s->failed)
+		return; /* the rest of the payload is discarded */
+	else if ((*net->sink.write)(net->sink.context, s->stream, data, len) != 0)
+	{
+		Log(TRACE_MIN, -1, "Writing to the payload stream failed, discarding the rest of the payload");
+		s->failed = 1;
+		return;
+	}
+	s->written += len;
+}
+
+
+/**
+ * Decodes the variable header of a publication read in pieces, and asks the
+ * application whether the payload is to be streamed.  The buffer the packet
+ * is kept in is allocated here, with room for the payload if it is not.
+ * @param MQTTVersion the MQTT version of the connection
+ * @param net the network handle the packet is read from
+ * @param s the publication
+ * @return TCPSOCKET_COMPLETE on success, SOCKET_ERROR otherwise
+ */
+static int MQTTPacket_openStream(int MQTTVersion, networkHandles* net, InboundStream* s)
+{
+	Publish* pack = NULL;
+	size_t payloadlen = s->remaining_length - s->headlen;
+	char* topic = NULL;
+	int rc = SOCKET_ERROR;
+
+	FUNC_ENTRY;
+	if ((pack = s->pack = MQTTPacket_readPublish(MQTTVersion, s->header, s->head, s->headlen, 0)) == NULL)
+	{
+		Log(LOG_ERROR, -1, "Bad MQTT packet, type %d", PUBLISH);
+		goto exit;
+	}
+	if (MQTTVersion >= MQTTVERSION_5 && MQTTPacket_resolveTopicAlias(net, pack, &s->aliased) != 0)
+	{
+		Log(LOG_ERROR, -1, "Invalid topic alias in PUBLISH");
+		goto exit;
+	}
+	if (payloadlen > 0 && net->sink.open)
+		s->streaming = (*net->sink.open)(net->sink.context, pack->topic, pack->topiclen,
+				pack->header.bits.qos, payloadlen, &s->stream);
+	if (s->aliased)
+	{	/* the topic is left in the alias table, and referenced by the packet when it is complete */
+		if ((s->buf = malloc(SOCKETBUFFER_HEADROOM + (s->streaming ? 0 : payloadlen))) == NULL)
+			goto exit;
+		s->payload = s->buf + SOCKETBUFFER_HEADROOM;
+	}
+	else
+	{
+		if ((s->buf = malloc(SOCKETBUFFER_HEADROOM + pack->topiclen + 1 + (s->streaming ? 0 : payloadlen))) == NULL)
+			goto exit;
+		topic = memcpy(s->buf + SOCKETBUFFER_HEADROOM, pack->topic, pack->topiclen);
+		topic[pack->topiclen] = '\0';
+		pack->topic = topic;
+		s->payload = topic + pack->topiclen + 1;
+	}
+	s->left = payloadlen - s->excess;
+	if (s->excess > 0)
+		MQTTPacket_putPayload(net, s, s->head + s->headlen, s->excess);
+	rc = TCPSOCKET_COMPLETE;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Completes a publication read in pieces, once its payload has been read.
+ * @param MQTTVersion the MQTT version of the connection
+ * @param net the network handle the packet was read from
+ * @param s the publication
+ * @param error returned: the result of persisting a QoS 2 publication
+ * @return the packet, with its topic and any payload in a PacketBuffer
+ */
+static Publish* MQTTPacket_finishStream(int MQTTVersion, networkHandles* net, InboundStream* s, int* error)
+{
+	Publish* pack = s->pack;
+
+	FUNC_ENTRY;
+	if (s->streaming)
+	{
+		(*net->sink.close)(net->sink.context, s->stream, s->failed ? -1 : 0);
+		pack->payloadlen = 0;
+		pack->streamed = (int)s->written;
+	}
+	else
+		pack->payloadlen = (int)s->written;
+	pack->payload = s->payload;
+	pack->buffer = (PacketBuffer*)s->buf;
+	pack->buffer->refcount = 1;
+	pack->buffer->aliasTopic = NULL;
+	if (s->aliased)
+	{
+		TopicAliases_retainTopic(pack->topic);
+		pack->buffer->aliasTopic = pack->topic;
+	}
+#if !defined(NO_PERSISTENCE)
+	if (pack->header.bits.qos == 2)
+	{	/* as in MQTTPacket_Factory, but with the payload left out if it was streamed */
+		char buf0[5];
+		char topiclen[2];
+		char* ptr = topiclen;
+		char* bufs[4];
+		size_t lens[4];
+		size_t remaining_length = 0;
+		int count = 0;
+		int i;
+
+		if (s->aliased)
+		{
+			writeInt(&ptr, pack->topiclen);
+			bufs[count] = topiclen;
+			lens[count++] = 2;
+			bufs[count] = pack->topic;
+			lens[count++] = pack->topiclen;
+			bufs[count] = s->head + 2;
+			lens[count++] = s->headlen - 2;
+		}
+		else
+		{
+			bufs[count] = s->head;
+			lens[count++] = s->headlen;
+		}
+		if (pack->payloadlen > 0)
+		{
+			bufs[count] = pack->payload;
+			lens[count++] = pack->payloadlen;
+		}
+		for (i = 0; i < count; ++i)
+			remaining_length += lens[i];
+		buf0[0] = s->header;
+		*error = MQTTPersistence_putPacket(net->socket, buf0, 1 + MQTTPacket_encode(&buf0[1], remaining_length),
+				count, bufs, lens, PUBLISH, pack->msgId, 1, MQTTVersion);
+	}
+#endif
+	s->streaming = 0;
+	s->pack = NULL;
+	s->buf = NULL;
+	MQTTPacket_endStream(net);
+	FUNC_EXIT;
+	return pack;
+}
+
+
+/**
+ * Reads as much more of a publication read in pieces as has arrived.
+ * @param MQTTVersion the MQTT version of the connection
+ * @param net the network handle the packet is read from
+ * @param wsFramePos returned: the websocket frame position to go back to
+ * if the packet has not all arrived yet
+ * @param error returned: TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED or SOCKET_ERROR
+ * @return the packet, once it has all been read, otherwise NULL
+ */
+static Publish* MQTTPacket_readStream(int MQTTVersion, networkHandles* net, size_t* wsFramePos, int* error)
+{
+	InboundStream* s = net->instream;
+	Publish* pack = NULL;
+	char* data = NULL;
+	Header header;
+
+	FUNC_ENTRY;
+	header.byte = s->header;
+	if (s->state == STREAM_TOPIC_LENGTH)
+	{
+		char* ptr = NULL;
+		size_t fields = 0;
+
+		if ((*error = MQTTPacket_readHead(net, s, wsFramePos)) != TCPSOCKET_COMPLETE)
+			goto exit;
+		ptr = s->head;
+		/* the topic and message id, and then as much as the properties length can take */
+		fields = readInt(&ptr) + (header.bits.qos > 0 ? 2 : 0) + (MQTTVersion >= MQTTVERSION_5 ? 4 : 0);
+		s->want = min(fields, s->remaining_length - s->headlen);
+		s->state = STREAM_HEAD;
+	}
+	if (s->state == STREAM_HEAD)
+	{
+		if (s->want > 0 && (*error = MQTTPacket_readHead(net, s, wsFramePos)) != TCPSOCKET_COMPLETE)
+			goto exit;
+		s->state = STREAM_OPEN;
+		if (MQTTVersion >= MQTTVERSION_5)
+		{
+			char* ptr = s->head;
+			size_t propsat = 2 + readInt(&ptr) + (header.bits.qos > 0 ? 2 : 0);
+			unsigned int proplen = 0;
+			size_t headend = 0;
+			int len = 0;
+
+			if (propsat >= s->headlen ||
+				(len = MQTTPacket_decodeBuf(&s->head[propsat], &proplen)) > 4 ||
+				(headend = propsat + len + proplen) > s->remaining_length)
+			{
+				Log(LOG_ERROR, -1, "Bad MQTT packet, type %d", PUBLISH);
+				*error = SOCKET_ERROR;
+				goto exit;
+			}
+			if (headend > s->headlen)
+			{
+				s->want = headend - s->headlen;
+				s->state = STREAM_PROPERTIES;
+			}
+			else
+			{	/* what was read past the properties is the start of the payload */
+				s->excess = s->headlen - headend;
+				s->headlen = headend;
+			}
+		}
+	}
+	if (s->state == STREAM_PROPERTIES)
+	{
+		if ((*error = MQTTPacket_readHead(net, s, wsFramePos)) != TCPSOCKET_COMPLETE)
+			goto exit;
+		s->state = STREAM_OPEN;
+	}
+	if (s->state == STREAM_OPEN)
+	{
+		if ((*error = MQTTPacket_openStream(MQTTVersion, net, s)) != TCPSOCKET_COMPLETE)
+			goto exit;
+		s->state = STREAM_PAYLOAD;
+	}
+	while (s->left > 0)
+	{
+		size_t bytes = min(s->left, STREAM_CHUNK);
+
+		if ((*error = MQTTPacket_readPiece(net, bytes, wsFramePos, &data)) != TCPSOCKET_COMPLETE)
+			goto exit;
+		MQTTPacket_putPayload(net, s, data, bytes);
+		s->left -= bytes;
+	}
+	*error = TCPSOCKET_COMPLETE;
+	pack = MQTTPacket_finishStream(MQTTVersion, net, s, error);
+exit:
+	if (pack == NULL && *error != TCPSOCKET_INTERRUPTED)
+		MQTTPacket_endStream(net);
+	FUNC_EXIT_RC(*error);
+	return pack;
+}
+
+
+/**
+ * Abandons a publication which is being read in pieces, if there is one,
+ * as when the connection is closed.  A payload stream is closed as failed.
+ * @param net the network handle the packet was being read from
+ */
+void MQTTPacket_endStream(networkHandles* net)
+{
+	InboundStream* s = net->instream;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+		goto exit;
+	net->instream = NULL;
+	if (s->streaming)
+		(*net->sink.close)(net->sink.context, s->stream, -1);
+	if (s->pack)
+	{
+		s->pack->topic = NULL; /* in the variable header, a topic alias or buf */
+		MQTTPacket_freePublish(s->pack);
+	}
+	if (s->buf)
+		free(s->buf);
+	if (s->head)
+		free(s->head);
+	free(s);
+exit:
+	FUNC_EXIT;
+}
+
+
 /**
  * Free allocated storage for a publish packet.
  * @param pack pointer to the publish packet structure
@@ -614,11 +1498,13 @@ exit:
 void MQTTPacket_freePublish(Publish* pack)
 {
 	FUNC_ENTRY;
-	if (pack->topic != NULL)
+	if (pack->buffer != NULL)
+		MQTTPacket_releaseBuffer(pack->buffer); /* the topic points into it */
+	else if (pack->topic != NULL)
 		free(pack->topic);
 	if (pack->MQTTVersion >= MQTTVERSION_5)
 		MQTTProperties_free(&pack->properties);
-	free(pack);
+	MemoryPool_free(POOL_PUBLISH, pack);
 	FUNC_EXIT;
 }
 
@@ -765,6 +1651,41 @@ int MQTTPacket_send_pubrel(int MQTTVersion, int msgid, int dup, networkHandles*
 }
 
 
+/**
+ * Puts the record of a PUBREL into the persistent store, as MQTTPacket_send does
+ * when it sends one, so that the record can be committed before the PUBREL is sent.
+ * @param MQTTVersion the version of MQTT being used
+ * @param msgid the MQTT message id of the PUBREL
+ * @param net the network handle of the client
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int MQTTPacket_persistPubrel(int MQTTVersion, int msgid, networkHandles* net)
+{
+	int rc = 0;
+#if !defined(NO_PERSISTENCE)
+	Header header;
+	char buf0[2];
+	char data[2];
+	char* buffer = data;
+	char* ptr = data;
+	size_t buflen = sizeof(data);
+#endif
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	header.byte = 0;
+	header.bits.type = PUBREL;
+	header.bits.qos = 1;
+	buf0[0] = header.byte;
+	MQTTPacket_encode(&buf0[1], buflen);
+	writeInt(&ptr, msgid);
+	rc = MQTTPersistence_putPacket(net->socket, buf0, sizeof(buf0), 1, &buffer, &buflen, PUBREL, msgid, 0, MQTTVersion);
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Send an MQTT PUBCOMP packet down a socket.
  * @param MQTTVersion the version of MQTT being used
@@ -915,21 +1836,60 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
 		char* bufs[4] = {topiclen, pack->topic, NULL, pack->payload};
 		size_t lens[4] = {2, strlen(pack->topic), buflen, pack->payloadlen};
 		int frees[4] = {1, 0, 1, 0};
-		PacketBuffers packetbufs = {4, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}};
+		PacketBuffers packetbufs = {4, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}, pack->file};
+		MQTTProperties props = pack->properties;
+		int alias = 0, sendTopic = 1;
+		char* fullbuf = NULL;
+		char* fullbufs[4] = {NULL, pack->topic, NULL, pack->payload};
+		size_t fulllens[4] = {2, strlen(pack->topic), buflen, pack->payloadlen};
+		int fullfrees[4] = {0, 0, 0, 0};
+		PacketBuffers persistbufs = {4, fullbufs, fulllens, fullfrees, {0, 0, 0, 0}};
+
+		if (pack->MQTTVersion >= 5 && net->outboundAliases &&
+				!MQTTProperties_hasProperty(&pack->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS))
+			alias = TopicAliases_assign(net->outboundAliases, pack->topic, &sendTopic);
+		if (alias > 0)
+		{
+			props.length += 3; /* the TOPIC_ALIAS property is appended */
+			lens[2] = buflen = ((qos > 0) ? 2 : 0) + MQTTProperties_len(&props);
+			if (!sendTopic)
+				lens[1] = 0;
+			if (qos > 0)
+			{   /* persist the packet as it would have been without the alias */
+				if ((fullbuf = malloc(2 + fulllens[2])) == NULL)
+					goto exit_free;
+				ptr = fullbufs[0] = fullbuf;
+				writeInt(&ptr, (int)fulllens[1]);
+				fullbufs[2] = ptr;
+				writeInt(&ptr, pack->msgId);
+				MQTTProperties_write(&ptr, &pack->properties);
+			}
+		}
 
 		bufs[2] = ptr = malloc(buflen);
 		if (ptr == NULL)
+		{
+			if (fullbuf)
+				free(fullbuf);
 			goto exit_free;
+		}
 		if (qos > 0)
 			writeInt(&ptr, pack->msgId);
 		if (pack->MQTTVersion >= 5)
-			MQTTProperties_write(&ptr, &pack->properties);
+			MQTTProperties_write(&ptr, &props);
+		if (alias > 0)
+		{
+			writeChar(&ptr, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+			writeInt(&ptr, alias);
+		}
 
 		ptr = topiclen;
 		writeInt(&ptr, (int)lens[1]);
-		rc = MQTTPacket_sends(net, header, &packetbufs, pack->MQTTVersion);
+		rc = MQTTPacket_sends(net, header, &packetbufs, fullbuf ? &persistbufs : NULL, pack->MQTTVersion);
 		if (rc != TCPSOCKET_INTERRUPTED)
 			free(bufs[2]);
+		if (fullbuf)
+			free(fullbuf);
 		memcpy(pack->mask, packetbufs.mask, sizeof(pack->mask));
 	}
 	else
@@ -938,10 +1898,10 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
 		char* bufs[3] = {topiclen, pack->topic, pack->payload};
 		size_t lens[3] = {2, strlen(pack->topic), pack->payloadlen};
 		int frees[3] = {1, 0, 0};
-		PacketBuffers packetbufs = {3, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}};
+		PacketBuffers packetbufs = {3, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}, pack->file};
 
 		writeInt(&ptr, (int)lens[1]);
-		rc = MQTTPacket_sends(net, header, &packetbufs, pack->MQTTVersion);
+		rc = MQTTPacket_sends(net, header, &packetbufs, NULL, pack->MQTTVersion);
 		memcpy(pack->mask, packetbufs.mask, sizeof(pack->mask));
 	}
 	{
@@ -953,7 +1913,7 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
 		char buf[buflen];
 		int len = 0;
 
-		len = MQTTPacket_formatPayload(buflen, buf, pack->payloadlen, pack->payload);
+		len = MQTTPacket_formatPayload(buflen, buf, pack->file ? 0 : pack->payloadlen, pack->payload);
 
 		if (qos == 0)
 			Log(LOG_PROTOCOL, 27, NULL, net->socket, clientID, retained, rc, pack->payloadlen, len, buf);
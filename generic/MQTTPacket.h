@@ -205,6 +205,11 @@ typedef struct
 	int MQTTVersion;  /**< the version of MQTT */
 	MQTTProperties properties; /**< MQTT 5.0 properties.  Not used for MQTT < 5.0 */
 	uint8_t mask[4]; /**< the websockets mask the payload is masked with, if any */
+	void (*release)(void*, void*); /**< releases a borrowed payload instead of free, if set */
+	void* release_context; /**< the first argument of release */
+	PacketBuffer* buffer; /**< the received packet the topic and payload point into, if any */
+	int streamed; /**< the number of payload bytes written to a payload stream instead */
+	PayloadFile* file; /**< the file the payload is read from as it is sent, instead of payload, if set */
 } Publish;
 
 
@@ -238,14 +243,21 @@ void writeData(char** pptr, const void* data, int datalen);
 const char* MQTTPacket_name(int ptype);
 
 void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error);
+void MQTTPacket_endStream(networkHandles* net);
 int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buflen, int free, int MQTTVersion);
-int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* buffers, int MQTTVersion);
+int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* buffers, PacketBuffers* persistbuffers, int MQTTVersion);
+int MQTTPacket_readFile(PayloadFile* file, char* buf, size_t pos, size_t len);
+void MQTTPacket_freeFile(PayloadFile* file);
+int MQTTPacket_continueFile(networkHandles* net);
+void MQTTPacket_endFile(networkHandles* net);
 
 void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 int MQTTPacket_send_disconnect(Clients* client, enum MQTTReasonCodes reason, MQTTProperties* props);
 
 void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 void MQTTPacket_freePublish(Publish* pack);
+void MQTTPacket_retainBuffer(PacketBuffer* buffer);
+void MQTTPacket_releaseBuffer(PacketBuffer* buffer);
 int MQTTPacket_formatPayload(int buflen, char* buf, int payloadlen, char* payload);
 int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, const char* clientID);
 int MQTTPacket_send_puback(int MQTTVersion, int msgid, networkHandles* net, const char* clientID);
@@ -256,6 +268,7 @@ void MQTTPacket_freeSuback(Suback* pack);
 void MQTTPacket_freeUnsuback(Unsuback* pack);
 int MQTTPacket_send_pubrec(int MQTTVersion, int msgid, networkHandles* net, const char* clientID);
 int MQTTPacket_send_pubrel(int MQTTVersion, int msgid, int dup, networkHandles* net, const char* clientID);
+int MQTTPacket_persistPubrel(int MQTTVersion, int msgid, networkHandles* net);
 int MQTTPacket_send_pubcomp(int MQTTVersion, int msgid, networkHandles* net, const char* clientID);
 
 void MQTTPacket_free_packet(MQTTPacket* pack);
@@ -28,7 +28,13 @@
 
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "MQTTPersistenceMmap.h"
+#include "MQTTPersistenceTmpfs.h"
+#include "MQTTPersistenceSqlite.h"
+#include "MQTTPersistenceWriter.h"
 #include "MQTTProtocolClient.h"
+#include "MemoryPool.h"
 #include "Heap.h"
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -38,6 +44,14 @@
 
 static MQTTPersistence_qEntry* MQTTPersistence_restoreQueueEntry(char* buffer, size_t buflen, int MQTTVersion);
 static void MQTTPersistence_insertInSeqOrder(List* list, MQTTPersistence_qEntry* qEntry, size_t size);
+static int MQTTPersistence_compareKeys(const void* a, const void* b);
+static int MQTTPersistence_compareMsgIds(const void* a, const void* b);
+static int MQTTPersistence_compareSeqnos(const void* a, const void* b);
+static int MQTTPersistence_compareBatches(const void* a, const void* b);
+static int MQTTPersistence_put(Clients* c, char* key, int bufcount, char* buffers[], int buflens[]);
+static int MQTTPersistence_removeKey(Clients* c, char* key);
+static void MQTTPersistence_closeQueueBatches(Clients* c);
+static void MQTTPersistence_freeQueueBatches(Clients* c);
 
 /**
  * Creates a ::MQTTClient_persistence structure representing a persistence implementation.
@@ -86,6 +100,104 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 			else
 				rc = PAHO_MEMORY_ERROR;
 			break;
+		case MQTTCLIENT_PERSISTENCE_LOG :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				if ((per->context = pstlogcontext(pcontext)) == NULL)
+				{
+					free(per);
+					per = NULL;
+					rc = MQTTCLIENT_PERSISTENCE_ERROR;
+					goto exit;
+				}
+				/* log functions */
+				per->popen        = pstlogopen;
+				per->pclose       = pstlogclose;
+				per->pput         = pstlogput;
+				per->pget         = pstlogget;
+				per->premove      = pstlogremove;
+				per->pkeys        = pstlogkeys;
+				per->pclear       = pstlogclear;
+				per->pcontainskey = pstlogcontainskey;
+			}
+			else
+				rc = PAHO_MEMORY_ERROR;
+			break;
+		case MQTTCLIENT_PERSISTENCE_MMAP :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				if ((per->context = pstmapcontext(pcontext)) == NULL)
+				{
+					free(per);
+					per = NULL;
+					rc = MQTTCLIENT_PERSISTENCE_ERROR;
+					goto exit;
+				}
+				/* memory mapped slot functions */
+				per->popen        = pstmapopen;
+				per->pclose       = pstmapclose;
+				per->pput         = pstmapput;
+				per->pget         = pstmapget;
+				per->premove      = pstmapremove;
+				per->pkeys        = pstmapkeys;
+				per->pclear       = pstmapclear;
+				per->pcontainskey = pstmapcontainskey;
+			}
+			else
+				rc = PAHO_MEMORY_ERROR;
+			break;
+		case MQTTCLIENT_PERSISTENCE_TMPFS :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				if ((per->context = psttmpcontext(pcontext)) == NULL)
+				{
+					free(per);
+					per = NULL;
+					rc = MQTTCLIENT_PERSISTENCE_ERROR;
+					goto exit;
+				}
+				/* tmpfs write-behind functions */
+				per->popen        = psttmpopen;
+				per->pclose       = psttmpclose;
+				per->pput         = psttmpput;
+				per->pget         = psttmpget;
+				per->premove      = psttmpremove;
+				per->pkeys        = psttmpkeys;
+				per->pclear       = psttmpclear;
+				per->pcontainskey = psttmpcontainskey;
+			}
+			else
+				rc = PAHO_MEMORY_ERROR;
+			break;
+#if defined(MQTT_SQLITE)
+		case MQTTCLIENT_PERSISTENCE_SQLITE :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				if ((per->context = pstsqlcontext(pcontext)) == NULL)
+				{
+					free(per);
+					per = NULL;
+					rc = MQTTCLIENT_PERSISTENCE_ERROR;
+					goto exit;
+				}
+				/* SQLite database functions */
+				per->popen        = pstsqlopen;
+				per->pclose       = pstsqlclose;
+				per->pput         = pstsqlput;
+				per->pget         = pstsqlget;
+				per->premove      = pstsqlremove;
+				per->pkeys        = pstsqlkeys;
+				per->pclear       = pstsqlclear;
+				per->pcontainskey = pstsqlcontainskey;
+			}
+			else
+				rc = PAHO_MEMORY_ERROR;
+			break;
+#endif
 		case MQTTCLIENT_PERSISTENCE_USER :
 			per = (MQTTClient_persistence *)pcontext;
 			if ( per == NULL || (per != NULL && (per->context == NULL || per->pclear == NULL ||
@@ -142,6 +254,9 @@ int MQTTPersistence_close(Clients *c)
 #if !defined(NO_PERSISTENCE)
 	if (c->persistence != NULL)
 	{
+		MQTTPersistence_closeQueueBatches(c);
+		MQTTPersistenceWriter_destroy(c->writer); /* commits what is still queued */
+		c->writer = NULL;
 		rc = c->persistence->pclose(c->phandle);
 
 		if (c->persistence->popen == pstopen) {
@@ -149,6 +264,24 @@ int MQTTPersistence_close(Clients *c)
 				free(c->persistence->context);
 			free(c->persistence);
 		}
+		else if (c->persistence->popen == pstlogopen) {
+			pstlogfreecontext(c->persistence->context);
+			free(c->persistence);
+		}
+		else if (c->persistence->popen == pstmapopen) {
+			pstmapfreecontext(c->persistence->context);
+			free(c->persistence);
+		}
+		else if (c->persistence->popen == psttmpopen) {
+			psttmpfreecontext(c->persistence->context);
+			free(c->persistence);
+		}
+#if defined(MQTT_SQLITE)
+		else if (c->persistence->popen == pstsqlopen) {
+			pstsqlfreecontext(c->persistence->context);
+			free(c->persistence);
+		}
+#endif
 
 		c->phandle = NULL;
 		c->persistence = NULL;
@@ -168,6 +301,9 @@ int MQTTPersistence_clear(Clients *c)
 	int rc = 0;
 
 	FUNC_ENTRY;
+	MQTTPersistence_freeQueueBatches(c);
+	if (c->writer != NULL)
+		MQTTPersistenceWriter_discard(c->writer);
 	if (c->persistence != NULL)
 		rc = c->persistence->pclear(c->phandle);
 
@@ -191,10 +327,19 @@ int MQTTPersistence_restorePackets(Clients *c)
 	int i = 0;
 	int msgs_sent = 0;
 	int msgs_rcvd = 0;
+	Messages** sent = NULL;
 
 	FUNC_ENTRY;
 	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
 	{
+		/* the sent messages are sorted once they are all read, rather than inserted in order one by one */
+		if (nkeys > 0 && (sent = malloc(nkeys * sizeof(Messages*))) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		/* and the keys are sorted to look up the PUBREL of a PUBLISH and the other way round */
+		qsort(msgkeys, nkeys, sizeof(char*), MQTTPersistence_compareKeys);
 		while (rc == 0 && i < nkeys)
 		{
 			if (strncmp(msgkeys[i], PERSISTENCE_COMMAND_KEY, strlen(PERSISTENCE_COMMAND_KEY)) == 0 ||
@@ -203,7 +348,10 @@ int MQTTPersistence_restorePackets(Clients *c)
 				;
 			}
 			else if (strncmp(msgkeys[i], PERSISTENCE_QUEUE_KEY, strlen(PERSISTENCE_QUEUE_KEY)) == 0 ||
-					 strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0)
+					 strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0 ||
+					 strncmp(msgkeys[i], PERSISTENCE_QUEUE_BATCH_KEY, strlen(PERSISTENCE_QUEUE_BATCH_KEY)) == 0 ||
+					 strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_BATCH_KEY, strlen(PERSISTENCE_V5_QUEUE_BATCH_KEY)) == 0 ||
+					 strcmp(msgkeys[i], PERSISTENCE_QUEUE_WATERMARK_KEY) == 0)
 			{
 				;
 			}
@@ -289,13 +437,13 @@ int MQTTPersistence_restorePackets(Clients *c)
 						else
 						{
 							msg = MQTTProtocol_createMessage(publish, &msg, publish->header.bits.qos, publish->header.bits.retain, 1);
-							if (c->persistence->pcontainskey(c->phandle, key) == 0)
+							if (bsearch(&key, msgkeys, nkeys, sizeof(char*), MQTTPersistence_compareKeys))
 								/* PUBLISH Qo2 and PUBREL sent */
 								msg->nextMessageType = PUBCOMP;
 							/* else: PUBLISH QoS1, or PUBLISH QoS2 and PUBREL not sent */
 							/* retry at the first opportunity */
 							memset(&msg->lastTouch, '\0', sizeof(msg->lastTouch));
-							MQTTPersistence_insertInOrder(c->outboundMsgs, msg, msg->len);
+							sent[msgs_sent] = msg;
 							publish->topic = NULL;
 							MQTTPacket_freePublish(publish);
 							msgs_sent++;
@@ -325,7 +473,7 @@ int MQTTPersistence_restorePackets(Clients *c)
 						    rc = MQTTCLIENT_PERSISTENCE_ERROR;
 						    Log(LOG_ERROR, 0, "Error writing %d chars with snprintf", chars);
 						}
-						else if (c->persistence->pcontainskey(c->phandle, key) != 0)
+						else if (!bsearch(&key, msgkeys, nkeys, sizeof(char*), MQTTPersistence_compareKeys))
 							rc = c->persistence->premove(c->phandle, msgkeys[i]);
 						free(pubrel);
 						free(key);
@@ -339,18 +487,29 @@ int MQTTPersistence_restorePackets(Clients *c)
 				free(buffer);
 				buffer = NULL;
 			}
-			if (msgkeys[i])
-			{
-				free(msgkeys[i]);
-				msgkeys[i] = NULL;
-			}
 			i++;
 		}
 	}
 	Log(TRACE_MINIMUM, -1, "%d sent messages and %d received messages restored for client %s\n", 
 		msgs_sent, msgs_rcvd, c->clientID);
-	MQTTPersistence_wrapMsgID(c);
 exit:
+	if (sent)
+	{
+		if (c->outboundMsgs->count == 0)
+		{
+			qsort(sent, msgs_sent, sizeof(Messages*), MQTTPersistence_compareMsgIds);
+			for (i = 0; i < msgs_sent; ++i)
+				ListAppend(c->outboundMsgs, sent[i], sent[i]->len);
+		}
+		else
+		{
+			for (i = 0; i < msgs_sent; ++i)
+				MQTTPersistence_insertInOrder(c->outboundMsgs, sent[i], sent[i]->len);
+		}
+		free(sent);
+	}
+	if (rc == 0)
+		MQTTPersistence_wrapMsgID(c);
 	if (msgkeys)
 	{
 		for (i = 0; i < nkeys; ++i)
@@ -427,6 +586,295 @@ void MQTTPersistence_insertInOrder(List* list, void* content, size_t size)
 }
 
 
+/**
+ * qsort and bsearch callback function for ordering persistence keys
+ */
+static int MQTTPersistence_compareKeys(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/**
+ * qsort callback function for ordering restored messages by message ID
+ */
+static int MQTTPersistence_compareMsgIds(const void* a, const void* b)
+{
+	int ida = (*(Messages* const*)a)->msgid;
+	int idb = (*(Messages* const*)b)->msgid;
+
+	return (ida > idb) - (ida < idb);
+}
+
+
+/**
+ * Puts a record into the persistent store of a client, or queues it for the
+ * writer of the client to commit.
+ * @param c the client as ::Clients.
+ * @param key the key of the record.
+ * @param bufcount the number of buffers making up the record.
+ * @param buffers the buffers.
+ * @param buflens the lengths of the buffers.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+static int MQTTPersistence_put(Clients* c, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	if (c->writer)
+		return MQTTPersistenceWriter_put(c->writer, key, bufcount, buffers, buflens);
+	return c->persistence->pput(c->phandle, key, bufcount, buffers, buflens);
+}
+
+
+/**
+ * Removes a record from the persistent store of a client, or queues the
+ * removal for the writer of the client to commit.
+ * @param c the client as ::Clients.
+ * @param key the key of the record.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+static int MQTTPersistence_removeKey(Clients* c, char* key)
+{
+	if (c->writer)
+		return MQTTPersistenceWriter_remove(c->writer, key);
+	return c->persistence->premove(c->phandle, key);
+}
+
+
+/**
+ * A batch of entries of the message queue of a client, which is persisted as
+ * one record once it is full or nothing more is waiting to be read, and
+ * removed once all its entries are delivered.  The entries restored from the
+ * records of single entries, as they were persisted before batches, are
+ * batches of one.
+ */
+typedef struct
+{
+	char key[PERSISTENCE_MAX_KEY_LENGTH + 1]; /**< the key of the record */
+	unsigned int first;  /**< the sequence number of the first entry, the rest following on */
+	int count;           /**< the number of entries */
+	int remaining;       /**< the entries not yet delivered */
+	int delivered;       /**< the entries delivered in order from the first */
+	int v5;              /**< whether the entries are MQTT V5 messages, with properties */
+	int written;         /**< whether the record has been put to the store */
+} QueueBatch;
+
+/** The queue batches of a client */
+typedef struct MQTTPersistenceBatchesStruct
+{
+	List* batches;       /**< the batches, oldest first */
+	QueueBatch* open;    /**< the last batch, while it is filled and not yet written */
+	char* buffer;        /**< the record of the open batch: the number of entries, then each entry after its length */
+	size_t len;          /**< the bytes of buffer used */
+	size_t size;         /**< the bytes of buffer allocated */
+	int failed;          /**< whether writing the open batch failed, so that it waits for the next entry */
+	int watermark;       /**< whether a watermark record may be in the store */
+	unsigned int marked[2]; /**< the watermark last put to the store */
+	int stale;           /**< whether entries of the oldest batch were delivered since the watermark was put */
+} QueueBatches;
+
+static int openBatches = 0; /**< the clients with an open queue batch, not failed */
+static int staleWatermarks = 0; /**< the clients with a stale watermark */
+
+
+/**
+ * Gets the queue batches of a client, making them when they are first needed.
+ * @param c the client as ::Clients.
+ * @return the batches, or NULL if memory is short
+ */
+static QueueBatches* MQTTPersistence_queueBatches(Clients* c)
+{
+	if (c->qbatches == NULL && (c->qbatches = malloc(sizeof(QueueBatches))) != NULL)
+	{
+		memset(c->qbatches, '\0', sizeof(QueueBatches));
+		if ((c->qbatches->batches = ListInitialize()) == NULL)
+		{
+			free(c->qbatches);
+			c->qbatches = NULL;
+		}
+	}
+	return c->qbatches;
+}
+
+
+/**
+ * Frees the queue batches of a client, leaving its store as it is.
+ * @param c the client as ::Clients.
+ */
+static void MQTTPersistence_freeQueueBatches(Clients* c)
+{
+	QueueBatches* qb = c->qbatches;
+
+	if (qb)
+	{
+		if (qb->open && !qb->failed)
+			--openBatches;
+		if (qb->stale)
+			--staleWatermarks;
+		ListFree(qb->batches);
+		if (qb->buffer)
+			free(qb->buffer);
+		free(qb);
+		c->qbatches = NULL;
+	}
+}
+
+
+/**
+ * Puts how many entries of the oldest queue batch of a client have been delivered to
+ * its store, if that has changed since it was last put, so that they are not restored
+ * and delivered again after the store is next opened, even if it was not closed.
+ * @param c the client as ::Clients.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+static int MQTTPersistence_writeWatermark(Clients* c)
+{
+	QueueBatches* qb = c->qbatches;
+	QueueBatch* oldest = NULL;
+	unsigned int watermark[2];
+	char* buffer = (char*)watermark;
+	int buflen = sizeof(watermark);
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (qb->stale)
+	{
+		qb->stale = 0;
+		--staleWatermarks;
+	}
+	if (qb->batches->first)
+		oldest = (QueueBatch*)qb->batches->first->content;
+	if (oldest == NULL || oldest->delivered == 0)
+		goto exit;
+	watermark[0] = oldest->first;
+	watermark[1] = (unsigned int)oldest->delivered;
+	if (qb->watermark && memcmp(watermark, qb->marked, sizeof(watermark)) == 0)
+		goto exit;
+	if (c->beforeWrite)
+		rc = c->beforeWrite(c->beforeWrite_context, 1, &buffer, &buflen);
+	if (rc == 0 && (rc = MQTTPersistence_put(c, PERSISTENCE_QUEUE_WATERMARK_KEY, 1, &buffer, &buflen)) != 0)
+		Log(LOG_ERROR, 0, "Error %d persisting queue watermark", rc);
+	if (rc == 0)
+		memcpy(qb->marked, watermark, sizeof(watermark));
+	qb->watermark = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Writes the open queue batch of a client to its store, as one record, and the
+ * watermark of its oldest batch if entries of it have been delivered since it was
+ * last written.  If the batch cannot be written, it stays open, so that the acks of
+ * its messages are held, and is tried again with the next entry added to it.
+ * @param c the client as ::Clients.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+int MQTTPersistence_writeQueueBatch(Clients* c)
+{
+	QueueBatches* qb = c->qbatches;
+	QueueBatch* batch = NULL;
+	char* buffer = NULL;
+	int buflen = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (qb == NULL)
+		goto exit;
+	if ((batch = qb->open) != NULL)
+	{
+		memcpy(qb->buffer, &batch->count, sizeof(int));
+		buffer = qb->buffer;
+		buflen = (int)qb->len;
+		if (c->beforeWrite)
+			rc = c->beforeWrite(c->beforeWrite_context, 1, &buffer, &buflen);
+		if (rc == 0 && (rc = MQTTPersistence_put(c, batch->key, 1, &buffer, &buflen)) != 0)
+			Log(LOG_ERROR, 0, "Error %d persisting queue batch %s", rc, batch->key);
+		if (rc != 0)
+		{
+			if (!qb->failed)
+			{	/* not tried again until an entry is added, rather than whenever the client is idle */
+				qb->failed = 1;
+				--openBatches;
+			}
+			goto exit;
+		}
+		batch->written = 1;
+		qb->open = NULL;
+		qb->len = 0;
+		if (qb->failed)
+			qb->failed = 0;
+		else
+			--openBatches;
+	}
+	if (batch || qb->stale)
+		rc = MQTTPersistence_writeWatermark(c);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Writes the open queue batch of a client when its store is closed, and how many
+ * entries of its oldest batch were delivered, so that they are not restored again.
+ * @param c the client as ::Clients.
+ */
+static void MQTTPersistence_closeQueueBatches(Clients* c)
+{
+	QueueBatches* qb = c->qbatches;
+	QueueBatch* oldest = NULL;
+
+	FUNC_ENTRY;
+	if (qb == NULL)
+		goto exit;
+	MQTTPersistence_writeQueueBatch(c);
+	if (qb->batches->first)
+		oldest = (QueueBatch*)qb->batches->first->content;
+	if (oldest && oldest->delivered > 0)
+		MQTTPersistence_writeWatermark(c);
+	else if (qb->watermark)
+		MQTTPersistence_removeKey(c, PERSISTENCE_QUEUE_WATERMARK_KEY);
+	MQTTPersistence_freeQueueBatches(c);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Whether a client has received messages in a queue batch which is not yet written,
+ * so that acknowledging them must wait.
+ * @param c the client as ::Clients.
+ * @return boolean
+ */
+int MQTTPersistence_queueBatchOpen(Clients* c)
+{
+	return c->qbatches != NULL && c->qbatches->open != NULL;
+}
+
+
+/**
+ * Whether any client has an open queue batch, which is to be written as soon as nothing
+ * more is waiting to be read.
+ * @return boolean
+ */
+int MQTTPersistence_queueBatchesOpen(void)
+{
+	return openBatches > 0;
+}
+
+
+/**
+ * Whether any client has an open queue batch or a stale watermark, to be written
+ * when nothing is waiting to be read.
+ * @return boolean
+ */
+int MQTTPersistence_queueBatchesPending(void)
+{
+	return openBatches > 0 || staleWatermarks > 0;
+}
+
+
 /**
  * Adds a record to the persistent store. This function must not be called for QoS0
  * messages.
@@ -520,7 +968,7 @@ int MQTTPersistence_putPacket(SOCKET socket, char* buf0, size_t buf0len, int cou
 			rc = client->beforeWrite(client->beforeWrite_context, nbufs, bufs, lens);
 
 		if (rc == 0)
-			rc = client->persistence->pput(client->phandle, key, nbufs, bufs, lens);
+			rc = MQTTPersistence_put(client, key, nbufs, bufs, lens);
 
 		free(key);
 		free(lens);
@@ -565,21 +1013,21 @@ int MQTTPersistence_remove(Clients* c, char *type, int qos, int msgId)
 				rc = MQTTCLIENT_PERSISTENCE_ERROR;
 			else
 			{
-				rc = c->persistence->premove(c->phandle, key);
+				rc = MQTTPersistence_removeKey(c, key);
 				if ((chars = snprintf(key, keysize, "%s%d", PERSISTENCE_V5_PUBREL, msgId)) >= keysize)
 					rc = MQTTCLIENT_PERSISTENCE_ERROR;
 				else
 				{
-					rc += c->persistence->premove(c->phandle, key);
+					rc += MQTTPersistence_removeKey(c, key);
 					if ((chars = snprintf(key, keysize, "%s%d", PERSISTENCE_PUBLISH_SENT, msgId)) >= keysize)
 						rc = MQTTCLIENT_PERSISTENCE_ERROR;
 					else
 					{
-						rc += c->persistence->premove(c->phandle, key);
+						rc += MQTTPersistence_removeKey(c, key);
 						if ((chars = snprintf(key, keysize, "%s%d", PERSISTENCE_PUBREL, msgId)) >= keysize)
 							rc = MQTTCLIENT_PERSISTENCE_ERROR;
 						else
-							rc += c->persistence->premove(c->phandle, key);
+							rc += MQTTPersistence_removeKey(c, key);
 					}
 				}
 			}
@@ -591,11 +1039,11 @@ int MQTTPersistence_remove(Clients* c, char *type, int qos, int msgId)
 				rc = MQTTCLIENT_PERSISTENCE_ERROR;
 			else
 			{
-				rc = c->persistence->premove(c->phandle, key);
+				rc = MQTTPersistence_removeKey(c, key);
 				if ((chars = snprintf(key, keysize, "%s%d", PERSISTENCE_PUBLISH_RECEIVED, msgId)) >= keysize)
 					rc = MQTTCLIENT_PERSISTENCE_ERROR;
 				else
-					rc += c->persistence->premove(c->phandle, key);
+					rc += MQTTPersistence_removeKey(c, key);
 			}
 		}
 		if (rc == MQTTCLIENT_PERSISTENCE_ERROR)
@@ -655,75 +1103,191 @@ void MQTTPersistence_wrapMsgID(Clients *client)
 
 
 #if !defined(NO_PERSISTENCE)
+/**
+ * Removes a delivered entry of the message queue from its batch, and the batch
+ * from the store once all its entries are delivered.
+ * @param client the client as ::Clients.
+ * @param qe the queue entry.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
 int MQTTPersistence_unpersistQueueEntry(Clients* client, MQTTPersistence_qEntry* qe)
 {
+	QueueBatches* qb = client->qbatches;
+	QueueBatch* batch = NULL;
+	ListElement* current = NULL;
 	int rc = 0;
-#if defined(_WIN32) || defined(_WIN64)
-#define KEYSIZE PERSISTENCE_MAX_KEY_LENGTH + 1
-#else
-	const size_t KEYSIZE = PERSISTENCE_MAX_KEY_LENGTH + 1;
-#endif
-	char key[KEYSIZE];
-	int chars = 0;
-	
+
 	FUNC_ENTRY;
-	if (client->MQTTVersion >= MQTTVERSION_5)
-		chars = snprintf(key, KEYSIZE, "%s%u", PERSISTENCE_V5_QUEUE_KEY, qe->seqno);
-	else
-		chars = snprintf(key, KEYSIZE, "%s%u", PERSISTENCE_QUEUE_KEY, qe->seqno);
-	if (chars >= KEYSIZE)
+	/* the entries are delivered in order, so their batch is nearly always the oldest */
+	while (qb && ListNextElement(qb->batches, &current))
+	{
+		QueueBatch* b = (QueueBatch*)current->content;
+
+		if (qe->seqno - b->first < (unsigned int)b->count)
+		{
+			batch = b;
+			break;
+		}
+	}
+	if (batch == NULL)
 	{
-		Log(LOG_ERROR, 0, "Error writing %d chars with snprintf", chars);
+		Log(LOG_ERROR, 0, "No queue batch for qEntry %u", qe->seqno);
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if (qe->seqno == batch->first + batch->delivered)
+	{
+		++(batch->delivered);
+		if (!qb->stale && batch->remaining > 1 && batch == (QueueBatch*)qb->batches->first->content)
+		{	/* put with the next batch written, or when the client is next idle */
+			qb->stale = 1;
+			++staleWatermarks;
+		}
 	}
-	else if ((rc = client->persistence->premove(client->phandle, key)) != 0)
-		Log(LOG_ERROR, 0, "Error %d removing qEntry from persistence", rc);
+	if (--(batch->remaining) > 0)
+		goto exit;
+	if (batch == qb->open)
+	{	/* delivered before it was written, so it never is */
+		qb->open = NULL;
+		qb->len = 0;
+		if (qb->failed)
+			qb->failed = 0;
+		else
+			--openBatches;
+	}
+	else if ((rc = MQTTPersistence_removeKey(client, batch->key)) != 0)
+		Log(LOG_ERROR, 0, "Error %d removing queue batch %s from persistence", rc, batch->key);
+	ListRemove(qb->batches, batch);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
+/**
+ * Adds an entry to the open queue batch of a client, opening one if need be.
+ * @param c the client as ::Clients.
+ * @param qb the queue batches of the client.
+ * @param seqno the sequence number of the entry.
+ * @param bufcount the number of buffers making up the entry.
+ * @param buffers the buffers.
+ * @param buflens the lengths of the buffers.
+ * @return 0 if success, #PAHO_MEMORY_ERROR otherwise.
+ */
+static int MQTTPersistence_addToQueueBatch(Clients* c, QueueBatches* qb, unsigned int seqno,
+		int bufcount, void* buffers[], int buflens[])
+{
+	QueueBatch* batch = qb->open;
+	size_t needed = (batch ? qb->len : sizeof(int)) + sizeof(int);
+	int entrylen = 0;
+	int i;
+	int rc = 0;
+
+	for (i = 0; i < bufcount; ++i)
+		entrylen += buflens[i];
+	needed += entrylen;
+	if (needed > qb->size)
+	{
+		size_t size = (qb->size > 0) ? qb->size : 4096;
+		char* newbuf = NULL;
+
+		while (size < needed)
+			size *= 2;
+		if ((newbuf = (qb->buffer) ? realloc(qb->buffer, size) : malloc(size)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		qb->buffer = newbuf;
+		qb->size = size;
+	}
+	if (batch && qb->failed)
+	{	/* tried again when it is full or the client is idle */
+		qb->failed = 0;
+		++openBatches;
+	}
+	if (batch == NULL)
+	{
+		if ((batch = malloc(sizeof(QueueBatch))) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		memset(batch, '\0', sizeof(QueueBatch));
+		batch->first = seqno;
+		batch->v5 = (c->MQTTVersion >= MQTTVERSION_5);
+		snprintf(batch->key, sizeof(batch->key), "%s%u",
+				batch->v5 ? PERSISTENCE_V5_QUEUE_BATCH_KEY : PERSISTENCE_QUEUE_BATCH_KEY, seqno);
+		ListAppend(qb->batches, batch, sizeof(QueueBatch));
+		qb->open = batch;
+		qb->len = sizeof(int); /* the number of entries, filled in when it is written */
+		++openBatches;
+	}
+	memcpy(qb->buffer + qb->len, &entrylen, sizeof(int));
+	qb->len += sizeof(int);
+	for (i = 0; i < bufcount; ++i)
+	{
+		memcpy(qb->buffer + qb->len, buffers[i], buflens[i]);
+		qb->len += buflens[i];
+	}
+	++(batch->count);
+	++(batch->remaining);
+exit:
+	return rc;
+}
+
+
 #define MAX_NO_OF_BUFFERS 9
+/**
+ * Persists an entry of the message queue in the open queue batch of the client,
+ * which is written when it is full, or by ::MQTTPersistence_writeQueueBatch.
+ * @param aclient the client as ::Clients.
+ * @param qe the queue entry.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
 int MQTTPersistence_persistQueueEntry(Clients* aclient, MQTTPersistence_qEntry* qe)
 {
 	int rc = 0;
 	int bufindex = 0;
-#if !defined(_WIN32) && !defined(_WIN64)
-	const size_t KEYSIZE = PERSISTENCE_MAX_KEY_LENGTH + 1;
-#endif
-	char key[KEYSIZE];
-	int chars = 0;
 	int lens[MAX_NO_OF_BUFFERS];
 	void* bufs[MAX_NO_OF_BUFFERS];
 	int props_allocated = 0;
-		
+	QueueBatches* qb = NULL;
+
 	FUNC_ENTRY;
+	if ((qb = MQTTPersistence_queueBatches(aclient)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+
 	bufs[bufindex] = &qe->msg->payloadlen;
 	lens[bufindex++] = sizeof(qe->msg->payloadlen);
-				
+
 	bufs[bufindex] = qe->msg->payload;
 	lens[bufindex++] = qe->msg->payloadlen;
-		
+
 	bufs[bufindex] = &qe->msg->qos;
 	lens[bufindex++] = sizeof(qe->msg->qos);
-		
+
 	bufs[bufindex] = &qe->msg->retained;
 	lens[bufindex++] = sizeof(qe->msg->retained);
-		
+
 	bufs[bufindex] = &qe->msg->dup;
 	lens[bufindex++] = sizeof(qe->msg->dup);
-				
+
 	bufs[bufindex] = &qe->msg->msgid;
 	lens[bufindex++] = sizeof(qe->msg->msgid);
-						
+
 	bufs[bufindex] = qe->topicName;
 	lens[bufindex++] = (int)strlen(qe->topicName) + 1;
-				
+
 	bufs[bufindex] = &qe->topicLen;
 	lens[bufindex++] = sizeof(qe->topicLen);
 
 	if (++aclient->qentry_seqno == PERSISTENCE_SEQNO_LIMIT)
 		aclient->qentry_seqno = 0;
+	qe->seqno = aclient->qentry_seqno;
 
 	if (aclient->MQTTVersion >= MQTTVERSION_5)  		/* persist properties */
 	{
@@ -745,24 +1309,17 @@ int MQTTPersistence_persistQueueEntry(Clients* aclient, MQTTPersistence_qEntry*
 		props_allocated = bufindex;
 		rc = MQTTProperties_write(&ptr, props);
 		lens[bufindex++] = temp_len;
-
-		chars = snprintf(key, KEYSIZE, "%s%u", PERSISTENCE_V5_QUEUE_KEY, aclient->qentry_seqno);
 	}
-	else
-		chars = snprintf(key, KEYSIZE, "%s%u", PERSISTENCE_QUEUE_KEY, aclient->qentry_seqno);
-
-	if (chars >= KEYSIZE)
-		rc = MQTTCLIENT_PERSISTENCE_ERROR;
-	else
-	{
-		qe->seqno = aclient->qentry_seqno;
 
-		if (aclient->beforeWrite)
-			rc = aclient->beforeWrite(aclient->beforeWrite_context, bufindex, (char**)bufs, lens);
-
-		if (rc == 0 && (rc = aclient->persistence->pput(aclient->phandle, key, bufindex, (char**)bufs, lens)) != 0)
-			Log(LOG_ERROR, 0, "Error persisting queue entry, rc %d", rc);
-	}
+	/* the entries of a batch have consecutive sequence numbers, and are of one MQTT version */
+	if (qb->open && (qe->seqno != qb->open->first + qb->open->count ||
+			qb->open->v5 != (aclient->MQTTVersion >= MQTTVERSION_5)) &&
+			(rc = MQTTPersistence_writeQueueBatch(aclient)) != 0 && qb->open)
+		Log(LOG_ERROR, 0, "Error persisting queue entry, rc %d", rc); /* the acks stay held */
+	else if ((rc = MQTTPersistence_addToQueueBatch(aclient, qb, qe->seqno, bufindex, bufs, lens)) != 0)
+		Log(LOG_ERROR, 0, "Error persisting queue entry, rc %d", rc);
+	else if (qb->open->count >= PERSISTENCE_QUEUE_BATCH_ENTRIES || qb->len >= PERSISTENCE_QUEUE_BATCH_BYTES)
+		rc = MQTTPersistence_writeQueueBatch(aclient);
 	if (props_allocated != 0)
 		free(bufs[props_allocated]);
 
@@ -779,28 +1336,28 @@ static MQTTPersistence_qEntry* MQTTPersistence_restoreQueueEntry(char* buffer, s
 	int data_size;
 	
 	FUNC_ENTRY;
-	if ((qe = malloc(sizeof(MQTTPersistence_qEntry))) == NULL)
+	if ((qe = MemoryPool_alloc(POOL_QUEUE_ENTRY)) == NULL)
 		goto exit;
 	memset(qe, '\0', sizeof(MQTTPersistence_qEntry));
 	
-	if ((qe->msg = malloc(sizeof(MQTTPersistence_message))) == NULL)
+	if ((qe->msg = MemoryPool_alloc(POOL_CLIENT_MESSAGE)) == NULL)
 	{
-		free(qe);
+		MemoryPool_free(POOL_QUEUE_ENTRY, qe);
 		qe = NULL;
 		goto exit;
 	}
-	memset(qe->msg, '\0', sizeof(MQTTPersistence_message));
+	memset(qe->msg, '\0', sizeof(MQTTPersistence_queuedMessage));
 	
 	qe->msg->struct_version = 1;
 
-	qe->msg->payloadlen = *(int*)ptr;
+	qe->payloadlen = qe->msg->payloadlen = *(int*)ptr;
 	ptr += sizeof(int);
 	
 	data_size = qe->msg->payloadlen;
 	if ((qe->msg->payload = malloc(data_size)) == NULL)
 	{
-		free(qe->msg);
-		free(qe);
+		MemoryPool_free(POOL_CLIENT_MESSAGE, qe->msg);
+		MemoryPool_free(POOL_QUEUE_ENTRY, qe);
 		qe = NULL;
 		goto exit;
 	}
@@ -823,8 +1380,8 @@ static MQTTPersistence_qEntry* MQTTPersistence_restoreQueueEntry(char* buffer, s
 	if ((qe->topicName = malloc(data_size)) == NULL)
 	{
 		free(qe->msg->payload);
-		free(qe->msg);
-		free(qe);
+		MemoryPool_free(POOL_CLIENT_MESSAGE, qe->msg);
+		MemoryPool_free(POOL_QUEUE_ENTRY, qe);
 		qe = NULL;
 		goto exit;
 	}
@@ -860,6 +1417,166 @@ static void MQTTPersistence_insertInSeqOrder(List* list, MQTTPersistence_qEntry*
 }
 
 
+/**
+ * qsort callback function for ordering restored queue entries by sequence number
+ */
+static int MQTTPersistence_compareSeqnos(const void* a, const void* b)
+{
+	unsigned int sa = (*(MQTTPersistence_qEntry* const*)a)->seqno;
+	unsigned int sb = (*(MQTTPersistence_qEntry* const*)b)->seqno;
+
+	return (sa > sb) - (sa < sb);
+}
+
+
+/**
+ * qsort callback function for ordering restored queue batches by their first sequence number
+ */
+static int MQTTPersistence_compareBatches(const void* a, const void* b)
+{
+	unsigned int fa = (*(QueueBatch* const*)a)->first;
+	unsigned int fb = (*(QueueBatch* const*)b)->first;
+
+	return (fa > fb) - (fa < fb);
+}
+
+
+/**
+ * Reads the number of entries delivered from the oldest queue batch when the store was
+ * last closed.
+ * @param c the client as ::Clients.
+ * @param watermark set to the first sequence number of that batch and the number of its
+ * entries delivered, or left as it is if there is no watermark record.
+ */
+static void MQTTPersistence_restoreWatermark(Clients* c, unsigned int watermark[2])
+{
+	char* buffer = NULL;
+	int buflen = 0;
+
+	if (c->persistence->pcontainskey(c->phandle, PERSISTENCE_QUEUE_WATERMARK_KEY) == 0 &&
+		c->persistence->pget(c->phandle, PERSISTENCE_QUEUE_WATERMARK_KEY, &buffer, &buflen) == 0 &&
+		(c->afterRead == NULL || c->afterRead(c->afterRead_context, &buffer, &buflen) == 0))
+	{
+		if (buflen == 2 * sizeof(unsigned int))
+			memcpy(watermark, buffer, buflen);
+		c->qbatches->watermark = 1;
+	}
+	if (buffer)
+		free(buffer);
+}
+
+
+/**
+ * Restores the entries of a record of the message queue, a batch or, as persisted before
+ * batches, a single entry, and adds it to the queue batches of the client.
+ * @param c the client as ::Clients.
+ * @param key the key of the record.
+ * @param buffer the record.
+ * @param buflen the length of the record.
+ * @param watermark the oldest queue batch when the store was last closed, and the entries
+ * delivered from it.
+ * @param entries the entries restored, to which those of the record are added.
+ * @param nentries the number of entries restored.
+ * @param size the number of entries there is room for.
+ * @return 0 if success, #PAHO_MEMORY_ERROR otherwise.
+ */
+static int MQTTPersistence_restoreQueueBatch(Clients* c, char* key, char* buffer, int buflen,
+		unsigned int watermark[2], MQTTPersistence_qEntry*** entries, int* nentries, int* size)
+{
+	int batched = strncmp(key, PERSISTENCE_QUEUE_BATCH_KEY, strlen(PERSISTENCE_QUEUE_BATCH_KEY)) == 0 ||
+		strncmp(key, PERSISTENCE_V5_QUEUE_BATCH_KEY, strlen(PERSISTENCE_V5_QUEUE_BATCH_KEY)) == 0;
+	int MQTTVersion = (strncmp(key, PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0 ||
+		strncmp(key, PERSISTENCE_V5_QUEUE_BATCH_KEY, strlen(PERSISTENCE_V5_QUEUE_BATCH_KEY)) == 0)
+		? MQTTVERSION_5 : MQTTVERSION_3_1_1;
+	QueueBatch* batch = NULL;
+	char* ptr = buffer;
+	char* end = buffer + buflen;
+	int count = 1;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((batch = malloc(sizeof(QueueBatch))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(batch, '\0', sizeof(QueueBatch));
+	strncpy(batch->key, key, sizeof(batch->key) - 1);
+	batch->first = (unsigned int)atoi(strchr(key, '-') + 1); /* key format is tag'-'seqno */
+	batch->v5 = (MQTTVersion >= MQTTVERSION_5);
+	batch->written = 1;
+	if (batched)
+	{
+		count = 0;
+		if (buflen >= (int)sizeof(int))
+		{
+			memcpy(&count, ptr, sizeof(int));
+			ptr += sizeof(int);
+		}
+		if (watermark[1] > 0 && watermark[0] == batch->first)
+			batch->delivered = ((int)watermark[1] < count) ? (int)watermark[1] : count;
+	}
+	for (i = 0; rc == 0 && i < count; ++i)
+	{
+		int len = (int)(end - ptr);
+		MQTTPersistence_qEntry* qe = NULL;
+
+		if (batched)
+		{
+			if (end - ptr < (int)sizeof(int))
+				break; /* cut short */
+			memcpy(&len, ptr, sizeof(int));
+			ptr += sizeof(int);
+			if (len < 0 || len > end - ptr)
+				break;
+		}
+		if (i >= batch->delivered && *nentries == *size)
+		{
+			int newsize = (*size > 0) ? *size * 2 : 1024;
+			MQTTPersistence_qEntry** newentries = (*entries) ?
+				realloc(*entries, newsize * sizeof(MQTTPersistence_qEntry*)) :
+				malloc(newsize * sizeof(MQTTPersistence_qEntry*));
+
+			if (newentries == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				break;
+			}
+			*entries = newentries;
+			*size = newsize;
+		}
+		if (i < batch->delivered)
+			; /* delivered before the store was last closed */
+		else if ((qe = MQTTPersistence_restoreQueueEntry(ptr, len, MQTTVersion)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			qe->seqno = batch->first + i;
+			(*entries)[(*nentries)++] = qe;
+			++(c->queuedMessages);
+			c->queuedBytes += qe->payloadlen;
+			++(batch->remaining);
+		}
+		ptr += len;
+	}
+	batch->count = i;
+	if (batch->count > 0)
+		c->qentry_seqno = max(c->qentry_seqno, batch->first + batch->count - 1);
+	if (batch->remaining > 0)
+		ListAppend(c->qbatches->batches, batch, sizeof(QueueBatch));
+	else
+	{
+		if (rc == 0)
+			MQTTPersistence_removeKey(c, key); /* all delivered, or nothing to restore */
+		free(batch);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Restores a queue of messages from persistence to memory
  * @param c the client as ::Clients - the client object to restore the messages to
@@ -872,49 +1589,123 @@ int MQTTPersistence_restoreMessageQueue(Clients* c)
 	int nkeys;
 	int i = 0;
 	int entries_restored = 0;
+	int entries_size = 0;
+	MQTTPersistence_qEntry** entries = NULL;
+	unsigned int watermark[2] = {0, 0};
 
 	FUNC_ENTRY;
-	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
+	if (c->persistence == NULL)
+		goto exit;
+	if (MQTTPersistence_queueBatches(c) == NULL)
 	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	if ((rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
+	{
+		MQTTPersistence_restoreWatermark(c, watermark);
 		while (rc == 0 && i < nkeys)
 		{
 			char *buffer = NULL;
 			int buflen;
-					
+
 			if (strncmp(msgkeys[i], PERSISTENCE_QUEUE_KEY, strlen(PERSISTENCE_QUEUE_KEY)) != 0 &&
-				strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) != 0)
+				strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) != 0 &&
+				strncmp(msgkeys[i], PERSISTENCE_QUEUE_BATCH_KEY, strlen(PERSISTENCE_QUEUE_BATCH_KEY)) != 0 &&
+				strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_BATCH_KEY, strlen(PERSISTENCE_V5_QUEUE_BATCH_KEY)) != 0)
 			{
-				; /* ignore if not a queue entry key */
+				; /* ignore if not a queue entry or batch key */
 			}
 			else if ((rc = c->persistence->pget(c->phandle, msgkeys[i], &buffer, &buflen)) == 0 &&
 				(c->afterRead == NULL || (rc = c->afterRead(c->afterRead_context, &buffer, &buflen)) == 0))
-			{
-				int MQTTVersion =
-					(strncmp(msgkeys[i], PERSISTENCE_V5_QUEUE_KEY, strlen(PERSISTENCE_V5_QUEUE_KEY)) == 0)
-					? MQTTVERSION_5 : MQTTVERSION_3_1_1;
-				MQTTPersistence_qEntry* qe = MQTTPersistence_restoreQueueEntry(buffer, buflen, MQTTVersion);
-				
-				if (qe)
-				{	
-					qe->seqno = atoi(strchr(msgkeys[i], '-')+1); /* key format is tag'-'seqno */
-					MQTTPersistence_insertInSeqOrder(c->messageQueue, qe, sizeof(MQTTPersistence_qEntry));
-					c->qentry_seqno = max(c->qentry_seqno, qe->seqno);
-					entries_restored++;
-				}
-				if (buffer)
-					free(buffer);
-			}
+				rc = MQTTPersistence_restoreQueueBatch(c, msgkeys[i], buffer, buflen, watermark,
+						&entries, &entries_restored, &entries_size);
+			if (buffer)
+				free(buffer);
 			if (msgkeys[i])
 			{
 				free(msgkeys[i]);
 			}
 			i++;
 		}
+		while (i < nkeys)
+			free(msgkeys[i++]);
 		if (msgkeys != NULL)
 			free(msgkeys);
 	}
+	if (c->qbatches->batches->count > 1)
+	{	/* the batches are kept oldest first, as the entries are delivered */
+		QueueBatch** batches = NULL;
+		int nbatches = c->qbatches->batches->count;
+
+		if ((batches = malloc(nbatches * sizeof(QueueBatch*))) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			for (i = 0; i < nbatches; ++i)
+				batches[i] = ListDetachHead(c->qbatches->batches);
+			ListEmpty(c->qbatches->batches); /* resets the size */
+			qsort(batches, nbatches, sizeof(QueueBatch*), MQTTPersistence_compareBatches);
+			for (i = 0; i < nbatches; ++i)
+				ListAppend(c->qbatches->batches, batches[i], sizeof(QueueBatch));
+			free(batches);
+		}
+	}
+	if (entries)
+	{
+		if (c->messageQueue->count == 0)
+		{
+			qsort(entries, entries_restored, sizeof(MQTTPersistence_qEntry*), MQTTPersistence_compareSeqnos);
+			for (i = 0; i < entries_restored; ++i)
+				ListAppend(c->messageQueue, entries[i], sizeof(MQTTPersistence_qEntry));
+		}
+		else
+		{
+			for (i = 0; i < entries_restored; ++i)
+				MQTTPersistence_insertInSeqOrder(c->messageQueue, entries[i], sizeof(MQTTPersistence_qEntry));
+		}
+		free(entries);
+	}
 	Log(TRACE_MINIMUM, -1, "%d queued messages restored for client %s", entries_restored, c->clientID);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
+
+
+static unsigned int crcTable[256];
+static volatile int crcTableMade = 0;
+
+/**
+ * Calculates the CRC-32 (ISO 3309) of a buffer, as the file system persistences
+ * check their records with.
+ * @param crc the CRC of the buffers before this one, 0 for the first
+ * @param buf the buffer
+ * @param len the length of the buffer
+ * @return the CRC of the buffers so far
+ */
+unsigned int MQTTPersistence_crc32(unsigned int crc, const char* buf, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)buf;
+
+	if (!crcTableMade)
+	{	/* threads which get here together make the same table */
+		unsigned int n;
+
+		for (n = 0; n < 256; ++n)
+		{
+			unsigned int c = n;
+			int k;
+
+			for (k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+			crcTable[n] = c;
+		}
+		crcTableMade = 1;
+	}
+	crc ^= 0xFFFFFFFFU;
+	while (len-- > 0)
+		crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFFU;
+}
 #endif
@@ -49,6 +49,16 @@
 #define PERSISTENCE_QUEUE_KEY "q-"
 /** Stem of the key for an MQTT V5 incoming message queue */
 #define PERSISTENCE_V5_QUEUE_KEY "q5-"
+/** Stem of the key for a batch of the client incoming message queue */
+#define PERSISTENCE_QUEUE_BATCH_KEY "qb-"
+/** Stem of the key for a batch of the MQTT V5 incoming message queue */
+#define PERSISTENCE_V5_QUEUE_BATCH_KEY "qb5-"
+/** Key of the number of messages delivered from the oldest batch of the incoming message queue */
+#define PERSISTENCE_QUEUE_WATERMARK_KEY "qw"
+/** The most entries written in one batch of the incoming message queue */
+#define PERSISTENCE_QUEUE_BATCH_ENTRIES 256
+/** The bytes at which a batch of the incoming message queue is written, however few its entries */
+#define PERSISTENCE_QUEUE_BATCH_BYTES 65536
 /** Maximum length of a stem for a persistence key */
 #define PERSISTENCE_MAX_STEM_LENGTH 4
 /** Maximum allowed length of a persistence key */
@@ -79,19 +89,38 @@ typedef struct
 	int dup;
 	int msgid;
 	MQTTProperties properties;
+	int streamed;
 } MQTTPersistence_message;
 
+/**
+ * The messages handed to the application are allocated with room for the
+ * received packet their topic and payload point into.
+ */
+typedef struct
+{
+	MQTTPersistence_message msg;
+	PacketBuffer* buffer; /**< the received packet, or NULL if the topic and payload are allocated on their own */
+} MQTTPersistence_queuedMessage;
+
 typedef struct
 {
 	MQTTPersistence_message* msg;
 	char* topicName;
 	int topicLen;
-	unsigned int seqno; /* only used on restore */
+	unsigned int seqno; /* the entry in the queue batches of the client */
+	int payloadlen; /* counted in queuedBytes until the message is delivered */
+	ListElement link; /* the element in messageQueue */
 } MQTTPersistence_qEntry;
 
 int MQTTPersistence_unpersistQueueEntry(Clients* client, MQTTPersistence_qEntry* qe);
 int MQTTPersistence_persistQueueEntry(Clients* aclient, MQTTPersistence_qEntry* qe);
 int MQTTPersistence_restoreMessageQueue(Clients* c);
+int MQTTPersistence_writeQueueBatch(Clients* c);
+int MQTTPersistence_queueBatchOpen(Clients* c);
+int MQTTPersistence_queueBatchesOpen(void);
+int MQTTPersistence_queueBatchesPending(void);
+
+unsigned int MQTTPersistence_crc32(unsigned int crc, const char* buf, size_t len);
 #ifdef __cplusplus
      }
 #endif
@@ -42,30 +42,177 @@
 	#define strtok_r strtok_s
 	#define snprintf _snprintf
 	int keysWin32(char *, char ***, int *);
-	int clearWin32(char *);
-	int containskeyWin32(char *, char *);
 #else
 	#include <sys/stat.h>
 	#include <dirent.h>
 	#include <unistd.h>
 	int keysUnix(char *, char ***, int *);
-	int clearUnix(char *);
-	int containskeyUnix(char *, char *);
 #endif
 
 #include "MQTTClientPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "Thread.h"
+#include "Tree.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
-/** Create persistence directory for the client: context/clientID-serverURI.
- *  See ::Persistence_open
+/** The handle of an open persistence directory, with the keys of the files in it */
+typedef struct
+{
+	char* clientDir;      /**< the directory, made by ::pstmkclientdir */
+	Tree* keys;           /**< the key of each file, as a string, read from the directory once at open */
+	mutex_type mutex;     /**< protects keys */
+} PersistenceDir;
+
+
+/**
+ * Tree callback function for comparing keys, which are the contents of the index
+ */
+static int pstkeycompare(void* a, void* b, int content)
+{
+	return strcmp((char*)a, (char*)b);
+}
+
+
+/**
+ * Adds a key to the index of a directory, if it is not there.
+ * @return 0 if success, #PAHO_MEMORY_ERROR otherwise
+ */
+static int pstindexadd(PersistenceDir* store, char* key)
+{
+	int rc = 0;
+
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->keys, key) == NULL)
+	{
+		size_t size = strlen(key) + 1;
+		char* copy = malloc(size);
+
+		if (copy == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			strcpy(copy, key);
+			TreeAdd(store->keys, copy, size);
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	return rc;
+}
+
+
+/**
+ * Removes a key from the index of a directory, if it is there.
+ */
+static void pstindexremove(PersistenceDir* store, char* key)
+{
+	char* copy = NULL;
+
+	Paho_thread_lock_mutex(store->mutex);
+	if ((copy = TreeRemoveKey(store->keys, key)) != NULL)
+		free(copy);
+	Paho_thread_unlock_mutex(store->mutex);
+}
+
+
+/**
+ * Frees the handle of a directory and its index.
  */
+static void pstfreedir(PersistenceDir* store)
+{
+	if (store->keys)
+	{
+		Node* node = NULL;
 
+		while ((node = TreeNextElement(store->keys, NULL)) != NULL)
+		{
+			void* copy = TreeRemove(store->keys, node->content);
+
+			if (copy)
+				free(copy);
+		}
+		TreeFree(store->keys);
+	}
+	if (store->mutex)
+		Paho_thread_destroy_mutex(store->mutex);
+	if (store->clientDir)
+		free(store->clientDir);
+	free(store);
+}
+
+
+/** Create persistence directory for the client: context/clientID-serverURI,
+ *  and read the keys of the files already in it into an index in memory,
+ *  which the other functions keep up to date, so that the directory is only
+ *  listed once.
+ *  See ::Persistence_open
+ */
 int pstopen(void **handle, const char* clientID, const char* serverURI, void* context)
 {
 	int rc = 0;
-	char *dataDir = context;
+	PersistenceDir *store = NULL;
+	char **keys = NULL;
+	int nkeys = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(PersistenceDir))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(PersistenceDir));
+	if ((rc = pstmkclientdir(&store->clientDir, clientID, serverURI, context)) != 0)
+		goto error;
+	if ((store->keys = TreeInitialize(pstkeycompare)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	store->mutex = Paho_thread_create_mutex(&rc);
+	if (rc != 0)
+		goto error;
+#if defined(_WIN32) || defined(_WIN64)
+	rc = keysWin32(store->clientDir, &keys, &nkeys);
+#else
+	rc = keysUnix(store->clientDir, &keys, &nkeys);
+#endif
+	for (i = 0; i < nkeys; ++i)
+	{	/* the index takes the strings */
+		if (rc == 0)
+			TreeAdd(store->keys, keys[i], strlen(keys[i]) + 1);
+		else
+			free(keys[i]);
+	}
+	if (keys)
+		free(keys);
+	if (rc != 0)
+		goto error;
+	*handle = store;
+	goto exit;
+error:
+	pstfreedir(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the name of the directory of an open persistence, for the
+ *  persistences which keep files of their own next to it.
+ */
+const char* pstclientdir(void* handle)
+{
+	return ((PersistenceDir*)handle)->clientDir;
+}
+
+/** Create persistence directory for the client: dataDir/clientID-serverURI.
+ *  @param handle set to the name of the directory, which the caller must free
+ *  @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int pstmkclientdir(char **handle, const char* clientID, const char* serverURI, const char* dataDir)
+{
+	int rc = 0;
 	char *clientDir;
 	char *pToken = NULL;
 	char *save_ptr = NULL;
@@ -148,7 +295,10 @@ int pstopen(void **handle, const char* clientID, const char* serverURI, void* co
 		pToken = strtok_r( NULL, "\\/", &save_ptr );
 	}
 
-	*handle = clientDir;
+	if (rc == 0)
+		*handle = clientDir;
+	else
+		free(clientDir);
 
 	free(pTokDirName);
 	free(pCrtDirName);
@@ -195,7 +345,8 @@ int pstmkdir( char *pPathname )
 int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
 {
 	int rc = 0;
-	char *clientDir = handle;
+	PersistenceDir *store = handle;
+	char *clientDir = NULL;
 	char *file;
 	FILE *fp;
 	size_t bytesWritten = 0,
@@ -204,11 +355,12 @@ int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]
 	size_t alloclen = 0;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
+	if (store == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
+	clientDir = store->clientDir;
 
 	/* consider '/' + '\0' */
 	alloclen = strlen(clientDir) + strlen(key) + strlen(MESSAGE_FILENAME_EXTENSION) + 2;
@@ -242,6 +394,8 @@ int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]
 		pstremove(handle, key);
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 	}
+	else if (rc == 0)
+		rc = pstindexadd(store, key);
 
 free_exit:
 	free(file);
@@ -258,7 +412,8 @@ int pstget(void* handle, char* key, char** buffer, int* buflen)
 {
 	int rc = 0;
 	FILE *fp = NULL;
-	char *clientDir = handle;
+	PersistenceDir *store = handle;
+	char *clientDir = NULL;
 	char *filename = NULL;
 	char *buf = NULL;
 	unsigned long fileLen = 0;
@@ -266,11 +421,12 @@ int pstget(void* handle, char* key, char** buffer, int* buflen)
 	size_t alloclen = 0;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
+	if (store == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
+	clientDir = store->clientDir;
 
 	/* consider '/' + '\0' */
 	alloclen = strlen(clientDir) + strlen(key) + strlen(MESSAGE_FILENAME_EXTENSION) + 2;
@@ -291,6 +447,7 @@ int pstget(void* handle, char* key, char** buffer, int* buflen)
 	free(filename);
 	if (fp != NULL)
 	{
+		setvbuf(fp, NULL, _IONBF, 0); /* the file is read whole, straight into buf */
 		fseek(fp, 0, SEEK_END);
 		fileLen = ftell(fp);
 		fseek(fp, 0, SEEK_SET);
@@ -322,16 +479,19 @@ exit:
 int pstremove(void* handle, char* key)
 {
 	int rc = 0;
-	char *clientDir = handle;
+	PersistenceDir *store = handle;
+	char *clientDir = NULL;
 	char *file;
 	size_t alloclen = 0;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
+	if (store == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
+	clientDir = store->clientDir;
+	pstindexremove(store, key);
 
 	/* consider '/' + '\0' */
 	/* consider '/' + '\0' */
@@ -371,27 +531,27 @@ exit:
 int pstclose(void* handle)
 {
 	int rc = 0;
-	char *clientDir = handle;
+	PersistenceDir *store = handle;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
+	if (store == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
 
 #if defined(_WIN32) || defined(_WIN64)
-	if ( _rmdir(clientDir) != 0 )
+	if ( _rmdir(store->clientDir) != 0 )
 	{
 #else
-	if ( rmdir(clientDir) != 0 )
+	if ( rmdir(store->clientDir) != 0 )
 	{
 #endif
 		if ( errno != ENOENT && errno != ENOTEMPTY )
 			rc = MQTTCLIENT_PERSISTENCE_ERROR;
 	}
 
-	free(clientDir);
+	pstfreedir(store);
 
 exit:
 	FUNC_EXIT_RC(rc);
@@ -404,21 +564,17 @@ exit:
  */
 int pstcontainskey(void *handle, char *key)
 {
-	int rc = 0;
-	char *clientDir = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	PersistenceDir *store = handle;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
-	{
-		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (store == NULL)
 		goto exit;
-	}
 
-#if defined(_WIN32) || defined(_WIN64)
-	rc = containskeyWin32(clientDir, key);
-#else
-	rc = containskeyUnix(clientDir, key);
-#endif
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->keys, key) != NULL)
+		rc = 0;
+	Paho_thread_unlock_mutex(store->mutex);
 
 exit:
 	FUNC_EXIT_RC(rc);
@@ -426,115 +582,6 @@ exit:
 }
 
 
-#if defined(_WIN32) || defined(_WIN64)
-int containskeyWin32(char *dirname, char *key)
-{
-	int notFound = MQTTCLIENT_PERSISTENCE_ERROR;
-	int fFinished = 0;
-	char *filekey, *ptraux;
-#if defined(_WIN32) || defined(_WIN64)
-#define DIRSIZE MAX_PATH+1
-#else
-	const size_t DIRSIZE = MAX_PATH+1;
-#endif
-	char dir[DIRSIZE];
-	WIN32_FIND_DATAA FileData;
-	HANDLE hDir;
-
-	FUNC_ENTRY;
-	if (snprintf(dir, DIRSIZE, "%s/*", dirname) >= DIRSIZE)
-		goto exit;
-
-	hDir = FindFirstFileA(dir, &FileData);
-	if (hDir != INVALID_HANDLE_VALUE)
-	{
-		while (!fFinished)
-		{
-			if (FileData.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE)
-			{
-				if ((filekey = malloc(strlen(FileData.cFileName) + 1)) == NULL)
-				{
-					notFound = PAHO_MEMORY_ERROR;
-					goto exit;
-				}
-				strcpy(filekey, FileData.cFileName);
-				ptraux = strstr(filekey, MESSAGE_FILENAME_EXTENSION);
-				if ( ptraux != NULL )
-					*ptraux = '\0' ;
-				if(strcmp(filekey, key) == 0)
-				{
-					notFound = 0;
-					fFinished = 1;
-				}
-				free(filekey);
-			}
-			if (!FindNextFileA(hDir, &FileData))
-			{
-				if (GetLastError() == ERROR_NO_MORE_FILES)
-					fFinished = 1;
-			}
-		}
-		FindClose(hDir);
-	}
-exit:
-	FUNC_EXIT_RC(notFound);
-	return notFound;
-}
-#else
-int containskeyUnix(char *dirname, char *key)
-{
-	int notFound = MQTTCLIENT_PERSISTENCE_ERROR;
-	char *filekey, *ptraux;
-	DIR *dp = NULL;
-	struct dirent *dir_entry;
-	struct stat stat_info;
-
-	FUNC_ENTRY;
-	if((dp = opendir(dirname)) != NULL)
-	{
-		while((dir_entry = readdir(dp)) != NULL && notFound)
-		{
-			const size_t allocsize = strlen(dirname) + strlen(dir_entry->d_name) + 2;
-			char* filename = malloc(allocsize);
-
-			if (!filename)
-			{
-				notFound = PAHO_MEMORY_ERROR;
-				goto exit;
-			}
-			if (snprintf(filename, allocsize, "%s/%s", dirname, dir_entry->d_name) >= allocsize)
-			{
-				free(filename);
-				notFound = MQTTCLIENT_PERSISTENCE_ERROR;
-				goto exit;
-			}
-			lstat(filename, &stat_info);
-			free(filename);
-			if(S_ISREG(stat_info.st_mode))
-			{
-				if ((filekey = malloc(strlen(dir_entry->d_name) + 1)) == NULL)
-				{
-					notFound = PAHO_MEMORY_ERROR;
-					goto exit;
-				}
-				strcpy(filekey, dir_entry->d_name);
-				ptraux = strstr(filekey, MESSAGE_FILENAME_EXTENSION);
-				if ( ptraux != NULL )
-					*ptraux = '\0' ;
-				if(strcmp(filekey, key) == 0)
-					notFound = 0;
-				free(filekey);
-			}
-		}
-	}
-
-exit:
-	if (dp)
-		closedir(dp);
-	FUNC_EXIT_RC(notFound);
-	return notFound;
-}
-#endif
 
 
 /** Delete all the persisted message in the client persistence directory.
@@ -543,114 +590,36 @@ exit:
 int pstclear(void *handle)
 {
 	int rc = 0;
-	char *clientDir = handle;
+	PersistenceDir *store = handle;
+	char **keys = NULL;
+	int nkeys = 0;
+	int i;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
+	if (store == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
 
-#if defined(_WIN32) || defined(_WIN64)
-	rc = clearWin32(clientDir);
-#else
-	rc = clearUnix(clientDir);
-#endif
-
-exit:
-	FUNC_EXIT_RC(rc);
-	return rc;
-}
-
-
-#if defined(_WIN32) || defined(_WIN64)
-int clearWin32(char *dirname)
-{
-	int rc = 0;
-	int fFinished = 0;
-	char *file;
-	char dir[DIRSIZE];
-	WIN32_FIND_DATAA FileData;
-	HANDLE hDir;
-
-	FUNC_ENTRY;
-	if (snprintf(dir, DIRSIZE, "%s/*", dirname) >= DIRSIZE)
-	{
-		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	/* the files are deleted by key, which also takes them out of the index */
+	if ((rc = pstkeys(handle, &keys, &nkeys)) != 0)
 		goto exit;
-	}
-
-	hDir = FindFirstFileA(dir, &FileData);
-	if (hDir != INVALID_HANDLE_VALUE)
+	for (i = 0; i < nkeys; ++i)
 	{
-		while (!fFinished)
-		{
-			if (FileData.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE)
-			{
-				size_t allocsize = strlen(dirname) + strlen(FileData.cFileName) + 2;
-
-				file = malloc(allocsize);
-				if (!file)
-				{
-					rc = PAHO_MEMORY_ERROR;
-					goto exit;
-				}
-				if (snprintf(file, allocsize, "%s/%s", dirname, FileData.cFileName) >= allocsize)
-				{
-					rc = MQTTCLIENT_PERSISTENCE_ERROR;
-					free(file);
-					goto exit;
-				}
-				rc = remove(file);
-				free(file);
-				if ( rc != 0 )
-				{
-					rc = MQTTCLIENT_PERSISTENCE_ERROR;
-					break;
-				}
-			}
-			if (!FindNextFileA(hDir, &FileData))
-			{
-				if (GetLastError() == ERROR_NO_MORE_FILES)
-					fFinished = 1;
-			}
-		}
-		FindClose(hDir);
-	} else
-		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		if (rc == 0)
+			rc = pstremove(handle, keys[i]);
+		free(keys[i]);
+	}
+	if (keys)
+		free(keys);
 
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
-#else
-int clearUnix(char *dirname)
-{
-	int rc = 0;
-	DIR *dp;
-	struct dirent *dir_entry;
-	struct stat stat_info;
 
-	FUNC_ENTRY;
-	if((dp = opendir(dirname)) != NULL)
-	{
-		while((dir_entry = readdir(dp)) != NULL && rc == 0)
-		{
-			if (lstat(dir_entry->d_name, &stat_info) == 0 && S_ISREG(stat_info.st_mode))
-			{
-				if (remove(dir_entry->d_name) != 0 && errno != ENOENT)
-					rc = MQTTCLIENT_PERSISTENCE_ERROR;
-			}
-		}
-		closedir(dp);
-	} else
-		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 
-	FUNC_EXIT_RC(rc);
-	return rc;
-}
-#endif
 
 
 /** Returns the keys (file names w/o the extension) in the client persistence directory.
@@ -659,20 +628,40 @@ int clearUnix(char *dirname)
 int pstkeys(void *handle, char ***keys, int *nkeys)
 {
 	int rc = 0;
-	char *clientDir = handle;
+	PersistenceDir *store = handle;
+	char **fkeys = NULL;
+	int nfkeys = 0;
+	Node *node = NULL;
 
 	FUNC_ENTRY;
-	if (clientDir == NULL)
+	if (store == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
 
-#if defined(_WIN32) || defined(_WIN64)
-	rc = keysWin32(clientDir, keys, nkeys);
-#else
-	rc = keysUnix(clientDir, keys, nkeys);
-#endif
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->keys->count > 0 && (fkeys = malloc(store->keys->count * sizeof(char *))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	while (rc == 0 && (node = TreeNextElement(store->keys, node)) != NULL)
+	{
+		if ((fkeys[nfkeys] = malloc(strlen(node->content) + 1)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+			strcpy(fkeys[nfkeys++], node->content);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	if (rc != 0)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		if (fkeys)
+			free(fkeys);
+		fkeys = NULL;
+	}
+	*keys = fkeys;
+	*nkeys = nfkeys;
+	/* the caller must free keys */
 
 exit:
 	FUNC_EXIT_RC(rc);
@@ -778,105 +767,74 @@ int keysUnix(char *dirname, char ***keys, int *nkeys)
 	int rc = 0;
 	char **fkeys = NULL;
 	int nfkeys = 0;
+	int maxkeys = 0;
 	char *ptraux;
-	int i;
+	char *temp = NULL;
+	size_t dirlen = strlen(dirname);
+	size_t templen = 0;
 	DIR *dp = NULL;
 	struct dirent *dir_entry;
 	struct stat stat_info;
 
 	FUNC_ENTRY;
-	/* get number of keys */
-	if((dp = opendir(dirname)) != NULL)
-	{
-		while((dir_entry = readdir(dp)) != NULL)
-		{
-			size_t allocsize = strlen(dirname)+strlen(dir_entry->d_name)+2;
-			char* temp = malloc(allocsize);
-
-			if (!temp)
-			{
-				rc = PAHO_MEMORY_ERROR;
-				goto exit;
-			}
-			if (snprintf(temp, allocsize, "%s/%s", dirname, dir_entry->d_name) >= allocsize)
-			{
-				free(temp);
-				rc = MQTTCLIENT_PERSISTENCE_ERROR;
-				goto exit;
-			}
-			if (lstat(temp, &stat_info) == 0 && S_ISREG(stat_info.st_mode))
-				nfkeys++;
-			free(temp);
-		}
-		closedir(dp);
-		dp = NULL;
-	} else
+	/* one pass over the directory, growing the array of keys as they are found */
+	if ((dp = opendir(dirname)) == NULL)
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
 	}
-
-	if (nfkeys != 0)
+	while ((dir_entry = readdir(dp)) != NULL)
 	{
-		if ((fkeys = (char **)malloc(nfkeys * sizeof(char *))) == NULL)
-		{
-			rc = PAHO_MEMORY_ERROR;
-			goto exit;
-		}
+		int regular = 0;
 
-		/* copy the keys */
-		if((dp = opendir(dirname)) != NULL)
-		{
-			i = 0;
-			while((dir_entry = readdir(dp)) != NULL)
-			{
-				size_t allocsize = strlen(dirname)+strlen(dir_entry->d_name)+2;
-				char* temp = malloc(allocsize);
+#if defined(DT_REG)
+		if (dir_entry->d_type != DT_UNKNOWN)
+			regular = (dir_entry->d_type == DT_REG);
+		else
+#endif
+		{	/* the file system does not give the type of the entry, so look it up */
+			size_t allocsize = dirlen + strlen(dir_entry->d_name) + 2;
 
-				if (!temp)
+			if (allocsize > templen)
+			{
+				if (temp)
+					free(temp);
+				if ((temp = malloc(allocsize)) == NULL)
 				{
-					int n = 0;
-					for (n = 0; n < i; n++)
-						free(fkeys[n]);
-					free(fkeys);
 					rc = PAHO_MEMORY_ERROR;
 					goto exit;
 				}
-				if (snprintf(temp, allocsize, "%s/%s", dirname, dir_entry->d_name) >= allocsize)
-				{
-					int n = 0;
-					for (n = 0; n < i; n++)
-						free(fkeys[n]);
-					free(temp);
-					free(fkeys);
-					rc = MQTTCLIENT_PERSISTENCE_ERROR;
-					goto exit;
-				}
-				if (lstat(temp, &stat_info) == 0 && S_ISREG(stat_info.st_mode))
-				{
-					if ((fkeys[i] = malloc(strlen(dir_entry->d_name) + 1)) == NULL)
-					{
-						int n = 0;
-						for (n = 0; n < i; n++)
-							free(fkeys[n]);
-						free(temp);
-						free(fkeys);
-						rc = PAHO_MEMORY_ERROR;
-						goto exit;
-					}
-					strcpy(fkeys[i], dir_entry->d_name);
-					ptraux = strstr(fkeys[i], MESSAGE_FILENAME_EXTENSION);
-					if ( ptraux != NULL )
-						*ptraux = '\0' ;
-					i++;
-				}
-				free(temp);
+				templen = allocsize;
 			}
-		} else
+			snprintf(temp, allocsize, "%s/%s", dirname, dir_entry->d_name);
+			regular = (lstat(temp, &stat_info) == 0 && S_ISREG(stat_info.st_mode));
+		}
+		if (!regular)
+			continue;
+		if (nfkeys == maxkeys)
 		{
-			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			int newmax = (maxkeys == 0) ? 64 : maxkeys * 2;
+			char **newkeys = (fkeys == NULL) ? malloc(newmax * sizeof(char *)) :
+				realloc(fkeys, newmax * sizeof(char *));
+
+			if (newkeys == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				goto exit;
+			}
+			fkeys = newkeys;
+			maxkeys = newmax;
+		}
+		if ((fkeys[nfkeys] = malloc(strlen(dir_entry->d_name) + 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
 			goto exit;
 		}
+		strcpy(fkeys[nfkeys], dir_entry->d_name);
+		ptraux = strstr(fkeys[nfkeys], MESSAGE_FILENAME_EXTENSION);
+		if ( ptraux != NULL )
+			*ptraux = '\0' ;
+		nfkeys++;
 	}
 
 	*nkeys = nfkeys;
@@ -884,6 +842,14 @@ int keysUnix(char *dirname, char ***keys, int *nkeys)
 	/* the caller must free keys */
 
 exit:
+	if (rc != 0 && fkeys)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		free(fkeys);
+	}
+	if (temp)
+		free(temp);
 	if (dp)
 		closedir(dp);
 	FUNC_EXIT_RC(rc);
@@ -927,7 +893,7 @@ int main (int argc, char *argv[])
 	/* open */
 	/* printf("Persistence directory : %s\n", perdir); */
 	rc = pstopen((void**)&handle, clientID, serverURI, perdir);
-	printf("%s Persistence directory for client %s : %s\n", RC, clientID, handle);
+	printf("%s Persistence directory for client %s : %s\n", RC, clientID, pstclientdir(handle));
 
 	/* put */
 	for(msgId=0;msgId<NMSGS;msgId++)
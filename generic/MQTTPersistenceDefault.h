@@ -32,5 +32,9 @@ int pstcontainskey(void* handle, char* key);
 
 int pstmkdir(char *pPathname);
 
+/* the directory of a client, for the persistences which keep files of their own */
+int pstmkclientdir(char **clientDir, const char* clientID, const char* serverURI, const char* dataDir);
+const char* pstclientdir(void* handle);
+
 #endif
 
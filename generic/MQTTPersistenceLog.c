@@ -0,0 +1,1167 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - append-only log persistence
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A file system based persistence implementation appending to a log.
+ *
+ * The default persistence creates, writes and unlinks a file for each
+ * message in flight, so that every QoS 1 or 2 message costs two directory
+ * updates.  This one keeps the same directory for each client ID and
+ * connection key (see ::pstopen), but appends the puts and removes to a log
+ * of segment files instead, each record with a CRC, and keeps an index of
+ * where the latest put of each key is in memory.
+ *
+ * A new segment is started when the last one reaches the segment size.  A
+ * thread of the store compacts the oldest segments while at most half of
+ * the ones before the last are still live, by appending their live puts to
+ * the last segment and unlinking them, and syncs the log with the interval
+ * sync policy.
+ * Only ever compacting the oldest segment means that a remove can be
+ * dropped along with it, there being no older put left for it to cancel.
+ *
+ * When the store is opened, the segments are read in order to rebuild the
+ * index.  A record which is cut short or fails its CRC ends the log: the
+ * last segment is truncated there, as it is what a crash in the middle of a
+ * put leaves behind.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#include <io.h>
+	#include <direct.h>
+	#define snprintf _snprintf
+	#define fsync _commit
+	#define ftruncate _chsize
+	#define fileno _fileno
+	#define dup _dup
+	#define close _close
+	#define unlink _unlink
+	#define rmdir _rmdir
+#else
+	#include <sys/types.h>
+	#include <dirent.h>
+	#include <unistd.h>
+	#define WINAPI
+#endif
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "MQTTTime.h"
+#include "Thread.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** the size at which a new segment is started, unless the options say otherwise */
+#define LOG_DEFAULT_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/** the longest the thread sleeps between looks at the segments, in milliseconds */
+#define LOG_IDLE_WAIT 1000
+
+/** the number of hex digits of the segment number in a segment filename */
+#define LOG_ID_DIGITS 8
+
+/** the bytes at the start of each segment */
+#define LOG_MAGIC "MQTCLOG1"
+#define LOG_MAGIC_LENGTH 8
+
+/** crc (4), type (1), unused (1), key length (2), data length (4) */
+#define LOG_HEADER_LENGTH 12
+
+#define LOG_RECORD_PUT 1
+#define LOG_RECORD_REMOVE 2
+
+/** A segment file of the log */
+typedef struct
+{
+	unsigned int id;      /**< the number in the filename, the segments being in order of it */
+	FILE* fp;
+	long size;            /**< the bytes in the file */
+	long live;            /**< the bytes of the records which are the latest puts of their keys */
+} LogSegment;
+
+/** Where the latest put of a key is.  The key follows the structure, in the same allocation. */
+typedef struct
+{
+	char* key;
+	unsigned int segment; /**< the id of the segment */
+	long offset;          /**< the offset of the data in the segment */
+	int datalen;
+	int reclen;           /**< the length of the whole record */
+} LogEntry;
+
+/** The handle of an open log */
+typedef struct
+{
+	char* clientDir;      /**< the directory of the segments, as made by ::pstmkclientdir */
+	int syncPolicy;       /**< one of the MQTTCLIENT_LOG_SYNC values */
+	int syncInterval;
+	long segmentSize;
+	mutex_type mutex;     /**< protects all the fields below */
+	sem_type wake;        /**< posted to make the thread look at the segments */
+	Tree* index;          /**< a LogEntry for each key, by key */
+	LogSegment* segments; /**< the segments, oldest first, the records being appended to the last */
+	int nsegments;
+	int maxsegments;
+	int dirty;            /**< whether the last segment has been written since it was last synced */
+	int stop;             /**< the thread is to finish */
+	volatile int running; /**< the thread has been started and not yet finished */
+} LogStore;
+
+
+static void writeInt4(char* p, unsigned int v)
+{
+	p[0] = (char)(v & 0xFF);
+	p[1] = (char)((v >> 8) & 0xFF);
+	p[2] = (char)((v >> 16) & 0xFF);
+	p[3] = (char)((v >> 24) & 0xFF);
+}
+
+
+static unsigned int readInt4(const char* buf)
+{
+	const unsigned char* p = (const unsigned char*)buf;
+
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+/**
+ * Tree callback function for comparing index entries by key
+ */
+static int pstlog_compare(void* a, void* b, int content)
+{
+	const char* key = content ? ((LogEntry*)b)->key : (const char*)b;
+
+	return strcmp(((LogEntry*)a)->key, key);
+}
+
+
+static int pstlog_idCompare(const void* a, const void* b)
+{
+	unsigned int ia = *(const unsigned int*)a, ib = *(const unsigned int*)b;
+
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+/**
+ * Makes the options of the log persistence into the context stored with it.
+ * @param options the options, NULL for the defaults
+ * @return the context, to be freed with ::pstlogfreecontext, or NULL if the
+ * options are not valid or memory is short
+ */
+void* pstlogcontext(const MQTTClient_logPersistenceOptions* options)
+{
+	MQTTClient_logPersistenceOptions defaults = MQTTClient_logPersistenceOptions_initializer;
+	MQTTClient_logPersistenceOptions* context = NULL;
+	const char* directory = NULL;
+
+	FUNC_ENTRY;
+	if (options == NULL)
+		options = &defaults;
+	if (strncmp(options->struct_id, "MQTL", 4) != 0 || options->struct_version != 0 ||
+		options->syncPolicy < MQTTCLIENT_LOG_SYNC_NEVER || options->syncPolicy > MQTTCLIENT_LOG_SYNC_INTERVAL ||
+		(options->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL && options->syncInterval <= 0) ||
+		options->segmentSize < 0)
+		goto exit;
+	directory = (options->directory) ? options->directory : "."; /* working directory */
+	if ((context = malloc(sizeof(MQTTClient_logPersistenceOptions) + strlen(directory) + 1)) == NULL)
+		goto exit;
+	*context = *options;
+	context->directory = (char*)(context + 1);
+	strcpy((char*)context->directory, directory);
+	if (context->segmentSize == 0)
+		context->segmentSize = LOG_DEFAULT_SEGMENT_SIZE;
+exit:
+	FUNC_EXIT;
+	return context;
+}
+
+
+/**
+ * Frees the context made by ::pstlogcontext.
+ * @param context the context
+ */
+void pstlogfreecontext(void* context)
+{
+	free(context);
+}
+
+
+/**
+ * Makes the filename of a segment.
+ * @return the filename, to be freed by the caller, or NULL if memory is short
+ */
+static char* pstlog_segmentName(LogStore* store, unsigned int id)
+{
+	/* consider '/' + '\0' */
+	size_t alloclen = strlen(store->clientDir) + LOG_ID_DIGITS + strlen(LOG_FILENAME_EXTENSION) + 2;
+	char* name = malloc(alloclen);
+
+	if (name)
+		snprintf(name, alloclen, "%s/%08x%s", store->clientDir, id, LOG_FILENAME_EXTENSION);
+	return name;
+}
+
+
+/**
+ * Finds the segment with an id.
+ */
+static LogSegment* pstlog_findSegment(LogStore* store, unsigned int id)
+{
+	int i;
+
+	for (i = store->nsegments - 1; i >= 0; --i)
+	{
+		if (store->segments[i].id == id)
+			return &store->segments[i];
+	}
+	return NULL;
+}
+
+
+/**
+ * Adds a segment after the last one.
+ * @return the segment, or NULL if memory is short
+ */
+static LogSegment* pstlog_addSegment(LogStore* store, unsigned int id, FILE* fp, long size)
+{
+	LogSegment* seg = NULL;
+
+	if (store->nsegments == store->maxsegments)
+	{
+		LogSegment* segments = realloc(store->segments, 2 * store->maxsegments * sizeof(LogSegment));
+
+		if (segments == NULL)
+			goto exit;
+		store->segments = segments;
+		store->maxsegments *= 2;
+	}
+	seg = &store->segments[store->nsegments++];
+	seg->id = id;
+	seg->fp = fp;
+	seg->size = size;
+	seg->live = 0;
+exit:
+	return seg;
+}
+
+
+/**
+ * Flushes a segment file to disk.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstlog_sync(LogSegment* seg)
+{
+	int rc = 0;
+
+	if (fflush(seg->fp) != 0 || fsync(fileno(seg->fp)) != 0)
+	{
+		Log(LOG_ERROR, -1, "Error %d syncing log segment %08x", errno, seg->id);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	return rc;
+}
+
+
+/**
+ * Creates a new segment, after the last one, for the records to be appended to.
+ * @param store the store
+ * @param id the number of the segment, higher than that of the last one
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstlog_newSegment(LogStore* store, unsigned int id)
+{
+	char* name = NULL;
+	FILE* fp = NULL;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store->nsegments > 0)
+	{	/* what is compacted into the new segment must not overtake this one to the disk */
+		if (store->syncPolicy != MQTTCLIENT_LOG_SYNC_NEVER)
+			pstlog_sync(&store->segments[store->nsegments - 1]);
+		store->dirty = 0;
+	}
+	if ((name = pstlog_segmentName(store, id)) == NULL)
+		goto exit;
+	if ((fp = fopen(name, "w+b")) == NULL)
+	{
+		Log(LOG_ERROR, -1, "Error %d creating log segment %s", errno, name);
+		goto exit;
+	}
+	if (fwrite(LOG_MAGIC, 1, LOG_MAGIC_LENGTH, fp) != LOG_MAGIC_LENGTH || fflush(fp) != 0 ||
+		pstlog_addSegment(store, id, fp, LOG_MAGIC_LENGTH) == NULL)
+	{
+		fclose(fp);
+		unlink(name);
+		goto exit;
+	}
+	rc = 0;
+exit:
+	if (name)
+		free(name);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Appends a record to the last segment, starting a new one first if it is full.
+ * Must be called with the store mutex held.
+ * @param store the store
+ * @param type LOG_RECORD_PUT or LOG_RECORD_REMOVE
+ * @param key the key of the record
+ * @param bufcount the number of buffers of the data
+ * @param buffers the buffers of the data
+ * @param buflens the lengths of the buffers
+ * @param offset set to the offset of the data in the segment
+ * @param reclen set to the length of the record
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstlog_append(LogStore* store, int type, char* key, int bufcount, char* buffers[], int buflens[],
+		long* offset, int* reclen)
+{
+	LogSegment* seg = &store->segments[store->nsegments - 1];
+	char header[LOG_HEADER_LENGTH];
+	size_t keylen = strlen(key);
+	unsigned int datalen = 0;
+	unsigned int crc = 0;
+	int written = 1;
+	int i;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (keylen == 0 || keylen > 0xFFFF)
+		goto exit;
+	if (seg->size >= store->segmentSize)
+	{
+		if (pstlog_newSegment(store, seg->id + 1) != 0)
+			goto exit;
+		seg = &store->segments[store->nsegments - 1];
+		Thread_post_sem(store->wake); /* the oldest segment may be due to be compacted */
+	}
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	header[4] = (char)type;
+	header[5] = 0;
+	header[6] = (char)(keylen & 0xFF);
+	header[7] = (char)(keylen >> 8);
+	writeInt4(&header[8], datalen);
+	crc = MQTTPersistence_crc32(crc, &header[4], LOG_HEADER_LENGTH - 4);
+	crc = MQTTPersistence_crc32(crc, key, keylen);
+	for (i = 0; i < bufcount; ++i)
+		crc = MQTTPersistence_crc32(crc, buffers[i], buflens[i]);
+	writeInt4(header, crc);
+
+	if (fseek(seg->fp, seg->size, SEEK_SET) != 0)
+		goto exit;
+	written = fwrite(header, 1, LOG_HEADER_LENGTH, seg->fp) == LOG_HEADER_LENGTH &&
+		fwrite(key, 1, keylen, seg->fp) == keylen;
+	for (i = 0; written && i < bufcount; ++i)
+		written = fwrite(buffers[i], 1, buflens[i], seg->fp) == (size_t)buflens[i];
+	if (!written || fflush(seg->fp) != 0)
+	{	/* cut off what was written, so that the next record follows the last whole one */
+		Log(LOG_ERROR, -1, "Error %d appending to log segment %08x", errno, seg->id);
+		clearerr(seg->fp);
+		fflush(seg->fp);
+		if (ftruncate(fileno(seg->fp), seg->size) != 0)
+			Log(LOG_ERROR, -1, "Error %d truncating log segment %08x", errno, seg->id);
+		goto exit;
+	}
+	*offset = seg->size + LOG_HEADER_LENGTH + (long)keylen;
+	*reclen = LOG_HEADER_LENGTH + (int)keylen + (int)datalen;
+	seg->size += *reclen;
+	rc = 0;
+	if (store->syncPolicy == MQTTCLIENT_LOG_SYNC_ALWAYS)
+		rc = pstlog_sync(seg);
+	else
+		store->dirty = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Records in the index where the latest put of a key is.
+ * @return 0 if success, #PAHO_MEMORY_ERROR if memory is short
+ */
+static int pstlog_indexPut(LogStore* store, char* key, LogSegment* seg, long offset, int datalen, int reclen)
+{
+	Node* node = TreeFind(store->index, key);
+	LogEntry* e = NULL;
+	int rc = 0;
+
+	if (node)
+	{
+		LogSegment* old = NULL;
+
+		e = node->content;
+		if ((old = pstlog_findSegment(store, e->segment)) != NULL)
+			old->live -= e->reclen;
+	}
+	else
+	{
+		if ((e = malloc(sizeof(LogEntry) + strlen(key) + 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		e->key = (char*)(e + 1);
+		strcpy(e->key, key);
+		TreeAdd(store->index, e, sizeof(LogEntry) + strlen(key) + 1);
+	}
+	e->segment = seg->id;
+	e->offset = offset;
+	e->datalen = datalen;
+	e->reclen = reclen;
+	seg->live += reclen;
+exit:
+	return rc;
+}
+
+
+/**
+ * Removes a key from the index.
+ */
+static void pstlog_indexRemove(LogStore* store, char* key)
+{
+	LogEntry* e = TreeRemoveKey(store->index, key);
+
+	if (e)
+	{
+		LogSegment* seg = pstlog_findSegment(store, e->segment);
+
+		if (seg)
+			seg->live -= e->reclen;
+		free(e);
+	}
+}
+
+
+/**
+ * Reads the data of a put from its segment.
+ * @return the data, to be freed by the caller, or NULL if it could not be read
+ */
+static char* pstlog_read(LogStore* store, LogEntry* e)
+{
+	LogSegment* seg = pstlog_findSegment(store, e->segment);
+	char* data = NULL;
+
+	if (seg == NULL || (data = malloc(e->datalen > 0 ? e->datalen : 1)) == NULL)
+		goto exit;
+	if (fseek(seg->fp, e->offset, SEEK_SET) != 0 || fread(data, 1, e->datalen, seg->fp) != (size_t)e->datalen)
+	{
+		Log(LOG_ERROR, -1, "Error reading %s from log segment %08x", e->key, seg->id);
+		free(data);
+		data = NULL;
+	}
+exit:
+	return data;
+}
+
+
+/**
+ * Whether the oldest segment is due to be compacted: it is not the one being
+ * appended to, and at most half of the segments before the last are live.
+ * The oldest may itself be all live, its puts then going to the last segment
+ * so that the ones behind it can be compacted in turn.
+ */
+static int pstlog_compactionDue(LogStore* store)
+{
+	long live = 0, size = 0;
+	int i;
+
+	for (i = 0; i < store->nsegments - 1; ++i)
+	{
+		live += store->segments[i].live;
+		size += store->segments[i].size;
+	}
+	return store->nsegments > 1 && live * 2 <= size;
+}
+
+
+/**
+ * Compacts the oldest segment, appending its live puts to the last segment
+ * and unlinking it.  Must be called with the store mutex held.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstlog_compact(LogStore* store)
+{
+	unsigned int id = store->segments[0].id;
+	Node* node = NULL;
+	char* name = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	while (rc == 0 && store->segments[0].live > 0 && (node = TreeNextElement(store->index, node)) != NULL)
+	{
+		LogEntry* e = node->content;
+		char* data = NULL;
+		long offset = 0;
+		int reclen = 0;
+
+		if (e->segment != id)
+			continue;
+		if ((data = pstlog_read(store, e)) == NULL)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if ((rc = pstlog_append(store, LOG_RECORD_PUT, e->key, 1, &data, &e->datalen, &offset, &reclen)) == 0)
+			rc = pstlog_indexPut(store, e->key, &store->segments[store->nsegments - 1], offset, e->datalen, reclen);
+		if (data)
+			free(data);
+	}
+	if (rc != 0)
+		goto exit;
+	if (store->syncPolicy != MQTTCLIENT_LOG_SYNC_NEVER && store->dirty)
+	{	/* the copies must be on disk before the originals go */
+		if ((rc = pstlog_sync(&store->segments[store->nsegments - 1])) != 0)
+			goto exit;
+		store->dirty = 0;
+	}
+	fclose(store->segments[0].fp);
+	if ((name = pstlog_segmentName(store, id)) != NULL)
+	{
+		unlink(name);
+		free(name);
+	}
+	--(store->nsegments);
+	memmove(&store->segments[0], &store->segments[1], store->nsegments * sizeof(LogSegment));
+exit:
+	if (rc != 0)
+		Log(LOG_ERROR, -1, "Error %d compacting log segment %08x", rc, id);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/* This is the thread function that compacts and syncs a log */
+static thread_return_type WINAPI pstlog_run(void* n)
+{
+	LogStore* store = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTLog");
+	Paho_thread_lock_mutex(store->mutex);
+	while (!store->stop)
+	{
+		int wait = (store->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL) ? store->syncInterval : LOG_IDLE_WAIT;
+
+		Paho_thread_unlock_mutex(store->mutex);
+		Thread_wait_sem(store->wake, wait);
+		Paho_thread_lock_mutex(store->mutex);
+		if (store->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL && store->dirty)
+		{	/* sync a duplicate of the descriptor, so that appends can go on meanwhile */
+			int fd = dup(fileno(store->segments[store->nsegments - 1].fp));
+
+			store->dirty = 0;
+			Paho_thread_unlock_mutex(store->mutex);
+			if (fd != -1)
+			{
+				if (fsync(fd) != 0)
+					Log(LOG_ERROR, -1, "Error %d syncing log", errno);
+				close(fd);
+			}
+			Paho_thread_lock_mutex(store->mutex);
+		}
+		while (!store->stop && pstlog_compactionDue(store) && pstlog_compact(store) == 0)
+			;
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	FUNC_EXIT;
+	store->running = 0; /* the last touch of the store, which may be freed from now on */
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
+/**
+ * Lists the ids of the segments in the directory of a log.
+ * @param ids set to the ids, to be freed by the caller
+ * @param nids set to the number of ids
+ * @return 0 if success, #PAHO_MEMORY_ERROR if memory is short
+ */
+static int pstlog_listSegments(LogStore* store, unsigned int** ids, int* nids)
+{
+	int max = 16;
+	int rc = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	WIN32_FIND_DATAA FileData;
+	HANDLE hDir;
+	char* pattern = NULL;
+	size_t alloclen = strlen(store->clientDir) + strlen(LOG_FILENAME_EXTENSION) + 3;
+#else
+	DIR* dp = NULL;
+	struct dirent* dir_entry;
+#endif
+
+	FUNC_ENTRY;
+	*nids = 0;
+	if ((*ids = malloc(max * sizeof(unsigned int))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+#if defined(_WIN32) || defined(_WIN64)
+	if ((pattern = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	snprintf(pattern, alloclen, "%s/*%s", store->clientDir, LOG_FILENAME_EXTENSION);
+	hDir = FindFirstFileA(pattern, &FileData);
+	free(pattern);
+	if (hDir == INVALID_HANDLE_VALUE)
+		goto exit;
+	do
+	{
+		const char* name = FileData.cFileName;
+#else
+	if ((dp = opendir(store->clientDir)) == NULL)
+		goto exit;
+	while ((dir_entry = readdir(dp)) != NULL)
+	{
+		const char* name = dir_entry->d_name;
+#endif
+		if (strlen(name) == LOG_ID_DIGITS + strlen(LOG_FILENAME_EXTENSION) &&
+			strspn(name, "0123456789abcdef") == LOG_ID_DIGITS &&
+			strcmp(name + LOG_ID_DIGITS, LOG_FILENAME_EXTENSION) == 0)
+		{
+			if (*nids == max)
+			{
+				unsigned int* more = realloc(*ids, 2 * max * sizeof(unsigned int));
+
+				if (more == NULL)
+				{
+					rc = PAHO_MEMORY_ERROR;
+					break;
+				}
+				*ids = more;
+				max *= 2;
+			}
+			(*ids)[(*nids)++] = (unsigned int)strtoul(name, NULL, 16);
+		}
+#if defined(_WIN32) || defined(_WIN64)
+	} while (FindNextFileA(hDir, &FileData));
+	FindClose(hDir);
+#else
+	}
+	closedir(dp);
+#endif
+	qsort(*ids, *nids, sizeof(unsigned int), pstlog_idCompare);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Reads the records of a segment into the index.  A record which is cut
+ * short or fails its CRC ends the segment.
+ * @param store the store
+ * @param seg the segment, its size being set to the end of its last whole record
+ * @return 0 if success, #PAHO_MEMORY_ERROR if memory is short
+ */
+static int pstlog_replay(LogStore* store, LogSegment* seg)
+{
+	char magic[LOG_MAGIC_LENGTH];
+	char header[LOG_HEADER_LENGTH];
+	char* buf = NULL;
+	size_t buflen = 0;
+	long pos = LOG_MAGIC_LENGTH;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (fread(magic, 1, LOG_MAGIC_LENGTH, seg->fp) != LOG_MAGIC_LENGTH ||
+		memcmp(magic, LOG_MAGIC, LOG_MAGIC_LENGTH) != 0)
+	{
+		pos = 0; /* not even the start of a segment */
+		goto exit;
+	}
+	while (fread(header, 1, LOG_HEADER_LENGTH, seg->fp) == LOG_HEADER_LENGTH)
+	{
+		int type = header[4];
+		size_t keylen = (unsigned char)header[6] | ((unsigned char)header[7] << 8);
+		size_t datalen = readInt4(&header[8]);
+		unsigned int crc = 0;
+
+		if ((type != LOG_RECORD_PUT && type != LOG_RECORD_REMOVE) || keylen == 0 ||
+			(type == LOG_RECORD_REMOVE && datalen != 0) || datalen > 0x7FFFFFFF - LOG_HEADER_LENGTH - keylen)
+			break;
+		if (keylen + datalen + 1 > buflen)
+		{
+			if (buf)
+				free(buf);
+			buflen = keylen + datalen + 1;
+			if ((buf = malloc(buflen)) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				goto exit;
+			}
+		}
+		if (fread(buf, 1, keylen + datalen, seg->fp) != keylen + datalen)
+			break;
+		crc = MQTTPersistence_crc32(crc, &header[4], LOG_HEADER_LENGTH - 4);
+		crc = MQTTPersistence_crc32(crc, buf, keylen + datalen);
+		if (crc != readInt4(header))
+			break;
+		buf[keylen] = '\0'; /* the data is not needed, it is read again by pstlogget */
+		if (type == LOG_RECORD_PUT)
+			rc = pstlog_indexPut(store, buf, seg, pos + LOG_HEADER_LENGTH + (long)keylen, (int)datalen,
+				LOG_HEADER_LENGTH + (int)(keylen + datalen));
+		else
+			pstlog_indexRemove(store, buf);
+		if (rc != 0)
+			goto exit;
+		pos += LOG_HEADER_LENGTH + (long)(keylen + datalen);
+	}
+exit:
+	if (buf)
+		free(buf);
+	seg->size = pos;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Opens the segments of a log and reads them into the index.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise
+ */
+static int pstlog_recover(LogStore* store)
+{
+	unsigned int* ids = NULL;
+	int nids = 0;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((rc = pstlog_listSegments(store, &ids, &nids)) != 0)
+		goto exit;
+	for (i = 0; rc == 0 && i < nids; ++i)
+	{
+		char* name = pstlog_segmentName(store, ids[i]);
+		FILE* fp = NULL;
+		LogSegment* seg = NULL;
+		long end = 0;
+
+		if (name == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			break;
+		}
+		if ((fp = fopen(name, "r+b")) == NULL)
+		{
+			Log(LOG_ERROR, -1, "Error %d opening log segment %s", errno, name);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		else if ((seg = pstlog_addSegment(store, ids[i], fp, 0)) == NULL)
+		{
+			fclose(fp);
+			rc = PAHO_MEMORY_ERROR;
+		}
+		else if ((rc = pstlog_replay(store, seg)) == 0 && fseek(fp, 0, SEEK_END) == 0 &&
+			(end = ftell(fp)) > seg->size)
+		{
+			if (i < nids - 1)
+				Log(LOG_ERROR, -1, "Log segment %s is corrupt after offset %ld", name, seg->size);
+			else
+				Log(TRACE_MIN, -1, "Truncating log segment %s from %ld to %ld", name, end, seg->size);
+			if (seg->size < LOG_MAGIC_LENGTH)
+			{	/* make it a segment again */
+				rewind(fp);
+				if (fwrite(LOG_MAGIC, 1, LOG_MAGIC_LENGTH, fp) == LOG_MAGIC_LENGTH)
+					seg->size = LOG_MAGIC_LENGTH;
+			}
+			if (i == nids - 1 && (fflush(fp) != 0 || ftruncate(fileno(fp), seg->size) != 0))
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		free(name);
+	}
+	if (rc == 0 && store->nsegments == 0)
+		rc = pstlog_newSegment(store, 0);
+exit:
+	if (ids)
+		free(ids);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Closes the segments of a log, and unlinks them if asked.
+ */
+static void pstlog_closeSegments(LogStore* store, int unlinkThem)
+{
+	int i;
+
+	for (i = 0; i < store->nsegments; ++i)
+	{
+		fclose(store->segments[i].fp);
+		if (unlinkThem)
+		{
+			char* name = pstlog_segmentName(store, store->segments[i].id);
+
+			if (name)
+			{
+				unlink(name);
+				free(name);
+			}
+		}
+	}
+	store->nsegments = 0;
+}
+
+
+/**
+ * Empties the index of a log.
+ */
+static void pstlog_emptyIndex(LogStore* store)
+{
+	Node* node = NULL;
+
+	while ((node = TreeNextElement(store->index, NULL)) != NULL)
+	{
+		void* e = TreeRemove(store->index, node->content);
+
+		if (e)
+			free(e);
+	}
+}
+
+
+/**
+ * Frees a store, which must have no segments open and no thread running.
+ */
+static void pstlog_free(LogStore* store)
+{
+	if (store->index)
+	{
+		pstlog_emptyIndex(store);
+		TreeFree(store->index);
+	}
+	if (store->segments)
+		free(store->segments);
+	if (store->wake)
+		Thread_destroy_sem(store->wake);
+	if (store->mutex)
+		Paho_thread_destroy_mutex(store->mutex);
+	if (store->clientDir)
+		free(store->clientDir);
+	free(store);
+}
+
+
+/** Open the log of the client, in the directory context/clientID-serverURI,
+ *  reading it into the index.
+ *  See ::Persistence_open
+ */
+int pstlogopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	MQTTClient_logPersistenceOptions* options = context;
+	LogStore* store = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(LogStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(LogStore));
+	store->syncPolicy = options->syncPolicy;
+	store->syncInterval = options->syncInterval;
+	store->segmentSize = options->segmentSize;
+	if ((rc = pstmkclientdir(&store->clientDir, clientID, serverURI, options->directory)) != 0)
+		goto error;
+	store->maxsegments = 8;
+	if ((store->segments = malloc(store->maxsegments * sizeof(LogSegment))) == NULL ||
+		(store->index = TreeInitialize(pstlog_compare)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	store->mutex = Paho_thread_create_mutex(&rc);
+	if (rc != 0)
+		goto error;
+	store->wake = Thread_create_sem(&rc);
+	if (rc != 0)
+		goto error;
+	if ((rc = pstlog_recover(store)) != 0)
+	{
+		pstlog_closeSegments(store, 0);
+		goto error;
+	}
+	store->running = 1;
+	Paho_thread_start(pstlog_run, store);
+	*handle = store;
+	goto exit;
+error:
+	pstlog_free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Close the log, and delete its segments and its directory if it holds nothing.
+ *  See ::Persistence_close
+ */
+int pstlogclose(void* handle)
+{
+	LogStore* store = handle;
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	store->stop = 1;
+	Paho_thread_unlock_mutex(store->mutex);
+	Thread_post_sem(store->wake);
+	while (store->running && ++count < 3000)
+		MQTTTime_sleep(10L);
+	if (store->running)
+	{	/* the segments would be closed under the thread, so leave them be */
+		Log(LOG_ERROR, -1, "Log persistence thread did not finish");
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if (store->index->count == 0)
+	{
+		pstlog_closeSegments(store, 1);
+		if (rmdir(store->clientDir) != 0 && errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	else
+	{
+		if (store->syncPolicy != MQTTCLIENT_LOG_SYNC_NEVER && store->dirty)
+			rc = pstlog_sync(&store->segments[store->nsegments - 1]);
+		pstlog_closeSegments(store, 0);
+	}
+	pstlog_free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a put of a wire message to the log.
+ *  See ::Persistence_put
+ */
+int pstlogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	LogStore* store = handle;
+	long offset = 0;
+	int datalen = 0;
+	int reclen = 0;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	Paho_thread_lock_mutex(store->mutex);
+	if ((rc = pstlog_append(store, LOG_RECORD_PUT, key, bufcount, buffers, buflens, &offset, &reclen)) == 0)
+		rc = pstlog_indexPut(store, key, &store->segments[store->nsegments - 1], offset, datalen, reclen);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from the log.
+ *  See ::Persistence_get
+ */
+int pstlogget(void* handle, char* key, char** buffer, int* buflen)
+{
+	LogStore* store = handle;
+	Node* node = NULL;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(store->mutex);
+	if ((node = TreeFind(store->index, key)) != NULL)
+	{
+		LogEntry* e = node->content;
+
+		if ((*buffer = pstlog_read(store, e)) != NULL)
+		{
+			*buflen = e->datalen;
+			rc = 0;
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	/* the caller must free the buffer */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a remove of a persisted message to the log.
+ *  See ::Persistence_remove
+ */
+int pstlogremove(void* handle, char* key)
+{
+	LogStore* store = handle;
+	long offset = 0;
+	int reclen = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->index, key) != NULL &&
+		(rc = pstlog_append(store, LOG_RECORD_REMOVE, key, 0, NULL, NULL, &offset, &reclen)) == 0)
+		pstlog_indexRemove(store, key);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys in the log.
+ *  See ::Persistence_keys
+ */
+int pstlogkeys(void* handle, char*** keys, int* nkeys)
+{
+	LogStore* store = handle;
+	Node* node = NULL;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->index->count > 0 && (fkeys = malloc(store->index->count * sizeof(char*))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	while (rc == 0 && (node = TreeNextElement(store->index, node)) != NULL)
+	{
+		LogEntry* e = node->content;
+
+		if ((fkeys[nfkeys] = malloc(strlen(e->key) + 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			break;
+		}
+		strcpy(fkeys[nfkeys++], e->key);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	if (rc != 0)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		if (fkeys)
+			free(fkeys);
+		fkeys = NULL;
+	}
+	*keys = fkeys;
+	*nkeys = nfkeys;
+	/* the caller must free keys */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the records of the log, starting a new segment.
+ *  See ::Persistence_clear
+ */
+int pstlogclear(void* handle)
+{
+	LogStore* store = handle;
+	unsigned int id = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	pstlog_emptyIndex(store);
+	if (store->nsegments > 0)
+		id = store->segments[store->nsegments - 1].id + 1;
+	pstlog_closeSegments(store, 1);
+	store->dirty = 0;
+	rc = pstlog_newSegment(store, id); /* numbered on, should the old ones not have gone */
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a wire message is persisted in the log.
+ *  See ::Persistence_containskey
+ */
+int pstlogcontainskey(void* handle, char* key)
+{
+	LogStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->index, key) != NULL)
+		rc = 0;
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+#endif /* !defined(NO_PERSISTENCE) */
@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - append-only log persistence
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCELOG_H)
+#define MQTTPERSISTENCELOG_H
+
+#include "MQTTClientPersistence.h"
+
+/** Extension of the segment filenames */
+#define LOG_FILENAME_EXTENSION ".log"
+
+/* the context of the log persistence, made from its options */
+void* pstlogcontext(const MQTTClient_logPersistenceOptions* options);
+void pstlogfreecontext(void* context);
+
+/* prototypes of the functions for the log persistence */
+int pstlogopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int pstlogclose(void* handle);
+int pstlogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int pstlogget(void* handle, char* key, char** buffer, int* buflen);
+int pstlogremove(void* handle, char* key);
+int pstlogkeys(void* handle, char*** keys, int* nkeys);
+int pstlogclear(void* handle);
+int pstlogcontainskey(void* handle, char* key);
+
+#endif
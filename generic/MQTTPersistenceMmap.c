@@ -0,0 +1,958 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - memory mapped slot persistence
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A file system based persistence implementation in a memory mapped file.
+ *
+ * The records are kept in the fixed size slots of a file which is allocated
+ * in full when it is created and mapped into memory, so that a put is a copy
+ * into a free slot and a remove is a change of the slot's state, without
+ * any file system call.  With the interval sync policy, a thread of the store
+ * syncs the range of the file written since the last sync; otherwise the
+ * slots written are synced at once, or not at all.
+ *
+ * The free slots are taken in turn round the ring of slots, so that writes
+ * are spread over the whole file rather than wearing out its first blocks.
+ * A record put again goes to a new slot before the old one is freed, so that
+ * a crash leaves one of the two whole: the slots have a sequence number to
+ * tell which is the later.  Each slot has a CRC of its contents, and its state
+ * is written last.  Opening the store scans the slots, freeing any whose CRC
+ * does not match, to rebuild the index of keys in memory.
+ *
+ * The header at the start of the file holds the number and size of the
+ * slots, and the last sequence number written when the file was closed.
+ * Records with a longer key or more data than fit in a slot are written to
+ * files of their own by the default persistence (see ::pstput), in the
+ * client directory made by ::pstopen; the file of the slots is kept next to
+ * that directory.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#include <io.h>
+	#define snprintf _snprintf
+	#define unlink _unlink
+#else
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define WINAPI
+#endif
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceMmap.h"
+#include "MQTTTime.h"
+#include "Thread.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** the number of slots of a new file, unless the options say otherwise */
+#define MMAP_DEFAULT_SLOT_COUNT 1024
+
+/** the size of the slots of a new file, unless the options say otherwise */
+#define MMAP_DEFAULT_SLOT_SIZE 512
+
+/** the longest the thread sleeps between looks at the store, in milliseconds */
+#define MMAP_IDLE_WAIT 1000
+
+/** the bytes before the first slot */
+#define MMAP_HEADER_SIZE 64
+
+/** the longest key kept in a slot, with its terminating null */
+#define MMAP_KEY_LENGTH 16
+
+#define MMAP_MAGIC "MQTCMAP1"
+#define MMAP_VERSION 1
+
+#define MMAP_SLOT_FREE 0
+#define MMAP_SLOT_USED 0x44455355 /* USED */
+
+/** The header at the start of the file, in the byte order of the host */
+typedef struct
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int slotCount;
+	unsigned int slotSize;
+	unsigned int seq;     /**< the sequence number of the last record written, when the file was closed */
+} MmapHeader;
+
+/** The header of a slot, the data following it */
+typedef struct
+{
+	unsigned int state;   /**< MMAP_SLOT_USED, written once the rest of the slot has been */
+	unsigned int crc;     /**< of the rest of the header and the data */
+	unsigned int seq;     /**< the sequence number of the put */
+	unsigned short keylen;
+	unsigned short reserved;
+	unsigned int datalen;
+	char key[MMAP_KEY_LENGTH];
+} MmapSlot;
+
+/** Where the record of a key is.  The key follows the structure, in the same allocation. */
+typedef struct
+{
+	char* key;
+	int slot;             /**< the slot, -1 for a record in a file of its own */
+} MmapEntry;
+
+/** The handle of an open store */
+typedef struct
+{
+	void* files;          /**< the default persistence of the records which do not fit in a slot */
+	char* mapName;        /**< the file of the slots */
+	int syncPolicy;       /**< one of the MQTTCLIENT_LOG_SYNC values */
+	int syncInterval;
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	char* base;           /**< where the file is mapped */
+	size_t length;
+	unsigned int slotCount;
+	unsigned int slotSize;
+	mutex_type mutex;     /**< protects all the fields below */
+	sem_type wake;        /**< posted to make the thread stop */
+	Tree* index;          /**< an MmapEntry for each key, by key */
+	unsigned int next;    /**< the slot the search for a free one starts at */
+	unsigned int used;    /**< the number of slots in use */
+	unsigned int seq;     /**< the sequence number of the last put */
+	size_t dirtyStart;    /**< the range of the file written since it was last synced */
+	size_t dirtyEnd;
+	int stop;             /**< the thread is to finish */
+	volatile int running; /**< the thread has been started and not yet finished */
+} MmapStore;
+
+
+/**
+ * Tree callback function for comparing index entries by key
+ */
+static int pstmap_compare(void* a, void* b, int content)
+{
+	const char* key = content ? ((MmapEntry*)b)->key : (const char*)b;
+
+	return strcmp(((MmapEntry*)a)->key, key);
+}
+
+
+/**
+ * Whether one sequence number comes before another, allowing for wrapping.
+ */
+static int seqBefore(unsigned int a, unsigned int b)
+{
+	return (int)(a - b) < 0;
+}
+
+
+static MmapSlot* pstmap_slot(MmapStore* store, unsigned int n)
+{
+	return (MmapSlot*)(store->base + MMAP_HEADER_SIZE + (size_t)n * store->slotSize);
+}
+
+
+/**
+ * Calculates the CRC of a slot, from its sequence number to the end of its data.
+ */
+static unsigned int pstmap_crc(MmapSlot* slot)
+{
+	return MQTTPersistence_crc32(0, (char*)&slot->seq, sizeof(MmapSlot) - offsetof(MmapSlot, seq) + slot->datalen);
+}
+
+
+/**
+ * Makes the options of the mmap persistence into the context stored with it.
+ * @param options the options, NULL for the defaults
+ * @return the context, to be freed with ::pstmapfreecontext, or NULL if the
+ * options are not valid or memory is short
+ */
+void* pstmapcontext(const MQTTClient_mmapPersistenceOptions* options)
+{
+	MQTTClient_mmapPersistenceOptions defaults = MQTTClient_mmapPersistenceOptions_initializer;
+	MQTTClient_mmapPersistenceOptions* context = NULL;
+	const char* directory = NULL;
+
+	FUNC_ENTRY;
+	if (options == NULL)
+		options = &defaults;
+	if (strncmp(options->struct_id, "MQTM", 4) != 0 || options->struct_version != 0 ||
+		options->syncPolicy < MQTTCLIENT_LOG_SYNC_NEVER || options->syncPolicy > MQTTCLIENT_LOG_SYNC_INTERVAL ||
+		(options->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL && options->syncInterval <= 0) ||
+		options->slotCount < 0 || options->slotSize < 0 || options->slotSize % 8 != 0 ||
+		(options->slotSize > 0 && options->slotSize < (int)sizeof(MmapSlot) + 8) ||
+		(options->slotSize > 0 && options->slotCount > 0x7FFFFFFF / options->slotSize))
+		goto exit;
+	directory = (options->directory) ? options->directory : "."; /* working directory */
+	if ((context = malloc(sizeof(MQTTClient_mmapPersistenceOptions) + strlen(directory) + 1)) == NULL)
+		goto exit;
+	*context = *options;
+	context->directory = (char*)(context + 1);
+	strcpy((char*)context->directory, directory);
+	if (context->slotCount == 0)
+		context->slotCount = MMAP_DEFAULT_SLOT_COUNT;
+	if (context->slotSize == 0)
+		context->slotSize = MMAP_DEFAULT_SLOT_SIZE;
+exit:
+	FUNC_EXIT;
+	return context;
+}
+
+
+/**
+ * Frees the context made by ::pstmapcontext.
+ * @param context the context
+ */
+void pstmapfreecontext(void* context)
+{
+	free(context);
+}
+
+
+/**
+ * Syncs a range of the file to disk.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstmap_flush(MmapStore* store, size_t start, size_t end)
+{
+	int rc = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	if (!FlushViewOfFile(store->base + start, end - start) || !FlushFileBuffers(store->file))
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#else
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	start -= start % page; /* msync wants the start of a page */
+	if (msync(store->base + start, end - start, MS_SYNC) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#endif
+	if (rc != 0)
+		Log(LOG_ERROR, -1, "Error %d syncing %s", errno, store->mapName);
+	return rc;
+}
+
+
+/**
+ * Records that a range of the file has been written, syncing it at once with
+ * the always sync policy.  Must be called with the store mutex held.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstmap_written(MmapStore* store, void* from, size_t len)
+{
+	size_t start = (char*)from - store->base;
+	int rc = 0;
+
+	if (store->syncPolicy == MQTTCLIENT_LOG_SYNC_ALWAYS)
+		rc = pstmap_flush(store, start, start + len);
+	else if (store->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL)
+	{
+		if (store->dirtyStart >= store->dirtyEnd || start < store->dirtyStart)
+			store->dirtyStart = start;
+		if (start + len > store->dirtyEnd)
+			store->dirtyEnd = start + len;
+	}
+	return rc;
+}
+
+
+/**
+ * Frees a slot.  Must be called with the store mutex held.
+ */
+static void pstmap_freeSlot(MmapStore* store, int n)
+{
+	MmapSlot* slot = pstmap_slot(store, n);
+
+	slot->state = MMAP_SLOT_FREE;
+	--(store->used);
+	pstmap_written(store, &slot->state, sizeof(slot->state));
+}
+
+
+/**
+ * Takes the next free slot round the ring.  Must be called with the store mutex held.
+ * @return the slot, or -1 if there is none free
+ */
+static int pstmap_takeSlot(MmapStore* store)
+{
+	unsigned int n = store->next;
+
+	if (store->used == store->slotCount)
+		return -1;
+	while (pstmap_slot(store, n)->state != MMAP_SLOT_FREE)
+		n = (n + 1 == store->slotCount) ? 0 : n + 1;
+	store->next = (n + 1 == store->slotCount) ? 0 : n + 1;
+	++(store->used);
+	return (int)n;
+}
+
+
+/**
+ * Records in the index where the record of a key is.
+ * @return the entry, or NULL if memory is short
+ */
+static MmapEntry* pstmap_indexPut(MmapStore* store, const char* key, int slot)
+{
+	MmapEntry* e = NULL;
+	size_t size = sizeof(MmapEntry) + strlen(key) + 1;
+
+	if ((e = malloc(size)) != NULL)
+	{
+		e->key = (char*)(e + 1);
+		strcpy(e->key, key);
+		e->slot = slot;
+		TreeAdd(store->index, e, size);
+	}
+	return e;
+}
+
+
+/**
+ * Empties the index of a store.
+ */
+static void pstmap_emptyIndex(MmapStore* store)
+{
+	Node* node = NULL;
+
+	while ((node = TreeNextElement(store->index, NULL)) != NULL)
+	{
+		void* e = TreeRemove(store->index, node->content);
+
+		if (e)
+			free(e);
+	}
+}
+
+
+/* This is the thread function that syncs the store with the interval sync policy */
+static thread_return_type WINAPI pstmap_run(void* n)
+{
+	MmapStore* store = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTMmap");
+	Paho_thread_lock_mutex(store->mutex);
+	while (!store->stop)
+	{
+		int wait = (store->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL) ? store->syncInterval : MMAP_IDLE_WAIT;
+
+		Paho_thread_unlock_mutex(store->mutex);
+		Thread_wait_sem(store->wake, wait);
+		Paho_thread_lock_mutex(store->mutex);
+		if (!store->stop && store->dirtyStart < store->dirtyEnd)
+		{	/* the mapping stays while the thread runs, so the puts can go on meanwhile */
+			size_t start = store->dirtyStart, end = store->dirtyEnd;
+
+			store->dirtyStart = store->dirtyEnd = 0;
+			Paho_thread_unlock_mutex(store->mutex);
+			pstmap_flush(store, start, end);
+			Paho_thread_lock_mutex(store->mutex);
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	FUNC_EXIT;
+	store->running = 0; /* the last touch of the store, which may be freed from now on */
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
+/**
+ * Opens the file of the slots, creating and allocating it in full if it is
+ * not there, and maps it into memory.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstmap_map(MmapStore* store, MQTTClient_mmapPersistenceOptions* options)
+{
+	MmapHeader header;
+	int created = 0;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#if defined(_WIN32) || defined(_WIN64)
+	DWORD bytes = 0;
+	LARGE_INTEGER size;
+
+	FUNC_ENTRY;
+	store->file = CreateFileA(store->mapName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (store->file == INVALID_HANDLE_VALUE)
+		goto exit;
+	created = !ReadFile(store->file, &header, sizeof(header), &bytes, NULL) || bytes == 0;
+#else
+	struct stat st;
+
+	FUNC_ENTRY;
+	if ((store->fd = open(store->mapName, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+		goto exit;
+	if (fstat(store->fd, &st) != 0)
+		goto exit;
+	created = (st.st_size == 0);
+	if (!created && read(store->fd, &header, sizeof(header)) != sizeof(header))
+		goto exit;
+#endif
+	if (created)
+	{
+		store->slotCount = options->slotCount;
+		store->slotSize = options->slotSize;
+	}
+	else if (memcmp(header.magic, MMAP_MAGIC, sizeof(header.magic)) != 0 || header.version != MMAP_VERSION ||
+		header.slotCount == 0 || header.slotSize < sizeof(MmapSlot) + 8)
+	{
+		Log(LOG_ERROR, -1, "%s is not a persistence file", store->mapName);
+		goto exit;
+	}
+	else
+	{	/* the slots of the file are kept, whatever the options say */
+		store->slotCount = header.slotCount;
+		store->slotSize = header.slotSize;
+		store->seq = header.seq;
+	}
+	store->length = MMAP_HEADER_SIZE + (size_t)store->slotCount * store->slotSize;
+#if defined(_WIN32) || defined(_WIN64)
+	size.QuadPart = (LONGLONG)store->length;
+	if (created && (!SetFilePointerEx(store->file, size, NULL, FILE_BEGIN) || !SetEndOfFile(store->file)))
+		goto exit;
+	if ((store->mapping = CreateFileMappingA(store->file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL)) == NULL)
+		goto exit;
+	if ((store->base = MapViewOfFile(store->mapping, FILE_MAP_ALL_ACCESS, 0, 0, store->length)) == NULL)
+		goto exit;
+#else
+	if (created)
+	{	/* allocate the blocks now, so that a put never finds the disk full */
+#if defined(__linux__)
+		if (posix_fallocate(store->fd, 0, (off_t)store->length) != 0)
+#endif
+			if (ftruncate(store->fd, (off_t)store->length) != 0)
+				goto exit;
+	}
+	else if ((size_t)st.st_size < store->length)
+	{
+		Log(LOG_ERROR, -1, "%s is too short for its slots", store->mapName);
+		goto exit;
+	}
+	store->base = mmap(NULL, store->length, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+	if (store->base == MAP_FAILED)
+	{
+		store->base = NULL;
+		goto exit;
+	}
+#endif
+	if (created)
+	{	/* the slots are all free, being zero */
+		MmapHeader* h = (MmapHeader*)store->base;
+
+		memcpy(h->magic, MMAP_MAGIC, sizeof(h->magic));
+		h->version = MMAP_VERSION;
+		h->slotCount = store->slotCount;
+		h->slotSize = store->slotSize;
+		h->seq = 0;
+		if (store->syncPolicy != MQTTCLIENT_LOG_SYNC_NEVER)
+			pstmap_flush(store, 0, MMAP_HEADER_SIZE);
+	}
+	rc = 0;
+exit:
+	if (rc != 0)
+		Log(LOG_ERROR, -1, "Error %d mapping %s", errno, store->mapName);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Unmaps and closes the file of the slots.
+ */
+static void pstmap_unmap(MmapStore* store)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	if (store->base)
+		UnmapViewOfFile(store->base);
+	if (store->mapping)
+		CloseHandle(store->mapping);
+	if (store->file != INVALID_HANDLE_VALUE)
+		CloseHandle(store->file);
+	store->file = INVALID_HANDLE_VALUE;
+	store->mapping = NULL;
+#else
+	if (store->base)
+		munmap(store->base, store->length);
+	if (store->fd != -1)
+		close(store->fd);
+	store->fd = -1;
+#endif
+	store->base = NULL;
+}
+
+
+/**
+ * Scans the slots, and the records in files of their own, into the index.
+ * @return 0 if success, #PAHO_MEMORY_ERROR or #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstmap_recover(MmapStore* store)
+{
+	char** keys = NULL;
+	int nkeys = 0;
+	int last = -1;
+	unsigned int n;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	for (n = 0; n < store->slotCount; ++n)
+	{
+		MmapSlot* slot = pstmap_slot(store, n);
+		Node* node = NULL;
+
+		if (slot->state == MMAP_SLOT_FREE)
+			continue;
+		if (slot->state != MMAP_SLOT_USED || slot->keylen == 0 || slot->keylen >= MMAP_KEY_LENGTH ||
+			slot->key[slot->keylen] != '\0' || slot->datalen > store->slotSize - sizeof(MmapSlot) ||
+			pstmap_crc(slot) != slot->crc)
+		{	/* cut short by a crash */
+			slot->state = MMAP_SLOT_FREE;
+			pstmap_written(store, &slot->state, sizeof(slot->state));
+			continue;
+		}
+		++(store->used);
+		if ((node = TreeFind(store->index, slot->key)) != NULL)
+		{	/* put again, and the crash came before the first was freed */
+			MmapEntry* e = node->content;
+
+			if (seqBefore(pstmap_slot(store, e->slot)->seq, slot->seq))
+			{
+				pstmap_freeSlot(store, e->slot);
+				e->slot = (int)n;
+			}
+			else
+			{
+				pstmap_freeSlot(store, n);
+				continue;
+			}
+		}
+		else if (pstmap_indexPut(store, slot->key, (int)n) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		if (seqBefore(store->seq, slot->seq))
+			store->seq = slot->seq;
+		if (last == -1 || seqBefore(pstmap_slot(store, last)->seq, slot->seq))
+			last = (int)n;
+	}
+	store->next = (last + 1 == (int)store->slotCount) ? 0 : last + 1; /* carry on round the ring */
+
+	if ((rc = pstkeys(store->files, &keys, &nkeys)) != 0)
+		goto exit;
+	for (i = 0; i < nkeys; ++i)
+	{
+		if (TreeFind(store->index, keys[i]) != NULL)
+			pstremove(store->files, keys[i]); /* the slot is the later, as it is freed last */
+		else if (rc == 0 && pstmap_indexPut(store, keys[i], -1) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		free(keys[i]);
+	}
+	if (keys)
+		free(keys);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Frees a store, which must be unmapped and have no thread running.
+ */
+static void pstmap_free(MmapStore* store)
+{
+	if (store->index)
+	{
+		pstmap_emptyIndex(store);
+		TreeFree(store->index);
+	}
+	if (store->wake)
+		Thread_destroy_sem(store->wake);
+	if (store->mutex)
+		Paho_thread_destroy_mutex(store->mutex);
+	if (store->mapName)
+		free(store->mapName);
+	if (store->files)
+		pstclose(store->files);
+	free(store);
+}
+
+
+/** Open the file of the slots of the client, context/clientID-serverURI.map,
+ *  reading it into the index.
+ *  See ::Persistence_open
+ */
+int pstmapopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	MQTTClient_mmapPersistenceOptions* options = context;
+	MmapStore* store = NULL;
+	size_t alloclen = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(MmapStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(MmapStore));
+#if defined(_WIN32) || defined(_WIN64)
+	store->file = INVALID_HANDLE_VALUE;
+#else
+	store->fd = -1;
+#endif
+	store->syncPolicy = options->syncPolicy;
+	store->syncInterval = options->syncInterval;
+	if ((rc = pstopen(&store->files, clientID, serverURI, (void*)options->directory)) != 0)
+		goto error;
+	alloclen = strlen(pstclientdir(store->files)) + strlen(MAP_FILENAME_EXTENSION) + 1;
+	if ((store->mapName = malloc(alloclen)) == NULL || (store->index = TreeInitialize(pstmap_compare)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	snprintf(store->mapName, alloclen, "%s%s", pstclientdir(store->files), MAP_FILENAME_EXTENSION);
+	store->mutex = Paho_thread_create_mutex(&rc);
+	if (rc != 0)
+		goto error;
+	store->wake = Thread_create_sem(&rc);
+	if (rc != 0)
+		goto error;
+	if ((rc = pstmap_map(store, options)) != 0 || (rc = pstmap_recover(store)) != 0)
+	{
+		pstmap_unmap(store);
+		goto error;
+	}
+	store->running = 1;
+	Paho_thread_start(pstmap_run, store);
+	*handle = store;
+	goto exit;
+error:
+	pstmap_free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Close the store, and delete its files if it holds nothing.
+ *  See ::Persistence_close
+ */
+int pstmapclose(void* handle)
+{
+	MmapStore* store = handle;
+	int count = 0;
+	int empty = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	store->stop = 1;
+	Paho_thread_unlock_mutex(store->mutex);
+	Thread_post_sem(store->wake);
+	while (store->running && ++count < 3000)
+		MQTTTime_sleep(10L);
+	if (store->running)
+	{	/* the file would be unmapped under the thread, so leave it be */
+		Log(LOG_ERROR, -1, "Mmap persistence thread did not finish");
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	empty = (store->index->count == 0);
+	((MmapHeader*)store->base)->seq = store->seq;
+	if (!empty && store->syncPolicy != MQTTCLIENT_LOG_SYNC_NEVER)
+		rc = pstmap_flush(store, 0, store->length);
+	pstmap_unmap(store);
+	if (empty)
+		unlink(store->mapName);
+	pstmap_free(store); /* pstclose removes the directory if it is empty */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Put a wire message into a free slot, or a file of its own if it does not fit.
+ *  See ::Persistence_put
+ */
+int pstmapput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	MmapStore* store = handle;
+	Node* node = NULL;
+	MmapEntry* e = NULL;
+	size_t keylen = strlen(key);
+	size_t datalen = 0;
+	int n = -1;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	Paho_thread_lock_mutex(store->mutex);
+	if ((node = TreeFind(store->index, key)) != NULL)
+		e = node->content;
+	if (keylen < MMAP_KEY_LENGTH && datalen <= store->slotSize - sizeof(MmapSlot) && (n = pstmap_takeSlot(store)) != -1)
+	{
+		MmapSlot* slot = pstmap_slot(store, n);
+		char* data = (char*)(slot + 1);
+
+		memset(slot->key, '\0', sizeof(slot->key));
+		memcpy(slot->key, key, keylen);
+		slot->keylen = (unsigned short)keylen;
+		slot->reserved = 0;
+		slot->datalen = (unsigned int)datalen;
+		slot->seq = ++(store->seq);
+		for (i = 0; i < bufcount; ++i)
+		{
+			memcpy(data, buffers[i], buflens[i]);
+			data += buflens[i];
+		}
+		slot->crc = pstmap_crc(slot);
+		slot->state = MMAP_SLOT_USED;
+		rc = pstmap_written(store, slot, sizeof(MmapSlot) + datalen);
+	}
+	else
+		rc = pstput(store->files, key, bufcount, buffers, buflens);
+	if (rc != 0)
+	{
+		if (n != -1)
+			pstmap_freeSlot(store, n);
+	}
+	else if (e == NULL)
+	{
+		if (pstmap_indexPut(store, key, n) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+	}
+	else
+	{	/* the old record goes once the new one is there */
+		if (e->slot != -1)
+			pstmap_freeSlot(store, e->slot);
+		else if (n != -1)
+			pstremove(store->files, key);
+		e->slot = n;
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from its slot or its file.
+ *  See ::Persistence_get
+ */
+int pstmapget(void* handle, char* key, char** buffer, int* buflen)
+{
+	MmapStore* store = handle;
+	Node* node = NULL;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(store->mutex);
+	if ((node = TreeFind(store->index, key)) != NULL)
+	{
+		MmapEntry* e = node->content;
+
+		if (e->slot == -1)
+			rc = pstget(store->files, key, buffer, buflen);
+		else
+		{
+			MmapSlot* slot = pstmap_slot(store, e->slot);
+
+			if ((*buffer = malloc(slot->datalen > 0 ? slot->datalen : 1)) == NULL)
+				rc = PAHO_MEMORY_ERROR;
+			else
+			{
+				memcpy(*buffer, slot + 1, slot->datalen);
+				*buflen = (int)slot->datalen;
+				rc = 0;
+			}
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	/* the caller must free the buffer */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Free the slot, or delete the file, of a persisted message.
+ *  See ::Persistence_remove
+ */
+int pstmapremove(void* handle, char* key)
+{
+	MmapStore* store = handle;
+	MmapEntry* e = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if ((e = TreeRemoveKey(store->index, key)) != NULL)
+	{
+		if (e->slot == -1)
+			rc = pstremove(store->files, key);
+		else
+			pstmap_freeSlot(store, e->slot);
+		free(e);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys in the store.
+ *  See ::Persistence_keys
+ */
+int pstmapkeys(void* handle, char*** keys, int* nkeys)
+{
+	MmapStore* store = handle;
+	Node* node = NULL;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->index->count > 0 && (fkeys = malloc(store->index->count * sizeof(char*))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	while (rc == 0 && (node = TreeNextElement(store->index, node)) != NULL)
+	{
+		MmapEntry* e = node->content;
+
+		if ((fkeys[nfkeys] = malloc(strlen(e->key) + 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			break;
+		}
+		strcpy(fkeys[nfkeys++], e->key);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	if (rc != 0)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		if (fkeys)
+			free(fkeys);
+		fkeys = NULL;
+	}
+	*keys = fkeys;
+	*nkeys = nfkeys;
+	/* the caller must free keys */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Free all the slots, and delete the files of the records which did not fit.
+ *  The files are deleted by key, leaving the rest of the directory alone.
+ *  See ::Persistence_clear
+ */
+int pstmapclear(void* handle)
+{
+	MmapStore* store = handle;
+	Node* node = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	while ((node = TreeNextElement(store->index, node)) != NULL)
+	{
+		MmapEntry* e = node->content;
+
+		if (e->slot != -1)
+			pstmap_freeSlot(store, e->slot);
+		else if (pstremove(store->files, e->key) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	pstmap_emptyIndex(store);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a wire message is persisted in the store.
+ *  See ::Persistence_containskey
+ */
+int pstmapcontainskey(void* handle, char* key)
+{
+	MmapStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->index, key) != NULL)
+		rc = 0;
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+#endif /* !defined(NO_PERSISTENCE) */
@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - memory mapped slot persistence
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCEMMAP_H)
+#define MQTTPERSISTENCEMMAP_H
+
+#include "MQTTClientPersistence.h"
+
+/** Extension of the filename of the slots, which is kept next to the client directory */
+#define MAP_FILENAME_EXTENSION ".map"
+
+/* the context of the mmap persistence, made from its options */
+void* pstmapcontext(const MQTTClient_mmapPersistenceOptions* options);
+void pstmapfreecontext(void* context);
+
+/* prototypes of the functions for the mmap persistence */
+int pstmapopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int pstmapclose(void* handle);
+int pstmapput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int pstmapget(void* handle, char* key, char** buffer, int* buflen);
+int pstmapremove(void* handle, char* key);
+int pstmapkeys(void* handle, char*** keys, int* nkeys);
+int pstmapclear(void* handle);
+int pstmapcontainskey(void* handle, char* key);
+
+#endif
@@ -0,0 +1,837 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - SQLite persistence
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A persistence implementation over an SQLite database.
+ *
+ * The records of all the clients which use the same directory are kept in
+ * one database there, ::SQL_FILENAME, a row for each record keyed by the
+ * client and the record key.  Opening a client makes no directory of its
+ * own, and listing or clearing its records is a query on the primary key.
+ * The database is opened once in the process, by the first client to use
+ * it, and the statements are prepared then; the clients share the connection.
+ *
+ * The database is in WAL journal mode, so that a commit is an append to the
+ * write-ahead log.  The sync policy says when the log is synced: at each
+ * commit (synchronous FULL), never (OFF), or with the interval policy
+ * (NORMAL) at the checkpoints a thread of the database makes every interval.
+ *
+ * Each put or remove is a transaction of its own, unless it is made between
+ * ::pstsqlbegin and ::pstsqlcommit, as the persistence writer does for each
+ * batch it commits.  A put or remove of another client meanwhile commits the
+ * open transaction and starts it again, so that a store which returns from a
+ * put has always committed it.
+ */
+
+#if defined(MQTT_SQLITE) && !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#define snprintf _snprintf
+#else
+	#define WINAPI
+#endif
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceSqlite.h"
+#include "MQTTTime.h"
+#include "LinkedList.h"
+#include "Thread.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** the longest the thread sleeps between looks at the database, in milliseconds */
+#define SQL_IDLE_WAIT 1000
+
+/** how long a statement waits for another process holding the database, in milliseconds */
+#define SQL_BUSY_WAIT 5000
+
+enum
+{
+	SQL_PUT, SQL_GET, SQL_REMOVE, SQL_KEYS, SQL_CLEAR, SQL_CONTAINS, SQL_BEGIN, SQL_COMMIT,
+	SQL_STATEMENTS
+};
+
+/** the statements prepared for each database, in the order of the enumeration above */
+static const char* sqlite_statements[SQL_STATEMENTS] =
+{
+	"INSERT OR REPLACE INTO records (client, key, data) VALUES (?1, ?2, ?3)",
+	"SELECT data FROM records WHERE client = ?1 AND key = ?2",
+	"DELETE FROM records WHERE client = ?1 AND key = ?2",
+	"SELECT key FROM records WHERE client = ?1",
+	"DELETE FROM records WHERE client = ?1",
+	"SELECT 1 FROM records WHERE client = ?1 AND key = ?2",
+	"BEGIN",
+	"COMMIT"
+};
+
+/** A database open in the process, shared by the stores in its directory */
+typedef struct
+{
+	char* fileName;
+	sqlite3* db;          /**< the connection, opened without a mutex of its own */
+	sqlite3_stmt* stmts[SQL_STATEMENTS];
+	int users;            /**< the stores open on the database */
+	mutex_type mutex;     /**< protects the connection and all the fields below */
+	sem_type wake;        /**< posted to make the thread stop */
+	int syncPolicy;       /**< the strictest MQTTCLIENT_LOG_SYNC value of the stores */
+	int syncInterval;     /**< the shortest interval of the stores */
+	int batches;          /**< the batches being committed in the open transaction */
+	int dirty;            /**< whether anything has been committed since the last checkpoint */
+	int stop;             /**< the thread is to finish */
+	volatile int running; /**< the thread has been started and not yet finished */
+} SqliteDb;
+
+/** The handle of an open store */
+typedef struct
+{
+	SqliteDb* db;
+	char* client;         /**< the client column of its records, clientID-serverURI */
+	int batching;         /**< whether a batch of the store is being committed */
+} SqliteStore;
+
+/**
+ * The databases open, which only ::pstsqlopen and ::pstsqlclose change.  The
+ * clients open and close their stores with mqttclient_mutex held.
+ */
+static List* sqlite_databases = NULL;
+
+
+/**
+ * Makes the options of the SQLite persistence into the context stored with it.
+ * @param options the options, NULL for the defaults
+ * @return the context, to be freed with ::pstsqlfreecontext, or NULL if the
+ * options are not valid or memory is short
+ */
+void* pstsqlcontext(const MQTTClient_sqlitePersistenceOptions* options)
+{
+	MQTTClient_sqlitePersistenceOptions defaults = MQTTClient_sqlitePersistenceOptions_initializer;
+	MQTTClient_sqlitePersistenceOptions* context = NULL;
+	const char* directory = NULL;
+
+	FUNC_ENTRY;
+	if (options == NULL)
+		options = &defaults;
+	if (strncmp(options->struct_id, "MQTQ", 4) != 0 || options->struct_version != 0 ||
+		options->syncPolicy < MQTTCLIENT_LOG_SYNC_NEVER || options->syncPolicy > MQTTCLIENT_LOG_SYNC_INTERVAL ||
+		(options->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL && options->syncInterval <= 0))
+		goto exit;
+	directory = (options->directory) ? options->directory : "."; /* working directory */
+	if ((context = malloc(sizeof(MQTTClient_sqlitePersistenceOptions) + strlen(directory) + 1)) == NULL)
+		goto exit;
+	*context = *options;
+	context->directory = (char*)(context + 1);
+	strcpy((char*)context->directory, directory);
+exit:
+	FUNC_EXIT;
+	return context;
+}
+
+
+/**
+ * Frees the context made by ::pstsqlcontext.
+ * @param context the context
+ */
+void pstsqlfreecontext(void* context)
+{
+	free(context);
+}
+
+
+/**
+ * Logs an error of the database.
+ * @return #MQTTCLIENT_PERSISTENCE_ERROR
+ */
+static int pstsql_error(SqliteDb* d, int rc, const char* what)
+{
+	Log(LOG_ERROR, -1, "SQLite persistence error %d %s %s: %s", rc, what, d->fileName, sqlite3_errmsg(d->db));
+	return MQTTCLIENT_PERSISTENCE_ERROR;
+}
+
+
+/**
+ * Runs a prepared statement which returns no rows.  Must be called with the
+ * database mutex held.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstsql_run(SqliteDb* d, int stmt)
+{
+	int rc = sqlite3_step(d->stmts[stmt]);
+
+	sqlite3_reset(d->stmts[stmt]);
+	return (rc == SQLITE_DONE) ? 0 : pstsql_error(d, rc, sqlite_statements[stmt]);
+}
+
+
+/**
+ * Binds the client and, if there is one, the key of a statement.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstsql_bind(SqliteStore* store, int stmt, const char* key)
+{
+	SqliteDb* d = store->db;
+	int rc = sqlite3_bind_text(d->stmts[stmt], 1, store->client, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK && key)
+		rc = sqlite3_bind_text(d->stmts[stmt], 2, key, -1, SQLITE_STATIC);
+	return (rc == SQLITE_OK) ? 0 : pstsql_error(d, rc, "binding");
+}
+
+
+/**
+ * Finishes a change of a store.  A change made in the transaction of another
+ * store's batch is committed at once, the transaction starting again for the
+ * rest of the batch.  Must be called with the database mutex held.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstsql_changed(SqliteStore* store)
+{
+	SqliteDb* d = store->db;
+	int rc = 0;
+
+	if (d->batches > 0 && !store->batching &&
+		(rc = pstsql_run(d, SQL_COMMIT)) == 0 && pstsql_run(d, SQL_BEGIN) != 0)
+		d->batches = 0; /* the rest of the batches go without a transaction */
+	d->dirty = 1;
+	return rc;
+}
+
+
+/**
+ * Sets how often the database is synced, the strictest of the policies of
+ * the stores open on it.  Must be called with the database mutex held.
+ */
+static int pstsql_setSync(SqliteDb* d, MQTTClient_sqlitePersistenceOptions* options)
+{
+	static const char* pragmas[] =
+	{	/* in the order of the MQTTCLIENT_LOG_SYNC values */
+		"PRAGMA synchronous = OFF", "PRAGMA synchronous = FULL", "PRAGMA synchronous = NORMAL"
+	};
+	static const int strictness[] = { 0, 2, 1 };
+	int rc = SQLITE_OK;
+
+	if (d->users == 0 || strictness[options->syncPolicy] > strictness[d->syncPolicy])
+	{
+		d->syncPolicy = options->syncPolicy;
+		rc = sqlite3_exec(d->db, pragmas[d->syncPolicy], NULL, NULL, NULL);
+	}
+	if (options->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL &&
+		(d->syncInterval == 0 || options->syncInterval < d->syncInterval))
+		d->syncInterval = options->syncInterval;
+	return (rc == SQLITE_OK) ? 0 : pstsql_error(d, rc, "setting the sync policy of");
+}
+
+
+/* This is the thread function that checkpoints a database with the interval sync policy */
+static thread_return_type WINAPI pstsql_thread(void* n)
+{
+	SqliteDb* d = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTSqlite");
+	Paho_thread_lock_mutex(d->mutex);
+	while (!d->stop)
+	{
+		int wait = (d->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL) ? d->syncInterval : SQL_IDLE_WAIT;
+
+		Paho_thread_unlock_mutex(d->mutex);
+		Thread_wait_sem(d->wake, wait);
+		Paho_thread_lock_mutex(d->mutex);
+		/* a checkpoint syncs the log first; an open transaction waits for the next one */
+		if (!d->stop && d->syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL && d->dirty && d->batches == 0)
+		{
+			int rc = sqlite3_wal_checkpoint_v2(d->db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+
+			if (rc == SQLITE_OK)
+				d->dirty = 0;
+			else if (rc != SQLITE_BUSY)
+				pstsql_error(d, rc, "checkpointing");
+		}
+	}
+	Paho_thread_unlock_mutex(d->mutex);
+	FUNC_EXIT;
+	d->running = 0; /* the last touch of the database, which may be freed from now on */
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
+/**
+ * Closes a database, which must have no thread running, and frees it.
+ */
+static void pstsql_free(SqliteDb* d)
+{
+	int i;
+
+	for (i = 0; i < SQL_STATEMENTS; ++i)
+	{
+		if (d->stmts[i])
+			sqlite3_finalize(d->stmts[i]);
+	}
+	if (d->db)
+		sqlite3_close(d->db); /* the last connection checkpoints the log and deletes it */
+	if (d->wake)
+		Thread_destroy_sem(d->wake);
+	if (d->mutex)
+		Paho_thread_destroy_mutex(d->mutex);
+	if (d->fileName)
+		free(d->fileName);
+	free(d);
+}
+
+
+/**
+ * Opens a database, creating it if it is not there, and prepares its statements.
+ * @param d the database, with its file name set
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstsql_connect(SqliteDb* d)
+{
+	int rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if ((rc = sqlite3_open_v2(d->fileName, &d->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+			SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK)
+	{
+		rc = pstsql_error(d, rc, "opening");
+		goto exit;
+	}
+	sqlite3_busy_timeout(d->db, SQL_BUSY_WAIT);
+	if ((rc = sqlite3_exec(d->db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL)) != SQLITE_OK ||
+		(rc = sqlite3_exec(d->db, "CREATE TABLE IF NOT EXISTS records (client TEXT NOT NULL, "
+			"key TEXT NOT NULL, data BLOB NOT NULL, PRIMARY KEY (client, key)) WITHOUT ROWID",
+			NULL, NULL, NULL)) != SQLITE_OK)
+	{
+		rc = pstsql_error(d, rc, "setting up");
+		goto exit;
+	}
+	for (i = 0; i < SQL_STATEMENTS; ++i)
+	{
+		if ((rc = sqlite3_prepare_v2(d->db, sqlite_statements[i], -1, &d->stmts[i], NULL)) != SQLITE_OK)
+		{
+			rc = pstsql_error(d, rc, "preparing the statements of");
+			goto exit;
+		}
+	}
+	rc = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Stops the thread of a database no store has open any more, closes it and
+ * frees it.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstsql_release(SqliteDb* d)
+{
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	ListDetach(sqlite_databases, d);
+	Paho_thread_lock_mutex(d->mutex);
+	d->stop = 1;
+	Paho_thread_unlock_mutex(d->mutex);
+	Thread_post_sem(d->wake);
+	while (d->running && ++count < 3000)
+		MQTTTime_sleep(10L);
+	if (d->running)
+	{	/* the connection would be closed under the thread, so leave it be */
+		Log(LOG_ERROR, -1, "SQLite persistence thread did not finish");
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	else
+		pstsql_free(d);
+	if (sqlite_databases->count == 0)
+	{
+		ListFree(sqlite_databases);
+		sqlite_databases = NULL;
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Finds the database of a directory open in the process, or opens it.
+ * @param options the options of the store
+ * @param db set to the database
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pstsql_database(MQTTClient_sqlitePersistenceOptions* options, SqliteDb** db)
+{
+	ListElement* current = NULL;
+	SqliteDb* d = NULL;
+	size_t alloclen = strlen(options->directory) + strlen(SQL_FILENAME) + 2;
+	char* fileName = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((fileName = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	snprintf(fileName, alloclen, "%s/%s", options->directory, SQL_FILENAME);
+	while (sqlite_databases && ListNextElement(sqlite_databases, &current))
+	{
+		if (strcmp(((SqliteDb*)current->content)->fileName, fileName) == 0)
+		{
+			d = current->content;
+			break;
+		}
+	}
+	if (d)
+		free(fileName);
+	else
+	{
+		if ((d = malloc(sizeof(SqliteDb))) == NULL)
+		{
+			free(fileName);
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		memset(d, '\0', sizeof(SqliteDb));
+		d->fileName = fileName;
+		if ((rc = pstmkdir((char*)options->directory)) != 0 || (rc = pstsql_connect(d)) != 0)
+			goto error;
+		d->mutex = Paho_thread_create_mutex(&rc);
+		if (rc != 0)
+			goto error;
+		d->wake = Thread_create_sem(&rc);
+		if (rc != 0)
+			goto error;
+		if (sqlite_databases == NULL && (sqlite_databases = ListInitialize()) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto error;
+		}
+		ListAppend(sqlite_databases, d, sizeof(SqliteDb));
+		d->running = 1;
+		Paho_thread_start(pstsql_thread, d);
+	}
+	Paho_thread_lock_mutex(d->mutex);
+	if ((rc = pstsql_setSync(d, options)) == 0)
+		++(d->users);
+	Paho_thread_unlock_mutex(d->mutex);
+	if (rc == 0)
+		*db = d;
+	else if (d->users == 0)
+		pstsql_release(d);
+	goto exit;
+error:
+	pstsql_free(d);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Open the records of the client, clientID-serverURI, in the database of
+ *  the directory, which the clients of the process share.
+ *  See ::Persistence_open
+ */
+int pstsqlopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	MQTTClient_sqlitePersistenceOptions* options = context;
+	SqliteStore* store = NULL;
+	size_t alloclen = strlen(clientID) + strlen(serverURI) + 2;
+	char* ptraux = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(SqliteStore))) == NULL || (store->client = malloc(alloclen)) == NULL)
+	{
+		if (store)
+			free(store);
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	store->batching = 0;
+	/* named as the directory of the default persistence is */
+	snprintf(store->client, alloclen, "%s-%s", clientID, serverURI);
+	while ((ptraux = strchr(store->client, ':')) != NULL)
+		*ptraux = '-';
+	if ((rc = pstsql_database(options, &store->db)) != 0)
+	{
+		free(store->client);
+		free(store);
+		goto exit;
+	}
+	*handle = store;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Close the store, and the database once no store has it open.
+ *  See ::Persistence_close
+ */
+int pstsqlclose(void* handle)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int users = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	if (store->batching)
+		pstsqlcommit(store);
+	Paho_thread_lock_mutex(d->mutex);
+	users = --(d->users);
+	Paho_thread_unlock_mutex(d->mutex);
+	if (users == 0)
+		rc = pstsql_release(d);
+	free(store->client);
+	free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Put a wire message into a row of the database.
+ *  See ::Persistence_put
+ */
+int pstsqlput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	char* data = NULL;
+	int datalen = 0;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	if (bufcount == 1)
+	{	/* as the persistence writer and the queue batches put them */
+		data = buffers[0];
+		datalen = buflens[0];
+	}
+	else
+	{
+		char* ptr = NULL;
+
+		for (i = 0; i < bufcount; ++i)
+			datalen += buflens[i];
+		if ((ptr = data = malloc(datalen > 0 ? datalen : 1)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		for (i = 0; i < bufcount; ++i)
+		{
+			memcpy(ptr, buffers[i], buflens[i]);
+			ptr += buflens[i];
+		}
+	}
+	Paho_thread_lock_mutex(d->mutex);
+	if ((rc = pstsql_bind(store, SQL_PUT, key)) == 0)
+	{
+		if ((rc = sqlite3_bind_blob(d->stmts[SQL_PUT], 3, data, datalen, SQLITE_STATIC)) != SQLITE_OK)
+			rc = pstsql_error(d, rc, "binding");
+		else if ((rc = pstsql_run(d, SQL_PUT)) == 0)
+			rc = pstsql_changed(store);
+	}
+	sqlite3_clear_bindings(d->stmts[SQL_PUT]);
+	Paho_thread_unlock_mutex(d->mutex);
+	if (bufcount != 1)
+		free(data);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from its row.
+ *  See ::Persistence_get
+ */
+int pstsqlget(void* handle, char* key, char** buffer, int* buflen)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	if (pstsql_bind(store, SQL_GET, key) == 0 && sqlite3_step(d->stmts[SQL_GET]) == SQLITE_ROW)
+	{
+		const void* data = sqlite3_column_blob(d->stmts[SQL_GET], 0);
+		int datalen = sqlite3_column_bytes(d->stmts[SQL_GET], 0);
+
+		if ((*buffer = malloc(datalen > 0 ? datalen : 1)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			if (datalen > 0)
+				memcpy(*buffer, data, datalen);
+			*buflen = datalen;
+			rc = 0;
+		}
+	}
+	sqlite3_reset(d->stmts[SQL_GET]);
+	Paho_thread_unlock_mutex(d->mutex);
+	/* the caller must free the buffer */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete the row of a persisted message.
+ *  See ::Persistence_remove
+ */
+int pstsqlremove(void* handle, char* key)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	if ((rc = pstsql_bind(store, SQL_REMOVE, key)) == 0 && (rc = pstsql_run(d, SQL_REMOVE)) == 0)
+		rc = pstsql_changed(store);
+	Paho_thread_unlock_mutex(d->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys of the client's rows.
+ *  See ::Persistence_keys
+ */
+int pstsqlkeys(void* handle, char*** keys, int* nkeys)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	int size = 0;
+	int step = SQLITE_DONE;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	if ((rc = pstsql_bind(store, SQL_KEYS, NULL)) != 0)
+		goto unlock;
+	while (rc == 0 && (step = sqlite3_step(d->stmts[SQL_KEYS])) == SQLITE_ROW)
+	{
+		const char* key = (const char*)sqlite3_column_text(d->stmts[SQL_KEYS], 0);
+
+		if (nfkeys == size)
+		{
+			char** newkeys = NULL;
+
+			size = (size > 0) ? size * 2 : 64;
+			if ((newkeys = (fkeys) ? realloc(fkeys, size * sizeof(char*)) : malloc(size * sizeof(char*))) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				break;
+			}
+			fkeys = newkeys;
+		}
+		if (key == NULL || (fkeys[nfkeys] = malloc(strlen(key) + 1)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+			strcpy(fkeys[nfkeys++], key);
+	}
+	if (rc == 0 && step != SQLITE_DONE)
+		rc = pstsql_error(d, step, "listing the keys in");
+unlock:
+	sqlite3_reset(d->stmts[SQL_KEYS]);
+	Paho_thread_unlock_mutex(d->mutex);
+	if (rc != 0 || nfkeys == 0)
+	{
+		while (nfkeys > 0)
+			free(fkeys[--nfkeys]);
+		if (fkeys)
+			free(fkeys);
+		fkeys = NULL;
+	}
+	*keys = fkeys;
+	*nkeys = nfkeys;
+	/* the caller must free keys */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the rows of the client.
+ *  See ::Persistence_clear
+ */
+int pstsqlclear(void* handle)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	if ((rc = pstsql_bind(store, SQL_CLEAR, NULL)) == 0 && (rc = pstsql_run(d, SQL_CLEAR)) == 0)
+		rc = pstsql_changed(store);
+	Paho_thread_unlock_mutex(d->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a wire message is persisted in the database.
+ *  See ::Persistence_containskey
+ */
+int pstsqlcontainskey(void* handle, char* key)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		goto exit;
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	if (pstsql_bind(store, SQL_CONTAINS, key) == 0 && sqlite3_step(d->stmts[SQL_CONTAINS]) == SQLITE_ROW)
+		rc = 0;
+	sqlite3_reset(d->stmts[SQL_CONTAINS]);
+	Paho_thread_unlock_mutex(d->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Starts a batch of puts and removes of a store, which are committed together
+ * by ::pstsqlcommit.  The batches of the stores of a database share its
+ * transaction.
+ * @param handle the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise, when the
+ * puts and removes are committed one by one
+ */
+int pstsqlbegin(void* handle)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->batching)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	if (d->batches > 0 || (rc = pstsql_run(d, SQL_BEGIN)) == 0)
+	{
+		++(d->batches);
+		store->batching = 1;
+	}
+	Paho_thread_unlock_mutex(d->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Commits the batch of a store started by ::pstsqlbegin, along with what the
+ * other batches of the database have put and removed so far.
+ * @param handle the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int pstsqlcommit(void* handle)
+{
+	SqliteStore* store = handle;
+	SqliteDb* d = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL || !store->batching)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	d = store->db;
+	Paho_thread_lock_mutex(d->mutex);
+	store->batching = 0;
+	if (d->batches > 0)
+	{	/* none if a failed commit in pstsql_changed ended the transaction */
+		if ((rc = pstsql_run(d, SQL_COMMIT)) != 0)
+			sqlite3_exec(d->db, "ROLLBACK", NULL, NULL, NULL); /* the store does not know what it holds */
+		if (--(d->batches) > 0 && pstsql_run(d, SQL_BEGIN) != 0)
+			d->batches = 0;
+	}
+	Paho_thread_unlock_mutex(d->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+#endif /* defined(MQTT_SQLITE) && !defined(NO_PERSISTENCE) */
@@ -0,0 +1,43 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - SQLite persistence
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCESQLITE_H)
+#define MQTTPERSISTENCESQLITE_H
+
+#include "MQTTClientPersistence.h"
+
+/** The name of the database in the directory of the options */
+#define SQL_FILENAME "mqttc.db"
+
+/* the context of the SQLite persistence, made from its options */
+void* pstsqlcontext(const MQTTClient_sqlitePersistenceOptions* options);
+void pstsqlfreecontext(void* context);
+
+/* prototypes of the functions for the SQLite persistence */
+int pstsqlopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int pstsqlclose(void* handle);
+int pstsqlput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int pstsqlget(void* handle, char* key, char** buffer, int* buflen);
+int pstsqlremove(void* handle, char* key);
+int pstsqlkeys(void* handle, char*** keys, int* nkeys);
+int pstsqlclear(void* handle);
+int pstsqlcontainskey(void* handle, char* key);
+
+/* the puts and removes of a store between these are committed in one transaction */
+int pstsqlbegin(void* handle);
+int pstsqlcommit(void* handle);
+
+#endif
@@ -0,0 +1,615 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - tmpfs write-behind persistence
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A file system based persistence implementation which writes behind to disk.
+ *
+ * The records are written by the default persistence (see ::pstopen) to a
+ * working directory on a fast file system, such as a tmpfs, and a thread of
+ * the store copies the keys put or removed since the last checkpoint to the
+ * default persistence of a directory on disk, at an interval and when the
+ * store is closed.  A put or remove costs a file in memory, and a crash of
+ * the process loses nothing; a crash of the host loses what was written
+ * since the last checkpoint.
+ *
+ * The working copy is deleted when the store is closed, once the last
+ * checkpoint has been made, and with it a file next to it, made when the
+ * store is opened.  On opening, a working copy which is there, or is empty
+ * but has that file, was left by a crash of the process, and is newer than
+ * the checkpoint, so the whole of it is checkpointed again; otherwise the
+ * working copy is made from the checkpoint.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+	#define WINAPI
+#endif
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceTmpfs.h"
+#include "MQTTTime.h"
+#include "Thread.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** the longest time between checkpoints, unless the options say otherwise */
+#define TMPFS_DEFAULT_INTERVAL 1000
+
+/** the extension of the file next to the working directory while the store is open */
+#define OPEN_FILENAME_EXTENSION ".open"
+
+/** The handle of an open store */
+typedef struct
+{
+	void* work;           /**< the default persistence of the working directory, where the records are written */
+	void* disk;           /**< the default persistence of the checkpoint */
+	char* openName;       /**< the file which is there while the store is open */
+	int interval;         /**< the longest time between checkpoints, in milliseconds */
+	mutex_type checkpoint_mutex; /**< held while a checkpoint is made, or the store cleared */
+	mutex_type mutex;     /**< protects all the fields below */
+	sem_type wake;        /**< posted to make the thread stop */
+	Tree* pending;        /**< the keys put or removed since they were last checkpointed */
+	int stop;             /**< the thread is to finish */
+	volatile int running; /**< the thread has been started and not yet finished */
+} TmpfsStore;
+
+
+/**
+ * Tree callback function for comparing keys, which are the contents of the tree
+ */
+static int psttmp_compare(void* a, void* b, int content)
+{
+	return strcmp((char*)a, (char*)b);
+}
+
+
+/**
+ * Makes the options of the tmpfs persistence into the context stored with it.
+ * @param options the options, NULL for the defaults
+ * @return the context, to be freed with ::psttmpfreecontext, or NULL if the
+ * options are not valid or memory is short
+ */
+void* psttmpcontext(const MQTTClient_tmpfsPersistenceOptions* options)
+{
+	MQTTClient_tmpfsPersistenceOptions defaults = MQTTClient_tmpfsPersistenceOptions_initializer;
+	MQTTClient_tmpfsPersistenceOptions* context = NULL;
+	const char* directory = NULL;
+	const char* workDirectory = NULL;
+
+	FUNC_ENTRY;
+	if (options == NULL)
+		options = &defaults;
+	if (strncmp(options->struct_id, "MQTK", 4) != 0 || options->struct_version != 0 ||
+		options->checkpointInterval < 0)
+		goto exit;
+	directory = (options->directory) ? options->directory : "."; /* working directory */
+	if ((workDirectory = options->workDirectory) == NULL)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		if ((workDirectory = getenv("TEMP")) == NULL)
+			workDirectory = ".";
+#elif defined(__linux__)
+		workDirectory = "/dev/shm";
+#else
+		if ((workDirectory = getenv("TMPDIR")) == NULL)
+			workDirectory = "/tmp";
+#endif
+	}
+	if (strcmp(directory, workDirectory) == 0)
+	{
+		Log(LOG_ERROR, -1, "The tmpfs persistence needs a working directory other than %s", directory);
+		goto exit;
+	}
+	if ((context = malloc(sizeof(MQTTClient_tmpfsPersistenceOptions) + strlen(directory) +
+			strlen(workDirectory) + 2)) == NULL)
+		goto exit;
+	*context = *options;
+	context->directory = (char*)(context + 1);
+	strcpy((char*)context->directory, directory);
+	context->workDirectory = context->directory + strlen(directory) + 1;
+	strcpy((char*)context->workDirectory, workDirectory);
+	if (context->checkpointInterval == 0)
+		context->checkpointInterval = TMPFS_DEFAULT_INTERVAL;
+exit:
+	FUNC_EXIT;
+	return context;
+}
+
+
+/**
+ * Frees the context made by ::psttmpcontext.
+ * @param context the context
+ */
+void psttmpfreecontext(void* context)
+{
+	free(context);
+}
+
+
+/**
+ * Adds a key to the keys to checkpoint, if it is not there.
+ * Must be called with the store mutex held.
+ * @return 0 if success, #PAHO_MEMORY_ERROR otherwise
+ */
+static int psttmp_pend(TmpfsStore* store, const char* key)
+{
+	int rc = 0;
+
+	if (TreeFind(store->pending, (void*)key) == NULL)
+	{
+		size_t size = strlen(key) + 1;
+		char* copy = malloc(size);
+
+		if (copy == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			strcpy(copy, key);
+			TreeAdd(store->pending, copy, size);
+		}
+	}
+	return rc;
+}
+
+
+/**
+ * Empties and frees a tree of keys.
+ */
+static void psttmp_freeKeys(Tree* keys)
+{
+	Node* node = NULL;
+
+	while ((node = TreeNextElement(keys, NULL)) != NULL)
+	{
+		void* copy = TreeRemove(keys, node->content);
+
+		if (copy)
+			free(copy);
+	}
+	TreeFree(keys);
+}
+
+
+/**
+ * Copies the keys put or removed since the last checkpoint from the working
+ * directory to the checkpoint, as they are now.  A key which fails to copy is
+ * left to the next checkpoint.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise
+ */
+static int psttmp_checkpoint(TmpfsStore* store)
+{
+	Tree* keys = NULL;
+	Tree* fresh = NULL;
+	Node* node = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(store->checkpoint_mutex);
+	if ((fresh = TreeInitialize(psttmp_compare)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	keys = store->pending; /* the puts and removes from now on are for the next checkpoint */
+	store->pending = fresh;
+	Paho_thread_unlock_mutex(store->mutex);
+
+	while ((node = TreeNextElement(keys, node)) != NULL)
+	{
+		char* key = node->content;
+		char* buffer = NULL;
+		int buflen = 0;
+		int rc1 = 0;
+
+		if (pstcontainskey(store->work, key) != 0)
+			rc1 = pstremove(store->disk, key);
+		else if (pstget(store->work, key, &buffer, &buflen) == 0)
+			rc1 = pstput(store->disk, key, 1, &buffer, &buflen);
+		else if (pstcontainskey(store->work, key) != 0)
+			rc1 = pstremove(store->disk, key); /* removed while it was being copied */
+		else
+			rc1 = MQTTCLIENT_PERSISTENCE_ERROR;
+		if (buffer)
+			free(buffer);
+		if (rc1 != 0)
+		{
+			Log(LOG_ERROR, -1, "Error %d checkpointing persistence key %s", rc1, key);
+			Paho_thread_lock_mutex(store->mutex);
+			psttmp_pend(store, key);
+			Paho_thread_unlock_mutex(store->mutex);
+			rc = rc1;
+		}
+	}
+	psttmp_freeKeys(keys);
+exit:
+	Paho_thread_unlock_mutex(store->checkpoint_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/* This is the thread function that checkpoints the store at its interval */
+static thread_return_type WINAPI psttmp_run(void* n)
+{
+	TmpfsStore* store = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTTmpfs");
+	Paho_thread_lock_mutex(store->mutex);
+	while (!store->stop)
+	{
+		int pending = 0;
+
+		Paho_thread_unlock_mutex(store->mutex);
+		Thread_wait_sem(store->wake, store->interval);
+		Paho_thread_lock_mutex(store->mutex);
+		pending = (store->pending->count > 0);
+		if (!store->stop && pending)
+		{
+			Paho_thread_unlock_mutex(store->mutex);
+			psttmp_checkpoint(store);
+			Paho_thread_lock_mutex(store->mutex);
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	FUNC_EXIT;
+	store->running = 0; /* the last touch of the store, which may be freed from now on */
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
+/**
+ * Brings the working directory and the checkpoint together when the store
+ * is opened.
+ * @param crashed whether the store was left open by the last process which had it
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise
+ */
+static int psttmp_recover(TmpfsStore* store, int crashed)
+{
+	char** workKeys = NULL;
+	char** diskKeys = NULL;
+	int nworkKeys = 0, ndiskKeys = 0;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((rc = pstkeys(store->work, &workKeys, &nworkKeys)) != 0)
+		goto exit;
+	if (crashed && nworkKeys == 0)
+	{	/* the process crashed with nothing in flight: the checkpoint may not have caught up */
+		rc = pstclear(store->disk);
+	}
+	else if (nworkKeys == 0)
+	{	/* closed cleanly, or the host restarted: the working copy is made from the checkpoint */
+		if ((rc = pstkeys(store->disk, &diskKeys, &ndiskKeys)) != 0)
+			goto exit;
+		for (i = 0; rc == 0 && i < ndiskKeys; ++i)
+		{
+			char* buffer = NULL;
+			int buflen = 0;
+
+			if ((rc = pstget(store->disk, diskKeys[i], &buffer, &buflen)) == 0)
+				rc = pstput(store->work, diskKeys[i], 1, &buffer, &buflen);
+			if (buffer)
+				free(buffer);
+		}
+	}
+	else
+	{	/* the process crashed: the working copy is the newer, so all of it is checkpointed */
+		if ((rc = pstkeys(store->disk, &diskKeys, &ndiskKeys)) != 0)
+			goto exit;
+		for (i = 0; rc == 0 && i < nworkKeys; ++i)
+			rc = psttmp_pend(store, workKeys[i]);
+		for (i = 0; rc == 0 && i < ndiskKeys; ++i)
+			rc = psttmp_pend(store, diskKeys[i]);
+	}
+exit:
+	for (i = 0; i < nworkKeys; ++i)
+		free(workKeys[i]);
+	if (workKeys)
+		free(workKeys);
+	for (i = 0; i < ndiskKeys; ++i)
+		free(diskKeys[i]);
+	if (diskKeys)
+		free(diskKeys);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Frees a store, which must have no thread running.
+ */
+static void psttmp_free(TmpfsStore* store)
+{
+	if (store->pending)
+		psttmp_freeKeys(store->pending);
+	if (store->wake)
+		Thread_destroy_sem(store->wake);
+	if (store->mutex)
+		Paho_thread_destroy_mutex(store->mutex);
+	if (store->checkpoint_mutex)
+		Paho_thread_destroy_mutex(store->checkpoint_mutex);
+	if (store->work)
+		pstclose(store->work);
+	if (store->disk)
+		pstclose(store->disk);
+	if (store->openName)
+		free(store->openName);
+	free(store);
+}
+
+
+/** Open the working directory and the checkpoint of the client, both
+ *  clientID-serverURI under the directories of the options.
+ *  See ::Persistence_open
+ */
+int psttmpopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	MQTTClient_tmpfsPersistenceOptions* options = context;
+	TmpfsStore* store = NULL;
+	FILE* file = NULL;
+	size_t alloclen = 0;
+	int crashed = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(TmpfsStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(TmpfsStore));
+	store->interval = options->checkpointInterval;
+	if ((store->pending = TreeInitialize(psttmp_compare)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	store->mutex = Paho_thread_create_mutex(&rc);
+	if (rc != 0)
+		goto error;
+	store->checkpoint_mutex = Paho_thread_create_mutex(&rc);
+	if (rc != 0)
+		goto error;
+	store->wake = Thread_create_sem(&rc);
+	if (rc != 0)
+		goto error;
+	if ((rc = pstopen(&store->work, clientID, serverURI, (void*)options->workDirectory)) != 0 ||
+		(rc = pstopen(&store->disk, clientID, serverURI, (void*)options->directory)) != 0)
+		goto error;
+	alloclen = strlen(pstclientdir(store->work)) + strlen(OPEN_FILENAME_EXTENSION) + 1;
+	if ((store->openName = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto error;
+	}
+	snprintf(store->openName, alloclen, "%s%s", pstclientdir(store->work), OPEN_FILENAME_EXTENSION);
+	if ((file = fopen(store->openName, "r")) != NULL)
+	{
+		crashed = 1;
+		fclose(file);
+	}
+	if ((rc = psttmp_recover(store, crashed)) != 0)
+		goto error;
+	if ((file = fopen(store->openName, "w")) == NULL)
+	{
+		Log(LOG_ERROR, -1, "Error creating %s", store->openName);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto error;
+	}
+	fclose(file);
+	store->running = 1;
+	Paho_thread_start(psttmp_run, store);
+	*handle = store;
+	goto exit;
+error:
+	psttmp_free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Make the last checkpoint and delete the working copy.
+ *  See ::Persistence_close
+ */
+int psttmpclose(void* handle)
+{
+	TmpfsStore* store = handle;
+	int count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+	store->stop = 1;
+	Paho_thread_unlock_mutex(store->mutex);
+	Thread_post_sem(store->wake);
+	while (store->running && ++count < 3000)
+		MQTTTime_sleep(10L);
+	if (store->running)
+	{	/* the thread still has the store, so leave it be */
+		Log(LOG_ERROR, -1, "Tmpfs persistence thread did not finish");
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if ((rc = psttmp_checkpoint(store)) == 0 &&
+		(rc = pstclear(store->work)) == 0) /* the checkpoint has it all */
+		remove(store->openName);
+	else
+		Log(LOG_ERROR, -1, "The working copy of the persistence is kept, as the checkpoint failed");
+	psttmp_free(store); /* pstclose removes the directories if they are empty */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Write a wire message to the working directory, to be checkpointed.
+ *  See ::Persistence_put
+ */
+int psttmpput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	TmpfsStore* store = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if ((rc = pstput(store->work, key, bufcount, buffers, buflens)) == 0)
+	{
+		Paho_thread_lock_mutex(store->mutex);
+		rc = psttmp_pend(store, key);
+		Paho_thread_unlock_mutex(store->mutex);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from the working directory.
+ *  See ::Persistence_get
+ */
+int psttmpget(void* handle, char* key, char** buffer, int* buflen)
+{
+	TmpfsStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store)
+		rc = pstget(store->work, key, buffer, buflen);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete a persisted message from the working directory, to be checkpointed.
+ *  See ::Persistence_remove
+ */
+int psttmpremove(void* handle, char* key)
+{
+	TmpfsStore* store = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if ((rc = pstremove(store->work, key)) == 0)
+	{
+		Paho_thread_lock_mutex(store->mutex);
+		rc = psttmp_pend(store, key);
+		Paho_thread_unlock_mutex(store->mutex);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys in the working directory.
+ *  See ::Persistence_keys
+ */
+int psttmpkeys(void* handle, char*** keys, int* nkeys)
+{
+	TmpfsStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store)
+		rc = pstkeys(store->work, keys, nkeys);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the persisted messages, both in the working directory and the checkpoint.
+ *  See ::Persistence_clear
+ */
+int psttmpclear(void* handle)
+{
+	TmpfsStore* store = handle;
+	Tree* fresh = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_lock_mutex(store->checkpoint_mutex); /* so that no checkpoint puts back what is cleared */
+	if ((fresh = TreeInitialize(psttmp_compare)) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	else
+	{
+		Paho_thread_lock_mutex(store->mutex);
+		psttmp_freeKeys(store->pending);
+		store->pending = fresh;
+		rc = pstclear(store->work);
+		Paho_thread_unlock_mutex(store->mutex);
+		if (rc == 0)
+			rc = pstclear(store->disk);
+	}
+	Paho_thread_unlock_mutex(store->checkpoint_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a wire message is persisted in the working directory.
+ *  See ::Persistence_containskey
+ */
+int psttmpcontainskey(void* handle, char* key)
+{
+	TmpfsStore* store = handle;
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+	if (store)
+		rc = pstcontainskey(store->work, key);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+#endif /* !defined(NO_PERSISTENCE) */
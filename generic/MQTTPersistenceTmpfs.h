@@ -0,0 +1,36 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - tmpfs write-behind persistence
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCETMPFS_H)
+#define MQTTPERSISTENCETMPFS_H
+
+#include "MQTTClientPersistence.h"
+
+/* the context of the tmpfs persistence, made from its options */
+void* psttmpcontext(const MQTTClient_tmpfsPersistenceOptions* options);
+void psttmpfreecontext(void* context);
+
+/* prototypes of the functions for the tmpfs persistence */
+int psttmpopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int psttmpclose(void* handle);
+int psttmpput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int psttmpget(void* handle, char* key, char** buffer, int* buflen);
+int psttmpremove(void* handle, char* key);
+int psttmpkeys(void* handle, char*** keys, int* nkeys);
+int psttmpclear(void* handle);
+int psttmpcontainskey(void* handle, char* key);
+
+#endif
@@ -0,0 +1,735 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - persistence writer thread with group commit
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Persistence writer thread with group commit
+ *
+ * Without a writer, each record is put into or removed from the persistent
+ * store as the packet is sent or received, with mqttclient_mutex held, so
+ * that the latency of the store caps the message rate of every client.  A
+ * writer takes a copy of the record instead, and a thread of the client's
+ * own commits the records queued so far to the store in one batch, when the
+ * policy says the batch is due:
+ *
+ * - ::MQTTCLIENT_PERSISTENCE_SYNC_NONE: as soon as the thread gets to them;
+ * - ::MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL: when the oldest record has waited
+ *   the interval;
+ * - ::MQTTCLIENT_PERSISTENCE_SYNC_COUNT: when the count of records is queued,
+ *   or the oldest has waited PERSISTENCE_WRITER_MAX_DELAY;
+ * - ::MQTTCLIENT_PERSISTENCE_SYNC_EACH: at once, the caller waiting for it.
+ *
+ * A record put and removed again before its batch is due, as a QoS 1 message
+ * acknowledged within the interval is, never reaches the store, and a record
+ * put again replaces the copy still queued.  Each put and remove has a
+ * sequence number, so that the acknowledgements which depend on a record can
+ * be held back until the record has been committed.  A put which fails stays
+ * queued, with the records after it, and is tried again after
+ * PERSISTENCE_WRITER_RETRY_DELAY, so that nothing after it counts as committed
+ * until it is.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "MQTTPersistenceWriter.h"
+#include "MQTTPersistenceSqlite.h"
+#include "MQTTClient.h"
+#include "MQTTTime.h"
+#include "Thread.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+
+#include "Heap.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#define WINAPI
+#endif
+
+/** the longest a record waits for the count of records of a batch, in milliseconds */
+#define PERSISTENCE_WRITER_MAX_DELAY 100
+
+/** the longest the thread sleeps with nothing queued, in milliseconds */
+#define PERSISTENCE_WRITER_IDLE_WAIT 1000
+
+/** how long a batch which failed waits before it is tried again, in milliseconds */
+#define PERSISTENCE_WRITER_RETRY_DELAY 100
+
+/**
+ * A put or a remove waiting to be committed.  The key and the data of a put
+ * follow the structure, in the same allocation.
+ */
+typedef struct PersistenceOpStruct
+{
+	struct PersistenceOpStruct* next;
+	char* key;
+	char* data;           /**< the record, NULL for a remove */
+	int datalen;
+	unsigned int seqno;   /**< the sequence number it was queued with */
+	int cancelled;        /**< removed or put again before it was committed */
+} PersistenceOp;
+
+struct MQTTPersistenceWriterStruct
+{
+	MQTTClient_persistence* persistence; /**< the store the records are committed to */
+	void* phandle;
+	int policy;           /**< one of the MQTTCLIENT_PERSISTENCE_SYNC values */
+	int value;            /**< the interval or the count of the policy */
+	mutex_type mutex;     /**< protects all the fields below */
+	sem_type wake;        /**< posted to make the thread look at the queue */
+	sem_type done;        /**< posted by the thread after a commit, if anyone is waiting */
+	PersistenceOp* first; /**< the records queued, in order */
+	PersistenceOp* last;
+	int count;            /**< the records queued and not cancelled */
+	START_TIME_TYPE oldest; /**< when the first record queued was queued */
+	Tree* puts;           /**< the puts queued and not cancelled, by key */
+	unsigned int issued;  /**< the sequence number of the last record queued */
+	unsigned int committed; /**< the sequence number of the last record committed */
+	int committing;       /**< whether the thread is committing a batch */
+	unsigned int batches; /**< the number of batches the thread has committed or tried to */
+	int waiting;          /**< the number of callers waiting for a commit */
+	int failed;           /**< whether the last batch failed, and is queued again */
+	int failedRc;         /**< the error it failed with */
+	unsigned int failedSeqno; /**< the sequence number of the record which failed */
+	START_TIME_TYPE failedAt; /**< when it failed */
+	int stop;             /**< the thread is to commit what is queued and finish */
+	volatile int running; /**< the thread has been started and not yet finished */
+};
+
+
+/**
+ * Tree callback function for comparing queued puts by key
+ */
+static int opCompare(void* a, void* b, int content)
+{
+	const char* key = content ? ((PersistenceOp*)b)->key : (const char*)b;
+
+	return strcmp(((PersistenceOp*)a)->key, key);
+}
+
+
+/**
+ * Whether one sequence number comes before another, allowing for wrapping.
+ */
+static int seqBefore(unsigned int a, unsigned int b)
+{
+	return (int)(a - b) < 0;
+}
+
+
+/**
+ * Adds a record to the queue.  Must be called with the writer mutex held.
+ * @param w the writer
+ * @param op the record
+ * @return whether the thread should be woken to look at the queue
+ */
+static int MQTTPersistenceWriter_queue(MQTTPersistenceWriter* w, PersistenceOp* op)
+{
+	PersistenceOp* old = NULL;
+	int wake = (w->first == NULL);
+
+	if (w->first == NULL)
+	{
+		w->first = op;
+		w->oldest = MQTTTime_now();
+	}
+	else
+		w->last->next = op;
+	w->last = op;
+	++(w->count);
+	op->seqno = ++(w->issued);
+	/* a put or remove of the same key makes the put still queued obsolete */
+	if ((old = TreeRemoveKey(w->puts, op->key)) != NULL)
+	{
+		old->cancelled = 1;
+		--(w->count);
+	}
+	if (op->data)
+		TreeAdd(w->puts, op, sizeof(PersistenceOp) + op->datalen);
+	if (w->policy == MQTTCLIENT_PERSISTENCE_SYNC_NONE || w->policy == MQTTCLIENT_PERSISTENCE_SYNC_EACH ||
+			(w->policy == MQTTCLIENT_PERSISTENCE_SYNC_COUNT && w->count >= w->value))
+		wake = 1;
+	return wake;
+}
+
+
+/**
+ * Works out how long the thread can wait before the records queued are due to
+ * be committed.  Must be called with the writer mutex held.
+ * @param w the writer
+ * @return the time to wait in milliseconds, 0 if a batch is due now, or -1 if
+ * nothing is queued
+ */
+static int MQTTPersistenceWriter_delay(MQTTPersistenceWriter* w)
+{
+	ELAPSED_TIME_TYPE waited = 0;
+	int delay = 0;
+
+	if (w->first == NULL)
+		return -1;
+	if (w->stop)
+		return 0;
+	if (w->failed)
+	{
+		waited = MQTTTime_elapsed(w->failedAt);
+		if (waited < PERSISTENCE_WRITER_RETRY_DELAY)
+			return PERSISTENCE_WRITER_RETRY_DELAY - (int)waited;
+	}
+	if (w->waiting > 0)
+		return 0;
+	waited = MQTTTime_elapsed(w->oldest);
+	if (w->policy == MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL)
+		delay = (waited >= (ELAPSED_TIME_TYPE)w->value) ? 0 : w->value - (int)waited;
+	else if (w->policy == MQTTCLIENT_PERSISTENCE_SYNC_COUNT && w->count < w->value)
+		delay = (waited >= PERSISTENCE_WRITER_MAX_DELAY) ? 0 : PERSISTENCE_WRITER_MAX_DELAY - (int)waited;
+	return delay;
+}
+
+
+/**
+ * Commits a batch of records to the store and frees them, up to the first put
+ * which fails.  Called by the thread without the writer mutex held.  A store
+ * which has transactions commits the batch in one, and if that fails, none of
+ * the records are freed.
+ * @param w the writer
+ * @param batch the first record of the batch, set to the first one not
+ * committed, or NULL if all were
+ * @return the error of the put or the commit which failed, or 0
+ */
+static int MQTTPersistenceWriter_commit(MQTTPersistenceWriter* w, PersistenceOp** batch)
+{
+	PersistenceOp* op = *batch;
+	int rc = 0;
+#if defined(MQTT_SQLITE)
+	int transaction = (w->persistence->popen == pstsqlopen && pstsqlbegin(w->phandle) == 0);
+#endif
+
+	for (; op; op = op->next)
+	{
+		if (op->cancelled)
+			;
+		else if (op->data)
+		{
+			if ((rc = w->persistence->pput(w->phandle, op->key, 1, &op->data, &op->datalen)) != 0)
+			{
+				Log(LOG_ERROR, -1, "Error %d committing persistence record %s", rc, op->key);
+				break;
+			}
+		}
+		else
+			w->persistence->premove(w->phandle, op->key); /* the key need not be there */
+	}
+#if defined(MQTT_SQLITE)
+	if (transaction)
+	{
+		int rc1 = pstsqlcommit(w->phandle);
+
+		if (rc1 != 0)
+		{
+			Log(LOG_ERROR, -1, "Error %d committing a batch of persistence records", rc1);
+			rc = rc1;
+			op = *batch; /* rolled back */
+		}
+	}
+#endif
+	while (*batch != op)
+	{
+		PersistenceOp* done = *batch;
+
+		*batch = done->next;
+		free(done);
+	}
+	return rc;
+}
+
+
+/**
+ * Puts the records of a batch which failed back at the front of the queue, to
+ * be tried again.  Those put again while the batch was being committed are
+ * cancelled.  Must be called with the writer mutex held.
+ * @param w the writer
+ * @param batch the first record not committed
+ */
+static void MQTTPersistenceWriter_requeue(MQTTPersistenceWriter* w, PersistenceOp* batch)
+{
+	PersistenceOp* op = NULL;
+	PersistenceOp* tail = NULL;
+
+	for (op = batch; op; op = op->next)
+	{
+		tail = op;
+		if (op->cancelled)
+			continue;
+		if (op->data && TreeFind(w->puts, op->key) != NULL)
+		{
+			op->cancelled = 1;
+			continue;
+		}
+		if (op->data)
+			TreeAdd(w->puts, op, sizeof(PersistenceOp) + op->datalen);
+		++(w->count);
+	}
+	if (w->first == NULL)
+	{
+		w->last = tail;
+		w->oldest = MQTTTime_now();
+	}
+	tail->next = w->first;
+	w->first = batch;
+}
+
+
+/**
+ * Frees the records of a batch which failed again as the writer stops.
+ * @param batch the first record not committed
+ */
+static void MQTTPersistenceWriter_drop(PersistenceOp* batch)
+{
+	while (batch)
+	{
+		PersistenceOp* op = batch;
+
+		batch = op->next;
+		if (!op->cancelled)
+			Log(LOG_ERROR, -1, "Persistence record %s dropped, as the writer is stopping", op->key);
+		free(op);
+	}
+}
+
+
+/* This is the thread function that commits the records of a writer */
+static thread_return_type WINAPI MQTTPersistenceWriter_run(void* n)
+{
+	MQTTPersistenceWriter* w = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTPersist");
+	Paho_thread_lock_mutex(w->mutex);
+	while (!w->stop || w->first)
+	{
+		PersistenceOp* batch = NULL;
+		PersistenceOp* op = NULL;
+		unsigned int last = 0;
+		int delay = MQTTPersistenceWriter_delay(w);
+		int rc = 0;
+
+		if (delay != 0)
+		{
+			Paho_thread_unlock_mutex(w->mutex);
+			Thread_wait_sem(w->wake, (delay < 0) ? PERSISTENCE_WRITER_IDLE_WAIT : delay);
+			Paho_thread_lock_mutex(w->mutex);
+			continue;
+		}
+		batch = w->first;
+		for (op = batch; op; op = op->next)
+		{
+			if (op->data && !op->cancelled)
+				TreeRemoveKey(w->puts, op->key);
+		}
+		w->first = w->last = NULL;
+		w->count = 0;
+		last = w->issued;
+		w->committing = 1;
+		Paho_thread_unlock_mutex(w->mutex);
+
+		rc = MQTTPersistenceWriter_commit(w, &batch);
+
+		Paho_thread_lock_mutex(w->mutex);
+		w->committing = 0;
+		++(w->batches);
+		if (batch && w->stop && w->failed)
+		{	/* it has been tried again as the writer stops */
+			MQTTPersistenceWriter_drop(batch);
+			batch = NULL;
+		}
+		if (batch == NULL)
+			w->failed = 0;
+		else
+		{	/* nothing from the record which failed on is committed */
+			w->failed = 1;
+			w->failedRc = rc;
+			w->failedSeqno = batch->seqno;
+			w->failedAt = MQTTTime_now();
+			last = batch->seqno - 1;
+			MQTTPersistenceWriter_requeue(w, batch);
+		}
+		if (seqBefore(w->committed, last)) /* a discard may have moved it on already */
+			w->committed = last;
+		if (w->waiting > 0)
+			Thread_post_sem(w->done);
+	}
+	Paho_thread_unlock_mutex(w->mutex);
+	FUNC_EXIT;
+	w->running = 0; /* the last touch of the writer, which may be freed from now on */
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
+/**
+ * Waits until a record has been committed, the thread committing what is
+ * queued at once, or until a batch fails at that record or one before it.
+ * Must be called with the writer mutex held.
+ * @param w the writer
+ * @param seqno the sequence number of the record
+ * @return 0 if the record has been committed, or the error of the put which failed
+ */
+static int MQTTPersistenceWriter_waitFor(MQTTPersistenceWriter* w, unsigned int seqno)
+{
+	unsigned int batches = w->batches;
+	int rc = 0;
+
+	++(w->waiting);
+	Thread_post_sem(w->wake);
+	while (seqBefore(w->committed, seqno))
+	{
+		if (w->batches != batches && w->failed && !seqBefore(seqno, w->failedSeqno))
+		{
+			rc = w->failedRc;
+			break;
+		}
+		Paho_thread_unlock_mutex(w->mutex);
+		Thread_wait_sem(w->done, 100);
+		Paho_thread_lock_mutex(w->mutex);
+	}
+	--(w->waiting);
+	return rc;
+}
+
+
+/**
+ * Creates a writer for the persistent store of a client, and starts its thread.
+ * @param persistence the store
+ * @param phandle the handle returned by the store's open function
+ * @param policy when records are committed, one of the MQTTCLIENT_PERSISTENCE_SYNC values
+ * @param value the interval in milliseconds or the count of records of the policy
+ * @return the writer, or NULL if memory is short
+ */
+MQTTPersistenceWriter* MQTTPersistenceWriter_create(MQTTClient_persistence* persistence, void* phandle,
+		int policy, int value)
+{
+	MQTTPersistenceWriter* w = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((w = malloc(sizeof(MQTTPersistenceWriter))) == NULL)
+		goto exit;
+	memset(w, '\0', sizeof(MQTTPersistenceWriter));
+	w->persistence = persistence;
+	w->phandle = phandle;
+	w->policy = policy;
+	w->value = value;
+	if ((w->puts = TreeInitialize(opCompare)) == NULL)
+		goto error;
+	w->mutex = Paho_thread_create_mutex(&rc);
+	if (rc != 0)
+		goto error;
+	w->wake = Thread_create_sem(&rc);
+	if (rc != 0)
+		goto error;
+	w->done = Thread_create_sem(&rc);
+	if (rc != 0)
+		goto error;
+	w->running = 1;
+	Paho_thread_start(MQTTPersistenceWriter_run, w);
+	goto exit;
+error:
+	if (w->wake)
+		Thread_destroy_sem(w->wake);
+	if (w->mutex)
+		Paho_thread_destroy_mutex(w->mutex);
+	if (w->puts)
+		TreeFree(w->puts);
+	free(w);
+	w = NULL;
+exit:
+	FUNC_EXIT;
+	return w;
+}
+
+
+/**
+ * Commits the records queued, stops the thread and frees the writer.
+ * @param w the writer, may be NULL
+ */
+void MQTTPersistenceWriter_destroy(MQTTPersistenceWriter* w)
+{
+	int count = 0;
+
+	FUNC_ENTRY;
+	if (w == NULL)
+		goto exit;
+	Paho_thread_lock_mutex(w->mutex);
+	w->stop = 1;
+	Paho_thread_unlock_mutex(w->mutex);
+	Thread_post_sem(w->wake);
+	while (w->running && ++count < 3000)
+		MQTTTime_sleep(10L);
+	if (w->running)
+	{	/* the store would be closed under the thread, so leave it be */
+		Log(LOG_ERROR, -1, "Persistence writer thread did not finish");
+		goto exit;
+	}
+	Thread_destroy_sem(w->wake);
+	Thread_destroy_sem(w->done);
+	Paho_thread_destroy_mutex(w->mutex);
+	TreeFree(w->puts);
+	free(w);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Changes when the records of a writer are committed.
+ * @param w the writer
+ * @param policy one of the MQTTCLIENT_PERSISTENCE_SYNC values
+ * @param value the interval in milliseconds or the count of records of the policy
+ */
+void MQTTPersistenceWriter_setPolicy(MQTTPersistenceWriter* w, int policy, int value)
+{
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->mutex);
+	w->policy = policy;
+	w->value = value;
+	Paho_thread_unlock_mutex(w->mutex);
+	Thread_post_sem(w->wake);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Queues a record to be put into the store.  The buffers are copied, so they
+ * are free to be reused when this returns.  With ::MQTTCLIENT_PERSISTENCE_SYNC_EACH,
+ * waits until the record has been committed.
+ * @param w the writer
+ * @param key the key of the record
+ * @param bufcount the number of buffers making up the record
+ * @param buffers the buffers
+ * @param buflens the lengths of the buffers
+ * @return 0 on success, PAHO_MEMORY_ERROR if memory is short, or with
+ * ::MQTTCLIENT_PERSISTENCE_SYNC_EACH the error of the store if committing this
+ * record, or one queued before it, failed; the record stays queued
+ */
+int MQTTPersistenceWriter_put(MQTTPersistenceWriter* w, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	PersistenceOp* op = NULL;
+	size_t keylen = strlen(key) + 1;
+	int datalen = 0;
+	int rc = 0;
+	int i;
+
+	int wake = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	if ((op = malloc(sizeof(PersistenceOp) + keylen + datalen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	op->next = NULL;
+	op->key = (char*)(op + 1);
+	memcpy(op->key, key, keylen);
+	op->data = op->key + keylen;
+	op->datalen = 0;
+	for (i = 0; i < bufcount; ++i)
+	{
+		memcpy(op->data + op->datalen, buffers[i], buflens[i]);
+		op->datalen += buflens[i];
+	}
+	op->cancelled = 0;
+
+	Paho_thread_lock_mutex(w->mutex);
+	wake = MQTTPersistenceWriter_queue(w, op);
+	if (w->policy == MQTTCLIENT_PERSISTENCE_SYNC_EACH)
+	{
+		rc = MQTTPersistenceWriter_waitFor(w, op->seqno);
+		wake = 0;
+	}
+	Paho_thread_unlock_mutex(w->mutex);
+	if (wake)
+		Thread_post_sem(w->wake);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Queues a record to be removed from the store.  A put of the same key still
+ * queued is dropped.  With ::MQTTCLIENT_PERSISTENCE_SYNC_EACH, waits until the
+ * remove has been committed.
+ * @param w the writer
+ * @param key the key of the record
+ * @return 0 on success, PAHO_MEMORY_ERROR if memory is short
+ */
+int MQTTPersistenceWriter_remove(MQTTPersistenceWriter* w, char* key)
+{
+	PersistenceOp* op = NULL;
+	size_t keylen = strlen(key) + 1;
+	int rc = 0;
+	int wake = 0;
+
+	FUNC_ENTRY;
+	if ((op = malloc(sizeof(PersistenceOp) + keylen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(op, '\0', sizeof(PersistenceOp));
+	op->key = (char*)(op + 1);
+	memcpy(op->key, key, keylen);
+
+	Paho_thread_lock_mutex(w->mutex);
+	wake = MQTTPersistenceWriter_queue(w, op);
+	if (w->policy == MQTTCLIENT_PERSISTENCE_SYNC_EACH)
+	{
+		MQTTPersistenceWriter_waitFor(w, op->seqno);
+		wake = 0;
+	}
+	Paho_thread_unlock_mutex(w->mutex);
+	if (wake)
+		Thread_post_sem(w->wake);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Waits until all the records queued have been committed.
+ * @param w the writer
+ * @return 0, or the error of the put which failed, if one did
+ */
+int MQTTPersistenceWriter_flush(MQTTPersistenceWriter* w)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->mutex);
+	rc = MQTTPersistenceWriter_waitFor(w, w->issued);
+	Paho_thread_unlock_mutex(w->mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Drops the records queued, as the store is about to be cleared, and waits for
+ * the batch being committed, if any.  The records dropped count as committed.
+ * @param w the writer
+ */
+void MQTTPersistenceWriter_discard(MQTTPersistenceWriter* w)
+{
+	PersistenceOp* batch = NULL;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->mutex);
+	do
+	{
+		batch = w->first;
+		w->first = w->last = NULL;
+		w->count = 0;
+		while (batch)
+		{
+			PersistenceOp* op = batch;
+
+			batch = op->next;
+			if (op->data && !op->cancelled)
+				TreeRemoveKey(w->puts, op->key);
+			free(op);
+		}
+		while (w->committing)
+		{
+			++(w->waiting);
+			Paho_thread_unlock_mutex(w->mutex);
+			Thread_wait_sem(w->done, 100);
+			Paho_thread_lock_mutex(w->mutex);
+			--(w->waiting);
+		}
+	}
+	while (w->first); /* the batch being committed failed, and was queued again */
+	w->committed = w->issued;
+	w->failed = 0;
+	Paho_thread_unlock_mutex(w->mutex);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Gets the sequence number of the last record queued.
+ * @param w the writer, may be NULL
+ * @return the sequence number, 0 if there is no writer
+ */
+unsigned int MQTTPersistenceWriter_issued(MQTTPersistenceWriter* w)
+{
+	unsigned int issued = 0;
+
+	if (w)
+	{
+		Paho_thread_lock_mutex(w->mutex);
+		issued = w->issued;
+		Paho_thread_unlock_mutex(w->mutex);
+	}
+	return issued;
+}
+
+
+/**
+ * Whether what depends on a record may go ahead: the record has been committed,
+ * or the policy does not hold anything back for it.
+ * @param w the writer, may be NULL
+ * @param seqno the sequence number of the record
+ * @return boolean
+ */
+int MQTTPersistenceWriter_durable(MQTTPersistenceWriter* w, unsigned int seqno)
+{
+	int durable = 1;
+
+	if (w)
+	{
+		Paho_thread_lock_mutex(w->mutex);
+		durable = (w->policy != MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL && w->policy != MQTTCLIENT_PERSISTENCE_SYNC_COUNT) ||
+			!seqBefore(w->committed, seqno);
+		Paho_thread_unlock_mutex(w->mutex);
+	}
+	return durable;
+}
+
+
+/**
+ * Whether the policy of a writer holds acknowledgements back until the records
+ * written before them have been committed.
+ * @param w the writer, may be NULL
+ * @return boolean
+ */
+int MQTTPersistenceWriter_holdsAcks(MQTTPersistenceWriter* w)
+{
+	int holds = 0;
+
+	if (w)
+	{
+		Paho_thread_lock_mutex(w->mutex);
+		holds = (w->policy == MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL || w->policy == MQTTCLIENT_PERSISTENCE_SYNC_COUNT);
+		Paho_thread_unlock_mutex(w->mutex);
+	}
+	return holds;
+}
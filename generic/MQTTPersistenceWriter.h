@@ -0,0 +1,40 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - persistence writer thread with group commit
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCEWRITER_H)
+#define MQTTPERSISTENCEWRITER_H
+
+#include "MQTTClientPersistence.h"
+
+/**
+ * Queues the puts and removes of one client's persistent store and commits
+ * them to the store in batches, on a thread of its own.
+ */
+typedef struct MQTTPersistenceWriterStruct MQTTPersistenceWriter;
+
+MQTTPersistenceWriter* MQTTPersistenceWriter_create(MQTTClient_persistence* persistence, void* phandle,
+		int policy, int value);
+void MQTTPersistenceWriter_destroy(MQTTPersistenceWriter* w);
+void MQTTPersistenceWriter_setPolicy(MQTTPersistenceWriter* w, int policy, int value);
+int MQTTPersistenceWriter_put(MQTTPersistenceWriter* w, char* key, int bufcount, char* buffers[], int buflens[]);
+int MQTTPersistenceWriter_remove(MQTTPersistenceWriter* w, char* key);
+int MQTTPersistenceWriter_flush(MQTTPersistenceWriter* w);
+void MQTTPersistenceWriter_discard(MQTTPersistenceWriter* w);
+unsigned int MQTTPersistenceWriter_issued(MQTTPersistenceWriter* w);
+int MQTTPersistenceWriter_durable(MQTTPersistenceWriter* w, unsigned int seqno);
+int MQTTPersistenceWriter_holdsAcks(MQTTPersistenceWriter* w);
+
+#endif
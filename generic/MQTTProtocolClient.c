@@ -36,8 +36,10 @@
 #if !defined(NO_PERSISTENCE)
 #include "MQTTPersistence.h"
 #endif
+#include "MQTTPersistenceWriter.h"
 #include "Socket.h"
 #include "SocketBuffer.h"
+#include "MemoryPool.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
@@ -56,13 +58,19 @@ static int MQTTProtocol_startPublishCommon(
 		int retained);
 static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regardless);
 
+static int MQTTProtocol_ackMustWait(Clients* client, SOCKET sock);
 static int MQTTProtocol_queueAck(Clients* client, int ackType, int msgId);
+static int MQTTProtocol_sendQueuedAcks(Clients* client);
 
 typedef struct {
 	int messageId;
 	int ackType;
+	unsigned int seqno; /**< the last persistence write to be committed before the ack is sent */
+	int batched;        /**< the open queue batch of the client is to be written before the ack is sent */
 } AckRequest;
 
+static int queuedAcks = 0; /**< the acks waiting in the outbound queues of all the clients */
+
 
 /**
  * List callback function for comparing Message structures by message id
@@ -124,7 +132,7 @@ static void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish)
 	pw->socket = pubclient->net.socket;
 	if (!ListAppend(&(state.pending_writes), pw, sizeof(pending_write)+len))
 	{
-		free(pw->p);
+		MQTTProtocol_removePublication(pw->p);
 		free(pw);
 		goto exit;
 	}
@@ -182,6 +190,7 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 		entirely; the socket buffer will use these locations to finish writing the packet */
 		qos12pub.payload = (*mm)->publish->payload;
 		qos12pub.topic = (*mm)->publish->topic;
+		qos12pub.file = (*mm)->publish->file;
 		qos12pub.properties = (*mm)->properties;
 		qos12pub.MQTTVersion = (*mm)->MQTTVersion;
 		publish = &qos12pub;
@@ -205,7 +214,7 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
  */
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, int retained, int allocatePayload)
 {
-	Messages* m = malloc(sizeof(Messages));
+	Messages* m = MemoryPool_alloc(POOL_MESSAGES);
 
 	FUNC_ENTRY;
 	if (!m)
@@ -217,7 +226,8 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, i
 		*mm = m;
 		if ((m->publish = MQTTProtocol_storePublication(publish, &len1)) == NULL)
 		{
-			free(m);
+			MemoryPool_free(POOL_MESSAGES, m);
+			m = NULL;
 			goto exit;
 		}
 		m->len += len1;
@@ -227,7 +237,8 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, i
 
 			if ((m->publish->payload = malloc(m->publish->payloadlen)) == NULL)
 			{
-				free(m);
+				MemoryPool_free(POOL_MESSAGES, m);
+				m = NULL;
 				goto exit;
 			}
 			memcpy(m->publish->payload, temp, m->publish->payloadlen);
@@ -261,7 +272,7 @@ exit:
  */
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 {
-	Publications* p = malloc(sizeof(Publications));
+	Publications* p = MemoryPool_alloc(POOL_PUBLICATIONS);
 
 	FUNC_ENTRY;
 	if (!p)
@@ -275,14 +286,17 @@ Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 	p->payloadlen = publish->payloadlen;
 	p->payload = publish->payload;
 	publish->payload = NULL;
+	p->streamed = publish->streamed;
+	p->file = publish->file;
+	publish->file = NULL;
 	*len += publish->payloadlen;
 	memcpy(p->mask, publish->mask, sizeof(p->mask));
+	p->release = publish->release;
+	p->release_context = publish->release_context;
+	if ((p->buffer = publish->buffer) != NULL)
+		MQTTPacket_retainBuffer(p->buffer);
 
-	if ((ListAppend(&(state.publications), p, *len)) == NULL)
-	{
-		free(p);
-		p = NULL;
-	}
+	ListAppend(&(state.publications), p, *len); /* the element is in p, so this cannot fail */
 exit:
 	FUNC_EXIT;
 	return p;
@@ -297,17 +311,31 @@ void MQTTProtocol_removePublication(Publications* p)
 	FUNC_ENTRY;
 	if (p && --(p->refcount) == 0)
 	{
+		if (p->buffer)
+		{	/* the topic and payload point into the received packet */
+			MQTTPacket_releaseBuffer(p->buffer);
+			p->payload = p->topic = NULL;
+		}
 		if (p->payload)
 		{
-			free(p->payload);
+			if (p->release)
+				(*p->release)(p->release_context, p->payload);
+			else
+				free(p->payload);
 			p->payload = NULL;
 		}
+		if (p->file)
+		{
+			MQTTPacket_freeFile(p->file);
+			p->file = NULL;
+		}
 		if (p->topic)
 		{
 			free(p->topic);
 			p->topic = NULL;
 		}
-		ListRemove(&(state.publications), p);
+		ListDetachElement(&(state.publications), &p->link);
+		MemoryPool_free(POOL_PUBLICATIONS, p);
 	}
 	FUNC_EXIT;
 }
@@ -359,7 +387,7 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 	{
 		Protocol_processPublication(publish, client, 1);
   
-		if (socketHasPendingWrites)
+		if (socketHasPendingWrites || MQTTProtocol_ackMustWait(client, sock))
 			rc = MQTTProtocol_queueAck(client, PUBACK, publish->msgId);
 		else
 			rc = MQTTPacket_send_puback(publish->MQTTVersion, publish->msgId, &client->net, client->clientID);
@@ -370,7 +398,7 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 		int len;
 		int already_received = 0;
 		ListElement* listElem = NULL;
-		Messages* m = malloc(sizeof(Messages));
+		Messages* m = MemoryPool_alloc(POOL_MESSAGES);
 		Publications* p = NULL;
 		if (!m)
 		{
@@ -394,7 +422,8 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 			if (msg->MQTTVersion >= MQTTVERSION_5)
 				MQTTProperties_free(&msg->properties);
 			ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
-			ListRemove(client->inboundMsgs, msg);
+			ListDetach(client->inboundMsgs, msg);
+			MemoryPool_free(POOL_MESSAGES, msg);
 			already_received = 1;
 		} else
 			ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
@@ -412,11 +441,16 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 			publish1.payloadlen = m->publish->payloadlen;
 			publish1.MQTTVersion = m->MQTTVersion;
 			publish1.properties = m->properties;
+			publish1.buffer = m->publish->buffer;
+			publish1.streamed = m->publish->streamed;
 
 			Protocol_processPublication(&publish1, client, 1);
-			ListRemove(&(state.publications), m->publish);
+			if (m->publish->buffer)
+				MQTTPacket_releaseBuffer(m->publish->buffer);
+			ListDetachElement(&(state.publications), &m->publish->link);
+			MemoryPool_free(POOL_PUBLICATIONS, m->publish);
 			m->publish = NULL;
-		} else
+		} else if (m->publish->buffer == NULL)
 		{	/* allocate and copy payload data as it's needed for pubrel.
 		       For other cases, it's done in Protocol_processPublication */
 			char *temp = m->publish->payload;
@@ -428,7 +462,7 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 			}
 			memcpy(m->publish->payload, temp, m->publish->payloadlen);
 		}
-		if (socketHasPendingWrites)
+		if (socketHasPendingWrites || MQTTProtocol_ackMustWait(client, sock))
 			rc = MQTTProtocol_queueAck(client, PUBREC, publish->msgId);
 		else
 			rc = MQTTPacket_send_pubrec(publish->MQTTVersion, publish->msgId, &client->net, client->clientID);
@@ -478,7 +512,8 @@ int MQTTProtocol_handlePubacks(void* pack, SOCKET sock, Publications** pubToRemo
 				MQTTProtocol_removePublication(m->publish);
 			if (m->MQTTVersion >= MQTTVERSION_5)
 				MQTTProperties_free(&m->properties);
-			ListRemove(client->outboundMsgs, m);
+			ListDetach(client->outboundMsgs, m);
+			MemoryPool_free(POOL_MESSAGES, m);
 		}
 	}
 	if (puback->MQTTVersion >= MQTTVERSION_5)
@@ -543,7 +578,8 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 					MQTTProtocol_removePublication(m->publish);
 				if (m->MQTTVersion >= MQTTVERSION_5)
 					MQTTProperties_free(&m->properties);
-				ListRemove(client->outboundMsgs, m);
+				ListDetach(client->outboundMsgs, m);
+				MemoryPool_free(POOL_MESSAGES, m);
 				(++state.msgs_sent);
 				send_pubrel = 0; /* in MQTT v5, stop the exchange if there is an error reported */
 			}
@@ -556,7 +592,12 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 	}
 	if (!send_pubrel)
 		; /* only don't send ack on MQTT v5 PUBREC error, otherwise send ack under all circumstances because MQTT state can get out of step */
-	else if (!Socket_noPendingWrites(sock))
+	else if (MQTTPersistenceWriter_holdsAcks(client->writer))
+	{	/* the PUBREL is recorded as sent, so its record must be committed before it is */
+		if ((rc = MQTTPacket_persistPubrel(pubrec->MQTTVersion, pubrec->msgId, &client->net)) == 0)
+			rc = MQTTProtocol_queueAck(client, PUBREL, pubrec->msgId);
+	}
+	else if (MQTTProtocol_ackMustWait(client, sock))
 		rc = MQTTProtocol_queueAck(client, PUBREL, pubrec->msgId);
 	else
 		rc = MQTTPacket_send_pubrel(pubrec->MQTTVersion, pubrec->msgId, 0, &client->net, client->clientID);
@@ -613,12 +654,17 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock)
 				publish.topiclen = m->publish->topiclen;
 				publish.payload = m->publish->payload;
 				publish.payloadlen = m->publish->payloadlen;
+				publish.buffer = m->publish->buffer;
+				publish.streamed = m->publish->streamed;
 			}
 			publish.MQTTVersion = m->MQTTVersion;
 			if (publish.MQTTVersion >= MQTTVERSION_5)
 				publish.properties = m->properties;
 			else
+			{
 				Protocol_processPublication(&publish, client, 0); /* only for 3.1.1 and lower */
+				MQTTPersistence_writeQueueBatch(client); /* queued in the store before its PUBLISH record goes */
+			}
 			#if !defined(NO_PERSISTENCE)
 			rc += MQTTPersistence_remove(client,
 					(m->MQTTVersion >= MQTTVERSION_5) ? PERSISTENCE_V5_PUBLISH_RECEIVED : PERSISTENCE_PUBLISH_RECEIVED,
@@ -626,14 +672,20 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock)
 			#endif
 			if (m->MQTTVersion >= MQTTVERSION_5)
 				MQTTProperties_free(&m->properties);
-			if (m->publish)
-				ListRemove(&(state.publications), m->publish);
-			ListRemove(client->inboundMsgs, m);
+			if (m->publish && m->MQTTVersion >= MQTTVERSION_5)
+				MQTTProtocol_removePublication(m->publish); /* delivered when it arrived */
+			else if (m->publish)
+			{	/* the topic and payload, or the packet holding them, were handed over */
+				ListDetachElement(&(state.publications), &m->publish->link);
+				MemoryPool_free(POOL_PUBLICATIONS, m->publish);
+			}
+			ListDetach(client->inboundMsgs, m);
+			MemoryPool_free(POOL_MESSAGES, m);
 			++(state.msgs_received);
 		}
 	}
 	/* Send ack under all circumstances because MQTT state can get out of step - this standard also says to do this */
-	if (!Socket_noPendingWrites(sock))
+	if (MQTTProtocol_ackMustWait(client, sock))
 		rc = MQTTProtocol_queueAck(client, PUBCOMP, pubrel->msgId);
 	else
 		rc = MQTTPacket_send_pubcomp(pubrel->MQTTVersion, pubrel->msgId, &client->net, client->clientID);
@@ -693,7 +745,8 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 					MQTTProtocol_removePublication(m->publish);
 				if (m->MQTTVersion >= MQTTVERSION_5)
 					MQTTProperties_free(&m->properties);
-				ListRemove(client->outboundMsgs, m);
+				ListDetach(client->outboundMsgs, m);
+				MemoryPool_free(POOL_MESSAGES, m);
 				(++state.msgs_sent);
 			}
 		}
@@ -707,7 +760,8 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 
 
 /**
- * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required.
+ * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required, except
+ * to clients whose reads are paused.
  * @param now current time
  */
 void MQTTProtocol_keepalive(START_TIME_TYPE now)
@@ -724,6 +778,10 @@ void MQTTProtocol_keepalive(START_TIME_TYPE now)
 		if (client->connected == 0 || client->keepAliveInterval == 0)
 			continue;
 
+		/* the PINGRESP could not be read while reads are paused, so neither ping nor time out */
+		if (client->readsPaused)
+			continue;
+
 		if (client->ping_outstanding == 1)
 		{
 			if (MQTTTime_difftime(now, client->net.lastPing) >= (DIFF_TIME_TYPE)(client->keepAliveInterval * 1500) &&
@@ -835,6 +893,7 @@ static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regar
 				publish.topic = m->publish->topic;
 				publish.payload = m->publish->payload;
 				publish.payloadlen = m->publish->payloadlen;
+				publish.file = m->publish->file;
 				publish.properties = m->properties;
 				publish.MQTTVersion = m->MQTTVersion;
 				memcpy(publish.mask, m->publish->mask, sizeof(publish.mask));
@@ -877,8 +936,25 @@ exit:
 
 
 /**
- * Queue an ack message. This is used when the socket is full (e.g. SSL_ERROR_WANT_WRITE).
- * To be completed/cleared when the socket is no longer full
+ * Whether an ack has to be queued rather than sent now: the socket is full, acks queued
+ * before it are still waiting, the received messages have not been written out of their
+ * queue batch yet, or the persistence writes made so far have not been committed.
+ * @param client the client that received the packet to acknowledge
+ * @param sock the socket of the client
+ * @return boolean
+ */
+static int MQTTProtocol_ackMustWait(Clients* client, SOCKET sock)
+{
+	return !Socket_noPendingWrites(sock) || client->outboundQueue->count > 0 ||
+		MQTTPersistence_queueBatchOpen(client) ||
+		!MQTTPersistenceWriter_durable(client->writer, MQTTPersistenceWriter_issued(client->writer));
+}
+
+
+/**
+ * Queue an ack message. This is used when the socket is full (e.g. SSL_ERROR_WANT_WRITE),
+ * or the persistence writes the ack depends on have not been committed yet.
+ * To be completed/cleared when the socket is no longer full and the writes are committed
  * @param client the client that received the published message
  * @param ackType the type of ack to send
  * @param msgId the msg id of the message we are acknowledging
@@ -897,7 +973,10 @@ int MQTTProtocol_queueAck(Clients* client, int ackType, int msgId)
 	{
 		ackReq->messageId = msgId;
 		ackReq->ackType = ackType;
+		ackReq->seqno = MQTTPersistenceWriter_issued(client->writer);
+		ackReq->batched = MQTTPersistence_queueBatchOpen(client);
 		ListAppend(client->outboundQueue, ackReq, sizeof(AckRequest));
+		++queuedAcks;
 	}
 
 	FUNC_EXIT_RC(rc);
@@ -905,6 +984,85 @@ int MQTTProtocol_queueAck(Clients* client, int ackType, int msgId)
 }
 
 
+/**
+ * Sends the acks queued for a client, in order, until the socket is full or the
+ * next ack depends on a queue batch not yet written, or on persistence writes which
+ * have not been committed yet.
+ * @param client the client
+ * @return the completion code of the last send
+ */
+static int MQTTProtocol_sendQueuedAcks(Clients* client)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	while (client->outboundQueue->first && rc == 0 && Socket_noPendingWrites(client->net.socket))
+	{
+		AckRequest* ackReq = (AckRequest*)(client->outboundQueue->first->content);
+
+		if (ackReq->batched)
+		{	/* the batch is written first, and then committed with whatever else was written since */
+			if (MQTTPersistence_queueBatchOpen(client))
+				break;
+			ackReq->batched = 0;
+			ackReq->seqno = MQTTPersistenceWriter_issued(client->writer);
+		}
+		if (!MQTTPersistenceWriter_durable(client->writer, ackReq->seqno))
+			break;
+		switch (ackReq->ackType)
+		{
+			case PUBACK:
+				rc = MQTTPacket_send_puback(client->MQTTVersion, ackReq->messageId, &client->net, client->clientID);
+				break;
+			case PUBREC:
+				rc = MQTTPacket_send_pubrec(client->MQTTVersion, ackReq->messageId, &client->net, client->clientID);
+				break;
+			case PUBREL:
+				rc = MQTTPacket_send_pubrel(client->MQTTVersion, ackReq->messageId, 0, &client->net, client->clientID);
+				break;
+			case PUBCOMP:
+				rc = MQTTPacket_send_pubcomp(client->MQTTVersion, ackReq->messageId, &client->net, client->clientID);
+				break;
+			default:
+				Log(LOG_ERROR, -1, "unknown ACK type %d, dropping msg", ackReq->ackType);
+		break;
+		}
+		/* an ack interrupted part way is finished with the pending writes of the socket */
+		ListRemoveHead(client->outboundQueue);
+		--queuedAcks;
+		if (rc == TCPSOCKET_INTERRUPTED)
+			rc = 0;
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Drops the acks queued for a client, as the connection they were for has gone.
+ * @param client the client
+ */
+void MQTTProtocol_emptyAckQueue(Clients* client)
+{
+	FUNC_ENTRY;
+	queuedAcks -= client->outboundQueue->count;
+	ListEmpty(client->outboundQueue);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Whether any client has acks queued, which may be waiting for persistence writes
+ * to be committed rather than for the socket.  Those are only sent from
+ * MQTTProtocol_retry, so the caller should not wait long for the socket.
+ * @return boolean
+ */
+int MQTTProtocol_acksQueued(void)
+{
+	return queuedAcks > 0;
+}
+
+
 /**
  * MQTT retry protocol and socket pending writes processing.
  * @param now current time
@@ -931,6 +1089,8 @@ void MQTTProtocol_retry(START_TIME_TYPE now, int doRetry, int regardless)
 		}
 		if (Socket_noPendingWrites(client->net.socket) == 0)
 			continue;
+		if (client->outboundQueue->count > 0 && MQTTProtocol_sendQueuedAcks(client) == SOCKET_ERROR)
+			continue;
 		if (doRetry)
 			MQTTProtocol_retries(now, client, regardless);
 	}
@@ -949,6 +1109,7 @@ void MQTTProtocol_freeClient(Clients* client)
 	MQTTProtocol_freeMessageList(client->outboundMsgs);
 	MQTTProtocol_freeMessageList(client->inboundMsgs);
 	ListFree(client->messageQueue);
+	MQTTProtocol_emptyAckQueue(client);
 	ListFree(client->outboundQueue);
 	free(client->clientID);
         client->clientID = NULL;
@@ -969,6 +1130,12 @@ void MQTTProtocol_freeClient(Clients* client)
 		free(client->httpsProxy);
 	if (client->net.http_proxy_auth)
 		free(client->net.http_proxy_auth);
+	TopicAliases_free(client->net.outboundAliases);
+	client->net.outboundAliases = NULL;
+	TopicAliases_free(client->net.inboundAliases);
+	client->net.inboundAliases = NULL;
+	MQTTPacket_endStream(&client->net);
+	MQTTPacket_endFile(&client->net);
 #if defined(OPENSSL)
 	if (client->net.https_proxy_auth)
 		free(client->net.https_proxy_auth);
@@ -1009,17 +1176,18 @@ void MQTTProtocol_freeClient(Clients* client)
  */
 void MQTTProtocol_emptyMessageList(List* msgList)
 {
-	ListElement* current = NULL;
+	Messages* m = NULL;
 
 	FUNC_ENTRY;
-	while (ListNextElement(msgList, &current))
+	/* detach each message before it is freed, as its list element is part of it */
+	while ((m = (Messages*)ListDetachHead(msgList)) != NULL)
 	{
-		Messages* m = (Messages*)(current->content);
 		MQTTProtocol_removePublication(m->publish);
 		if (m->MQTTVersion >= MQTTVERSION_5)
 			MQTTProperties_free(&m->properties);
+		MemoryPool_free(POOL_MESSAGES, m);
 	}
-	ListEmpty(msgList);
+	ListEmpty(msgList); /* resets the size */
 	FUNC_EXIT;
 }
 
@@ -1046,39 +1214,20 @@ void MQTTProtocol_freeMessageList(List* msgList)
 void MQTTProtocol_writeAvailable(SOCKET socket)
 {
 	Clients* client = NULL;
-	ListElement* current = NULL;
 	int rc = 0;
 
 	FUNC_ENTRY;
 
 	client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
 
-	current = NULL;
-	while (ListNextElement(client->outboundQueue, &current) && rc == 0)
-	{
-		AckRequest* ackReq = (AckRequest*)(current->content);
-
-		switch (ackReq->ackType)
-		{
-			case PUBACK:
-				rc = MQTTPacket_send_puback(client->MQTTVersion, ackReq->messageId, &client->net, client->clientID);
-				break;
-			case PUBREC:
-				rc = MQTTPacket_send_pubrec(client->MQTTVersion, ackReq->messageId, &client->net, client->clientID);
-				break;
-			case PUBREL:
-				rc = MQTTPacket_send_pubrel(client->MQTTVersion, ackReq->messageId, 0, &client->net, client->clientID);
-				break;
-			case PUBCOMP:
-				rc = MQTTPacket_send_pubcomp(client->MQTTVersion, ackReq->messageId, &client->net, client->clientID);
-				break;
-			default:
-				Log(LOG_ERROR, -1, "unknown ACK type %d, dropping msg", ackReq->ackType);
-		break;
-		}
-	}
+	/* a payload being sent from a file comes first, as the rest of its packet must follow */
+	if ((rc = MQTTPacket_continueFile(&client->net)) == SOCKET_ERROR)
+		client->good = 0;
+	if (rc != TCPSOCKET_COMPLETE)
+		goto exit;
 
-	ListEmpty(client->outboundQueue);
+	rc = MQTTProtocol_sendQueuedAcks(client);
+exit:
 	FUNC_EXIT_RC(rc);
 }
 
@@ -56,6 +56,8 @@ char* MQTTStrncpy(char *dest, const char* src, size_t num);
 char* MQTTStrdup(const char* src);
 
 void MQTTProtocol_writeAvailable(SOCKET socket);
+void MQTTProtocol_emptyAckQueue(Clients* client);
+int MQTTProtocol_acksQueued(void);
 
 //#define MQTTStrdup(src) MQTTStrncpy(malloc(strlen(src)+1), src, strlen(src)+1)
 
@@ -0,0 +1,422 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - fixed size pools for the message path structures
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Fixed size pools for the structures on the message path
+ *
+ * Every publication sent or received allocates a handful of small structures
+ * of fixed size: the Publish packet, the Messages and Publications kept until
+ * the exchange completes and the qEntry and MQTTClient_message handed to the
+ * application.  Rather than going to the heap for each of them, they are
+ * carved out of slabs of POOL_SLAB_OBJECTS objects and recycled, so that once
+ * the pools have grown to the working set no further heap allocations are
+ * made for them.  Only these call sites use the pools: lists on the message
+ * path are linked through the items themselves, and other lists and
+ * structures are allocated from the heap as before.
+ *
+ * Each thread keeps its own free list for each pool, which it allocates from
+ * and frees to without a lock.  Only when a free list runs empty, or grows
+ * past twice POOL_CACHE_OBJECTS, is the shared pool locked, to move
+ * POOL_CACHE_OBJECTS objects at a time.  An object may be freed on another
+ * thread than it was allocated on, as when a Publications is released by the
+ * thread which completes its exchange for another client, or a message by
+ * the application, so the objects of one pool move freely between the free
+ * lists of the threads.  The free list of a thread is returned to the shared
+ * pool when the thread ends.
+ *
+ * Slabs are only returned to the heap when the library terminates, and then
+ * only for pools which have no objects outstanding or held by other threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "MemoryPool.h"
+#include "MQTTPacket.h"
+#include "MQTTPersistence.h"
+#include "Thread.h"
+#include "StackTrace.h"
+
+#include "Heap.h"
+
+/** the number of objects in a slab when a pool grows on demand */
+#define POOL_SLAB_OBJECTS 64
+
+/** the number of objects moved between the free list of a thread and its pool at a time */
+#define POOL_CACHE_OBJECTS 32
+
+/** the alignment of the objects in a slab */
+#define POOL_ALIGNMENT sizeof(union { void* p; double d; long long l; })
+
+#define POOL_ROUND(x) (((x) + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT * POOL_ALIGNMENT)
+
+#if defined(_WIN32) || defined(_WIN64)
+mutex_type pool_mutex;
+static DWORD cache_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE cache_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_mutex_t pool_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type pool_mutex = &pool_mutex_store;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int cache_key_created = 0;
+#endif
+
+/**
+ * The header of a free object, linking it into a free list.
+ */
+typedef struct FreeObjectStruct
+{
+	struct FreeObjectStruct* next;
+} FreeObject;
+
+/**
+ * The header of a slab, linking it into the slab list of its pool.
+ * The objects follow the header.
+ */
+typedef struct SlabStruct
+{
+	struct SlabStruct* next;
+} Slab;
+
+typedef struct
+{
+	size_t size;        /**< the size of one object, rounded up to the alignment */
+	FreeObject* free;   /**< the objects not held by any thread */
+	Slab* slabs;        /**< the slabs the objects were carved from */
+	int capacity;       /**< the number of objects in all the slabs */
+	int inuse;          /**< the number of objects handed out or held in the free lists of threads */
+	int nslabs;         /**< the number of slabs */
+} Pool;
+
+static Pool pools[POOL_TYPE_COUNT] =
+{
+	{ POOL_ROUND(sizeof(Publish)), NULL, NULL, 0, 0, 0 },
+	{ POOL_ROUND(sizeof(Messages)), NULL, NULL, 0, 0, 0 },
+	{ POOL_ROUND(sizeof(Publications)), NULL, NULL, 0, 0, 0 },
+	{ POOL_ROUND(sizeof(MQTTPersistence_qEntry)), NULL, NULL, 0, 0, 0 }, /* the layout of qEntry */
+	{ POOL_ROUND(sizeof(MQTTPersistence_queuedMessage)), NULL, NULL, 0, 0, 0 }, /* an MQTTClient_message with its packet */
+};
+
+/**
+ * The free list of one thread for one pool.
+ */
+typedef struct
+{
+	FreeObject* free;   /**< the objects available to this thread */
+	int count;          /**< the number of objects in free */
+} PoolCache;
+
+/**
+ * The free lists of one thread, one for each pool.
+ */
+typedef struct
+{
+	PoolCache caches[POOL_TYPE_COUNT];
+} ThreadCache;
+
+
+/**
+ * Adds a slab of objects to a pool.  Must be called with the pool mutex held.
+ * @param pool the pool to grow
+ * @param count the number of objects to add
+ * @return 0 on success, PAHO_MEMORY_ERROR if the slab could not be allocated
+ */
+static int Pool_grow(Pool* pool, int count)
+{
+	Slab* slab = NULL;
+	char* object = NULL;
+	int i;
+
+	if ((slab = malloc(POOL_ROUND(sizeof(Slab)) + count * pool->size)) == NULL)
+		return PAHO_MEMORY_ERROR;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	object = (char*)slab + POOL_ROUND(sizeof(Slab));
+	for (i = 0; i < count; ++i)
+	{
+		FreeObject* fo = (FreeObject*)(object + i * pool->size);
+		fo->next = pool->free;
+		pool->free = fo;
+	}
+	pool->capacity += count;
+	++(pool->nslabs);
+	return 0;
+}
+
+
+/**
+ * Moves up to count objects from a pool to the free list of a thread,
+ * growing the pool if it has none.  Locks the pool mutex.
+ * @param type the pool, one of ::MemoryPool_types
+ * @param cache the free list of the thread for the pool
+ * @param count the number of objects wanted
+ */
+static void Pool_refill(int type, PoolCache* cache, int count)
+{
+	Pool* pool = &pools[type];
+
+	Paho_thread_lock_mutex(pool_mutex);
+	if (pool->free == NULL)
+		Pool_grow(pool, POOL_SLAB_OBJECTS);
+	while (pool->free && count-- > 0)
+	{
+		FreeObject* fo = pool->free;
+
+		pool->free = fo->next;
+		fo->next = cache->free;
+		cache->free = fo;
+		++(cache->count);
+		++(pool->inuse);
+	}
+	Paho_thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Moves up to count objects from the free list of a thread back to their
+ * pool.  Locks the pool mutex.
+ * @param type the pool, one of ::MemoryPool_types
+ * @param cache the free list of the thread for the pool
+ * @param count the number of objects to return
+ */
+static void Pool_spill(int type, PoolCache* cache, int count)
+{
+	Pool* pool = &pools[type];
+
+	Paho_thread_lock_mutex(pool_mutex);
+	while (cache->free && count-- > 0)
+	{
+		FreeObject* fo = cache->free;
+
+		cache->free = fo->next;
+		--(cache->count);
+		fo->next = pool->free;
+		pool->free = fo;
+		--(pool->inuse);
+	}
+	Paho_thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Returns all the free lists of a thread to the pools and frees them.
+ * Called when a thread which has used the pools ends.
+ * @param context the free lists of the thread
+ */
+#if defined(_WIN32) || defined(_WIN64)
+static VOID WINAPI ThreadCache_free(PVOID context)
+#else
+static void ThreadCache_free(void* context)
+#endif
+{
+	ThreadCache* tc = (ThreadCache*)context;
+	int type;
+
+	if (tc == NULL)
+		return;
+	for (type = 0; type < POOL_TYPE_COUNT; ++type)
+		Pool_spill(type, &tc->caches[type], tc->caches[type].count);
+	free(tc);
+}
+
+
+#if defined(_WIN32) || defined(_WIN64)
+static BOOL CALLBACK ThreadCache_createKey(PINIT_ONCE once, PVOID parameter, PVOID* context)
+{
+	cache_key = FlsAlloc(ThreadCache_free);
+	return TRUE;
+}
+#else
+static void ThreadCache_createKey(void)
+{
+	cache_key_created = (pthread_key_create(&cache_key, ThreadCache_free) == 0);
+}
+#endif
+
+
+/**
+ * Gets the free lists of the calling thread, creating them on first use.
+ * @param create whether to create the free lists if the thread has none
+ * @return the free lists, or NULL if there are none and they could not be
+ * created, in which case the shared pools are used directly
+ */
+static ThreadCache* ThreadCache_get(int create)
+{
+	ThreadCache* tc = NULL;
+
+#if defined(_WIN32) || defined(_WIN64)
+	InitOnceExecuteOnce(&cache_once, ThreadCache_createKey, NULL, NULL);
+	if (cache_key == FLS_OUT_OF_INDEXES)
+		return NULL;
+	tc = FlsGetValue(cache_key);
+#else
+	pthread_once(&cache_once, ThreadCache_createKey);
+	if (!cache_key_created)
+		return NULL;
+	tc = pthread_getspecific(cache_key);
+#endif
+	if (tc == NULL && create && (tc = malloc(sizeof(ThreadCache))) != NULL)
+	{
+		memset(tc, '\0', sizeof(ThreadCache));
+#if defined(_WIN32) || defined(_WIN64)
+		if (!FlsSetValue(cache_key, tc))
+#else
+		if (pthread_setspecific(cache_key, tc) != 0)
+#endif
+		{
+			free(tc);
+			tc = NULL;
+		}
+	}
+	return tc;
+}
+
+
+/**
+ * Allocates an object from a pool, through the free list of the calling
+ * thread.  The object is not initialized.
+ * @param type the pool to allocate from, one of ::MemoryPool_types
+ * @return pointer to the object, or NULL if memory is short
+ */
+void* MemoryPool_alloc(int type)
+{
+	ThreadCache* tc = ThreadCache_get(1);
+	PoolCache local = { NULL, 0 };
+	PoolCache* cache = tc ? &tc->caches[type] : &local;
+	FreeObject* fo = NULL;
+
+	/* no entry/exit trace points, as this is called for every message */
+	if (cache->free == NULL)
+		Pool_refill(type, cache, tc ? POOL_CACHE_OBJECTS : 1);
+	if ((fo = cache->free) != NULL)
+	{
+		cache->free = fo->next;
+		--(cache->count);
+	}
+	return fo;
+}
+
+
+/**
+ * Returns an object to the free list of the calling thread for its pool.
+ * @param type the pool the object was allocated from, one of ::MemoryPool_types
+ * @param p pointer to the object, may be NULL
+ */
+void MemoryPool_free(int type, void* p)
+{
+	ThreadCache* tc = NULL;
+	PoolCache local = { NULL, 0 };
+	PoolCache* cache = NULL;
+	FreeObject* fo = (FreeObject*)p;
+
+	if (p == NULL)
+		return;
+	tc = ThreadCache_get(1);
+	cache = tc ? &tc->caches[type] : &local;
+	fo->next = cache->free;
+	cache->free = fo;
+	if (++(cache->count) >= 2 * POOL_CACHE_OBJECTS || tc == NULL)
+		Pool_spill(type, cache, tc ? POOL_CACHE_OBJECTS : 1);
+}
+
+
+/**
+ * Makes sure that each pool can hand out count more objects without growing.
+ * @param count the number of free objects wanted in each pool
+ * @return 0 on success, PAHO_MEMORY_ERROR if a slab could not be allocated
+ */
+int MemoryPool_reserve(int count)
+{
+	int rc = 0;
+	int type;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(pool_mutex);
+	for (type = 0; type < POOL_TYPE_COUNT && rc == 0; ++type)
+	{
+		Pool* pool = &pools[type];
+		int available = pool->capacity - pool->inuse;
+
+		if (available < count)
+			rc = Pool_grow(pool, count - available);
+	}
+	Paho_thread_unlock_mutex(pool_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Gets the state of a pool.
+ * @param type the pool, one of ::MemoryPool_types
+ * @param info returned: the state of the pool
+ */
+void MemoryPool_get_info(int type, pool_info* info)
+{
+	Pool* pool = &pools[type];
+
+	Paho_thread_lock_mutex(pool_mutex);
+	info->size = pool->size;
+	info->capacity = pool->capacity;
+	info->inuse = pool->inuse;
+	info->slabs = pool->nslabs;
+	Paho_thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Returns the slabs of the pools with no objects outstanding to the heap.
+ * Called when the library terminates, before the heap is checked for leaks.
+ * The free lists of the calling thread are returned to the pools first;
+ * objects held by other threads keep their pools.
+ */
+void MemoryPool_terminate(void)
+{
+	ThreadCache* tc = ThreadCache_get(0);
+	int type;
+
+	FUNC_ENTRY;
+	if (tc)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		FlsSetValue(cache_key, NULL);
+#else
+		pthread_setspecific(cache_key, NULL);
+#endif
+		ThreadCache_free(tc);
+	}
+	Paho_thread_lock_mutex(pool_mutex);
+	for (type = 0; type < POOL_TYPE_COUNT; ++type)
+	{
+		Pool* pool = &pools[type];
+
+		if (pool->inuse > 0)
+			continue; /* the objects may still be freed after we have gone */
+		while (pool->slabs)
+		{
+			Slab* slab = pool->slabs;
+
+			pool->slabs = slab->next;
+			free(slab);
+		}
+		pool->free = NULL;
+		pool->capacity = pool->nslabs = 0;
+	}
+	Paho_thread_unlock_mutex(pool_mutex);
+	FUNC_EXIT;
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - fixed size pools for the message path structures
+ *******************************************************************************/
+
+#if !defined(MEMORYPOOL_H)
+#define MEMORYPOOL_H
+
+/**
+ * The structures which are allocated from pools, one pool for each.
+ */
+enum MemoryPool_types
+{
+	POOL_PUBLISH,        /**< Publish */
+	POOL_MESSAGES,       /**< Messages */
+	POOL_PUBLICATIONS,   /**< Publications */
+	POOL_QUEUE_ENTRY,    /**< qEntry, the messages waiting to be received */
+	POOL_CLIENT_MESSAGE, /**< MQTTClient_message, with the packet it points into */
+	POOL_TYPE_COUNT
+};
+
+/**
+ * Information about the state of one pool.
+ */
+typedef struct
+{
+	size_t size;     /**< the size of the objects in the pool in bytes */
+	int capacity;    /**< the number of objects allocated so far */
+	int inuse;       /**< the number of objects currently handed out or held by threads */
+	int slabs;       /**< the number of slabs the objects were carved from */
+} pool_info;
+
+void* MemoryPool_alloc(int type);
+void MemoryPool_free(int type, void* p);
+int MemoryPool_reserve(int count);
+void MemoryPool_get_info(int type, pool_info* info);
+void MemoryPool_terminate(void);
+
+#endif
@@ -0,0 +1,235 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - single producer, single consumer message ring
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Single producer, single consumer ring of message pointers
+ *
+ * Hands messages from the thread reading the network to the thread calling
+ * the messageArrived callback, and back again once they have been delivered.
+ * The producer only writes the tail index and the consumer only writes the
+ * head index, each on a cache line of its own, so neither has to take a lock
+ * and they do not invalidate each other's cache lines on every message.  Each
+ * side keeps a copy of the other's index and only reads the shared one when
+ * the copy says the ring is full or empty.
+ *
+ * The consumer only sleeps when the ring is empty, and says so first, so the
+ * producer posts the semaphore once for a batch of messages, and only if the
+ * consumer is actually waiting.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "MessageRing.h"
+#include "Thread.h"
+#include "StackTrace.h"
+
+#include "Heap.h"
+
+/** the size of the cache lines the indices are kept apart by */
+#define RING_CACHE_LINE 64
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RING_LOAD_ACQUIRE(p) (_ReadWriteBarrier(), *(volatile unsigned int*)(p))
+#define RING_STORE_RELEASE(p, v) do { _ReadWriteBarrier(); *(volatile unsigned int*)(p) = (v); } while (0)
+#define RING_STORE_FENCED(p, v) InterlockedExchange((volatile long*)(p), (long)(v))
+#define RING_EXCHANGE(p, v) ((int)InterlockedExchange((volatile long*)(p), (long)(v)))
+#define RING_FENCE() MemoryBarrier()
+#else
+#define RING_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define RING_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define RING_STORE_FENCED(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define RING_EXCHANGE(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define RING_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+struct MessageRingStruct
+{
+	void** slots;             /**< the messages, capacity of them */
+	unsigned int mask;        /**< capacity - 1, the capacity being a power of two */
+	sem_type sem;             /**< posted to wake the consumer */
+	char pad0[RING_CACHE_LINE];
+	unsigned int tail;        /**< the next slot to fill, written by the producer */
+	unsigned int cachedHead;  /**< the producer's copy of head */
+	char pad1[RING_CACHE_LINE - 2 * sizeof(unsigned int)];
+	unsigned int head;        /**< the next slot to empty, written by the consumer */
+	unsigned int cachedTail;  /**< the consumer's copy of tail */
+	char pad2[RING_CACHE_LINE - 2 * sizeof(unsigned int)];
+	int waiting;              /**< whether the consumer is asleep, or about to be */
+	char pad3[RING_CACHE_LINE - sizeof(int)];
+};
+
+
+/**
+ * Creates a ring.
+ * @param capacity the number of messages it can hold, rounded up to a power of two
+ * @return the ring, or NULL if memory is short
+ */
+MessageRing* MessageRing_create(int capacity)
+{
+	MessageRing* ring = NULL;
+	unsigned int size = 1;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	while (size < (unsigned int)capacity)
+		size <<= 1;
+	if ((ring = malloc(sizeof(MessageRing))) == NULL)
+		goto exit;
+	memset(ring, '\0', sizeof(MessageRing));
+	ring->mask = size - 1;
+	if ((ring->slots = malloc(size * sizeof(void*))) == NULL)
+	{
+		free(ring);
+		ring = NULL;
+		goto exit;
+	}
+	ring->sem = Thread_create_sem(&rc);
+	if (rc != 0)
+	{
+		free(ring->slots);
+		free(ring);
+		ring = NULL;
+	}
+exit:
+	FUNC_EXIT;
+	return ring;
+}
+
+
+/**
+ * Frees a ring.  Any messages still in it are the caller's to free first.
+ * @param ring the ring, may be NULL
+ */
+void MessageRing_destroy(MessageRing* ring)
+{
+	FUNC_ENTRY;
+	if (ring)
+	{
+		Thread_destroy_sem(ring->sem);
+		free(ring->slots);
+		free(ring);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Adds a message to the tail of the ring.  Called by the producer only.
+ * The consumer is not woken until MessageRing_wake is called, so that a
+ * batch of messages costs one wakeup.
+ * @param ring the ring
+ * @param item the message
+ * @return 1 if the message was added, 0 if the ring is full
+ */
+int MessageRing_push(MessageRing* ring, void* item)
+{
+	unsigned int tail = ring->tail;
+
+	/* no entry/exit trace points, as this is called for every message */
+	if (tail - ring->cachedHead > ring->mask)
+	{
+		ring->cachedHead = RING_LOAD_ACQUIRE(&ring->head);
+		if (tail - ring->cachedHead > ring->mask)
+			return 0;
+	}
+	ring->slots[tail & ring->mask] = item;
+	RING_STORE_RELEASE(&ring->tail, tail + 1);
+	return 1;
+}
+
+
+/**
+ * Wakes the consumer if it is waiting.  Called by the producer after pushing
+ * a batch of messages, or by any thread to make the consumer look at its
+ * other state.
+ * @param ring the ring
+ */
+void MessageRing_wake(MessageRing* ring)
+{
+	RING_FENCE(); /* the tail must be visible before waiting is read */
+	if (RING_EXCHANGE(&ring->waiting, 0))
+		Thread_post_sem(ring->sem);
+}
+
+
+/**
+ * Gets the message at the head of the ring without removing it.
+ * Called by the consumer only.
+ * @param ring the ring
+ * @return the message, or NULL if the ring is empty
+ */
+void* MessageRing_peek(MessageRing* ring)
+{
+	unsigned int head = ring->head;
+
+	if (head == ring->cachedTail)
+	{
+		ring->cachedTail = RING_LOAD_ACQUIRE(&ring->tail);
+		if (head == ring->cachedTail)
+			return NULL;
+	}
+	return ring->slots[head & ring->mask];
+}
+
+
+/**
+ * Removes the message at the head of the ring.  Called by the consumer only.
+ * @param ring the ring
+ * @return the message, or NULL if the ring is empty
+ */
+void* MessageRing_pop(MessageRing* ring)
+{
+	void* item = MessageRing_peek(ring);
+
+	if (item)
+		RING_STORE_RELEASE(&ring->head, ring->head + 1);
+	return item;
+}
+
+
+/**
+ * Waits for the ring to be non-empty, or for a wakeup.  Called by the consumer only.
+ * @param ring the ring
+ * @param timeout the maximum time to wait, in milliseconds
+ * @return 1 if there is a message in the ring, 0 otherwise
+ */
+int MessageRing_wait(MessageRing* ring, int timeout)
+{
+	int rc = 1;
+
+	RING_STORE_FENCED(&ring->waiting, 1);
+	if (MessageRing_peek(ring) == NULL)
+	{
+		Thread_wait_sem(ring->sem, timeout);
+		rc = MessageRing_peek(ring) != NULL;
+	}
+	RING_STORE_FENCED(&ring->waiting, 0);
+	return rc;
+}
+
+
+/**
+ * Gets the number of messages the ring can hold.
+ * @param ring the ring
+ * @return the capacity
+ */
+int MessageRing_capacity(MessageRing* ring)
+{
+	return (int)ring->mask + 1;
+}
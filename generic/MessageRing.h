@@ -0,0 +1,35 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - single producer, single consumer message ring
+ *******************************************************************************/
+
+#if !defined(MESSAGERING_H)
+#define MESSAGERING_H
+
+/**
+ * A bounded ring of pointers passed from one producer thread to one consumer
+ * thread without locks.
+ */
+typedef struct MessageRingStruct MessageRing;
+
+MessageRing* MessageRing_create(int capacity);
+void MessageRing_destroy(MessageRing* ring);
+int MessageRing_push(MessageRing* ring, void* item);
+void MessageRing_wake(MessageRing* ring);
+void* MessageRing_peek(MessageRing* ring);
+void* MessageRing_pop(MessageRing* ring);
+int MessageRing_wait(MessageRing* ring, int timeout);
+int MessageRing_capacity(MessageRing* ring);
+
+#endif
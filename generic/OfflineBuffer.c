@@ -0,0 +1,754 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - offline publish buffer
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A queue of the messages published while the client is disconnected
+ *
+ * The messages are copied into a ring of bytes in memory, each one in a
+ * single contiguous record, so that buffering one costs no allocation.  A
+ * message which would not fit is not left out: with a spill directory, the
+ * whole ring is appended to a segment file there, and the messages after it
+ * are appended to the segments as well, until they have all been taken out
+ * again.  So the messages are either all in memory or all in the segments,
+ * and are always taken out in the order they were added.
+ *
+ * The segments are read through a large stdio buffer, and the offset of the
+ * next message to read is written into the header of the segment by
+ * ::OfflineBuffer_sync, so that it is not done for every message.  What was
+ * read since the last sync is read again by the next buffer opened for the
+ * same client ID and server URI, after a crash.  A segment is unlinked once
+ * it has been read to its end, and the ring is written to the segments when
+ * the buffer is destroyed, so that a buffer with a spill directory loses no
+ * messages when it is closed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#include <windows.h>
+	#include <direct.h>
+	#define snprintf _snprintf
+	#define unlink _unlink
+	#define rmdir _rmdir
+#else
+	#include <sys/types.h>
+	#include <dirent.h>
+	#include <unistd.h>
+#endif
+
+#include "OfflineBuffer.h"
+#include "MQTTClient.h"
+#include "MQTTPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "Log.h"
+#include "StackTrace.h"
+
+#include "Heap.h"
+
+/** the size at which a new segment is started */
+#define OFFLINE_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/** the size of the stdio buffer the segments are read through */
+#define OFFLINE_READ_BUFFER (64 * 1024)
+
+/** the number of hex digits of the segment number in a segment filename */
+#define OFFLINE_ID_DIGITS 8
+
+/** the bytes at the start of each segment, followed by the offset of the next message to read */
+#define OFFLINE_MAGIC "MQTCOBF1"
+#define OFFLINE_MAGIC_LENGTH 8
+#define OFFLINE_SEGMENT_HEADER (OFFLINE_MAGIC_LENGTH + 4)
+
+/** crc (4), qos (1), retained (1), topic length (2), payload length (4) */
+#define OFFLINE_HEADER_LENGTH 12
+
+/** The header of a message in the ring, followed by its topic, a '\0' and its payload */
+typedef struct
+{
+	unsigned int reclen;      /**< the bytes of the whole record, a multiple of 8 */
+	unsigned short topiclen;
+	char qos;
+	char retained;
+	int payloadlen;
+} RingRecord;
+
+struct OfflineBufferStruct
+{
+	char* ring;               /**< the messages in memory, allocated when the first is added */
+	size_t size;              /**< the bytes of the ring */
+	size_t head;              /**< the offset of the oldest message in the ring */
+	size_t tail;              /**< the offset the next message is added at */
+	size_t wrap;              /**< the end of the messages before the start of the ring, 0 if they do not wrap */
+	int count;                /**< the number of messages in the ring */
+	char* dir;                /**< the directory of the segments, NULL if there is no spilling */
+	int spilled;              /**< whether the messages are in the segments */
+	unsigned int firstId;     /**< the segment read from */
+	unsigned int lastId;      /**< the segment appended to, or the newest found by ::OfflineBuffer_create */
+	FILE* rfp;                /**< the segment read from, NULL if not yet opened */
+	long rpos;                /**< the offset of the next message to read from it */
+	long synced;              /**< the offset last written into its header */
+	FILE* wfp;                /**< the segment appended to, NULL if not yet opened */
+	long wsize;               /**< the bytes in it */
+	char* rbuf;               /**< the topic and payload of the message last read from a segment */
+	size_t rbuflen;
+	OfflineMessage rmsg;      /**< that message */
+	int peeked;               /**< the bytes of that message in the segment, 0 if it is to be read */
+};
+
+
+#if !defined(NO_PERSISTENCE)
+static void writeInt4(char* p, unsigned int v)
+{
+	p[0] = (char)(v & 0xFF);
+	p[1] = (char)((v >> 8) & 0xFF);
+	p[2] = (char)((v >> 16) & 0xFF);
+	p[3] = (char)((v >> 24) & 0xFF);
+}
+
+
+static unsigned int readInt4(const char* buf)
+{
+	const unsigned char* p = (const unsigned char*)buf;
+
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+static int OfflineBuffer_idCompare(const void* a, const void* b)
+{
+	unsigned int ia = *(const unsigned int*)a, ib = *(const unsigned int*)b;
+
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+/**
+ * Makes the filename of a segment.
+ * @return the filename, to be freed by the caller, or NULL if memory is short
+ */
+static char* OfflineBuffer_segmentName(OfflineBuffer* b, unsigned int id)
+{
+	size_t len = strlen(b->dir) + OFFLINE_ID_DIGITS + strlen(OFFLINE_FILENAME_EXTENSION) + 2;
+	char* name = malloc(len);
+
+	if (name)
+		snprintf(name, len, "%s/%08x%s", b->dir, id, OFFLINE_FILENAME_EXTENSION);
+	return name;
+}
+
+
+/**
+ * Finds the segments left in the spill directory by an earlier buffer.
+ * @return 0 if success, #PAHO_MEMORY_ERROR if memory is short
+ */
+static int OfflineBuffer_findSegments(OfflineBuffer* b)
+{
+	unsigned int* ids = NULL;
+	int nids = 0;
+	int max = 16;
+	int rc = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	WIN32_FIND_DATAA FileData;
+	HANDLE hDir;
+	char* pattern = NULL;
+	size_t alloclen = strlen(b->dir) + strlen(OFFLINE_FILENAME_EXTENSION) + 3;
+#else
+	DIR* dp = NULL;
+	struct dirent* dir_entry;
+#endif
+
+	FUNC_ENTRY;
+	if ((ids = malloc(max * sizeof(unsigned int))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+#if defined(_WIN32) || defined(_WIN64)
+	if ((pattern = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	snprintf(pattern, alloclen, "%s/*%s", b->dir, OFFLINE_FILENAME_EXTENSION);
+	hDir = FindFirstFileA(pattern, &FileData);
+	free(pattern);
+	if (hDir == INVALID_HANDLE_VALUE)
+		goto exit;
+	do
+	{
+		const char* name = FileData.cFileName;
+#else
+	if ((dp = opendir(b->dir)) == NULL)
+		goto exit;
+	while ((dir_entry = readdir(dp)) != NULL)
+	{
+		const char* name = dir_entry->d_name;
+#endif
+		if (strlen(name) == OFFLINE_ID_DIGITS + strlen(OFFLINE_FILENAME_EXTENSION) &&
+			strspn(name, "0123456789abcdef") == OFFLINE_ID_DIGITS &&
+			strcmp(name + OFFLINE_ID_DIGITS, OFFLINE_FILENAME_EXTENSION) == 0)
+		{
+			if (nids == max)
+			{
+				unsigned int* more = realloc(ids, 2 * max * sizeof(unsigned int));
+
+				if (more == NULL)
+				{
+					rc = PAHO_MEMORY_ERROR;
+					break;
+				}
+				ids = more;
+				max *= 2;
+			}
+			ids[nids++] = (unsigned int)strtoul(name, NULL, 16);
+		}
+#if defined(_WIN32) || defined(_WIN64)
+	} while (FindNextFileA(hDir, &FileData));
+	FindClose(hDir);
+#else
+	}
+	closedir(dp);
+#endif
+	if (nids > 0)
+	{
+		qsort(ids, nids, sizeof(unsigned int), OfflineBuffer_idCompare);
+		b->firstId = ids[0];
+		b->lastId = ids[nids - 1];
+		b->spilled = 1;
+	}
+exit:
+	if (ids)
+		free(ids);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Appends a message to the last segment, starting a new one if there is none
+ * or it is full.  The segment is not flushed.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise
+ */
+static int OfflineBuffer_append(OfflineBuffer* b, const char* topic, int topiclen, const void* payload,
+		int payloadlen, int qos, int retained)
+{
+	char header[OFFLINE_HEADER_LENGTH];
+	unsigned int crc = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (b->wfp && b->wsize >= OFFLINE_SEGMENT_SIZE)
+	{
+		fclose(b->wfp);
+		b->wfp = NULL;
+	}
+	if (b->wfp == NULL)
+	{
+		char* name = NULL;
+		char segheader[OFFLINE_SEGMENT_HEADER];
+
+		if (b->spilled)
+			++(b->lastId);
+		else
+			b->firstId = ++(b->lastId);
+		if ((name = OfflineBuffer_segmentName(b, b->lastId)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		if ((b->wfp = fopen(name, "w+b")) == NULL)
+			Log(LOG_ERROR, -1, "Error %d creating offline segment %s", errno, name);
+		free(name);
+		if (b->wfp == NULL)
+		{
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			goto exit;
+		}
+		memcpy(segheader, OFFLINE_MAGIC, OFFLINE_MAGIC_LENGTH);
+		writeInt4(&segheader[OFFLINE_MAGIC_LENGTH], OFFLINE_SEGMENT_HEADER);
+		if (fwrite(segheader, 1, OFFLINE_SEGMENT_HEADER, b->wfp) != OFFLINE_SEGMENT_HEADER)
+		{
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			goto exit;
+		}
+		b->wsize = OFFLINE_SEGMENT_HEADER;
+		b->spilled = 1;
+	}
+	header[4] = (char)qos;
+	header[5] = (char)retained;
+	header[6] = (char)(topiclen & 0xFF);
+	header[7] = (char)((topiclen >> 8) & 0xFF);
+	writeInt4(&header[8], (unsigned int)payloadlen);
+	crc = MQTTPersistence_crc32(crc, &header[4], OFFLINE_HEADER_LENGTH - 4);
+	crc = MQTTPersistence_crc32(crc, topic, topiclen);
+	crc = MQTTPersistence_crc32(crc, payload, payloadlen);
+	writeInt4(header, crc);
+	if (fwrite(header, 1, OFFLINE_HEADER_LENGTH, b->wfp) != OFFLINE_HEADER_LENGTH ||
+		fwrite(topic, 1, topiclen, b->wfp) != (size_t)topiclen ||
+		(payloadlen > 0 && fwrite(payload, 1, payloadlen, b->wfp) != (size_t)payloadlen))
+	{
+		Log(LOG_ERROR, -1, "Error %d writing offline segment %u", errno, b->lastId);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	b->wsize += OFFLINE_HEADER_LENGTH + topiclen + payloadlen;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+#endif
+
+
+/**
+ * Takes the oldest message out of the ring.
+ */
+static void OfflineBuffer_ringPop(OfflineBuffer* b)
+{
+	RingRecord* rec = (RingRecord*)(b->ring + b->head);
+
+	b->head += rec->reclen;
+	if (--(b->count) == 0)
+		b->head = b->tail = b->wrap = 0;
+	else if (b->wrap > 0 && b->head == b->wrap)
+	{	/* the rest of the messages start at the start of the ring */
+		b->head = 0;
+		b->wrap = 0;
+	}
+}
+
+
+/**
+ * Moves the messages of the ring to the segments.  If a write fails, those
+ * which were not moved are taken out of the ring after those in the segments.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise
+ */
+static int OfflineBuffer_spillRing(OfflineBuffer* b)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	while (rc == 0 && b->count > 0)
+	{
+		RingRecord* rec = (RingRecord*)(b->ring + b->head);
+		char* topic = (char*)(rec + 1);
+
+		if ((rc = OfflineBuffer_append(b, topic, rec->topiclen, topic + rec->topiclen + 1,
+				rec->payloadlen, rec->qos, rec->retained)) == 0)
+			OfflineBuffer_ringPop(b);
+	}
+	if (b->wfp)
+		fflush(b->wfp);
+#else
+	rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Creates an offline buffer.
+ * @param maxBytes the size of the ring in memory, which may be 0 to spill every message
+ * @param spillDir the directory under which the segments are kept, NULL to keep only
+ * what fits in the ring.  The segments are in a directory of their own for each client
+ * ID and server URI, which is where the buffer carries on from the last one with them.
+ * @param clientID the client ID
+ * @param serverURI the server URI
+ * @return the buffer, or NULL if memory is short or the spill directory cannot be made
+ */
+OfflineBuffer* OfflineBuffer_create(size_t maxBytes, const char* spillDir, const char* clientID,
+		const char* serverURI)
+{
+	OfflineBuffer* b = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((b = malloc(sizeof(OfflineBuffer))) == NULL)
+		goto exit;
+	memset(b, '\0', sizeof(OfflineBuffer));
+	b->size = maxBytes & ~(size_t)7;
+	if (spillDir)
+	{
+#if !defined(NO_PERSISTENCE)
+		/* not the directory of the persistence, if it is under the same one */
+		size_t len = strlen(clientID) + 9;
+		char* name = malloc(len);
+
+		if (name == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			snprintf(name, len, "offline-%s", clientID);
+			rc = pstmkclientdir(&b->dir, name, serverURI, spillDir);
+			free(name);
+		}
+		if (rc == 0)
+			rc = OfflineBuffer_findSegments(b);
+#else
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#endif
+		if (rc != 0)
+		{
+			Log(LOG_ERROR, -1, "Error %d opening offline buffer in %s", rc, spillDir);
+			OfflineBuffer_destroy(b);
+			b = NULL;
+		}
+	}
+exit:
+	FUNC_EXIT;
+	return b;
+}
+
+
+/**
+ * Destroys an offline buffer.  The messages in the ring are written to the
+ * segments first, if there is a spill directory, and otherwise lost.
+ */
+void OfflineBuffer_destroy(OfflineBuffer* b)
+{
+	FUNC_ENTRY;
+	if (b == NULL)
+		goto exit;
+	if (b->count > 0 && (b->dir == NULL || OfflineBuffer_spillRing(b) != 0))
+		Log(LOG_ERROR, -1, "%d offline messages lost", b->count);
+	OfflineBuffer_sync(b);
+	if (b->wfp)
+		fclose(b->wfp);
+	if (b->rfp)
+		fclose(b->rfp);
+	if (b->dir)
+	{
+		if (!b->spilled)
+			rmdir(b->dir); /* left if it is not empty */
+		free(b->dir);
+	}
+	if (b->ring)
+		free(b->ring);
+	if (b->rbuf)
+		free(b->rbuf);
+	free(b);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Adds a message to an offline buffer.
+ * @param b the buffer
+ * @param topic the topic, at most 65535 bytes
+ * @param payload the payload, which is copied
+ * @param payloadlen the length of the payload
+ * @param qos the QoS
+ * @param retained the retained flag
+ * @return 0 if success, #OFFLINEBUFFER_FULL if it does not fit in the ring and there is
+ * no spill directory, #MQTTCLIENT_PERSISTENCE_ERROR if it cannot be written to the
+ * segments, #MQTTCLIENT_FAILURE if the topic is too long, #PAHO_MEMORY_ERROR
+ */
+int OfflineBuffer_add(OfflineBuffer* b, const char* topic, const void* payload, int payloadlen,
+		int qos, int retained)
+{
+	size_t topiclen = strlen(topic);
+	size_t reclen = (sizeof(RingRecord) + topiclen + 1 + (size_t)payloadlen + 7) & ~(size_t)7;
+	char* p = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (topiclen > 65535 || payloadlen < 0)
+	{
+		rc = MQTTCLIENT_FAILURE;
+		goto exit;
+	}
+	if (!b->spilled && reclen <= b->size)
+	{
+		if (b->ring == NULL && (b->ring = malloc(b->size)) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		if (b->count == 0 || b->wrap == 0)
+		{	/* the messages are from head to tail, and the space after them or before them */
+			if (b->size - b->tail >= reclen)
+				p = b->ring + b->tail;
+			else if (b->head >= reclen)
+			{
+				b->wrap = b->tail;
+				b->tail = 0;
+				p = b->ring;
+			}
+		}
+		else if (b->head - b->tail >= reclen)
+			p = b->ring + b->tail;
+	}
+	if (p)
+	{
+		RingRecord* rec = (RingRecord*)p;
+
+		rec->reclen = (unsigned int)reclen;
+		rec->topiclen = (unsigned short)topiclen;
+		rec->qos = (char)qos;
+		rec->retained = (char)retained;
+		rec->payloadlen = payloadlen;
+		memcpy(rec + 1, topic, topiclen + 1);
+		if (payloadlen > 0)
+			memcpy((char*)(rec + 1) + topiclen + 1, payload, payloadlen);
+		b->tail += reclen;
+		++(b->count);
+	}
+	else if (b->dir == NULL)
+		rc = OFFLINEBUFFER_FULL;
+#if !defined(NO_PERSISTENCE)
+	else if ((rc = OfflineBuffer_spillRing(b)) == 0 &&
+		(rc = OfflineBuffer_append(b, topic, (int)topiclen, payload, payloadlen, qos, retained)) == 0)
+		fflush(b->wfp);
+#endif
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if !defined(NO_PERSISTENCE)
+/**
+ * Finishes with the segment read from, unlinking it.  If it is the last one,
+ * the messages are in memory again from then on.
+ */
+static void OfflineBuffer_nextSegment(OfflineBuffer* b)
+{
+	char* name = OfflineBuffer_segmentName(b, b->firstId);
+
+	if (b->rfp)
+		fclose(b->rfp);
+	b->rfp = NULL;
+	b->peeked = 0;
+	if (name)
+	{
+		unlink(name);
+		free(name);
+	}
+	if (b->firstId == b->lastId)
+	{
+		if (b->wfp)
+			fclose(b->wfp);
+		b->wfp = NULL;
+		b->spilled = 0;
+	}
+	else
+		++(b->firstId);
+}
+
+
+/**
+ * Opens the segment to read from, at the offset in its header.
+ * @return 0 if success, nonzero if it cannot be read
+ */
+static int OfflineBuffer_openSegment(OfflineBuffer* b)
+{
+	char segheader[OFFLINE_SEGMENT_HEADER];
+	char* name = OfflineBuffer_segmentName(b, b->firstId);
+	int rc = -1;
+
+	if (name == NULL)
+		goto exit;
+	if ((b->rfp = fopen(name, "r+b")) == NULL)
+		Log(LOG_ERROR, -1, "Error %d opening offline segment %s", errno, name);
+	else
+	{
+		setvbuf(b->rfp, NULL, _IOFBF, OFFLINE_READ_BUFFER);
+		if (fread(segheader, 1, OFFLINE_SEGMENT_HEADER, b->rfp) == OFFLINE_SEGMENT_HEADER &&
+			memcmp(segheader, OFFLINE_MAGIC, OFFLINE_MAGIC_LENGTH) == 0 &&
+			(b->rpos = (long)readInt4(&segheader[OFFLINE_MAGIC_LENGTH])) >= OFFLINE_SEGMENT_HEADER &&
+			fseek(b->rfp, b->rpos, SEEK_SET) == 0)
+		{
+			b->synced = b->rpos;
+			rc = 0;
+		}
+	}
+	free(name);
+exit:
+	return rc;
+}
+
+
+/**
+ * Reads the next message from the segments.  A message which is cut short or
+ * fails its CRC ends its segment, as it is what a crash in the middle of an
+ * append leaves behind.
+ * @return 0 if there is one, 1 if there is none, #PAHO_MEMORY_ERROR
+ */
+static int OfflineBuffer_read(OfflineBuffer* b)
+{
+	char header[OFFLINE_HEADER_LENGTH];
+	int rc = 1;
+
+	FUNC_ENTRY;
+	while (b->spilled && rc == 1)
+	{
+		size_t topiclen = 0, payloadlen = 0;
+		unsigned int crc = 0;
+
+		if (b->rfp == NULL && OfflineBuffer_openSegment(b) != 0)
+		{
+			OfflineBuffer_nextSegment(b);
+			continue;
+		}
+		if (b->wfp && b->firstId == b->lastId && b->rpos >= b->wsize)
+		{	/* all that has been appended has been read */
+			OfflineBuffer_nextSegment(b);
+			continue;
+		}
+		if (fread(header, 1, OFFLINE_HEADER_LENGTH, b->rfp) == OFFLINE_HEADER_LENGTH &&
+			(topiclen = (unsigned char)header[6] | ((unsigned char)header[7] << 8)) > 0 &&
+			(payloadlen = readInt4(&header[8])) <= 0x7FFFFFFF - OFFLINE_HEADER_LENGTH - topiclen)
+		{
+			if (topiclen + payloadlen + 1 > b->rbuflen)
+			{
+				if (b->rbuf)
+					free(b->rbuf);
+				b->rbuflen = topiclen + payloadlen + 1;
+				if ((b->rbuf = malloc(b->rbuflen)) == NULL)
+				{
+					b->rbuflen = 0;
+					fseek(b->rfp, b->rpos, SEEK_SET);
+					rc = PAHO_MEMORY_ERROR;
+					break;
+				}
+			}
+			if (fread(b->rbuf, 1, topiclen, b->rfp) == topiclen &&
+				fread(b->rbuf + topiclen + 1, 1, payloadlen, b->rfp) == payloadlen)
+			{
+				crc = MQTTPersistence_crc32(crc, &header[4], OFFLINE_HEADER_LENGTH - 4);
+				crc = MQTTPersistence_crc32(crc, b->rbuf, topiclen);
+				crc = MQTTPersistence_crc32(crc, b->rbuf + topiclen + 1, payloadlen);
+				if (crc == readInt4(header))
+				{
+					b->rbuf[topiclen] = '\0';
+					b->rmsg.topic = b->rbuf;
+					b->rmsg.payload = b->rbuf + topiclen + 1;
+					b->rmsg.payloadlen = (int)payloadlen;
+					b->rmsg.qos = header[4];
+					b->rmsg.retained = header[5];
+					b->peeked = OFFLINE_HEADER_LENGTH + (int)(topiclen + payloadlen);
+					rc = 0;
+					break;
+				}
+			}
+		}
+		if (b->wfp && b->firstId == b->lastId)
+			Log(LOG_ERROR, -1, "Error reading offline segment %u at %ld", b->firstId, b->rpos);
+		OfflineBuffer_nextSegment(b);
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+#endif
+
+
+/**
+ * Gets the oldest message of an offline buffer, without taking it out.
+ * @param b the buffer
+ * @param message set to the message, which is valid until the buffer is next used
+ * @return 0 if there is a message, 1 if the buffer is empty, #PAHO_MEMORY_ERROR
+ */
+int OfflineBuffer_peek(OfflineBuffer* b, OfflineMessage* message)
+{
+	int rc = 1;
+
+#if !defined(NO_PERSISTENCE)
+	if (b->spilled && (b->peeked > 0 || (rc = OfflineBuffer_read(b)) == 0))
+	{
+		*message = b->rmsg;
+		goto exit;
+	}
+	if (rc == PAHO_MEMORY_ERROR)
+		goto exit;
+#endif
+	if (b->count > 0)
+	{
+		RingRecord* rec = (RingRecord*)(b->ring + b->head);
+
+		message->topic = (char*)(rec + 1);
+		message->payload = (char*)(rec + 1) + rec->topiclen + 1;
+		message->payloadlen = rec->payloadlen;
+		message->qos = rec->qos;
+		message->retained = rec->retained;
+		rc = 0;
+	}
+#if !defined(NO_PERSISTENCE)
+exit:
+#endif
+	return rc;
+}
+
+
+/**
+ * Takes the message last got by ::OfflineBuffer_peek out of an offline buffer.
+ */
+void OfflineBuffer_pop(OfflineBuffer* b)
+{
+	if (b->spilled)
+	{
+		b->rpos += b->peeked;
+		b->peeked = 0;
+	}
+	else if (b->count > 0)
+		OfflineBuffer_ringPop(b);
+}
+
+
+/**
+ * Whether an offline buffer is empty.  Segments left by an earlier buffer count
+ * as messages until they have been read.
+ */
+int OfflineBuffer_isEmpty(OfflineBuffer* b)
+{
+	return b->count == 0 && !b->spilled;
+}
+
+
+/**
+ * Writes the offset of the next message to read into the header of the
+ * segment read from, so that the messages taken out so far are not read again
+ * by the next buffer for the client.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int OfflineBuffer_sync(OfflineBuffer* b)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	if (b->rfp && b->rpos != b->synced)
+	{
+		char offset[4];
+
+		writeInt4(offset, (unsigned int)b->rpos);
+		if (fseek(b->rfp, OFFLINE_MAGIC_LENGTH, SEEK_SET) != 0 ||
+			fwrite(offset, 1, sizeof(offset), b->rfp) != sizeof(offset) ||
+			fflush(b->rfp) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else
+			b->synced = b->rpos;
+		fseek(b->rfp, b->rpos + b->peeked, SEEK_SET);
+	}
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - offline publish buffer
+ *******************************************************************************/
+
+#if !defined(OFFLINEBUFFER_H)
+#define OFFLINEBUFFER_H
+
+#include <stddef.h>
+
+/** The extension of the spill segment filenames */
+#define OFFLINE_FILENAME_EXTENSION ".obuf"
+
+/** Returned by ::OfflineBuffer_add when a message does not fit, and there is nowhere to spill it */
+#define OFFLINEBUFFER_FULL 1
+
+/**
+ * A queue of messages published while the client is not connected, kept in
+ * a ring in memory, and in segment files once the ring is full.
+ */
+typedef struct OfflineBufferStruct OfflineBuffer;
+
+/** A buffered message, as returned by ::OfflineBuffer_peek */
+typedef struct
+{
+	const char* topic;
+	const void* payload;
+	int payloadlen;
+	int qos;
+	int retained;
+} OfflineMessage;
+
+OfflineBuffer* OfflineBuffer_create(size_t maxBytes, const char* spillDir, const char* clientID,
+		const char* serverURI);
+void OfflineBuffer_destroy(OfflineBuffer* buffer);
+int OfflineBuffer_add(OfflineBuffer* buffer, const char* topic, const void* payload, int payloadlen,
+		int qos, int retained);
+int OfflineBuffer_peek(OfflineBuffer* buffer, OfflineMessage* message);
+void OfflineBuffer_pop(OfflineBuffer* buffer);
+int OfflineBuffer_isEmpty(OfflineBuffer* buffer);
+int OfflineBuffer_sync(OfflineBuffer* buffer);
+
+#endif
@@ -1016,7 +1016,7 @@ int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, Pack
 			}
 			Log(TRACE_MIN, -1, "Partial write: incomplete write of %lu bytes on SSL socket %d",
 				iovec.iov_len, socket);
-			SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, iovec.iov_len, 0);
+			SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, iovec.iov_len, 0, NULL, 0);
 			*sockmem = socket;
 			ListAppend(mod_s.write_pending, sockmem, sizeof(int));
 #if defined(USE_SELECT)
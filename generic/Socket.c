@@ -48,6 +48,10 @@
 #include <sys/un.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
 #if defined(USE_SELECT)
 int isReady(int socket, fd_set* read_set, fd_set* write_set);
 int Socket_continueWrites(fd_set* pwset, SOCKET* socket, mutex_type mutex);
@@ -171,6 +175,7 @@ void Socket_outInitialize(void)
 	mod_s.cur_clientsds = NULL;
 	FD_ZERO(&(mod_s.rset));														/* Initialize the descriptor set */
 	FD_ZERO(&(mod_s.pending_wset));
+	FD_ZERO(&(mod_s.paused_rset));
 	mod_s.maxfdp1 = 0;
 	memcpy((void*)&(mod_s.rset_saved), (void*)&(mod_s.rset), sizeof(mod_s.rset_saved));
 #else
@@ -456,6 +461,16 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 		}
 
 		memcpy((void*)&(mod_s.rset), (void*)&(mod_s.rset_saved), sizeof(mod_s.rset));
+		{	/* leave out the sockets not being read from */
+			ListElement* cur_clientsds = NULL;
+
+			while (ListNextElement(mod_s.clientsds, &cur_clientsds))
+			{
+				int cursock = *((int*)(cur_clientsds->content));
+				if (FD_ISSET(cursock, &(mod_s.paused_rset)))
+					FD_CLR(cursock, &(mod_s.rset));
+			}
+		}
 		memcpy((void*)&(pwset), (void*)&(mod_s.pending_wset), sizeof(pwset));
 		maxfdp1_saved = mod_s.maxfdp1;
 		
@@ -671,6 +686,52 @@ exit:
 #endif
 
 
+#if defined(USE_SELECT)
+/**
+ * Stops or resumes reading from a socket, leaving it in the socket set so that
+ * it can still be written to.  While it is not read from, TCP flow control
+ * pushes back on the sender.
+ * @param socket the socket
+ * @param pause 1 to stop reading, 0 to resume
+ */
+void Socket_pauseReads(SOCKET socket, int pause)
+{
+	FUNC_ENTRY;
+	if (pause)
+		FD_SET(socket, &(mod_s.paused_rset));
+	else
+		FD_CLR(socket, &(mod_s.paused_rset));
+	FUNC_EXIT;
+}
+#else
+/**
+ * Stops or resumes reading from a socket, leaving it in the socket set so that
+ * errors on it are still reported.  While it is not read from, TCP flow control
+ * pushes back on the sender.
+ * @param socket the socket
+ * @param pause 1 to stop reading, 0 to resume
+ */
+void Socket_pauseReads(SOCKET socket, int pause)
+{
+	struct pollfd* fd;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(socket_mutex);
+	if (mod_s.nfds > 0 &&
+		(fd = bsearch(&socket, mod_s.fds_read, (size_t)mod_s.nfds, sizeof(mod_s.fds_read[0]), cmpsockfds)) != NULL)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		fd->events = pause ? 0 : POLLIN;
+#else
+		fd->events = pause ? 0 : POLLIN | POLLNVAL;
+#endif
+	}
+	Paho_thread_unlock_mutex(socket_mutex);
+	FUNC_EXIT;
+}
+#endif
+
+
 /**
  *  Reads one byte from a socket
  *  @param socket the socket to read from
@@ -839,6 +900,67 @@ for testing purposes only!
 }
 
 
+/**
+ *  Writes part of a payload from a file to a socket, for as long as the socket takes it.
+ *  On Linux the file is handed to the kernel with sendfile, so the payload is not copied
+ *  through user space.  Elsewhere it is read in pieces with pread, and a piece the socket
+ *  does not take in full is read again when the write is continued.
+ *  @param socket the socket to write to
+ *  @param file the file to read from
+ *  @param pos the position in the payload to start at
+ *  @param len the number of bytes to write
+ *  @param bytes returned: the number of bytes written
+ *  @return completion code, TCPSOCKET_INTERRUPTED if the socket is full
+ */
+static int Socket_sendfile(SOCKET socket, PayloadFile* file, size_t pos, size_t len, unsigned long* bytes)
+{
+	int rc = TCPSOCKET_COMPLETE;
+#if defined(_WIN32) || defined(_WIN64)
+	FUNC_ENTRY;
+	*bytes = 0L;
+	Log(LOG_ERROR, -1, "Payloads read from files are not supported on this platform");
+	rc = SOCKET_ERROR;
+#else
+	FUNC_ENTRY;
+	*bytes = 0L;
+	while (*bytes < len)
+	{
+		ssize_t n;
+#if defined(__linux__)
+		off_t offset = file->offset + (off_t)(pos + *bytes);
+
+		n = sendfile(socket, file->fd, &offset, len - *bytes);
+#else
+		char piece[16384];
+		size_t want = (len - *bytes < sizeof(piece)) ? len - *bytes : sizeof(piece);
+		ssize_t got = pread(file->fd, piece, want, file->offset + (off_t)(pos + *bytes));
+
+		if (got <= 0)
+			n = got;
+		else
+			n = send(socket, piece, got, 0);
+#endif
+		if (n == SOCKET_ERROR)
+		{
+			int err = Socket_error("sendfile - putdatas", socket);
+
+			rc = (err == EWOULDBLOCK || err == EAGAIN) ? TCPSOCKET_INTERRUPTED : SOCKET_ERROR;
+			break;
+		}
+		if (n == 0)
+		{	/* the file has been cut short since the packet length was worked out */
+			Log(LOG_ERROR, -1, "Payload file for socket %d ended %lu bytes early", socket, (unsigned long)(len - *bytes));
+			rc = SOCKET_ERROR;
+			break;
+		}
+		*bytes += (unsigned long)n;
+	}
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  *  Attempts to write a series of buffers to a socket in *one* system call so that they are
  *  sent as one packet.
@@ -857,6 +979,7 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 	int frees1[5];
 	int rc = TCPSOCKET_INTERRUPTED, i;
 	size_t total = buf0len;
+	size_t filelen = 0;
 
 	FUNC_ENTRY;
 	if (!Socket_noPendingWrites(socket))
@@ -866,6 +989,8 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 		goto exit;
 	}
 
+	if (bufs.file)
+		filelen = bufs.buflens[--bufs.count]; /* the last buffer is read from the file, after the others */
 	for (i = 0; i < bufs.count; i++)
 		total += bufs.buflens[i];
 
@@ -879,7 +1004,16 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 		frees1[i+1] = bufs.frees[i];
 	}
 
-	if ((rc = Socket_writev(socket, iovecs, bufs.count+1, &bytes)) != SOCKET_ERROR)
+	rc = Socket_writev(socket, iovecs, bufs.count+1, &bytes);
+	if (rc != SOCKET_ERROR && bytes == total && filelen > 0)
+	{
+		unsigned long filebytes = 0L;
+
+		rc = Socket_sendfile(socket, bufs.file, 0, filelen, &filebytes);
+		bytes += filebytes;
+	}
+	total += filelen;
+	if (rc != SOCKET_ERROR)
 	{
 		if (bytes == total)
 			rc = TCPSOCKET_COMPLETE;
@@ -895,9 +1029,9 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 			Log(TRACE_MIN, -1, "Partial write: %lu bytes of %lu actually written on socket %d",
 					bytes, total, socket);
 #if defined(OPENSSL)
-			SocketBuffer_pendingWrite(socket, NULL, bufs.count+1, iovecs, frees1, total, bytes);
+			SocketBuffer_pendingWrite(socket, NULL, bufs.count+1, iovecs, frees1, total, bytes, bufs.file, filelen);
 #else
-			SocketBuffer_pendingWrite(socket, bufs.count+1, iovecs, frees1, total, bytes);
+			SocketBuffer_pendingWrite(socket, bufs.count+1, iovecs, frees1, total, bytes, bufs.file, filelen);
 #endif
 			*sockmem = socket;
 			if (!ListAppend(mod_s.write_pending, sockmem, sizeof(int)))
@@ -985,6 +1119,7 @@ int Socket_close(SOCKET socket)
 	FUNC_ENTRY;
 	Socket_close_only(socket);
 	FD_CLR(socket, &(mod_s.rset_saved));
+	FD_CLR(socket, &(mod_s.paused_rset));
 	if (FD_ISSET(socket, &(mod_s.pending_wset)))
 		FD_CLR(socket, &(mod_s.pending_wset));
 	if (mod_s.cur_clientsds != NULL && *(int*)(mod_s.cur_clientsds->content) == socket)
@@ -1434,7 +1569,16 @@ int Socket_continueWrite(SOCKET socket)
 		curbuflen += pw->iovecs[i].iov_len;
 	}
 
-	if ((rc = Socket_writev(socket, iovecs1, curbuf+1, &bytes)) != SOCKET_ERROR)
+	if (curbuf >= 0)
+		rc = Socket_writev(socket, iovecs1, curbuf+1, &bytes);
+	if (rc != SOCKET_ERROR && pw->filelen > 0 && pw->bytes + bytes >= curbuflen)
+	{	/* the buffers are written, so carry on with the file */
+		unsigned long filebytes = 0L;
+
+		rc = Socket_sendfile(socket, pw->file, pw->bytes + bytes - curbuflen, pw->total - pw->bytes - bytes, &filebytes);
+		bytes += filebytes;
+	}
+	if (rc != SOCKET_ERROR)
 	{
 		pw->bytes += bytes;
 		if ((rc = (pw->bytes == pw->total)))
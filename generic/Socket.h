@@ -93,6 +93,15 @@
 
 #include "LinkedList.h"
 
+/**
+ * A payload which is read from a file as it is written, rather than from memory
+ */
+typedef struct
+{
+	int fd;            /**< the file, open for reading, closed when the payload is freed */
+	off_t offset;      /**< where in the file the payload starts */
+} PayloadFile;
+
 /*
  * Network write buffers for an MQTT packet
  */
@@ -103,6 +112,7 @@ typedef struct
 	size_t* buflens;   /**> array of lengths of buffers */
 	int* frees;        /**> array of flags indicating whether each buffer needs to be freed */
 	uint8_t mask[4];   /**> websocket mask used to mask the buffer data, if any */
+	PayloadFile* file; /**> if set, the last buffer is NULL and its data is read from this file */
 } PacketBuffers;
 
 
@@ -121,6 +131,7 @@ typedef struct
 	List* clientsds; /**< list of client socket descriptors */
 	ListElement* cur_clientsds; /**< current client socket descriptor (iterator) */
 	fd_set pending_wset; /**< socket pending write set for select */
+	fd_set paused_rset; /**< sockets not to be read from for now */
 #else
 	unsigned int nfds;         /**< no of file descriptors for poll */
 	struct pollfd* fds_read;        /**< poll read file descriptors */
@@ -152,6 +163,7 @@ int Socket_new(const char* addr, size_t addr_len, int port, SOCKET* socket);
 int Socket_unix_new(const char* addr, size_t addr_len, SOCKET* sock);
 
 int Socket_noPendingWrites(SOCKET socket);
+void Socket_pauseReads(SOCKET socket, int pause);
 char* Socket_getpeer(SOCKET sock);
 
 void Socket_addPendingWrite(SOCKET socket);
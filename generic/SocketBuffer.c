@@ -110,7 +110,7 @@ int SocketBuffer_initialize(void)
 		if ((queues = ListInitialize()) == NULL)
 			rc = PAHO_MEMORY_ERROR;
 	}
-	ListZero(&writes);
+	ListZeroIntrusive(&writes, offsetof(pending_writes, link));
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -121,7 +121,8 @@ int SocketBuffer_initialize(void)
  */
 void SocketBuffer_freeDefQ(void)
 {
-	free(def_queue->buf);
+	if (def_queue->buf)
+		free(def_queue->buf);
 	free(def_queue);
         def_queue = NULL;
 }
@@ -137,7 +138,10 @@ void SocketBuffer_terminate(void)
 
 	FUNC_ENTRY;
 	while (ListNextElement(queues, &cur))
-		free(((socket_queue*)(cur->content))->buf);
+	{
+		if (((socket_queue*)(cur->content))->buf)
+			free(((socket_queue*)(cur->content))->buf);
+	}
 	ListFree(queues);
 	SocketBuffer_freeDefQ();
 	FUNC_EXIT;
@@ -154,7 +158,8 @@ void SocketBuffer_cleanup(SOCKET socket)
 	SocketBuffer_writeComplete(socket); /* clean up write buffers */
 	if (ListFindItem(queues, &socket, socketcompare))
 	{
-		free(((socket_queue*)(queues->current->content))->buf);
+		if (((socket_queue*)(queues->current->content))->buf)
+			free(((socket_queue*)(queues->current->content))->buf);
 		ListRemove(queues, queues->current->content);
 	}
 	if (def_queue->socket == socket)
@@ -167,7 +172,8 @@ void SocketBuffer_cleanup(SOCKET socket)
 
 
 /**
- * Get any queued data for a specific socket
+ * Get any queued data for a specific socket.  The data starts
+ * SOCKETBUFFER_HEADROOM bytes into the queue buffer.
  * @param socket the socket to get queued data for
  * @param bytes the number of bytes of data to retrieve
  * @param actual_len the actual length returned
@@ -192,10 +198,10 @@ char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len
 	{
 		if (queue->datalen > 0)
 		{
-			void* newmem = malloc(bytes);
+			void* newmem = malloc(bytes + SOCKETBUFFER_HEADROOM);
 			if (newmem)
 			{
-				memcpy(newmem, queue->buf, queue->datalen);
+				memcpy(newmem, queue->buf, queue->datalen + SOCKETBUFFER_HEADROOM);
 				free(queue->buf);
 				queue->buf = newmem;
 			}
@@ -206,9 +212,14 @@ char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len
 				goto exit;
 			}
 		}
+		else if (queue->buf == NULL) /* taken over by SocketBuffer_takeData */
+		{
+			if ((queue->buf = malloc(bytes + SOCKETBUFFER_HEADROOM)) == NULL)
+				goto exit;
+		}
 		else
 		{
-			void* newmem = realloc(queue->buf, bytes);
+			void* newmem = realloc(queue->buf, bytes + SOCKETBUFFER_HEADROOM);
 			if (newmem)
 			{
 				queue->buf = newmem;
@@ -224,7 +235,7 @@ char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len
 	}
 exit:
 	FUNC_EXIT;
-	return queue->buf;
+	return (queue->buf) ? queue->buf + SOCKETBUFFER_HEADROOM : NULL;
 }
 
 
@@ -309,7 +320,31 @@ char* SocketBuffer_complete(SOCKET socket)
 	def_queue->socket = def_queue->index = 0;
 	def_queue->headerlen = def_queue->datalen = 0;
 	FUNC_EXIT;
-	return def_queue->buf;
+	return (def_queue->buf) ? def_queue->buf + SOCKETBUFFER_HEADROOM : NULL;
+}
+
+
+/**
+ * Takes over the buffer holding a packet which has just been read completely,
+ * so that the packet can be kept without copying it.  The default queue gets
+ * a new buffer when the next packet is read.
+ * @param data the data of the packet, as returned by Socket_getdata
+ * @return the buffer, which starts SOCKETBUFFER_HEADROOM bytes before data and
+ * is now to be freed by the caller, or NULL if data is not in the default queue
+ */
+char* SocketBuffer_takeData(char* data)
+{
+	char* buf = NULL;
+
+	FUNC_ENTRY;
+	if (def_queue->buf && data == def_queue->buf + SOCKETBUFFER_HEADROOM)
+	{
+		buf = def_queue->buf;
+		def_queue->buf = NULL;
+		def_queue->buflen = 0;
+	}
+	FUNC_EXIT;
+	return buf;
 }
 
 
@@ -360,11 +395,15 @@ void SocketBuffer_queueChar(SOCKET socket, char c)
  * @param frees a set of flags indicating which of the iovecs array should be freed
  * @param total total data length to be written
  * @param bytes actual data length that was written
+ * @param file where the data following the buffers is read from, or NULL
+ * @param filelen the length of the data read from file, included in total
  */
 #if defined(OPENSSL)
-int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes,
+	PayloadFile* file, size_t filelen)
 #else
-int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes,
+	PayloadFile* file, size_t filelen)
 #endif
 {
 	int i = 0;
@@ -385,6 +424,8 @@ int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* free
 	pw->bytes = bytes;
 	pw->total = total;
 	pw->count = count;
+	pw->file = file;
+	pw->filelen = filelen;
 	for (i = 0; i < count; i++)
 	{
 		pw->iovecs[i] = iovecs[i];
@@ -448,7 +489,7 @@ pending_writes* SocketBuffer_updateWrite(SOCKET socket, char* topic, char* paylo
 	if ((le = ListFindItem(&writes, &socket, pending_socketcompare)) != NULL)
 	{
 		pw = (pending_writes*)(le->content);
-		if (pw->count == 4)
+		if (pw->count == 4 && pw->file == NULL)
 		{
 			pw->iovecs[2].iov_base = topic;
 			pw->iovecs[3].iov_base = payload;
@@ -52,6 +52,9 @@ typedef struct
 	size_t bytes;
 	iobuf iovecs[5];
 	int frees[5];
+	PayloadFile* file; /**< where the data after the buffers is read from, if anywhere */
+	size_t filelen;    /**< the length of the data read from file, included in total */
+	ListElement link; /**< the element in the list of pending writes */
 } pending_writes;
 
 #define SOCKETBUFFER_COMPLETE 0
@@ -60,6 +63,12 @@ typedef struct
 #endif
 #define SOCKETBUFFER_INTERRUPTED -22 /* must be the same value as TCPSOCKET_INTERRUPTED */
 
+/**
+ * The bytes kept free in front of the data in an input queue buffer, so that
+ * a buffer taken over by SocketBuffer_takeData has room for a PacketBuffer header
+ */
+#define SOCKETBUFFER_HEADROOM 16
+
 int SocketBuffer_initialize(void);
 void SocketBuffer_terminate(void);
 void SocketBuffer_cleanup(SOCKET socket);
@@ -68,11 +77,14 @@ int SocketBuffer_getQueuedChar(SOCKET socket, char* c);
 void SocketBuffer_interrupted(SOCKET socket, size_t actual_len);
 char* SocketBuffer_complete(SOCKET socket);
 void SocketBuffer_queueChar(SOCKET socket, char c);
+char* SocketBuffer_takeData(char* data);
 
 #if defined(OPENSSL)
-int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes);
+int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes,
+	PayloadFile* file, size_t filelen);
 #else
-int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes);
+int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes,
+	PayloadFile* file, size_t filelen);
 #endif
 pending_writes* SocketBuffer_getWrite(SOCKET socket);
 int SocketBuffer_writeComplete(SOCKET socket);
@@ -0,0 +1,375 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - MQTT 5 topic alias tables
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief MQTT 5 topic alias tables
+ *
+ * An outbound table maps topics to alias numbers, so that repeated
+ * publications to the same topic can be sent with an empty topic name
+ * and a TOPIC_ALIAS property.  The number of aliases is limited by the
+ * server, so they are handed out in least recently used order.
+ *
+ * An inbound table is indexed by the alias number, holding the topics the
+ * server has assigned, so that aliased publications can be resolved in
+ * constant time while they are decoded.
+ *
+ * The entries of both are kept in blocks of TOPICALIASES_BLOCK, allocated
+ * when an alias in them is first used, which leaves them where they are for
+ * the index to point to.
+ *
+ * The topics of inbound aliases carry a reference count in front of them, so
+ * that a received publication can point at the topic of its alias instead of
+ * copying it.  The table holds one reference, and each such publication one
+ * more until it is freed, possibly by the application on another thread.
+ * Reassigning an alias whose topic is still referenced allocates a new one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "TopicAliases.h"
+#include "MQTTPacket.h"
+#include "StackTrace.h"
+#include "Log.h"
+
+#include "Heap.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TOPIC_INCREMENT(p) InterlockedIncrement((volatile long*)(p))
+#define TOPIC_DECREMENT(p) InterlockedDecrement((volatile long*)(p))
+#define TOPIC_LOAD(p) (_ReadWriteBarrier(), *(volatile long*)(p))
+#else
+#define TOPIC_INCREMENT(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define TOPIC_DECREMENT(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#define TOPIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#endif
+
+/** the reference count in front of the topic of an inbound alias */
+#define TOPIC_REFCOUNT(topic) ((long*)((topic) - sizeof(long)))
+
+
+/**
+ * Tree comparison function for topic alias entries.
+ * @param a the alias entry in the tree
+ * @param b the alias entry or topic string to compare with
+ * @param content whether b is an alias entry (1) or a topic string (0)
+ * @return the result of the string comparison
+ */
+static int aliasCompare(void* a, void* b, int content)
+{
+	const char* topic = content ? ((TopicAlias*)b)->topic : (const char*)b;
+
+	return strcmp(((TopicAlias*)a)->topic, topic);
+}
+
+
+/**
+ * Finds the entry of an alias.
+ * @param aliases the table
+ * @param alias the alias number, from 1 to the maximum
+ * @param create whether to allocate the block of the entry if it has not been
+ * @return the entry, or NULL if its block has not been allocated
+ */
+static TopicAlias* find_alias(TopicAliases* aliases, int alias, int create)
+{
+	int block = (alias - 1) / TOPICALIASES_BLOCK;
+	TopicAlias* entries = aliases->blocks[block];
+	int i;
+
+	if (entries == NULL && create)
+	{
+		if ((entries = malloc(TOPICALIASES_BLOCK * sizeof(TopicAlias))) == NULL)
+			return NULL;
+		memset(entries, '\0', TOPICALIASES_BLOCK * sizeof(TopicAlias));
+		for (i = 0; i < TOPICALIASES_BLOCK; ++i)
+			entries[i].alias = block * TOPICALIASES_BLOCK + i + 1;
+		aliases->blocks[block] = entries;
+	}
+	return entries ? &entries[(alias - 1) % TOPICALIASES_BLOCK] : NULL;
+}
+
+
+/**
+ * Allocates the topic of an inbound alias, with the reference of the table.
+ * @param size the size of the topic, including the terminator
+ * @return the topic, or NULL if memory is short
+ */
+static char* topic_alloc(int size)
+{
+	char* block = malloc(sizeof(long) + size);
+
+	if (block == NULL)
+		return NULL;
+	*(long*)block = 1;
+	return block + sizeof(long);
+}
+
+
+/**
+ * Adds a reference to the topic of an inbound alias, returned by
+ * TopicAliases_get, which keeps it unchanged until it is released.
+ * @param topic the topic
+ */
+void TopicAliases_retainTopic(const char* topic)
+{
+	TOPIC_INCREMENT(TOPIC_REFCOUNT(topic));
+}
+
+
+/**
+ * Drops a reference to the topic of an inbound alias, and frees it with the
+ * last one.  This may be called on any thread.
+ * @param topic the topic
+ */
+void TopicAliases_releaseTopic(const char* topic)
+{
+	if (TOPIC_DECREMENT(TOPIC_REFCOUNT(topic)) == 0)
+		free((char*)TOPIC_REFCOUNT(topic));
+}
+
+
+/**
+ * Allocates an empty topic alias table.
+ * @param maximum the highest alias number which may be used
+ * @param outbound whether the table is for the publications we send, which
+ * need a lookup by topic, or for those we receive
+ * @return the new table, or NULL if maximum is 0 or memory is short
+ */
+TopicAliases* TopicAliases_create(int maximum, int outbound)
+{
+	TopicAliases* aliases = NULL;
+	size_t nblocks = 0;
+
+	FUNC_ENTRY;
+	if (maximum <= 0)
+		goto exit;
+	if ((aliases = malloc(sizeof(TopicAliases))) == NULL)
+		goto exit;
+	memset(aliases, '\0', sizeof(TopicAliases));
+	aliases->maximum = maximum;
+	nblocks = (maximum + TOPICALIASES_BLOCK - 1) / TOPICALIASES_BLOCK;
+	if ((aliases->blocks = malloc(nblocks * sizeof(TopicAlias*))) == NULL ||
+		(outbound && (aliases->index = TreeInitialize(aliasCompare)) == NULL))
+	{
+		if (aliases->blocks)
+			free(aliases->blocks);
+		free(aliases);
+		aliases = NULL;
+		goto exit;
+	}
+	memset(aliases->blocks, '\0', nblocks * sizeof(TopicAlias*));
+exit:
+	FUNC_EXIT;
+	return aliases;
+}
+
+
+/**
+ * Frees a topic alias table and all the topics it holds.
+ * @param aliases the table to free, may be NULL
+ */
+void TopicAliases_free(TopicAliases* aliases)
+{
+	int nblocks;
+	int i, j;
+
+	FUNC_ENTRY;
+	if (aliases == NULL)
+		goto exit;
+	nblocks = (aliases->maximum + TOPICALIASES_BLOCK - 1) / TOPICALIASES_BLOCK;
+	for (i = 0; i < nblocks; ++i)
+	{
+		TopicAlias* entries = aliases->blocks[i];
+
+		if (entries == NULL)
+			continue;
+		for (j = 0; j < TOPICALIASES_BLOCK; ++j)
+		{
+			if (entries[j].topic == NULL)
+				continue;
+			if (aliases->index)
+			{
+				TreeRemove(aliases->index, &entries[j]);
+				free(entries[j].topic);
+			}
+			else
+				TopicAliases_releaseTopic(entries[j].topic);
+		}
+		free(entries);
+	}
+	if (aliases->index)
+		TreeFree(aliases->index);
+	free(aliases->blocks);
+	free(aliases);
+exit:
+	FUNC_EXIT;
+}
+
+
+/* the aliases on the LRU list have all been assigned, so their blocks are there */
+static void unlink_alias(TopicAliases* aliases, int alias)
+{
+	TopicAlias* entry = find_alias(aliases, alias, 0);
+
+	if (entry->prev)
+		find_alias(aliases, entry->prev, 0)->next = entry->next;
+	else
+		aliases->head = entry->next;
+	if (entry->next)
+		find_alias(aliases, entry->next, 0)->prev = entry->prev;
+	else
+		aliases->tail = entry->prev;
+	entry->prev = entry->next = 0;
+}
+
+
+static void push_alias(TopicAliases* aliases, int alias)
+{
+	TopicAlias* entry = find_alias(aliases, alias, 0);
+
+	entry->prev = 0;
+	entry->next = aliases->head;
+	if (aliases->head)
+		find_alias(aliases, aliases->head, 0)->prev = alias;
+	aliases->head = alias;
+	if (aliases->tail == 0)
+		aliases->tail = alias;
+}
+
+
+/**
+ * Finds or assigns the alias to use for an outbound publication.
+ * @param aliases the outbound alias table of the connection
+ * @param topic the topic of the publication
+ * @param sendTopic returned: whether the topic name must be sent along with
+ * the alias, because the alias has just been assigned to it
+ * @return the alias number, or 0 if no alias can be used
+ */
+int TopicAliases_assign(TopicAliases* aliases, const char* topic, int* sendTopic)
+{
+	Node* node = NULL;
+	TopicAlias* entry = NULL;
+	char* copy = NULL;
+	size_t topiclen;
+	int alias = 0;
+
+	FUNC_ENTRY;
+	*sendTopic = 1;
+	if ((node = TreeFind(aliases->index, (void*)topic)) != NULL)
+	{
+		entry = (TopicAlias*)node->content;
+		alias = entry->alias;
+		if (aliases->head != alias)
+		{
+			unlink_alias(aliases, alias);
+			push_alias(aliases, alias);
+		}
+		*sendTopic = 0;
+		goto exit;
+	}
+
+	topiclen = strlen(topic);
+	if ((copy = malloc(topiclen + 1)) == NULL)
+		goto exit; /* send the topic without an alias */
+	memcpy(copy, topic, topiclen + 1);
+	if (aliases->count < aliases->maximum)
+	{
+		if ((entry = find_alias(aliases, aliases->count + 1, 1)) == NULL)
+		{
+			free(copy);
+			goto exit; /* send the topic without an alias */
+		}
+		alias = ++aliases->count;
+	}
+	else
+	{
+		alias = aliases->tail;
+		entry = find_alias(aliases, alias, 0);
+		TreeRemove(aliases->index, entry);
+		unlink_alias(aliases, alias);
+		free(entry->topic);
+	}
+	entry->topic = copy;
+	entry->topiclen = (int)topiclen;
+	TreeAdd(aliases->index, entry, sizeof(TopicAlias) + topiclen + 1);
+	push_alias(aliases, alias);
+	Log(TRACE_MAX, -1, "Assigned topic alias %d to %s", alias, topic);
+exit:
+	FUNC_EXIT_RC(alias);
+	return alias;
+}
+
+
+/**
+ * Records the topic the server has assigned to an inbound alias.
+ * @param aliases the inbound alias table of the connection
+ * @param alias the alias number from the TOPIC_ALIAS property
+ * @param topic the topic name, not null terminated
+ * @param topiclen the length of topic
+ * @return 0 on success, -1 if the alias is out of range or memory is short
+ */
+int TopicAliases_set(TopicAliases* aliases, int alias, const char* topic, int topiclen)
+{
+	TopicAlias* entry = NULL;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	if (alias <= 0 || alias > aliases->maximum)
+		goto exit;
+	if ((entry = find_alias(aliases, alias, 1)) == NULL)
+		goto exit;
+	if (entry->size < topiclen + 1 || (entry->topic && TOPIC_LOAD(TOPIC_REFCOUNT(entry->topic)) > 1))
+	{   /* only grow the buffer, so that reassignments rarely allocate, unless a message still points at it */
+		int size = (entry->size > topiclen + 1) ? entry->size : topiclen + 1;
+
+		if (entry->topic)
+			TopicAliases_releaseTopic(entry->topic);
+		entry->size = 0;
+		entry->topiclen = 0;
+		if ((entry->topic = topic_alloc(size)) == NULL)
+			goto exit;
+		entry->size = size;
+	}
+	memcpy(entry->topic, topic, topiclen);
+	entry->topic[topiclen] = '\0';
+	entry->topiclen = topiclen;
+	rc = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Looks up the topic of an inbound alias.
+ * @param aliases the inbound alias table of the connection
+ * @param alias the alias number from the TOPIC_ALIAS property
+ * @param topiclen returned: the length of the topic
+ * @return the topic, or NULL if the alias is out of range or not assigned
+ */
+const char* TopicAliases_get(TopicAliases* aliases, int alias, int* topiclen)
+{
+	TopicAlias* entry = NULL;
+
+	if (alias <= 0 || alias > aliases->maximum)
+		return NULL;
+	if ((entry = find_alias(aliases, alias, 0)) == NULL)
+		return NULL;
+	*topiclen = entry->topiclen;
+	return entry->topic;
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+ * Copyright (c) 2026 The mqttc authors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    The mqttc authors - MQTT 5 topic alias tables
+ *******************************************************************************/
+
+#if !defined(TOPICALIASES_H)
+#define TOPICALIASES_H
+
+#include "Tree.h"
+
+/**
+ * One entry of a topic alias table.
+ */
+typedef struct
+{
+	char* topic;   /**< the topic the alias stands for, NULL if unassigned */
+	int alias;     /**< the alias number of this entry */
+	int topiclen;  /**< the length of topic */
+	int size;      /**< the allocated size of topic (inbound aliases only) */
+	int prev;      /**< the next more recently used alias, 0 if none (outbound aliases only) */
+	int next;      /**< the next less recently used alias, 0 if none (outbound aliases only) */
+} TopicAlias;
+
+/**
+ * The topic aliases of one direction of a network connection.  Aliases
+ * are numbered from 1 to maximum, the value of the TOPIC_ALIAS_MAXIMUM
+ * property in the CONNACK (outbound) or in our CONNECT (inbound).
+ * When all outbound aliases are in use, the least recently used one is
+ * reassigned.  Inbound aliases are set by the server and looked up
+ * directly by number.  The entries are allocated in blocks as the aliases
+ * are first used, as a server may allow many more than are ever used.
+ */
+typedef struct
+{
+	int maximum;         /**< the highest alias number we may use */
+	int count;           /**< the number of aliases assigned so far */
+	int head;            /**< the most recently used alias, 0 if none */
+	int tail;            /**< the least recently used alias, 0 if none */
+	TopicAlias** blocks; /**< the blocks of alias entries, NULL until used */
+	Tree* index;         /**< alias numbers by topic, NULL for inbound aliases */
+} TopicAliases;
+
+/** the number of alias entries in one block of a table */
+#define TOPICALIASES_BLOCK 64
+
+TopicAliases* TopicAliases_create(int maximum, int outbound);
+void TopicAliases_free(TopicAliases* aliases);
+int TopicAliases_assign(TopicAliases* aliases, const char* topic, int* sendTopic);
+int TopicAliases_set(TopicAliases* aliases, int alias, const char* topic, int topiclen);
+const char* TopicAliases_get(TopicAliases* aliases, int alias, int* topiclen);
+void TopicAliases_retainTopic(const char* topic);
+void TopicAliases_releaseTopic(const char* topic);
+
+#endif
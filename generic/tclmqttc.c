@@ -10,41 +10,1100 @@ extern "C" {
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
 #include "MQTTClient.h"
+#include "MemoryPool.h"
+#include "OfflineBuffer.h"
+
+/*
+ * Only the _Init function is exported.
+ */
+
+extern DLLEXPORT int	Mqttc_Init(Tcl_Interp * interp);
+
+/*
+ * end block for C++
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/*
+ * An interned topic object.  Entries are kept in a doubly linked list in
+ * least recently used order, so the cache can be bounded.
+ */
+typedef struct TopicCacheEntry {
+    Tcl_Obj                 *topicObj;
+    Tcl_HashEntry           *hPtr;
+    struct TopicCacheEntry  *prev;    /* more recently used */
+    struct TopicCacheEntry  *next;    /* less recently used */
+} TopicCacheEntry;
+
+/*
+ * A subscription whose large payloads are written to a channel.
+ */
+typedef struct StreamSub {
+    char                    *filter;       /* the topic filter subscribed to */
+    char                    *channelName;
+    struct StreamSub        *next;
+} StreamSub;
+
+/*
+ * What the reconnects of a handle with -autoReconnect took, for stats.
+ */
+typedef struct ReconnectStats {
+    Tcl_WideInt  reconnects;          /* connections made again */
+    Tcl_WideInt  attempts;            /* connects tried, successful or not */
+    Tcl_WideInt  sessionsResumed;     /* reconnects where the broker had the session */
+    Tcl_WideInt  resubscribes;        /* SUBSCRIBEs sent after reconnects */
+    Tcl_WideInt  resubscribeFailures; /* topic filters not granted again */
+    Tcl_WideInt  lastLatency;         /* ms from noticing the loss to the CONNACK */
+    Tcl_WideInt  maxLatency;
+    Tcl_WideInt  totalLatency;
+} ReconnectStats;
+
+/*
+ * A payload lent to the library by publishMessage or publishChannel, which
+ * holds a reference to its object until the library is done with it.
+ */
+typedef struct LentPayload {
+    Tcl_Obj             *objPtr;
+    struct MQTTCDATA    *pMqtt;
+    struct LentPayload  *next;
+} LentPayload;
+
+/*
+ * This struct is to record MonetDB database info,
+ */
+struct MQTTCDATA {
+    MQTTClient   client;
+    int          version;
+    Tcl_Interp   *interp;
+    char         *clientId;
+    int          timeout;
+    Tcl_HashTable topicCache;         /* topic name -> TopicCacheEntry */
+    TopicCacheEntry *topicHead;       /* most recently used */
+    TopicCacheEntry *topicTail;       /* least recently used */
+    int          topicCacheSize;      /* max entries, 0 disables the cache */
+    int          topicCacheCount;
+    StreamSub    *streams;            /* subscriptions with -channel */
+    Tcl_WideInt  streamThreshold;     /* packets this large are streamed */
+    OfflineBuffer *offline;           /* messages published while disconnected */
+    MQTTClient_connectOptions connOpts; /* kept to connect again */
+    MQTTClient_SSLOptions sslOpts;
+    MQTTProperties connectProps;
+    char         *connStrings[6];     /* the copies connOpts and sslOpts point to */
+    int          reconnectMin;        /* -autoReconnect backoff in ms, 0 if off */
+    int          reconnectMax;
+    int          reconnectDelay;      /* the backoff after the last failed attempt */
+    Tcl_WideInt  lostAt;              /* when the loss was noticed, 0 if connected */
+    Tcl_WideInt  retryAt;             /* when the next attempt is due */
+    Tcl_TimerToken reconnectTimer;
+    Tcl_HashTable subscriptions;      /* topic filter -> QoS, to subscribe again */
+    int          subsPending;         /* subscriptions not granted again yet */
+    int          resubscribeDelay;    /* the backoff after the last failed resubscribe */
+    Tcl_WideInt  resubscribeAt;       /* when the pending ones are tried again */
+    unsigned int jitter;              /* the state of the reconnect backoff's generator */
+    ReconnectStats stats;
+    int          connecting;          /* CONNECT_PENDING or CONNECT_FINISHED while -async */
+    int          connectRc;
+    Tcl_Obj      *onconnect;          /* the -onconnect script, with the handle appended */
+    struct MQTTCDATA *nextConnecting;
+    Tcl_ThreadId owner;               /* the thread the handle was created in */
+    Tcl_Mutex    releasedMutex;
+    struct LentPayload *released;     /* payloads released on other threads */
+    struct LentPayload *lentFree;     /* unused LentPayloads, for reuse */
+};
+
+typedef struct MQTTCDATA MQTTCDATA;
+
+/*
+ * The handles of a thread which are connecting with -async: those still
+ * connecting are looked at from a timer, and those done are moved to the
+ * finished list until their -onconnect script has been run.
+ */
+#define CONNECT_PENDING  1
+#define CONNECT_FINISHED 2
+
+/* how often the sockets of the connecting handles are looked at, in ms */
+#define CONNECT_POLL_MS 5
+
+typedef struct ThreadSpecificData {
+    MQTTCDATA    *connecting;
+    MQTTCDATA    *finished;
+    Tcl_TimerToken connectTimer;
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+
+static void TopicCacheUnlink(MQTTCDATA *pMqtt, TopicCacheEntry *pEntry) {
+  if(pEntry->prev) pEntry->prev->next = pEntry->next;
+  else pMqtt->topicHead = pEntry->next;
+  if(pEntry->next) pEntry->next->prev = pEntry->prev;
+  else pMqtt->topicTail = pEntry->prev;
+  pEntry->prev = pEntry->next = NULL;
+}
+
+static void TopicCachePush(MQTTCDATA *pMqtt, TopicCacheEntry *pEntry) {
+  pEntry->prev = NULL;
+  pEntry->next = pMqtt->topicHead;
+  if(pMqtt->topicHead) pMqtt->topicHead->prev = pEntry;
+  pMqtt->topicHead = pEntry;
+  if(pMqtt->topicTail == NULL) pMqtt->topicTail = pEntry;
+}
+
+static void TopicCacheRemove(MQTTCDATA *pMqtt, TopicCacheEntry *pEntry) {
+  TopicCacheUnlink(pMqtt, pEntry);
+  Tcl_DeleteHashEntry(pEntry->hPtr);
+  Tcl_DecrRefCount(pEntry->topicObj);
+  Tcl_Free((char *)pEntry);
+  pMqtt->topicCacheCount--;
+}
+
+/*
+ * Returns the shared object for a received topic name.  Subscribers tend
+ * to see the same few topics over and over, so returning one object per
+ * topic saves an allocation per message and lets scripts reuse the
+ * cached hash value when the topic is used as a dict key.
+ */
+static Tcl_Obj *TopicCacheGet(MQTTCDATA *pMqtt, const char *topicName) {
+  Tcl_HashEntry *hPtr;
+  TopicCacheEntry *pEntry;
+  int isNew;
+
+  if(pMqtt->topicCacheSize <= 0) {
+      return Tcl_NewStringObj(topicName, -1);
+  }
+
+  hPtr = Tcl_CreateHashEntry(&pMqtt->topicCache, topicName, &isNew);
+  if(!isNew) {
+      pEntry = (TopicCacheEntry *)Tcl_GetHashValue(hPtr);
+      if(pMqtt->topicHead != pEntry) {
+          TopicCacheUnlink(pMqtt, pEntry);
+          TopicCachePush(pMqtt, pEntry);
+      }
+      return pEntry->topicObj;
+  }
+
+  pEntry = (TopicCacheEntry *)Tcl_Alloc(sizeof(TopicCacheEntry));
+  pEntry->topicObj = Tcl_NewStringObj(topicName, -1);
+  Tcl_IncrRefCount(pEntry->topicObj);
+  pEntry->hPtr = hPtr;
+  Tcl_SetHashValue(hPtr, pEntry);
+  TopicCachePush(pMqtt, pEntry);
+  pMqtt->topicCacheCount++;
+
+  if(pMqtt->topicCacheCount > pMqtt->topicCacheSize) {
+      TopicCacheRemove(pMqtt, pMqtt->topicTail);
+  }
+
+  return pEntry->topicObj;
+}
+
+
+/*
+ * Lends the string or byte array of an object to the library as a payload,
+ * keeping a reference to the object until the library releases it.
+ */
+static LentPayload *LendPayload(MQTTCDATA *pMqtt, Tcl_Obj *objPtr) {
+  LentPayload *pLent = pMqtt->lentFree;
+
+  if(pLent) {
+      pMqtt->lentFree = pLent->next;
+  } else {
+      pLent = (LentPayload *)Tcl_Alloc(sizeof(LentPayload));
+      pLent->pMqtt = pMqtt;
+  }
+  pLent->objPtr = objPtr;
+  Tcl_IncrRefCount(objPtr);
+  return pLent;
+}
+
+static void LentPayloadFree(MQTTCDATA *pMqtt, LentPayload *pLent) {
+  Tcl_DecrRefCount(pLent->objPtr);
+  pLent->next = pMqtt->lentFree;
+  pMqtt->lentFree = pLent;
+}
+
+/*
+ * Called by the library when it no longer needs a payload given to
+ * MQTTClient_publish5Borrowed.  That is on the thread the library happens
+ * to handle the acknowledgement on, which may belong to another handle, so
+ * the object is only let go of here on the thread which owns it.  Otherwise
+ * it waits on the released list of the handle for its next command.
+ */
+static void ReleasePayload(void *context, void *payload) {
+  LentPayload *pLent = (LentPayload *)context;
+  MQTTCDATA *pMqtt = pLent->pMqtt;
+
+  if(Tcl_GetCurrentThread() == pMqtt->owner) {
+      LentPayloadFree(pMqtt, pLent);
+      return;
+  }
+  Tcl_MutexLock(&pMqtt->releasedMutex);
+  pLent->next = pMqtt->released;
+  pMqtt->released = pLent;
+  Tcl_MutexUnlock(&pMqtt->releasedMutex);
+}
+
+/*
+ * Lets go of the payloads released on other threads, on the owning thread.
+ */
+static void ReleasedPayloadsFree(MQTTCDATA *pMqtt) {
+  LentPayload *pLent;
+
+  if(pMqtt->released == NULL) {
+      return;   /* looked at without the lock: one missed now goes next time */
+  }
+  Tcl_MutexLock(&pMqtt->releasedMutex);
+  pLent = pMqtt->released;
+  pMqtt->released = NULL;
+  Tcl_MutexUnlock(&pMqtt->releasedMutex);
+
+  while(pLent) {
+      LentPayload *pNext = pLent->next;
+
+      LentPayloadFree(pMqtt, pLent);
+      pLent = pNext;
+  }
+}
+
+
+/*
+ * Whether a received topic matches a subscription's topic filter, with the
+ * + and # wildcards.  Wildcards at the start do not match topics starting
+ * with $, and the $share/group/ prefix of a shared subscription is ignored.
+ */
+static int TopicMatches(const char *filter, const char *topic, int topicLen) {
+  const char *end = topic + topicLen;
+
+  if(strncmp(filter, "$share/", 7) == 0) {
+      filter = strchr(filter + 7, '/');
+      if(filter == NULL) return 0;
+      filter++;
+  }
+
+  if(topic < end && *topic == '$' && (*filter == '+' || *filter == '#')) {
+      return 0;
+  }
+
+  while(*filter && topic < end) {
+      if(*filter == '#') {
+          return 1;
+      } else if(*filter == '+') {
+          while(topic < end && *topic != '/') topic++;
+          filter++;
+      } else if(*filter++ != *topic++) {
+          return 0;
+      }
+  }
+
+  if(topic != end) return 0;
+
+  /* "a/+" matches "a/" and "a/#" matches "a" */
+  return *filter == '\0' || strcmp(filter, "+") == 0 ||
+         strcmp(filter, "#") == 0 || strcmp(filter, "/#") == 0;
+}
+
+
+/*
+ * Called by the library, inside our own calls, when a large publication
+ * starts to arrive.  Its payload is written to the channel of the first
+ * -channel subscription its topic matches, if that channel is still open.
+ * The channel is kept open until the payload has all been written, even if
+ * the script closes it in the meantime.
+ *
+ * Any thread calling into the library may read our socket, and channels
+ * belong to the thread that created them: a publication that starts to
+ * arrive on another thread is delivered the usual way, and the rest of a
+ * stream read there is discarded.
+ */
+static int StreamOpen(void *context, char *topicName, int topicLen, int qos,
+                      size_t payloadlen, void **stream) {
+  MQTTCDATA *pMqtt = (MQTTCDATA *)context;
+  StreamSub *pSub;
+  Tcl_Channel chan;
+  int mode;
+
+  if(Tcl_GetCurrentThread() != pMqtt->owner) return 0;
+
+  for(pSub = pMqtt->streams; pSub; pSub = pSub->next) {
+      if(TopicMatches(pSub->filter, topicName, topicLen)) {
+          break;
+      }
+  }
+
+  if(pSub == NULL) return 0;
+
+  chan = Tcl_GetChannel(pMqtt->interp, pSub->channelName, &mode);
+  if(chan == NULL || (mode & TCL_WRITABLE) == 0) {
+      Tcl_ResetResult(pMqtt->interp);
+      return 0;
+  }
+
+  Tcl_RegisterChannel(NULL, chan);
+  *stream = chan;
+  return 1;
+}
+
+static int StreamWrite(void *context, void *stream, const char *data, size_t len) {
+  MQTTCDATA *pMqtt = (MQTTCDATA *)context;
+
+  if(Tcl_GetCurrentThread() != pMqtt->owner) return 1;
+
+  return Tcl_Write((Tcl_Channel)stream, data, len) < 0;
+}
+
+typedef struct StreamCloseEvent {
+  Tcl_Event header;
+  Tcl_Channel chan;
+} StreamCloseEvent;
+
+static void StreamRelease(Tcl_Channel chan) {
+  Tcl_Flush(chan);
+  Tcl_UnregisterChannel(NULL, chan);
+}
+
+static int StreamCloseProc(Tcl_Event *evPtr, int flags) {
+  StreamRelease(((StreamCloseEvent *)evPtr)->chan);
+  return 1;
+}
+
+/*
+ * A stream finished on another thread is released by the thread that owns
+ * its channel.
+ */
+static void StreamClose(void *context, void *stream, int rc) {
+  MQTTCDATA *pMqtt = (MQTTCDATA *)context;
+  StreamCloseEvent *ev;
+
+  if(Tcl_GetCurrentThread() == pMqtt->owner) {
+      StreamRelease((Tcl_Channel)stream);
+      return;
+  }
+
+  ev = (StreamCloseEvent *)Tcl_Alloc(sizeof(StreamCloseEvent));
+  ev->header.proc = StreamCloseProc;
+  ev->chan = (Tcl_Channel)stream;
+  Tcl_ThreadQueueEvent(pMqtt->owner, (Tcl_Event *)ev, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(pMqtt->owner);
+}
+
+static void StreamSubRemove(MQTTCDATA *pMqtt, const char *filter) {
+  StreamSub **ppSub = &pMqtt->streams;
+
+  while(*ppSub) {
+      StreamSub *pSub = *ppSub;
+
+      if(strcmp(pSub->filter, filter) == 0) {
+          *ppSub = pSub->next;
+          Tcl_Free(pSub->filter);
+          Tcl_Free(pSub->channelName);
+          Tcl_Free((char *)pSub);
+          return;
+      }
+      ppSub = &pSub->next;
+  }
+}
+
+static void StreamSubAdd(MQTTCDATA *pMqtt, const char *filter, const char *channelName) {
+  StreamSub *pSub = (StreamSub *)Tcl_Alloc(sizeof(StreamSub));
+
+  StreamSubRemove(pMqtt, filter);
+  pSub->filter = strcpy(Tcl_Alloc(strlen(filter) + 1), filter);
+  pSub->channelName = strcpy(Tcl_Alloc(strlen(channelName) + 1), channelName);
+  pSub->next = pMqtt->streams;
+  pMqtt->streams = pSub;
+}
+
+
+static int OfflineDrain(MQTTCDATA *pMqtt);
+
+/*
+ * Reads the rest of a channel as bytes, as they are in the file: the
+ * encoding and end of line translation of the channel are not applied, as
+ * they are not when a file is published from its descriptor.  Returns a new
+ * object with a reference, or NULL with an error in interp.
+ */
+static Tcl_Obj *ReadChannelBytes(Tcl_Interp *interp, Tcl_Channel chan) {
+  Tcl_Obj *pObj = Tcl_NewByteArrayObj(NULL, 0);
+  Tcl_DString translation, eofchar;
+  int len = 0;
+  int n;
+
+  /* Tcl_Read skips the encoding, but not the translation or the EOF character */
+  Tcl_DStringInit(&translation);
+  Tcl_DStringInit(&eofchar);
+  Tcl_GetChannelOption(NULL, chan, "-translation", &translation);
+  Tcl_GetChannelOption(NULL, chan, "-eofchar", &eofchar);
+  Tcl_SetChannelOption(NULL, chan, "-translation", "lf");
+  Tcl_SetChannelOption(NULL, chan, "-eofchar", "");
+
+  Tcl_IncrRefCount(pObj);
+  do {
+      unsigned char *buf = Tcl_SetByteArrayLength(pObj, len + 65536);
+
+      if((n = Tcl_Read(chan, (char *)buf + len, 65536)) < 0) {
+          Tcl_DecrRefCount(pObj);
+          pObj = NULL;
+          Tcl_AppendResult(interp, "error reading \"", Tcl_GetChannelName(chan),
+                           "\": ", Tcl_PosixError(interp), (char*)0);
+          break;
+      }
+      len += n;
+      if(len > 268435455) {
+          Tcl_DecrRefCount(pObj);
+          pObj = NULL;
+          Tcl_AppendResult(interp, "payload too large", (char*)0);
+          break;
+      }
+  } while(n > 0);
+  if(pObj) {
+      Tcl_SetByteArrayLength(pObj, len);
+  }
+
+  Tcl_SetChannelOption(NULL, chan, "-translation", Tcl_DStringValue(&translation));
+  Tcl_SetChannelOption(NULL, chan, "-eofchar", Tcl_DStringValue(&eofchar));
+  Tcl_DStringFree(&translation);
+  Tcl_DStringFree(&eofchar);
+  return pObj;
+}
+
+/*
+ * Keeps a message in the offline buffer, with -1 as the result, or 0 if it
+ * does not fit.
+ */
+static void PublishOffline(Tcl_Interp *interp, MQTTCDATA *pMqtt, const char *topic,
+                           const void *payload, int payloadlen, int qos, int retained) {
+  int rc = OfflineBuffer_add(pMqtt->offline, topic, payload, payloadlen, qos, retained);
+
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(rc == 0 ? -1 : 0));
+}
+
+/*
+ * Publishes the rest of a channel, from its current position to its end.
+ * A channel on a regular file, with nothing stacked on it, is published from
+ * a duplicate of its file descriptor, which the library reads the payload
+ * from as it is sent, so that a file of any size is sent without reading it
+ * into memory; the channel is then left at the end of the file.  Any other
+ * channel is read into memory and published like publishMessage, as is one
+ * going to the offline buffer.  Sets the result like publishMessage.
+ */
+static int PublishChannel(Tcl_Interp *interp, MQTTCDATA *pMqtt, const char *topic,
+                          Tcl_Channel chan, int qos, int retained) {
+  MQTTResponse response = MQTTResponse_initializer;
+  MQTTClient_deliveryToken token = 0;
+  Tcl_Obj *pObj;
+  unsigned char *payload;
+  int payloadlen = 0;
+  int rc;
+#ifndef _WIN32
+  ClientData handle;
+  Tcl_WideInt pos;
+  struct stat st;
+#endif
+
+  if((Tcl_GetChannelMode(chan) & TCL_WRITABLE) && Tcl_Flush(chan) != TCL_OK) {
+      Tcl_AppendResult(interp, "error flushing \"", Tcl_GetChannelName(chan),
+                       "\": ", Tcl_PosixError(interp), (char*)0);
+      return TCL_ERROR;
+  }
+
+  /* buffered in order behind the messages already there, as in publishMessage */
+  if(pMqtt->offline) {
+      if(!OfflineBuffer_isEmpty(pMqtt->offline) && MQTTClient_isConnected(pMqtt->client)) {
+          OfflineDrain(pMqtt);
+      }
+
+      if(!OfflineBuffer_isEmpty(pMqtt->offline) || !MQTTClient_isConnected(pMqtt->client)) {
+          if((pObj = ReadChannelBytes(interp, chan)) == NULL) {
+              return TCL_ERROR;
+          }
+          payload = Tcl_GetByteArrayFromObj(pObj, &payloadlen);
+          PublishOffline(interp, pMqtt, topic, payload, payloadlen, qos, retained);
+          Tcl_DecrRefCount(pObj);
+          return TCL_OK;
+      }
+  }
+
+#ifndef _WIN32
+  if(strcmp(Tcl_ChannelName(Tcl_GetChannelType(chan)), "file") == 0
+     && Tcl_GetStackedChannel(chan) == NULL
+     && Tcl_GetChannelHandle(chan, TCL_READABLE, &handle) == TCL_OK
+     && (pos = Tcl_Tell(chan)) >= 0
+     && fstat((int)(intptr_t)handle, &st) == 0 && S_ISREG(st.st_mode)) {
+      Tcl_WideInt len = ((Tcl_WideInt)st.st_size > pos) ? (Tcl_WideInt)st.st_size - pos : 0;
+      int fd;
+
+      if(len > 268435455) {
+          Tcl_AppendResult(interp, "payload too large", (char*)0);
+          return TCL_ERROR;
+      }
+
+      if((fd = dup((int)(intptr_t)handle)) < 0) {
+          Tcl_AppendResult(interp, "couldn't duplicate \"", Tcl_GetChannelName(chan),
+                           "\": ", Tcl_PosixError(interp), (char*)0);
+          return TCL_ERROR;
+      }
+
+      /* the library owns the duplicate from now on, and closes it when done */
+      response = MQTTClient_publishFile5(pMqtt->client, topic, fd, (long long)pos,
+                   (int)len, qos, retained, NULL, &token);
+      rc = response.reasonCode;
+      MQTTResponse_free(response);
+
+      if(rc == MQTTCLIENT_DISCONNECTED && pMqtt->offline) {
+          /* lost since it was looked at above: read the file after all */
+          Tcl_Seek(chan, pos, SEEK_SET);
+          if((pObj = ReadChannelBytes(interp, chan)) == NULL) {
+              return TCL_ERROR;
+          }
+          payload = Tcl_GetByteArrayFromObj(pObj, &payloadlen);
+          PublishOffline(interp, pMqtt, topic, payload, payloadlen, qos, retained);
+          Tcl_DecrRefCount(pObj);
+          return TCL_OK;
+      }
+      Tcl_Seek(chan, 0, SEEK_END);
+  } else
+#endif
+  {
+      if((pObj = ReadChannelBytes(interp, chan)) == NULL) {
+          return TCL_ERROR;
+      }
+
+      payload = Tcl_GetByteArrayFromObj(pObj, &payloadlen);
+      response = MQTTClient_publish5Borrowed(pMqtt->client, topic, payloadlen,
+                   payload, qos, retained, NULL, &token, ReleasePayload, LendPayload(pMqtt, pObj));
+      rc = response.reasonCode;
+      MQTTResponse_free(response);
+
+      if(rc == MQTTCLIENT_DISCONNECTED && pMqtt->offline) {
+          PublishOffline(interp, pMqtt, topic, payload, payloadlen, qos, retained);
+          Tcl_DecrRefCount(pObj);
+          return TCL_OK;
+      }
+      Tcl_DecrRefCount(pObj);
+  }
+
+  if(rc != MQTTCLIENT_SUCCESS) {
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+      return TCL_OK;
+  }
+
+  rc = MQTTClient_waitForCompletion(pMqtt->client, token, pMqtt->timeout);
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(rc == MQTTCLIENT_SUCCESS ? token : 0));
+  return TCL_OK;
+}
+
+
+/*
+ * The messages published from the offline buffer before they are waited
+ * for and its read offset is synced, so that a crash sends no more than this
+ * many again, and loses none which had not completed.
+ */
+#define OFFLINE_DRAIN_BATCH 1024
+
+/*
+ * The QoS 1 and 2 messages in flight at once on a connection with an
+ * offline buffer, rather than one, so that it is drained without waiting
+ * for each message to complete.
+ */
+#define OFFLINE_DRAIN_WINDOW 1024
+
+/*
+ * Waits for a message published from the offline buffer to complete, for
+ * as long as the messages in flight keep completing, however slowly.
+ */
+static int OfflineDrainWait(MQTTCDATA *pMqtt, MQTTClient_deliveryToken token) {
+  int pending = -1;
+  int rc;
+
+  while((rc = MQTTClient_waitForCompletion(pMqtt->client, token, pMqtt->timeout))
+            == MQTTCLIENT_FAILURE) {
+      MQTTClient_deliveryToken *tokens = NULL;
+      int n = 0;
+
+      if(MQTTClient_getPendingDeliveryTokens(pMqtt->client, &tokens) != MQTTCLIENT_SUCCESS) {
+          break;
+      }
+      if(tokens) {
+          while(tokens[n] != -1) n++;
+          MQTTClient_free(tokens);
+      }
+      if(pending >= 0 && n >= pending) break;
+      pending = n;
+  }
+
+  return rc;
+}
+
+/*
+ * Publishes the messages of the offline buffer, oldest first, without
+ * waiting for each to complete: the library only blocks when the window of
+ * messages in flight is full, and the last of each batch is waited for
+ * before the read offset is synced past it.  Stops at the first which
+ * cannot be published, which stays in the buffer.
+ */
+static int OfflineDrain(MQTTCDATA *pMqtt) {
+  OfflineMessage m;
+  MQTTClient_deliveryToken token = 0;
+  MQTTClient_deliveryToken last = 0;
+  int count = 0;
+  int rc = MQTTCLIENT_SUCCESS;
+
+  while(OfflineBuffer_peek(pMqtt->offline, &m) == 0) {
+      MQTTResponse response = MQTTClient_publish5(pMqtt->client, m.topic,
+                   m.payloadlen, (void *)m.payload, m.qos, m.retained, NULL, &token);
+
+      rc = response.reasonCode;
+      MQTTResponse_free(response);
+      if(rc != MQTTCLIENT_SUCCESS) break;
+
+      OfflineBuffer_pop(pMqtt->offline);
+      if(m.qos > 0) last = token;
+      if(++count % OFFLINE_DRAIN_BATCH == 0) {
+          /* the broker completes them in order, so all of the batch has */
+          if(last != 0) {
+              rc = OfflineDrainWait(pMqtt, last);
+              if(rc != MQTTCLIENT_SUCCESS) break;
+              last = 0;
+          }
+          OfflineBuffer_sync(pMqtt->offline);
+      }
+  }
+
+  if(last != 0 && rc == MQTTCLIENT_SUCCESS) {
+      rc = OfflineDrainWait(pMqtt, last);
+  }
+  if(last == 0 || rc == MQTTCLIENT_SUCCESS) {
+      OfflineBuffer_sync(pMqtt->offline);
+  }
+
+  return rc;
+}
+
+
+static Tcl_WideInt NowMs(void) {
+  Tcl_Time now;
+
+  Tcl_GetTime(&now);
+  return (Tcl_WideInt)now.sec * 1000 + now.usec / 1000;
+}
+
+
+/*
+ * Copies a string the connect options point to, so that they stay valid
+ * for connecting again.
+ */
+static char *KeepString(MQTTCDATA *pMqtt, int i, const char *string) {
+  if(string == NULL) {
+      return NULL;
+  }
+
+  pMqtt->connStrings[i] = Tcl_Alloc(strlen(string) + 1);
+  strcpy(pMqtt->connStrings[i], string);
+  return pMqtt->connStrings[i];
+}
+
+static void ConnectOptionsFree(MQTTCDATA *pMqtt) {
+  int i;
+
+  for(i = 0; i < 6; i++) {
+      if(pMqtt->connStrings[i]) Tcl_Free(pMqtt->connStrings[i]);
+      pMqtt->connStrings[i] = NULL;
+  }
+  MQTTProperties_free(&pMqtt->connectProps);
+}
+
+
+/*
+ * Connects the client with the options the handle was created with.
+ */
+static int MqttConnect(MQTTCDATA *pMqtt) {
+  int rc;
+
+  pMqtt->connOpts.returned.sessionPresent = 0;
+  if(pMqtt->version == MQTTVERSION_5) {
+      MQTTResponse response = MQTTClient_connect5(pMqtt->client, &pMqtt->connOpts,
+                                                  &pMqtt->connectProps, NULL);
+      rc = response.reasonCode;
+      MQTTResponse_free(response);
+  } else {
+      rc = MQTTClient_connect(pMqtt->client, &pMqtt->connOpts);
+  }
+
+  return rc;
+}
+
+
+/*
+ * A remembered subscription which was not granted when it was made again,
+ * kept in the QoS value of its entry.
+ */
+#define SUB_PENDING 0x100
+
+/*
+ * A random number for the backoff of a handle, from a generator of its own
+ * seeded with the time, the process and the client identifier, so that the
+ * clients of a fleet started together still pick different waits.
+ */
+static unsigned int Jitter(MQTTCDATA *pMqtt) {
+  unsigned int x = pMqtt->jitter;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  pMqtt->jitter = x;
+  return x;
+}
+
+static void JitterSeed(MQTTCDATA *pMqtt, const char *clientId) {
+  unsigned int seed = (unsigned int)NowMs() ^ ((unsigned int)getpid() << 16);
+
+  while(*clientId) {
+      seed = seed * 31 + (unsigned char)*clientId++;
+  }
+  pMqtt->jitter = seed ? seed : 0x9e3779b9;
+}
+
+/*
+ * Subscribes again to the topic filters of the handle, in a single
+ * SUBSCRIBE packet: all of them, or with pendingOnly those not granted the
+ * last time.  Those the broker refuses, or all of them if the SUBSCRIBE
+ * fails, are marked pending, and tried again after a backoff like that of
+ * the reconnects.
+ */
+static int Resubscribe(MQTTCDATA *pMqtt, int pendingOnly) {
+  Tcl_HashSearch search;
+  Tcl_HashEntry *hPtr;
+  int count = pMqtt->subscriptions.numEntries;
+  char **topics;
+  int *qoss;
+  Tcl_HashEntry **entries;
+  int *granted;
+  int i = 0;
+  int n;
+  int rc;
+
+  topics = (char **)Tcl_Alloc(count * sizeof(char *));
+  qoss = (int *)Tcl_Alloc(count * sizeof(int));
+  granted = (int *)Tcl_Alloc(count * sizeof(int));
+  entries = (Tcl_HashEntry **)Tcl_Alloc(count * sizeof(Tcl_HashEntry *));
+  for(hPtr = Tcl_FirstHashEntry(&pMqtt->subscriptions, &search); hPtr != NULL;
+      hPtr = Tcl_NextHashEntry(&search)) {
+      int value = (int)(size_t)Tcl_GetHashValue(hPtr);
+
+      if(pendingOnly && (value & SUB_PENDING) == 0) continue;
+      entries[i] = hPtr;
+      topics[i] = (char *)Tcl_GetHashKey(&pMqtt->subscriptions, hPtr);
+      qoss[i++] = value & ~SUB_PENDING;
+  }
+  n = i;
+
+  pMqtt->stats.resubscribes++;
+  if(pMqtt->version == MQTTVERSION_5) {
+      MQTTResponse response = MQTTClient_subscribeMany5(pMqtt->client, n, topics,
+                                                        qoss, NULL, NULL);
+      rc = response.reasonCode < 0 ? response.reasonCode : MQTTCLIENT_SUCCESS;
+      for(i = 0; i < n; i++) {
+          int code = (n > 1 && response.reasonCodes) ? (int)response.reasonCodes[i]
+                                                     : response.reasonCode;
+          granted[i] = (rc == MQTTCLIENT_SUCCESS && code >= 0
+                        && code < MQTTREASONCODE_UNSPECIFIED_ERROR);
+      }
+      MQTTResponse_free(response);
+  } else {
+      /* on return, each QoS is the one granted, or 0x80 if refused */
+      rc = MQTTClient_subscribeMany(pMqtt->client, n, topics, qoss);
+      for(i = 0; i < n; i++) {
+          granted[i] = (rc == MQTTCLIENT_SUCCESS && qoss[i] >= 0 && qoss[i] <= 2);
+      }
+  }
+
+  for(i = 0; i < n; i++) {
+      int value = (int)(size_t)Tcl_GetHashValue(entries[i]);
+
+      if(granted[i] && (value & SUB_PENDING)) {
+          pMqtt->subsPending--;
+          value &= ~SUB_PENDING;
+      } else if(!granted[i]) {
+          pMqtt->stats.resubscribeFailures++;
+          if((value & SUB_PENDING) == 0) {
+              pMqtt->subsPending++;
+              value |= SUB_PENDING;
+          }
+      }
+      Tcl_SetHashValue(entries[i], (void *)(size_t)value);
+  }
+
+  if(pMqtt->subsPending > 0) {
+      int delay = pMqtt->resubscribeDelay * 2;
+
+      if(delay < pMqtt->reconnectMin) delay = pMqtt->reconnectMin;
+      if(delay > pMqtt->reconnectMax) delay = pMqtt->reconnectMax;
+      pMqtt->resubscribeDelay = delay;
+      pMqtt->resubscribeAt = NowMs() + delay;
+  } else {
+      pMqtt->resubscribeDelay = 0;
+  }
+
+  Tcl_Free((char *)entries);
+  Tcl_Free((char *)granted);
+  Tcl_Free((char *)qoss);
+  Tcl_Free((char *)topics);
+  return rc;
+}
+
+
+static void ReconnectTimerProc(void *cd);
+
+/*
+ * Connects a handle with -autoReconnect again.  If the broker still has the
+ * session, it still has the subscriptions too; otherwise they are made
+ * again, and then the offline buffer is drained.  If the connect fails, the
+ * next attempt is made after a backoff doubling from the minimum up to the
+ * maximum, with each wait picked at random from the upper half of it, so
+ * that many clients losing the same broker do not all come back at once.
+ */
+static void ReconnectAttempt(MQTTCDATA *pMqtt) {
+  int delay;
+  int wait;
+
+  if(pMqtt->reconnectTimer) {
+      Tcl_DeleteTimerHandler(pMqtt->reconnectTimer);
+      pMqtt->reconnectTimer = NULL;
+  }
+
+  pMqtt->stats.attempts++;
+  if(MqttConnect(pMqtt) == MQTTCLIENT_SUCCESS) {
+      Tcl_WideInt latency = NowMs() - pMqtt->lostAt;
+
+      pMqtt->stats.reconnects++;
+      pMqtt->stats.lastLatency = latency;
+      pMqtt->stats.totalLatency += latency;
+      if(latency > pMqtt->stats.maxLatency) pMqtt->stats.maxLatency = latency;
+      pMqtt->lostAt = 0;
+      pMqtt->reconnectDelay = 0;
+
+      pMqtt->resubscribeDelay = 0;
+      if(pMqtt->connOpts.returned.sessionPresent) {
+          pMqtt->stats.sessionsResumed++;
+          if(pMqtt->subsPending > 0) {
+              Resubscribe(pMqtt, 1);
+          }
+      } else if(pMqtt->subscriptions.numEntries > 0) {
+          Resubscribe(pMqtt, 0);
+      }
+
+      if(pMqtt->offline && !OfflineBuffer_isEmpty(pMqtt->offline)) {
+          OfflineDrain(pMqtt);
+      }
+      return;
+  }
+
+  delay = pMqtt->reconnectDelay * 2;
+  if(delay < pMqtt->reconnectMin) delay = pMqtt->reconnectMin;
+  if(delay > pMqtt->reconnectMax) delay = pMqtt->reconnectMax;
+  pMqtt->reconnectDelay = delay;
+
+  wait = delay - delay / 2;
+  wait = delay / 2 + (int)(Jitter(pMqtt) % (unsigned int)(wait + 1));
+  pMqtt->retryAt = NowMs() + wait;
+  pMqtt->reconnectTimer = Tcl_CreateTimerHandler(wait, ReconnectTimerProc, pMqtt);
+}
+
+static void ReconnectTimerProc(void *cd) {
+  MQTTCDATA *pMqtt = (MQTTCDATA *)cd;
+
+  pMqtt->reconnectTimer = NULL;
+  if(!MQTTClient_isConnected(pMqtt->client)) {
+      ReconnectAttempt(pMqtt);
+  }
+}
+
+/*
+ * Called by the commands of a handle with -autoReconnect, which is how the
+ * loss of the connection is noticed, as the library only does network work
+ * inside our own calls.  The first attempt is made right away, and the
+ * rest from the event loop or by the next command after they are due.
+ * With wait, sleeps up to that many ms for the next attempt to be due.
+ * While connected, subscribes again to those not granted when due.
+ */
+static void ReconnectCheck(MQTTCDATA *pMqtt, int wait) {
+  Tcl_WideInt now;
+
+  if(pMqtt->reconnectMax == 0 || pMqtt->connecting) {
+      return;
+  }
+
+  if(MQTTClient_isConnected(pMqtt->client)) {
+      if(pMqtt->subsPending > 0 && NowMs() >= pMqtt->resubscribeAt) {
+          Resubscribe(pMqtt, 1);
+      }
+      return;
+  }
+
+  now = NowMs();
+  if(pMqtt->lostAt == 0) {
+      pMqtt->lostAt = now;
+      pMqtt->retryAt = now;
+      pMqtt->reconnectDelay = 0;
+  }
+
+  if(wait > 0 && pMqtt->retryAt > now) {
+      Tcl_Sleep((int)(pMqtt->retryAt - now < wait ? pMqtt->retryAt - now : wait));
+      now = NowMs();
+  }
+
+  if(now >= pMqtt->retryAt) {
+      ReconnectAttempt(pMqtt);
+  }
+}
+
+
+static void ConnectUnlink(MQTTCDATA **list, MQTTCDATA *pMqtt) {
+  while(*list && *list != pMqtt) {
+      list = &(*list)->nextConnecting;
+  }
+  if(*list) *list = pMqtt->nextConnecting;
+  pMqtt->nextConnecting = NULL;
+}
 
 /*
- * Only the _Init function is exported.
+ * An -async connect has finished: the offline buffer is drained, and the
+ * -onconnect script is run with the handle and the return code appended.
+ * The script may close any handle, this one included.
  */
+static void ConnectFinished(MQTTCDATA *pMqtt) {
+  Tcl_Interp *interp = pMqtt->interp;
+  Tcl_Obj *cmd;
+  int code;
+
+  if(pMqtt->connectRc == MQTTCLIENT_SUCCESS
+     && pMqtt->offline && !OfflineBuffer_isEmpty(pMqtt->offline)) {
+      OfflineDrain(pMqtt);
+  }
 
-extern DLLEXPORT int	Mqttc_Init(Tcl_Interp * interp);
+  if(pMqtt->onconnect == NULL) {
+      return;
+  }
+
+  cmd = Tcl_DuplicateObj(pMqtt->onconnect);
+  Tcl_IncrRefCount(cmd);
+  Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewIntObj(pMqtt->connectRc));
+  Tcl_Preserve(interp);
+  code = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+  if(code != TCL_OK) {
+      Tcl_BackgroundException(interp, code);
+  }
+  Tcl_Release(interp);
+  Tcl_DecrRefCount(cmd);
+}
 
 /*
- * end block for C++
+ * Reads the sockets which are ready, which carries on all the connects in
+ * progress at once, and takes the handles whose connect has finished off the
+ * connecting list before running any script.
  */
+static void ConnectTimerProc(void *cd) {
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+  MQTTCDATA **list = &tsdPtr->connecting;
+  MQTTCDATA *pMqtt;
+
+  tsdPtr->connectTimer = NULL;
+  MQTTClient_poll(0);
+
+  while((pMqtt = *list) != NULL) {
+      pMqtt->connectRc = MQTTClient_connectStatus(pMqtt->client);
+      if(pMqtt->connectRc == MQTTCLIENT_CONNECT_IN_PROGRESS) {
+          list = &pMqtt->nextConnecting;
+          continue;
+      }
 
-#ifdef __cplusplus
-}
-#endif
+      *list = pMqtt->nextConnecting;
+      pMqtt->nextConnecting = tsdPtr->finished;
+      tsdPtr->finished = pMqtt;
+      pMqtt->connecting = CONNECT_FINISHED;
+  }
 
+  while((pMqtt = tsdPtr->finished) != NULL) {
+      tsdPtr->finished = pMqtt->nextConnecting;
+      pMqtt->nextConnecting = NULL;
+      pMqtt->connecting = 0;
+      ConnectFinished(pMqtt);
+  }
+
+  if(tsdPtr->connecting && tsdPtr->connectTimer == NULL) {
+      tsdPtr->connectTimer = Tcl_CreateTimerHandler(CONNECT_POLL_MS, ConnectTimerProc, NULL);
+  }
+}
 
 /*
- * This struct is to record MonetDB database info,
+ * Carries on with an -async connect from the commands of the handle, so
+ * that it finishes for scripts which do not run the event loop too.  Once
+ * it has, the handle is taken off the lists and finished as by the timer.
+ * Returns TCL_ERROR if the -onconnect script closed the handle.
  */
-struct MQTTCDATA {
-    MQTTClient   client;
-    int          version;
-    Tcl_Interp   *interp;
-    char         *clientId;
-    int          timeout;
-};
+static int ConnectCheck(Tcl_Interp *interp, MQTTCDATA *pMqtt) {
+  ThreadSpecificData *tsdPtr;
+  int closed;
 
-typedef struct MQTTCDATA MQTTCDATA;
+  if(pMqtt->connecting == 0) {
+      return TCL_OK;
+  }
+
+  tsdPtr = (ThreadSpecificData *)Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+  if(pMqtt->connecting == CONNECT_PENDING) {
+      MQTTClient_poll(0);
+      pMqtt->connectRc = MQTTClient_connectStatus(pMqtt->client);
+      if(pMqtt->connectRc == MQTTCLIENT_CONNECT_IN_PROGRESS) {
+          return TCL_OK;
+      }
+      ConnectUnlink(&tsdPtr->connecting, pMqtt);
+  } else {
+      ConnectUnlink(&tsdPtr->finished, pMqtt);
+  }
+  pMqtt->connecting = 0;
+
+  Tcl_Preserve(pMqtt);
+  ConnectFinished(pMqtt);
+  closed = (pMqtt->client == NULL);
+  Tcl_Release(pMqtt);
+
+  if(closed) {
+      Tcl_SetResult(interp, (char *)"handle closed by its -onconnect script", TCL_STATIC);
+      return TCL_ERROR;
+  }
+  return TCL_OK;
+}
 
 
 static void DbDeleteCmd(void *db) {
   MQTTCDATA *pDb = (MQTTCDATA *)db;
 
   if(pDb) {
+      if(pDb->connecting) {
+          ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+              Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+
+          ConnectUnlink(pDb->connecting == CONNECT_PENDING ? &tsdPtr->connecting
+                        : &tsdPtr->finished, pDb);
+      }
+      if(pDb->onconnect) {
+          Tcl_DecrRefCount(pDb->onconnect);
+      }
+
       if(pDb->version == MQTTVERSION_5) {
           MQTTClient_disconnect5(pDb->client, pDb->timeout, MQTTREASONCODE_SUCCESS, NULL);
       } else {
@@ -53,7 +1112,35 @@ static void DbDeleteCmd(void *db) {
 
       MQTTClient_destroy(&(pDb->client));
 
-      Tcl_Free((char*)pDb);
+      ReleasedPayloadsFree(pDb);
+      while(pDb->lentFree) {
+          LentPayload *pLent = pDb->lentFree;
+
+          pDb->lentFree = pLent->next;
+          Tcl_Free((char *)pLent);
+      }
+      Tcl_MutexFinalize(&pDb->releasedMutex);
+
+      /* kept in the spill directory, if there is one, for the next handle */
+      OfflineBuffer_destroy(pDb->offline);
+
+      if(pDb->reconnectTimer) {
+          Tcl_DeleteTimerHandler(pDb->reconnectTimer);
+      }
+      ConnectOptionsFree(pDb);
+      Tcl_DeleteHashTable(&pDb->subscriptions);
+
+      while(pDb->topicTail) {
+          TopicCacheRemove(pDb, pDb->topicTail);
+      }
+      Tcl_DeleteHashTable(&pDb->topicCache);
+
+      while(pDb->streams) {
+          StreamSubRemove(pDb, pDb->streams->filter);
+      }
+
+      /* not while a command of the handle is finishing its connect */
+      Tcl_EventuallyFree(pDb, TCL_DYNAMIC);
   }
 
   pDb = 0;
@@ -67,9 +1154,12 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
   static const char *MQTT_strs[] = {
     "isConnected",
     "publishMessage",
+    "publishFile",
+    "publishChannel",
     "subscribe",
     "unsubscribe",
     "receive",
+    "stats",
     "close",
     0
   };
@@ -77,9 +1167,12 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
   enum MQTT_enum {
     MQTT_ISCONNECTED,
     MQTT_PUBLISHMESSAGE,
+    MQTT_PUBLISHFILE,
+    MQTT_PUBLISHCHANNEL,
     MQTT_SUBSCRIBE,
     MQTT_UNSUBSCRIBE,
     MQTT_RECEIVE,
+    MQTT_STATS,
     MQTT_CLOSE,
   };
 
@@ -92,6 +1185,8 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
     return TCL_ERROR;
   }
 
+  ReleasedPayloadsFree(pMqtt);
+
   switch( (enum MQTT_enum)choice ){
 
     case MQTT_ISCONNECTED: {
@@ -102,6 +1197,10 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
         return TCL_ERROR;
       }
 
+      if(ConnectCheck(interp, pMqtt) != TCL_OK) {
+          return TCL_ERROR;
+      }
+      ReconnectCheck(pMqtt, 0);
       rc = MQTTClient_isConnected(pMqtt->client);
       if(rc == 0) {
           Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
@@ -115,9 +1214,10 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
     case MQTT_PUBLISHMESSAGE: {
       char *topic = NULL;
       char *payload = NULL;
+      int payloadlen = 0;
       int qos = 1;
       int retained = 0;
-      MQTTClient_message pubmsg = MQTTClient_message_initializer;
+      MQTTResponse response = MQTTResponse_initializer;
       MQTTClient_deliveryToken token;
       int rc;
 
@@ -130,7 +1230,7 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       }
 
       topic = Tcl_GetStringFromObj(objv[2], 0);
-      payload= Tcl_GetStringFromObj(objv[3], 0);
+      payload= Tcl_GetStringFromObj(objv[3], &payloadlen);
 
       if(Tcl_GetIntFromObj(interp, objv[4], &qos) != TCL_OK) {
           return TCL_ERROR;
@@ -145,18 +1245,38 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
           return TCL_ERROR;
       }
 
-      pubmsg.payload = payload;
-      pubmsg.payloadlen = strlen(payload);
-      pubmsg.qos = qos;
-      pubmsg.retained = retained;
+      if(ConnectCheck(interp, pMqtt) != TCL_OK) {
+          return TCL_ERROR;
+      }
+      ReconnectCheck(pMqtt, 0);
+
+      /*
+       * With an offline buffer, messages published while disconnected are
+       * buffered, and so are those after them until the buffer has been
+       * drained, so that they are sent in order.
+       */
+      if(pMqtt->offline) {
+          if(!OfflineBuffer_isEmpty(pMqtt->offline) && MQTTClient_isConnected(pMqtt->client)) {
+              OfflineDrain(pMqtt);
+          }
+
+          if(!OfflineBuffer_isEmpty(pMqtt->offline) || !MQTTClient_isConnected(pMqtt->client)) {
+              PublishOffline(interp, pMqtt, topic, payload, payloadlen, qos, retained);
+              break;
+          }
+      }
 
-      if(pMqtt->version == MQTTVERSION_5) {
-          MQTTResponse response = MQTTResponse_initializer;
-          response = MQTTClient_publishMessage5(pMqtt->client, topic, &pubmsg, &token);
-          rc = response.reasonCode;
-          MQTTResponse_free(response);
-      } else {
-          MQTTClient_publishMessage(pMqtt->client, topic, &pubmsg, &token);
+      /*
+       * The library sends the payload straight from the string of the
+       * object, which stays pinned until it is released.
+       */
+      response = MQTTClient_publish5Borrowed(pMqtt->client, topic, payloadlen,
+                   payload, qos, retained, NULL, &token, ReleasePayload, LendPayload(pMqtt, objv[3]));
+      rc = response.reasonCode;
+      MQTTResponse_free(response);
+      if(rc == MQTTCLIENT_DISCONNECTED && pMqtt->offline) {
+          PublishOffline(interp, pMqtt, topic, payload, payloadlen, qos, retained);
+          break;
       }
       rc = MQTTClient_waitForCompletion(pMqtt->client, token, pMqtt->timeout);
       if(rc == MQTTCLIENT_SUCCESS) {
@@ -169,13 +1289,81 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       break;
     }
 
+    case MQTT_PUBLISHFILE:
+    case MQTT_PUBLISHCHANNEL: {
+      char *topic = NULL;
+      Tcl_Channel chan;
+      int mode;
+      int qos = 1;
+      int retained = 0;
+      int rc;
+
+      if( objc != 6 ){
+        Tcl_WrongNumArgs(interp, 2, objv,
+          choice == MQTT_PUBLISHFILE ? "topic path QoS retained " : "topic chanName QoS retained "
+        );
+
+        return TCL_ERROR;
+      }
+
+      topic = Tcl_GetStringFromObj(objv[2], 0);
+
+      if(Tcl_GetIntFromObj(interp, objv[4], &qos) != TCL_OK) {
+          return TCL_ERROR;
+      }
+
+      if(qos < 0 || qos > 2) {
+          Tcl_AppendResult(interp, "qos must be 0, 1 or 2", (char*)0);
+          return TCL_ERROR;
+      }
+
+      if(Tcl_GetBooleanFromObj(interp, objv[5], &retained) != TCL_OK) {
+          return TCL_ERROR;
+      }
+
+      if(ConnectCheck(interp, pMqtt) != TCL_OK) {
+          return TCL_ERROR;
+      }
+      ReconnectCheck(pMqtt, 0);
+
+      if(choice == MQTT_PUBLISHFILE) {
+          chan = Tcl_FSOpenFileChannel(interp, objv[3], "r", 0);
+          if(chan == NULL) {
+              return TCL_ERROR;
+          }
+          Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+          rc = PublishChannel(interp, pMqtt, topic, chan, qos, retained);
+          Tcl_Close(NULL, chan);
+      } else {
+          chan = Tcl_GetChannel(interp, Tcl_GetStringFromObj(objv[3], 0), &mode);
+          if(chan == NULL) {
+              return TCL_ERROR;
+          }
+
+          if((mode & TCL_READABLE) == 0) {
+              Tcl_AppendResult(interp, "channel \"", Tcl_GetStringFromObj(objv[3], 0),
+                               "\" wasn't opened for reading", (char*)0);
+              return TCL_ERROR;
+          }
+          rc = PublishChannel(interp, pMqtt, topic, chan, qos, retained);
+      }
+
+      if(rc != TCL_OK) {
+          return TCL_ERROR;
+      }
+
+      break;
+    }
+
     case MQTT_SUBSCRIBE: {
       char *topic = NULL;
+      char *channelName = NULL;
       int qos = 1;
+      int granted;
       int rc;
 
-      if( objc !=4) {
-        Tcl_WrongNumArgs(interp, 2, objv, "topic QoS ");
+      if( objc != 4 && objc != 6 ) {
+        Tcl_WrongNumArgs(interp, 2, objv, "topic QoS ?-channel chanName? ");
 
         return TCL_ERROR;
       }
@@ -190,13 +1378,67 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
           return TCL_ERROR;
       }
 
+      if(objc == 6) {
+          int mode;
+
+          if(strcmp(Tcl_GetStringFromObj(objv[4], 0), "-channel") != 0) {
+              Tcl_AppendResult(interp, "unknown option: ",
+                               Tcl_GetStringFromObj(objv[4], 0), (char*)0);
+              return TCL_ERROR;
+          }
+
+          channelName = Tcl_GetStringFromObj(objv[5], 0);
+          if(Tcl_GetChannel(interp, channelName, &mode) == NULL) {
+              return TCL_ERROR;
+          }
+
+          if((mode & TCL_WRITABLE) == 0) {
+              Tcl_AppendResult(interp, "channel \"", channelName,
+                               "\" wasn't opened for writing", (char*)0);
+              return TCL_ERROR;
+          }
+      }
+
+      if(ConnectCheck(interp, pMqtt) != TCL_OK) {
+          return TCL_ERROR;
+      }
+      ReconnectCheck(pMqtt, 0);
+
       if(pMqtt->version == MQTTVERSION_5) {
           MQTTResponse response = MQTTResponse_initializer;
           response = MQTTClient_subscribe5(pMqtt->client, topic, qos, NULL, NULL);
           rc = response.reasonCode;
           MQTTResponse_free(response);
+          /* the reason code is the QoS granted, unless it is 0x80 or more */
+          granted = (rc >= 0 && rc < MQTTREASONCODE_UNSPECIFIED_ERROR);
       } else {
           rc = MQTTClient_subscribe(pMqtt->client, topic, qos);
+          granted = (rc == MQTTCLIENT_SUCCESS);
+      }
+
+      /*
+       * Large payloads are written to the channel as they are read from
+       * the connection, so are never held in memory whole.  A refused
+       * subscription leaves any stream the filter already had in place.
+       */
+      if(channelName && granted) {
+          if(pMqtt->streams == NULL) {
+              MQTTClient_setPayloadStream(pMqtt->client, (size_t)pMqtt->streamThreshold,
+                  pMqtt, StreamOpen, StreamWrite, StreamClose);
+          }
+          StreamSubAdd(pMqtt, topic, channelName);
+      }
+
+      /* remembered to be made again when the connection is */
+      if(granted && pMqtt->reconnectMax > 0) {
+          Tcl_HashEntry *hPtr;
+          int isNew;
+
+          hPtr = Tcl_CreateHashEntry(&pMqtt->subscriptions, topic, &isNew);
+          if(!isNew && ((int)(size_t)Tcl_GetHashValue(hPtr) & SUB_PENDING)) {
+              pMqtt->subsPending--;
+          }
+          Tcl_SetHashValue(hPtr, (void *)(size_t)qos);
       }
 
       if(rc == MQTTCLIENT_SUCCESS) {
@@ -219,6 +1461,22 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       }
 
       topic = Tcl_GetStringFromObj(objv[2], 0);
+      if(ConnectCheck(interp, pMqtt) != TCL_OK) {
+          return TCL_ERROR;
+      }
+      StreamSubRemove(pMqtt, topic);
+      if(pMqtt->reconnectMax > 0) {
+          Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&pMqtt->subscriptions, topic);
+
+          if(hPtr) {
+              if((int)(size_t)Tcl_GetHashValue(hPtr) & SUB_PENDING) {
+                  pMqtt->subsPending--;
+              }
+              Tcl_DeleteHashEntry(hPtr);
+          }
+      }
+
+      ReconnectCheck(pMqtt, 0);
 
       if(pMqtt->version == MQTTVERSION_5) {
           MQTTResponse response = MQTTResponse_initializer;
@@ -251,23 +1509,57 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       }
 
       pResultStr = Tcl_NewListObj(0, NULL);
-      rc = MQTTClient_receive(pMqtt->client, &topicName, &topicLen, &message, pMqtt->timeout);
+
+      /*
+       * While reconnecting, wait as long as for a message, and return
+       * nothing if the connection is still not there.
+       */
+      ReconnectCheck(pMqtt, pMqtt->timeout);
+      if(pMqtt->connecting) {
+          MQTTClient_poll(pMqtt->timeout);
+          if(ConnectCheck(interp, pMqtt) != TCL_OK) {
+              Tcl_DecrRefCount(pResultStr);
+              return TCL_ERROR;
+          }
+          Tcl_SetObjResult(interp, pResultStr);
+          break;
+      }
+
+      if(pMqtt->reconnectMax > 0 && !MQTTClient_isConnected(pMqtt->client)) {
+          Tcl_SetObjResult(interp, pResultStr);
+          break;
+      }
+
+      /*
+       * The topic is borrowed from the message: both are in the packet
+       * as it was read, which is freed with the message.
+       */
+      rc = MQTTClient_receiveBorrowed(pMqtt->client, &topicName, &topicLen, &message, pMqtt->timeout);
 
       // Is it OK?
+      if(rc == MQTTCLIENT_DISCONNECTED && pMqtt->reconnectMax > 0) {
+          Tcl_SetObjResult(interp, pResultStr);
+          break;
+      }
+
       if(rc != MQTTCLIENT_SUCCESS) {
           return TCL_ERROR;
       }
 
       if (message) {
            Tcl_ListObjAppendElement(interp, pResultStr, 
-                     Tcl_NewStringObj(topicName, -1));
+                     TopicCacheGet(pMqtt, topicName));
            Tcl_ListObjAppendElement(interp, pResultStr, 
                      Tcl_NewStringObj(message->payload, message->payloadlen));
            Tcl_ListObjAppendElement(interp, pResultStr, 
                      Tcl_NewBooleanObj(message->dup));
+           /* the payload went to a -channel, only its length is returned */
+           if (message->streamed > 0) {
+               Tcl_ListObjAppendElement(interp, pResultStr,
+                         Tcl_NewWideIntObj(message->streamed));
+           }
 
            MQTTClient_freeMessage(&message);
-           MQTTClient_free(topicName);
       }
 
       Tcl_SetObjResult(interp, pResultStr);
@@ -275,6 +1567,58 @@ static int MgttObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       break;
     }
 
+    case MQTT_STATS: {
+      Tcl_Obj *pDict;
+      Tcl_Obj *pPending;
+      Tcl_HashSearch search;
+      Tcl_HashEntry *hPtr;
+      Tcl_WideInt down = 0;
+
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      if(pMqtt->lostAt > 0) {
+          down = NowMs() - pMqtt->lostAt;
+      }
+
+      pDict = Tcl_NewDictObj();
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("connected", -1),
+                     Tcl_NewBooleanObj(MQTTClient_isConnected(pMqtt->client)));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("reconnects", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.reconnects));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("reconnectAttempts", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.attempts));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("sessionsResumed", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.sessionsResumed));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("resubscribes", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.resubscribes));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("resubscribeFailures", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.resubscribeFailures));
+      pPending = Tcl_NewListObj(0, NULL);
+      for(hPtr = Tcl_FirstHashEntry(&pMqtt->subscriptions, &search); hPtr != NULL;
+          hPtr = Tcl_NextHashEntry(&search)) {
+          if((int)(size_t)Tcl_GetHashValue(hPtr) & SUB_PENDING) {
+              Tcl_ListObjAppendElement(interp, pPending, Tcl_NewStringObj(
+                  (char *)Tcl_GetHashKey(&pMqtt->subscriptions, hPtr), -1));
+          }
+      }
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("pendingSubscriptions", -1),
+                     pPending);
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("lastReconnectMs", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.lastLatency));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("maxReconnectMs", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.maxLatency));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("totalReconnectMs", -1),
+                     Tcl_NewWideIntObj(pMqtt->stats.totalLatency));
+      Tcl_DictObjPut(interp, pDict, Tcl_NewStringObj("disconnectedMs", -1),
+                     Tcl_NewWideIntObj(down));
+      Tcl_SetObjResult(interp, pDict);
+
+      break;
+    }
+
     case MQTT_CLOSE: {
       if( objc != 2){
         Tcl_WrongNumArgs(interp, 2, objv, 0);
@@ -317,6 +1661,26 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
   MQTTProperties connect_props = MQTTProperties_initializer;
   MQTTProperty property;
   int interval = -1;
+  int aliasMaximum = 0;
+  int topicCacheSize = 1024;
+  int preallocate = 0;
+  int maxQueuedMessages = 0;
+  Tcl_WideInt maxQueuedBytes = 0;
+  Tcl_WideInt streamThreshold = 65536;
+  int syncPolicy = -1;
+  int syncValue = 0;
+  char *persistenceDir = NULL;
+  MQTTClient_logPersistenceOptions logOpts = MQTTClient_logPersistenceOptions_initializer;
+  MQTTClient_mmapPersistenceOptions mapOpts = MQTTClient_mmapPersistenceOptions_initializer;
+  MQTTClient_tmpfsPersistenceOptions tmpOpts = MQTTClient_tmpfsPersistenceOptions_initializer;
+  MQTTClient_sqlitePersistenceOptions sqlOpts = MQTTClient_sqlitePersistenceOptions_initializer;
+  void *persistenceContext = NULL;
+  Tcl_WideInt offlineBufferBytes = 0;
+  char *offlineSpillDir = NULL;
+  int reconnectMin = 0;
+  int reconnectMax = 0;
+  int async = 0;
+  Tcl_Obj *onconnect = NULL;
   int i, rc;
   int length;
 
@@ -328,6 +1692,15 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       "?-trustStore truststore? ?-keyStore keystore? "
       "?-privateKey privatekey? ?-privateKeyPassword password? "
       "?-enableServerCertAuth boolean? ?-session-expiry-interval value? "
+      "?-topic-alias-maximum value? ?-topic-cache-size value? "
+      "?-preallocate count? ?-maxQueuedMessages count? "
+      "?-maxQueuedBytes bytes? ?-streamThreshold bytes? "
+      "?-persistenceSync policy? ?-persistence type? "
+      "?-persistenceDir path? ?-persistenceFsync policy? "
+      "?-persistenceSlots count? ?-persistenceSlotSize bytes? "
+      "?-persistenceTmpDir path? ?-persistenceCheckpoint ms? "
+      "?-offlineBufferBytes bytes? ?-offlineSpillDir path? "
+      "?-autoReconnect {min max}? ?-async boolean? ?-onconnect script? "
       "?-version version? "
     );
     return TCL_ERROR;
@@ -399,6 +1772,208 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
             Tcl_AppendResult(interp, "interval must be >= 0", (char*)0);
             return TCL_ERROR;
         }
+    } else if( strcmp(zArg, "-topic-alias-maximum")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &aliasMaximum) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(aliasMaximum < 0 || aliasMaximum > 65535) {
+            Tcl_AppendResult(interp, "topic alias maximum must be 0 to 65535", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-topic-cache-size")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &topicCacheSize) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(topicCacheSize < 0) {
+            Tcl_AppendResult(interp, "topic cache size must be >= 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-preallocate")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &preallocate) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(preallocate < 0) {
+            Tcl_AppendResult(interp, "preallocate must be >= 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-maxQueuedMessages")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &maxQueuedMessages) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(maxQueuedMessages < 0) {
+            Tcl_AppendResult(interp, "maxQueuedMessages must be >= 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-maxQueuedBytes")==0 ) {
+        if(Tcl_GetWideIntFromObj(interp, objv[i + 1], &maxQueuedBytes) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(maxQueuedBytes < 0) {
+            Tcl_AppendResult(interp, "maxQueuedBytes must be >= 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-streamThreshold")==0 ) {
+        if(Tcl_GetWideIntFromObj(interp, objv[i + 1], &streamThreshold) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(streamThreshold < 2 || streamThreshold > 268435455) {
+            Tcl_AppendResult(interp, "streamThreshold must be 2 to 268435455", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-persistenceSync")==0 ) {
+        /* in the order of the MQTTCLIENT_PERSISTENCE_SYNC values */
+        static const char *policies[] = { "none", "interval", "count", "each", NULL };
+        Tcl_Obj **elems;
+        int nelems;
+
+        if(Tcl_ListObjGetElements(interp, objv[i + 1], &nelems, &elems) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(nelems < 1 || nelems > 2 || Tcl_GetIndexFromObj(interp, elems[0], policies,
+                "persistenceSync policy", 0, &syncPolicy) != TCL_OK) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, "persistenceSync must be none, each, "
+                    "{interval ms} or {count messages}", (char*)0);
+            return TCL_ERROR;
+        }
+
+        if((syncPolicy == MQTTCLIENT_PERSISTENCE_SYNC_INTERVAL ||
+            syncPolicy == MQTTCLIENT_PERSISTENCE_SYNC_COUNT) != (nelems == 2)) {
+            Tcl_AppendResult(interp, "persistenceSync must be none, each, "
+                    "{interval ms} or {count messages}", (char*)0);
+            return TCL_ERROR;
+        }
+
+        if(nelems == 2) {
+            if(Tcl_GetIntFromObj(interp, elems[1], &syncValue) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            if(syncValue <= 0) {
+                Tcl_AppendResult(interp, "persistenceSync value must be > 0", (char*)0);
+                return TCL_ERROR;
+            }
+        }
+    } else if( strcmp(zArg, "-persistence")==0 ) {
+        static const char *types[] = { "default", "none", "log", "mmap", "tmpfs",
+            "sqlite", NULL };
+        static const int typeValues[] = { MQTTCLIENT_PERSISTENCE_DEFAULT,
+            MQTTCLIENT_PERSISTENCE_NONE, MQTTCLIENT_PERSISTENCE_LOG,
+            MQTTCLIENT_PERSISTENCE_MMAP, MQTTCLIENT_PERSISTENCE_TMPFS,
+            MQTTCLIENT_PERSISTENCE_SQLITE };
+        int type;
+
+        if(Tcl_GetIndexFromObj(interp, objv[i + 1], types,
+                "persistence type", 0, &type) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        persistence_type = typeValues[type];
+#if !defined(MQTT_SQLITE)
+        if(persistence_type == MQTTCLIENT_PERSISTENCE_SQLITE) {
+            Tcl_AppendResult(interp, "sqlite persistence is not built in", (char*)0);
+            return TCL_ERROR;
+        }
+#endif
+    } else if( strcmp(zArg, "-persistenceDir")==0 ) {
+        persistenceDir = Tcl_GetStringFromObj(objv[i + 1], 0);
+    } else if( strcmp(zArg, "-persistenceFsync")==0 ) {
+        /* in the order of the MQTTCLIENT_LOG_SYNC values */
+        static const char *policies[] = { "never", "always", "interval", NULL };
+        Tcl_Obj **elems;
+        int nelems;
+
+        if(Tcl_ListObjGetElements(interp, objv[i + 1], &nelems, &elems) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(nelems < 1 || nelems > 2 || Tcl_GetIndexFromObj(interp, elems[0], policies,
+                "persistenceFsync policy", 0, &logOpts.syncPolicy) != TCL_OK ||
+           (logOpts.syncPolicy == MQTTCLIENT_LOG_SYNC_INTERVAL) != (nelems == 2)) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, "persistenceFsync must be never, always "
+                    "or {interval ms}", (char*)0);
+            return TCL_ERROR;
+        }
+
+        if(nelems == 2) {
+            if(Tcl_GetIntFromObj(interp, elems[1], &logOpts.syncInterval) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            if(logOpts.syncInterval <= 0) {
+                Tcl_AppendResult(interp, "persistenceFsync interval must be > 0", (char*)0);
+                return TCL_ERROR;
+            }
+        }
+    } else if( strcmp(zArg, "-persistenceSlots")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &mapOpts.slotCount) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(mapOpts.slotCount <= 0) {
+            Tcl_AppendResult(interp, "persistenceSlots must be > 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-persistenceSlotSize")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &mapOpts.slotSize) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(mapOpts.slotSize < 64 || mapOpts.slotSize % 8 != 0) {
+            Tcl_AppendResult(interp, "persistenceSlotSize must be a multiple "
+                    "of 8 and >= 64", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-persistenceTmpDir")==0 ) {
+        tmpOpts.workDirectory = Tcl_GetStringFromObj(objv[i + 1], 0);
+    } else if( strcmp(zArg, "-persistenceCheckpoint")==0 ) {
+        if(Tcl_GetIntFromObj(interp, objv[i + 1], &tmpOpts.checkpointInterval) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(tmpOpts.checkpointInterval <= 0) {
+            Tcl_AppendResult(interp, "persistenceCheckpoint must be > 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-offlineBufferBytes")==0 ) {
+        if(Tcl_GetWideIntFromObj(interp, objv[i + 1], &offlineBufferBytes) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(offlineBufferBytes < 0) {
+            Tcl_AppendResult(interp, "offlineBufferBytes must be >= 0", (char*)0);
+            return TCL_ERROR;
+        }
+    } else if( strcmp(zArg, "-offlineSpillDir")==0 ) {
+        offlineSpillDir = Tcl_GetStringFromObj(objv[i + 1], 0);
+    } else if( strcmp(zArg, "-async")==0 ){
+        if( Tcl_GetBooleanFromObj(interp, objv[i+1], &async) ) return TCL_ERROR;
+    } else if( strcmp(zArg, "-onconnect")==0 ){
+        onconnect = objv[i + 1];
+    } else if( strcmp(zArg, "-autoReconnect")==0 ) {
+        Tcl_Obj **elems;
+        int nelems;
+
+        if(Tcl_ListObjGetElements(interp, objv[i + 1], &nelems, &elems) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        if(nelems != 2
+           || Tcl_GetIntFromObj(interp, elems[0], &reconnectMin) != TCL_OK
+           || Tcl_GetIntFromObj(interp, elems[1], &reconnectMax) != TCL_OK
+           || reconnectMin <= 0 || reconnectMax < reconnectMin) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, "autoReconnect must be {min max} "
+                    "in ms, with 0 < min <= max", (char*)0);
+            return TCL_ERROR;
+        }
     } else if( strcmp(zArg, "-version")==0 ){
         version = Tcl_GetStringFromObj(objv[i + 1], 0);
     } else {
@@ -407,6 +1982,11 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
     }
   }
 
+  if(onconnect && !async) {
+      Tcl_AppendResult(interp, "-onconnect needs -async", (char*)0);
+      return TCL_ERROR;
+  }
+
   // Don't let user give ssl URL but sslenable is false.
   length = strlen(serverURI);
   if((length > 3 && strncmp(serverURI, "ssl", 3)==0) && sslenable==0)
@@ -441,9 +2021,34 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
   }
 
   memset(p, 0, sizeof(*p));
+  p->owner = Tcl_GetCurrentThread();
+
+  /*
+   * The file system persistences keep their files under -persistenceDir,
+   * the working directory by default.
+   */
+  if(persistence_type == MQTTCLIENT_PERSISTENCE_LOG) {
+      logOpts.directory = persistenceDir;
+      persistenceContext = &logOpts;
+  } else if(persistence_type == MQTTCLIENT_PERSISTENCE_MMAP) {
+      mapOpts.directory = persistenceDir;
+      mapOpts.syncPolicy = logOpts.syncPolicy;
+      mapOpts.syncInterval = logOpts.syncInterval;
+      persistenceContext = &mapOpts;
+  } else if(persistence_type == MQTTCLIENT_PERSISTENCE_TMPFS) {
+      tmpOpts.directory = persistenceDir;
+      persistenceContext = &tmpOpts;
+  } else if(persistence_type == MQTTCLIENT_PERSISTENCE_SQLITE) {
+      sqlOpts.directory = persistenceDir;
+      sqlOpts.syncPolicy = logOpts.syncPolicy;
+      sqlOpts.syncInterval = logOpts.syncInterval;
+      persistenceContext = &sqlOpts;
+  } else if(persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT) {
+      persistenceContext = persistenceDir;
+  }
 
   rc = MQTTClient_createWithOptions(&(p->client), serverURI, clientId, persistence_type, 
-		  NULL, &createOpts);
+		  persistenceContext, &createOpts);
   if (rc != MQTTCLIENT_SUCCESS) {
       printf("return value %d\n", rc);
       Tcl_SetResult (interp, "Create MQTT client fail", NULL);
@@ -452,27 +2057,76 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       return TCL_ERROR;
   }
 
+  /*
+   * Grow the message pools shared by all handles, so that the first
+   * messages of this connection do not need to allocate.
+   */
+  if(preallocate > 0 && MemoryPool_reserve(preallocate) != 0) {
+      Tcl_SetResult (interp, "Preallocate message pools fail", NULL);
+
+      MQTTClient_destroy(&(p->client));
+      if(p) Tcl_Free((char*) p);
+      return TCL_ERROR;
+  }
+
+  /*
+   * Stop reading from the broker while receive is behind, rather than
+   * queueing without bound.
+   */
+  MQTTClient_setQueueLimits(p->client, maxQueuedMessages, (size_t)maxQueuedBytes);
+
+  /*
+   * Commit the persistence writes on a thread of their own, in batches,
+   * rather than one by one as the messages are sent and received.
+   */
+  if(syncPolicy >= 0 &&
+     MQTTClient_setPersistenceSync(p->client, syncPolicy, syncValue) != MQTTCLIENT_SUCCESS) {
+      Tcl_SetResult (interp, "Start persistence writer fail", NULL);
+
+      MQTTClient_destroy(&(p->client));
+      if(p) Tcl_Free((char*) p);
+      return TCL_ERROR;
+  }
+
+  /*
+   * Keep what is published while disconnected, in memory up to
+   * -offlineBufferBytes and in -offlineSpillDir after that.
+   */
+  if(offlineBufferBytes > 0 || offlineSpillDir) {
+      p->offline = OfflineBuffer_create((size_t)offlineBufferBytes, offlineSpillDir,
+                                        clientId, serverURI);
+      if(p->offline == NULL) {
+          Tcl_SetResult (interp, "Create offline buffer fail", NULL);
+
+          MQTTClient_destroy(&(p->client));
+          if(p) Tcl_Free((char*) p);
+          return TCL_ERROR;
+      }
+  }
+
   if(createOpts.MQTTVersion==MQTTVERSION_5) {
       MQTTClient_connectOptions conn_opts5 = MQTTClient_connectOptions_initializer5;
       conn_opts = conn_opts5;
   }
   conn_opts.keepAliveInterval = keepalive;
-  if(username) conn_opts.username = username;
-  if(password) conn_opts.password = password;
+  if(p->offline) conn_opts.maxInflightMessages = OFFLINE_DRAIN_WINDOW;
+  if(username) conn_opts.username = KeepString(p, 0, username);
+  if(password) conn_opts.password = KeepString(p, 1, password);
   if(version) conn_opts.MQTTVersion = createOpts.MQTTVersion;
 
+  /* the options are kept with the handle, to connect again with */
   if(sslenable) {
-      if(trustStore) ssl_opts.trustStore = trustStore;
-      if(keyStore) ssl_opts.keyStore = keyStore;
-      if(privateKey) ssl_opts.privateKey = privateKey;
-      if(privateKeyPassword) ssl_opts.privateKeyPassword = privateKeyPassword;
+      if(trustStore) ssl_opts.trustStore = KeepString(p, 2, trustStore);
+      if(keyStore) ssl_opts.keyStore = KeepString(p, 3, keyStore);
+      if(privateKey) ssl_opts.privateKey = KeepString(p, 4, privateKey);
+      if(privateKeyPassword) ssl_opts.privateKeyPassword = KeepString(p, 5, privateKeyPassword);
       ssl_opts.enableServerCertAuth = enableServerCertAuth;
-      conn_opts.ssl = &ssl_opts;
+      p->sslOpts = ssl_opts;
+      conn_opts.ssl = &p->sslOpts;
   }
 
   if (createOpts.MQTTVersion == MQTTVERSION_5)
   {
-      MQTTResponse response = MQTTResponse_initializer;
       conn_opts.cleanstart = cleanstart;
 
       if(interval >= 0) {
@@ -481,13 +2135,35 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
           MQTTProperties_add(&connect_props, &property);
       }
 
-      response = MQTTClient_connect5(p->client, &conn_opts, &connect_props, NULL);
-      rc = response.reasonCode;
-      MQTTResponse_free(response);
+      if(aliasMaximum > 0) {
+          property.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM;
+          property.value.integer2 = aliasMaximum;
+          MQTTProperties_add(&connect_props, &property);
+      }
+
   } else {
       conn_opts.cleansession = cleansession;
+  }
 
-      rc = MQTTClient_connect(p->client, &conn_opts);
+  p->version = createOpts.MQTTVersion;
+  p->connOpts = conn_opts;
+  p->connectProps = connect_props;
+
+  /*
+   * With -async, the connect is only started here, and carried on from the
+   * event loop, by ConnectTimerProc.
+   */
+  if(async) {
+      MQTTResponse response = MQTTClient_connectStart(p->client, &p->connOpts,
+              p->version == MQTTVERSION_5 ? &p->connectProps : NULL, NULL);
+      rc = response.reasonCode;
+      MQTTResponse_free(response);
+      if(rc == MQTTCLIENT_CONNECT_IN_PROGRESS) {
+          p->connecting = CONNECT_PENDING;
+          rc = MQTTCLIENT_SUCCESS;
+      }
+  } else {
+      rc = MqttConnect(p);
   }
 
   if (rc != MQTTCLIENT_SUCCESS)
@@ -495,18 +2171,52 @@ static int MQTTC_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv
       printf("return value %d\n", rc);
       Tcl_SetResult (interp, "Connect MQTT server fail", NULL);
 
+      MQTTClient_destroy(&(p->client));
+      OfflineBuffer_destroy(p->offline);
+      ConnectOptionsFree(p);
       if(p) Tcl_Free((char*) p);
       return TCL_ERROR;
   }
 
   p->interp = interp;
-  p->version = createOpts.MQTTVersion;
   p->clientId = clientId;
   p->timeout = timeout;
+  p->topicCacheSize = topicCacheSize;
+  p->streamThreshold = streamThreshold;
+  Tcl_InitHashTable(&p->topicCache, TCL_STRING_KEYS);
+  Tcl_InitHashTable(&p->subscriptions, TCL_STRING_KEYS);
+  JitterSeed(p, clientId);
+  p->reconnectMin = reconnectMin;
+  p->reconnectMax = reconnectMax;
+
+  /* send what an earlier handle left in the spill directory */
+  if(!p->connecting && p->offline && !OfflineBuffer_isEmpty(p->offline)) {
+      OfflineDrain(p);
+  }
 
   zArg = Tcl_GetStringFromObj(objv[1], 0);
   Tcl_CreateObjCommand(interp, zArg, MgttObjCmd, (char*)p, DbDeleteCmd);
 
+  if(p->connecting) {
+      ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+          Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+
+      if(onconnect) {
+          p->onconnect = Tcl_DuplicateObj(onconnect);
+          Tcl_IncrRefCount(p->onconnect);
+          if(Tcl_ListObjAppendElement(interp, p->onconnect, objv[1]) != TCL_OK) {
+              Tcl_DeleteCommand(interp, zArg);
+              return TCL_ERROR;
+          }
+      }
+
+      p->nextConnecting = tsdPtr->connecting;
+      tsdPtr->connecting = p;
+      if(tsdPtr->connectTimer == NULL) {
+          tsdPtr->connectTimer = Tcl_CreateTimerHandler(0, ConnectTimerProc, NULL);
+      }
+  }
+
   return TCL_OK;
 }
 